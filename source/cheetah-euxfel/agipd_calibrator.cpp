@@ -26,6 +26,9 @@
 
 #include "agipd_calibrator.h"
 #include <iostream>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // A few constants...
 const int cAgipdCalibrator::nGains = 3;
@@ -45,6 +48,8 @@ cAgipdCalibrator::cAgipdCalibrator()
 	_gainLevelGainCellPtr = NULL;
     _badpixelGainCellPtr = NULL;
     _relativeGainGainCellPtr = NULL;
+	_nGroups = 0;
+	_packedCalib = NULL;
 }
 
 // Constructor with arguments
@@ -61,6 +66,8 @@ cAgipdCalibrator::cAgipdCalibrator(std::string filename, cAgipdModuleReader &rea
 	_gainLevelGainCellPtr = NULL;
     _badpixelGainCellPtr = NULL;
     _relativeGainGainCellPtr = NULL;
+	_nGroups = 0;
+	_packedCalib = NULL;
 }
 
 // Destructor
@@ -76,6 +83,22 @@ cAgipdCalibrator::~cAgipdCalibrator()
     _badpixelData = NULL;
     _relativeGainData = NULL;
     
+    freeGainCellPtr();
+
+	free(_packedCalib);
+	_packedCalib = NULL;
+}
+
+
+// Free the tables of pointers to each gain and cell
+void cAgipdCalibrator::freeGainCellPtr()
+{
+	for (int g = 0; g < nGains; g++) {
+		if(_darkOffsetGainCellPtr != NULL) free(_darkOffsetGainCellPtr[g]);
+		if(_gainLevelGainCellPtr != NULL) free(_gainLevelGainCellPtr[g]);
+		if(_badpixelGainCellPtr != NULL) free(_badpixelGainCellPtr[g]);
+		if(_relativeGainGainCellPtr != NULL) free(_relativeGainGainCellPtr[g]);
+	}
     free(_darkOffsetGainCellPtr);
     free(_gainLevelGainCellPtr);
     free(_badpixelGainCellPtr);
@@ -87,6 +110,68 @@ cAgipdCalibrator::~cAgipdCalibrator()
 }
 
 
+#ifdef __SSE2__
+/*
+ *	Sign extend 4 of the int16_t in v (the high 4 if hi is set) to int32_t
+ */
+static inline __m128i extendInt16(__m128i v, int hi) {
+	__m128i	w = hi ? _mm_unpackhi_epi16(v, v) : _mm_unpacklo_epi16(v, v);
+	return _mm_srai_epi32(w, 16);
+}
+
+/*
+ *	Calibrate one group of AGIPD_CALIB_GROUP pixels (see applyCalibration for what happens to each pixel)
+ *	The gain stage is picked with compares and masks rather than branches
+ */
+static inline void calibrateGroup(const tAgipdCalibGroup *group, float *aduData, uint16_t *gainData, uint16_t *badpixMask) {
+	__m128i	zero = _mm_setzero_si128();
+	__m128i	gain16 = _mm_loadu_si128((const __m128i *) gainData);
+	__m128i	level1 = _mm_loadu_si128((const __m128i *) group->gainLevel[0]);
+	__m128i	level2 = _mm_loadu_si128((const __m128i *) group->gainLevel[1]);
+	__m128i	dark0 = _mm_loadu_si128((const __m128i *) group->darkOffset[0]);
+	__m128i	dark1 = _mm_loadu_si128((const __m128i *) group->darkOffset[1]);
+	__m128i	dark2 = _mm_loadu_si128((const __m128i *) group->darkOffset[2]);
+	__m128i	bad16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) group->badpixel), zero);
+	__m128i	stage[2];
+	__m128i	bad[2];
+
+	for (int h = 0; h < 2; h++) {
+		// Gain data is unsigned, the thresholds are signed
+		__m128i	gain = h ? _mm_unpackhi_epi16(gain16, zero) : _mm_unpacklo_epi16(gain16, zero);
+		__m128i	is2 = _mm_cmpgt_epi32(gain, extendInt16(level2, h));
+		__m128i	is1 = _mm_andnot_si128(is2, _mm_cmpgt_epi32(gain, extendInt16(level1, h)));
+		__m128i	is0 = _mm_andnot_si128(_mm_or_si128(is1, is2), _mm_set1_epi32(-1));
+		stage[h] = _mm_or_si128(_mm_and_si128(is2, _mm_set1_epi32(2)), _mm_and_si128(is1, _mm_set1_epi32(1)));
+
+		// Bad in the selected gain stage
+		__m128i	bit = _mm_or_si128(_mm_or_si128(_mm_and_si128(is2, _mm_set1_epi32(4)), _mm_and_si128(is1, _mm_set1_epi32(2))), _mm_and_si128(is0, _mm_set1_epi32(1)));
+		__m128i	badBits = h ? _mm_unpackhi_epi16(bad16, zero) : _mm_unpacklo_epi16(bad16, zero);
+		bad[h] = _mm_cmpgt_epi32(_mm_and_si128(badBits, bit), zero);
+
+		// Offset and gain of the selected gain stage
+		__m128	s0 = _mm_castsi128_ps(is0);
+		__m128	s1 = _mm_castsi128_ps(is1);
+		__m128	s2 = _mm_castsi128_ps(is2);
+		__m128	dark = _mm_or_ps(_mm_or_ps(_mm_and_ps(s0, _mm_cvtepi32_ps(extendInt16(dark0, h))), _mm_and_ps(s1, _mm_cvtepi32_ps(extendInt16(dark1, h)))), _mm_and_ps(s2, _mm_cvtepi32_ps(extendInt16(dark2, h))));
+		__m128	gain0 = _mm_loadu_ps(group->relativeGain[0] + 4*h);
+		__m128	gain1 = _mm_loadu_ps(group->relativeGain[1] + 4*h);
+		__m128	gain2 = _mm_loadu_ps(group->relativeGain[2] + 4*h);
+		__m128	relGain = _mm_or_ps(_mm_or_ps(_mm_and_ps(s0, gain0), _mm_and_ps(s1, gain1)), _mm_and_ps(s2, gain2));
+
+		// Bad pixels go to 0
+		__m128	v = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(aduData + 4*h), dark), relGain);
+		_mm_storeu_ps(aduData + 4*h, _mm_andnot_ps(_mm_castsi128_ps(bad[h]), v));
+	}
+
+	_mm_storeu_si128((__m128i *) gainData, _mm_packs_epi32(stage[0], stage[1]));
+	__m128i	isBad = _mm_packs_epi32(bad[0], bad[1]);
+	__m128i	mask = _mm_loadu_si128((const __m128i *) badpixMask);
+	mask = _mm_or_si128(_mm_andnot_si128(isBad, mask), _mm_and_si128(isBad, _mm_set1_epi16(1)));
+	_mm_storeu_si128((__m128i *) badpixMask, mask);
+}
+#endif
+
+
 /*
  *	Apply AGIPD calibration
  *	Overwrites contents of aduData with calibrated value
@@ -101,8 +186,8 @@ void cAgipdCalibrator::applyCalibration(int cellID, float *aduData, uint16_t *ga
 		return;
     }
 
-    if (_darkOffsetData == NULL) {
-        std::cout << "WARNING: No _darkOffsetData in cAgipdCalibrator::applyCalibration for module " << std::endl;
+    if (_packedCalib == NULL) {
+        std::cout << "WARNING: No calibration constants in cAgipdCalibrator::applyCalibration for module " << std::endl;
 		return;
     }
     
@@ -111,28 +196,21 @@ void cAgipdCalibrator::applyCalibration(int cellID, float *aduData, uint16_t *ga
         return;
     }
 
-	// Extract pointers to data for this cell
-	int16_t 	*cellDarkOffset[nGains];
-    int16_t     *cellGainLevel[nGains];
-    float       *cellRelativeGain[nGains];
-    uint8_t     *cellBadpix[nGains];
-	for (int g = 0; g<nGains; g++)
-	{
-		cellDarkOffset[g] = darkOffsetForGainAndCell(g, cellID);
-        cellGainLevel[g] = gainLevelForGainAndCell(g, cellID);
-        cellRelativeGain[g] = relativeGainForGainAndCell(g, cellID);
-        cellBadpix[g] = badpixelForGainAndCell(g, cellID);
-	}
+	// Constants for this cell
+	tAgipdCalibGroup	*cellCalib = _packedCalib + cellID*_nGroups;
+	long	nn = _myModule->nn;
 	
     
     //if(_myModule->_doNotApplyGainSwitch)
     if(false)
     {
-		for (long p=0; p<_myModule->nn; p++) {
-			aduData[p] -= cellDarkOffset[0][p];
+		for (long p=0; p<nn; p++) {
+			tAgipdCalibGroup *group = &cellCalib[p/AGIPD_CALIB_GROUP];
+			int i = p % AGIPD_CALIB_GROUP;
+			aduData[p] -= group->darkOffset[0][i];
             gainData[p] = 0;
             badpixMask[p] = 0;
-            if(cellBadpix[0][p] != 0) {
+            if(group->badpixel[i] & 1) {
                 aduData[p] = 0;
                 badpixMask[p] = 1;
             }
@@ -142,65 +220,42 @@ void cAgipdCalibrator::applyCalibration(int cellID, float *aduData, uint16_t *ga
 	}
 	
 
-	int		pixGain = 0;
-	long	pixelsInGainLevel[3] = {0,0,0};
-	
     // Loop through pixels
-	for (long p=0; p<_myModule->nn; p++) {
-        pixGain = 0;
+	long	p = 0;
+#ifdef __SSE2__
+	for (; p+AGIPD_CALIB_GROUP <= nn; p+=AGIPD_CALIB_GROUP) {
+		calibrateGroup(&cellCalib[p/AGIPD_CALIB_GROUP], aduData+p, gainData+p, badpixMask+p);
+	}
+#endif
+	for (; p<nn; p++) {
+		tAgipdCalibGroup *group = &cellCalib[p/AGIPD_CALIB_GROUP];
+		int i = p % AGIPD_CALIB_GROUP;
 
 		// Determine which gain stage by thresholding
-        if(true) {
-            if(gainData[p] > cellGainLevel[2][p])
-            {
-                pixGain = 2;
-                pixelsInGainLevel[2] += 1;
-            }
-            else if(gainData[p] > cellGainLevel[1][p])
-            {
-                pixGain = 1;
-                pixelsInGainLevel[1] += 1;
-            }
-            else {
-                pixGain = 0;
-                pixelsInGainLevel[0] += 1;
-            }
-        }
+		int pixGain = 0;
+		if(gainData[p] > group->gainLevel[1][i])
+			pixGain = 2;
+		else if(gainData[p] > group->gainLevel[0][i])
+			pixGain = 1;
 
         // Remember the gain level setting
         gainData[p] = pixGain;
 
-        
         // Check whether this ia a bad pixel
-        if(cellBadpix[pixGain][p] != 0) {
+        if(group->badpixel[i] & (1 << pixGain)) {
             badpixMask[p]= 1;
             aduData[p] = 0;
             continue;
         }
-        
-
-        // Subtract the appropriate offset
-		aduData[p] -= cellDarkOffset[pixGain][p];		// Correct way
-		//aduData[p] -= cellDarkOffset[0][p];		    // For testing
-
-        
-		// Apply gain factor
-		aduData[p] *= cellRelativeGain[pixGain][p];
-	}
 
-	// 	This is verbose but sometimes useful
-	if(false) {
-        pixelsInGainLevel[0] = _myModule->nn - pixelsInGainLevel[1] - pixelsInGainLevel[2];
-		std::cout << "nPixels in gain mode (0,1,2) = (";
-		std::cout << pixelsInGainLevel[0] << ", ";
-		std::cout << pixelsInGainLevel[1] << ", ";
-		std::cout << pixelsInGainLevel[2] << ")" << std::endl;
+        // Subtract the appropriate offset and apply gain factor
+		aduData[p] -= group->darkOffset[pixGain][i];
+		aduData[p] *= group->relativeGain[pixGain][i];
 	}
 }
 
 
 
-
 /*
  *    Read in calibration constants needed by Cheetah
  *      h5_putdata, outfile, 'Offset', offset_out
@@ -339,6 +394,9 @@ void cAgipdCalibrator::readCalibrationData()
     }
     std::cout << std::endl;
     
+    // Repack for applyCalibration()
+    packCalibrationData();
+
     // If we get this far, we have successfully loaded the calibration data
     _calibrationLoaded = true;
 
@@ -346,6 +404,51 @@ void cAgipdCalibrator::readCalibrationData()
 
 
 
+/*
+ *	Repack the calibration constants cell by cell, with all constants for a group of pixels next to each other
+ *	(applyCalibration then reads one stream of memory instead of up to ten arrays)
+ *	The planar arrays read from file are freed afterwards
+ */
+void cAgipdCalibrator::packCalibrationData()
+{
+	if(_darkOffsetData == NULL || _gainLevelData == NULL || _relativeGainData == NULL || _badpixelData == NULL) {
+		std::cout << "Error: calibration constants missing from " << _filename << ", data will not be calibrated" << std::endl;
+		return;
+	}
+
+	long	nn = _myModule->nn;
+	_nGroups = (nn + AGIPD_CALIB_GROUP - 1) / AGIPD_CALIB_GROUP;
+	free(_packedCalib);
+	_packedCalib = (tAgipdCalibGroup *) calloc(nCells*_nGroups, sizeof(tAgipdCalibGroup));
+
+	for (int c = 0; c < nCells; c++) {
+		for (long p = 0; p < nn; p++) {
+			tAgipdCalibGroup *group = &_packedCalib[c*_nGroups + p/AGIPD_CALIB_GROUP];
+			int i = p % AGIPD_CALIB_GROUP;
+			group->gainLevel[0][i] = _gainLevelGainCellPtr[1][c][p];
+			group->gainLevel[1][i] = _gainLevelGainCellPtr[2][c][p];
+			for (int g = 0; g < nGains; g++) {
+				group->darkOffset[g][i] = _darkOffsetGainCellPtr[g][c][p];
+				group->relativeGain[g][i] = _relativeGainGainCellPtr[g][c][p];
+				if(_badpixelGainCellPtr[g][c][p] != 0)
+					group->badpixel[i] |= 1 << g;
+			}
+		}
+	}
+
+	freeGainCellPtr();
+	free(_darkOffsetData);
+	free(_gainLevelData);
+	free(_badpixelData);
+	free(_relativeGainData);
+	_darkOffsetData = NULL;
+	_gainLevelData = NULL;
+	_badpixelData = NULL;
+	_relativeGainData = NULL;
+}
+
+
+
 /*
  *	Read in calibration data from files provided by Manuela
  *  This function is currently not called but parked here in case needed again in the future.
@@ -460,6 +563,7 @@ int16_t *cAgipdCalibrator::darkOffsetForGainAndCell(int gain, int cell)
 {
 	if (gain >= nGains) return NULL;
 	if (cell >= nCells) return NULL;
+	if (_darkOffsetGainCellPtr == NULL) return NULL;
 
 	return _darkOffsetGainCellPtr[gain][cell];
 }
@@ -469,6 +573,7 @@ int16_t *cAgipdCalibrator::gainLevelForGainAndCell(int gain, int cell)
 {
 	if (gain >= nGains) return NULL;
 	if (cell >= nCells) return NULL;
+	if (_gainLevelGainCellPtr == NULL) return NULL;
 	
 	return _gainLevelGainCellPtr[gain][cell];
 }
@@ -479,6 +584,7 @@ float *cAgipdCalibrator::relativeGainForGainAndCell(int gain, int cell)
 {
     if (gain >= nGains) return NULL;
     if (cell >= nCells) return NULL;
+    if (_relativeGainGainCellPtr == NULL) return NULL;
     
     return _relativeGainGainCellPtr[gain][cell];
 }
@@ -488,6 +594,7 @@ uint8_t *cAgipdCalibrator::badpixelForGainAndCell(int gain, int cell)
 {
     if (gain >= nGains) return NULL;
     if (cell >= nCells) return NULL;
+    if (_badpixelGainCellPtr == NULL) return NULL;
     
     return _badpixelGainCellPtr[gain][cell];
 }
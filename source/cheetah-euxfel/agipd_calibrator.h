@@ -27,6 +27,21 @@
 
 class cAgipdModuleReader; // forward decl.
 
+// Pixels per group of the packed calibration constants
+#define AGIPD_CALIB_GROUP	8
+
+/*
+ *	Everything needed to calibrate AGIPD_CALIB_GROUP neighbouring pixels of one memory cell, stored together
+ *	(one of these per group of pixels, cell after cell)
+ */
+typedef struct {
+	int16_t		gainLevel[2][AGIPD_CALIB_GROUP];	// digital gain thresholds for medium and low gain
+	int16_t		darkOffset[3][AGIPD_CALIB_GROUP];
+	uint8_t		badpixel[AGIPD_CALIB_GROUP];		// bit g set = bad pixel in gain stage g
+	uint8_t		unused[AGIPD_CALIB_GROUP];
+	float		relativeGain[3][AGIPD_CALIB_GROUP];
+} tAgipdCalibGroup;
+
 class cAgipdCalibrator : public cHDF5Functions
 {
 public:
@@ -39,6 +54,7 @@ public:
 	void applyCalibration(int, float*, uint16_t*, uint16_t*);
 
 
+	// Only valid until the constants are packed at the end of readCalibrationData()
 	int16_t *darkOffsetForGainAndCell(int gain, int cell);
 	int16_t *gainLevelForGainAndCell(int gain, int cell);
     uint8_t *badpixelForGainAndCell(int gain, int cell);
@@ -64,6 +80,13 @@ private:
 	int16_t ***_gainLevelGainCellPtr;
     uint8_t ***_badpixelGainCellPtr;
     float ***_relativeGainGainCellPtr;
+
+	// Constants as used by applyCalibration()
+	long	_nGroups;
+	tAgipdCalibGroup *_packedCalib;
+
+	void packCalibrationData();
+	void freeGainCellPtr();
 };
 
 #endif /* defined(__agipd__agipd_calibrator__) */
@@ -130,6 +130,14 @@ cAgipdModuleReader::cAgipdModuleReader(void){
 
 	calibGainFactor = NULL;
 
+	memset(block, 0, sizeof(block));
+	block[0].first = -1;
+	block[1].first = -1;
+	currentBlock = 0;
+	blockFrames = AGIPD_BLOCK_FRAMES;
+	pthread_mutex_init(&blockMutex, NULL);
+	pthread_cond_init(&blockLoaded, NULL);
+
 	calibrator = NULL;
 	darkcalFilename = "No_file_specified";
 	gaincalFilename = "No_file_specified";
@@ -138,6 +146,8 @@ cAgipdModuleReader::cAgipdModuleReader(void){
 cAgipdModuleReader::~cAgipdModuleReader(){
 	std::cout << "\tModule destructor called" << std::endl;
 	cAgipdModuleReader::close();
+	pthread_mutex_destroy(&blockMutex);
+	pthread_cond_destroy(&blockLoaded);
 };
 
 /*
@@ -290,8 +300,6 @@ void cAgipdModuleReader::close(void) {
 	if (noData || !fileOK)
         return;
 
-	if(data==NULL)
-		return;
 	if(h5_file_id==NULL)
 		return;
 
@@ -316,26 +324,27 @@ void cAgipdModuleReader::close(void) {
     }
 
     
-	// Free array memory
-	if(data != NULL) {
-		std::cout << "\tFreeing memory " << filename << "\n";
-		free(pulseIDlist);
-		free(trainIDlist);
-		free(cellIDlist);
-		free(statusIDlist);
-		free(data);
-		free(digitalGain);
-		free(badpixMask);
-		
-		// Pointers to NULL
-		pulseIDlist = NULL;
-		trainIDlist = NULL;
-		cellIDlist = NULL;
-		statusIDlist = NULL;
-		data = NULL;
-		digitalGain = NULL;
-		badpixMask = NULL;
-	}
+	// Free array memory (frame arrays are only there if readFrame(long) was used)
+	std::cout << "\tFreeing memory " << filename << "\n";
+	free(pulseIDlist);
+	free(trainIDlist);
+	free(cellIDlist);
+	free(statusIDlist);
+	free(data);
+	free(digitalGain);
+	free(badpixMask);
+	freeBlock(&block[0]);
+	freeBlock(&block[1]);
+	currentBlock = 0;
+	
+	// Pointers to NULL
+	pulseIDlist = NULL;
+	trainIDlist = NULL;
+	cellIDlist = NULL;
+	statusIDlist = NULL;
+	data = NULL;
+	digitalGain = NULL;
+	badpixMask = NULL;
 	
 	
 	if (h5_file_id != 0) {
@@ -458,19 +467,38 @@ void cAgipdModuleReader::readImageStack(void){
 
 
 /*
- *	Read one frame of data
+ *	Read one frame of data into this module's data, digitalGain and badpixMask
  */
 void cAgipdModuleReader::readFrame(long frameNum){
+    if (noData) {
+        return;
+    }
+
+	if(data == NULL) {
+		data = (float *) malloc(nn*sizeof(float));
+		digitalGain = (uint16_t *) malloc(nn*sizeof(uint16_t));
+		badpixMask = (uint16_t *) malloc(nn*sizeof(uint16_t));
+	}
+	readFrame(frameNum, data, digitalGain, badpixMask);
+}
+
+
+/*
+ *	Read one frame of data into nn-element arrays belonging to the caller
+ *	Each module only touches its own datasets and arrays, so different modules can be read on different threads
+ *	Returns false if nothing could be read
+ */
+bool cAgipdModuleReader::readFrame(long frameNum, float *frameData, uint16_t *frameGain, uint16_t *frameMask){
 	// Read a single image at position frameNum
 	// Will have both fs and ss, and stack...
 
     if (noData) {
-        return;
+        return false;
     }
 
 	if(frameNum < 0 || frameNum >= nframes) {
 		std::cout << "\treadFrame::frameNum out of bounds " << frameNum << std::endl;
-		return;
+		return false;
 	}
 	
 	if(verbose) {
@@ -485,79 +513,247 @@ void cAgipdModuleReader::readFrame(long frameNum){
 	cellID = cellIDlist[frameNum];
 	statusID = statusIDlist[frameNum];
 	
+	// Block of frames from this train (usually already read ahead by prefetchNextBlock())
+	tAgipdFrameBlock *b = frameBlock(frameNum);
+	if(b == NULL) {
+		return false;
+	}
 
 	// Read the data frame
 	if (rawDetectorData) {
-		readFrameRaw(frameNum);
+		return readFrameRaw(frameNum, b, frameData, frameGain, frameMask);
 	}
 	else {
-		readFrameXFELCalib(frameNum);
+		return readFrameXFELCalib(frameNum, b, frameData, frameGain, frameMask);
 	}
 }
 // cAgipdModuleReader::readFrame
 
 
 /*
- *	Read one frame of data from RAW files
+ *	Frames of the block holding frameNum: those of its train, in pieces of at most blockFrames
  */
-void cAgipdModuleReader::readFrameRaw(long frameNum) {
-    if (noData) {
-		return;
-    }
+void cAgipdModuleReader::blockRange(long frameNum, long *first, long *count) {
+	uint64_t	train = trainIDlist[frameNum];
+
+	long trainStart = frameNum;
+	while(trainStart > 0 && trainIDlist[trainStart-1] == train) {
+		trainStart--;
+	}
+
+	long start = trainStart + ((frameNum-trainStart)/blockFrames)*blockFrames;
+	long n = 0;
+	while(n < blockFrames && start+n < nframes && trainIDlist[start+n] == train) {
+		n++;
+	}
+	*first = start;
+	*count = n;
+}
 
-	// Define hyperslab in RAW data file
+
+/*
+ *	Read the frames b->first ... b->first+b->count-1 with one hyperslab read per dataset
+ *	Called without blockMutex held: nothing else touches a block while it is loading
+ */
+bool cAgipdModuleReader::readBlock(tAgipdFrameBlock *b) {
 	hsize_t     slab_start[4];
 	hsize_t		slab_size[4];
-	slab_start[0] = frameNum;
-	slab_start[1] = 0;
-	slab_start[2] = 0;
-	slab_start[3] = 0;
-	slab_size[0] = 1;
-	slab_size[1] = 1;
-	slab_size[2] = n1;
-	slab_size[3] = n0;
-	int ndims = 4;
-	
-	// Free existing memory
-	free(data); data = NULL;
-	free(digitalGain); digitalGain = NULL;
-	free(badpixMask); badpixMask = NULL;
 
+	if (rawDetectorData) {
+		// Gain data sits gainDataOffset further along, so read those frames and stack layers as well
+		long nstackRead = 1 + gainDataOffset[1];
+		b->nread = b->count + gainDataOffset[0];
+		if(b->first + b->nread > nframes) {
+			b->nread = nframes - b->first;
+		}
+		if(b->image == NULL) {
+			b->image = malloc((blockFrames + gainDataOffset[0]) * nstackRead * nn * sizeof(uint16_t));
+		}
 
-    // Read data from hyperslab in RAW data file (which is unit16_t, so convert it to float)
-	uint16_t *tempdata = NULL;
-    if(useNewDatasetReader) {
-        tempdata = (uint16_t*) raw_image_dataset.checkAllocReadHyperslab(ndims, slab_start, slab_size, H5T_STD_U16LE, sizeof(uint16_t));
-    }
-    else {
-        tempdata = (uint16_t*) checkAllocReadHyperslab((char *)h5_image_data_field.c_str(), ndims, slab_start, slab_size, H5T_STD_U16LE, sizeof(uint16_t));
+		slab_start[0] = b->first;
+		slab_start[1] = 0;
+		slab_start[2] = 0;
+		slab_start[3] = 0;
+		slab_size[0] = b->nread;
+		slab_size[1] = nstackRead;
+		slab_size[2] = n1;
+		slab_size[3] = n0;
+		return readHyperslab(&raw_image_dataset, h5_image_data_field, 4, slab_start, slab_size, H5T_STD_U16LE, sizeof(uint16_t), b->image);
+	}
+	else {
+		b->nread = b->count;
+		if(b->image == NULL) {
+			b->image = malloc(blockFrames * nn * sizeof(float));
+			b->gain = (uint8_t *) malloc(blockFrames * nn * sizeof(uint8_t));
+			b->mask = (uint8_t *) malloc(blockFrames * nn * sizeof(uint8_t));
+		}
 
-    }
-	
-    if (!tempdata) {
+		slab_start[0] = b->first;
+		slab_start[1] = 0;
+		slab_start[2] = 0;
+		slab_size[0] = b->nread;
+		slab_size[1] = n1;
+		slab_size[2] = n0;
+		if(!readHyperslab(&proc_image_dataset, h5_image_data_field, 3, slab_start, slab_size, H5T_IEEE_F32LE, sizeof(float), b->image))
+			return false;
+		if(!readHyperslab(&proc_gain_dataset, h5_image_gain_field, 3, slab_start, slab_size, H5T_STD_U8LE, sizeof(uint8_t), b->gain))
+			return false;
+		return readHyperslab(&proc_mask_dataset, h5_image_mask_field, 3, slab_start, slab_size, H5T_STD_U8LE, sizeof(uint8_t), b->mask);
+	}
+}
+
+
+void cAgipdModuleReader::freeBlock(tAgipdFrameBlock *b) {
+	pthread_mutex_lock(&blockMutex);
+	while(b->loading) {
+		pthread_cond_wait(&blockLoaded, &blockMutex);
+	}
+	pthread_mutex_unlock(&blockMutex);
+
+	free(b->image);
+	free(b->gain);
+	free(b->mask);
+	memset(b, 0, sizeof(tAgipdFrameBlock));
+	b->first = -1;
+}
+
+
+static inline bool blockHolds(tAgipdFrameBlock *b, long frameNum) {
+	return b->first >= 0 && frameNum >= b->first && frameNum < b->first + b->count;
+}
+
+
+/*
+ *	Block holding frameNum, read now unless it is the current block or the one read ahead
+ *	Only one thread at a time reads frames from a module, prefetchNextBlock() only ever fills the other block
+ */
+tAgipdFrameBlock *cAgipdModuleReader::frameBlock(long frameNum) {
+	pthread_mutex_lock(&blockMutex);
+	while(true) {
+		tAgipdFrameBlock *b = &block[currentBlock];
+		tAgipdFrameBlock *next = &block[1-currentBlock];
+
+		if(blockHolds(b, frameNum)) {
+			pthread_mutex_unlock(&blockMutex);
+			return b;
+		}
+		if(next->loading) {
+			pthread_cond_wait(&blockLoaded, &blockMutex);
+			continue;
+		}
+		if(blockHolds(next, frameNum)) {
+			currentBlock = 1-currentBlock;
+			continue;
+		}
+		break;
+	}
+
+	// Not read ahead: read it into the other block now
+	tAgipdFrameBlock *b = &block[1-currentBlock];
+	// (marked as loading so a queued prefetchNextBlock() leaves it alone)
+	blockRange(frameNum, &b->first, &b->count);
+	b->loading = true;
+	pthread_mutex_unlock(&blockMutex);
+
+	bool ok = readBlock(b);
+
+	pthread_mutex_lock(&blockMutex);
+	b->loading = false;
+	if(ok) {
+		currentBlock = 1-currentBlock;
+	}
+	else {
+		std::cout << "\tFailed to read frames " << b->first << "-" << b->first+b->count-1 << " from " << filename << std::endl;
+		b->first = -1;
+		b = NULL;
+	}
+	pthread_cond_broadcast(&blockLoaded);
+	pthread_mutex_unlock(&blockMutex);
+	return b;
+}
+
+
+/*
+ *	Read the block following the current one into the other block (if not already there)
+ *	Meant to run on a background thread while frames are taken from the current block
+ */
+void cAgipdModuleReader::prefetchNextBlock(void) {
+	if (noData) {
 		return;
 	}
-    
-    // Convert uint16_t to float
-	data = (float *)malloc(n0 * n1 * sizeof(float));
-	for (int i = 0; i < n0 * n1; i++) {
-		data[i] = tempdata[i];
+
+	pthread_mutex_lock(&blockMutex);
+	tAgipdFrameBlock *b = &block[currentBlock];
+	tAgipdFrameBlock *next = &block[1-currentBlock];
+	long nextFrame = b->first + b->count;
+	if(b->first < 0 || next->loading || nextFrame >= nframes || blockHolds(next, nextFrame)) {
+		pthread_mutex_unlock(&blockMutex);
+		return;
 	}
-	free(tempdata);
-	
-	// Digital gain is in the second dimension (at least that's the way it was meant to be)
-	// For the first few experiments digital gain is actually in the next analog memory location: location configured via gainDataOffset
-	slab_start[0] += gainDataOffset[0];
-	slab_start[1] += gainDataOffset[1];
+	blockRange(nextFrame, &next->first, &next->count);
+	next->loading = true;
+	pthread_mutex_unlock(&blockMutex);
+
+	bool ok = readBlock(next);
+
+	pthread_mutex_lock(&blockMutex);
+	next->loading = false;
+	if(!ok) {
+		next->first = -1;
+	}
+	pthread_cond_broadcast(&blockLoaded);
+	pthread_mutex_unlock(&blockMutex);
+}
+
+
+/*
+ *	Read a hyperslab into buffer, through the persistent dataset or by field name
+ */
+bool cAgipdModuleReader::readHyperslab(cHDF5dataset *dataset, std::string &field, int ndims, hsize_t *slab_start, hsize_t *slab_size, hid_t h5_type_id, size_t targetsize, void *buffer) {
     if(useNewDatasetReader) {
-        digitalGain = (uint16_t*) raw_image_dataset.checkAllocReadHyperslab(ndims, slab_start, slab_size, H5T_STD_U16LE, sizeof(uint16_t));
+        return dataset->checkReadHyperslab(ndims, slab_start, slab_size, h5_type_id, buffer);
     }
-    else {
-        digitalGain = (uint16_t*) checkAllocReadHyperslab((char *)h5_image_data_field.c_str(), ndims, slab_start, slab_size, H5T_STD_U16LE, sizeof(uint16_t));
+
+    void *temp = checkAllocReadHyperslab((char *)field.c_str(), ndims, slab_start, slab_size, h5_type_id, targetsize);
+    if(temp == NULL) {
+        return false;
     }
+    long nelements = 1;
+    for(int i=0; i<ndims; i++)
+        nelements *= slab_size[i];
+    memcpy(buffer, temp, nelements*targetsize);
+    free(temp);
+    return true;
+}
+
+
+/*
+ *	Read one frame of data from RAW files
+ */
+bool cAgipdModuleReader::readFrameRaw(long frameNum, tAgipdFrameBlock *b, float *frameData, uint16_t *frameGain, uint16_t *frameMask) {
+    if (noData) {
+		return false;
+    }
+
+	// Digital gain is in the second dimension (at least that's the way it was meant to be)
+	// For the first few experiments digital gain is actually in the next analog memory location: location configured via gainDataOffset
+	long nstackRead = 1 + gainDataOffset[1];
+	long f = frameNum - b->first;
+	if(f + gainDataOffset[0] >= b->nread) {
+		return false;
+	}
+	uint16_t *tempdata = (uint16_t *) b->image + (f*nstackRead)*nn;
+	uint16_t *tempgain = (uint16_t *) b->image + ((f+gainDataOffset[0])*nstackRead + gainDataOffset[1])*nn;
+
+    // RAW data is unit16_t, so convert it to float
+	for (int i = 0; i < n0 * n1; i++) {
+		frameData[i] = tempdata[i];
+	}
+	memcpy(frameGain, tempgain, nn*sizeof(uint16_t));
+
 	// Bad pixel mask added by raw data calibration, or left alone if uncalibrated
-    // Pixel good = 0, pixel bad = anything else; deliberate use of calloc() to zero the array
-	badpixMask = (uint16_t *)calloc(nn, sizeof(uint16_t));
+    // Pixel good = 0, pixel bad = anything else
+	memset(frameMask, 0, nn*sizeof(uint16_t));
 
 	
 	// Update timestamp, status bits and other stuff
@@ -568,7 +764,8 @@ void cAgipdModuleReader::readFrameRaw(long frameNum) {
 	
 	
 	//	Apply calibration constants (if known).
-	applyCalibration(frameNum);
+	applyCalibration(frameNum, frameData, frameGain, frameMask);
+	return true;
 };
 // cAgipdModuleReader::readFrameRaw
 
@@ -578,87 +775,45 @@ void cAgipdModuleReader::readFrameRaw(long frameNum) {
  *	usually found in {$EXPT}/proc
  *  as provided by Steffen Hauf's calibration routines
  */
-void cAgipdModuleReader::readFrameXFELCalib(long frameNum) {
+bool cAgipdModuleReader::readFrameXFELCalib(long frameNum, tAgipdFrameBlock *b, float *frameData, uint16_t *frameGain, uint16_t *frameMask) {
 	if (noData) {
-		return;
+		return false;
 	}
 	
-	// Define hyperslab in CALIB data file
-	hsize_t     slab_start[4];
-	hsize_t		slab_size[4];
-	slab_start[0] = frameNum;
-	slab_start[1] = 0;
-	slab_start[2] = 0;
-	slab_size[0] = 1;
-	slab_size[1] = n1;
-	slab_size[2] = n0;
-	int ndims = 3;
-	
-	// Free existing memory
-	free(data); data = NULL;
-	free(digitalGain); digitalGain = NULL;
-	free(badpixMask); badpixMask = NULL;
+	long f = frameNum - b->first;
 
-    //std::cout << "ndims=" << ndims << ", size=[" << slab_size[0] << ", " << slab_size[1] << ", " << slab_size[2] << std::endl;
-    
-	// Read data directly from hyperslab in corrected data file (which is already a float)
-    if(useNewDatasetReader) {
-        data = (float *) proc_image_dataset.checkAllocReadHyperslab(ndims, slab_start, slab_size, H5T_IEEE_F32LE, sizeof(float));
-    }
-    else {
-        data = (float *) checkAllocReadHyperslab((char *)h5_image_data_field.c_str(), ndims, slab_start, slab_size, H5T_IEEE_F32LE, sizeof(float));
-    }
-    if (!data) {
-        return;
-    }
+	// Corrected data is already a float
+	memcpy(frameData, (float *) b->image + f*nn, nn*sizeof(float));
 
 	// Digital gain is in a different field and is H5T_STD_U8LE Dataset {7500, 512, 128}
 	// Default format is uint16_t so we must convert
-	uint8_t *tempgain = NULL;
-    if(useNewDatasetReader) {
-        tempgain = (uint8_t*) proc_gain_dataset.checkAllocReadHyperslab(ndims, slab_start, slab_size, H5T_STD_U8LE, sizeof(uint8_t));
-    }
-    else {
-        tempgain = (uint8_t*) checkAllocReadHyperslab((char *)h5_image_gain_field.c_str(), ndims, slab_start, slab_size, H5T_STD_U8LE, sizeof(uint8_t));
-    }
-	digitalGain = (uint16_t *)malloc(nn * sizeof(uint16_t));
+	uint8_t *tempgain = b->gain + f*nn;
 	for (int i = 0; i < nn; i++) {
-		digitalGain[i] = tempgain[i];
+		frameGain[i] = tempgain[i];
 	}
-	free(tempgain);
 
 	
 	// Bad pixel mask is a H5T_STD_U8LE Dataset {7500, 512, 128, 3}  <--- Not any more
-	//slab_start[3] = 0;
-	//slab_size[3] = 3;
-	//ndims = 4;
-	uint8_t *tempmask = NULL;
-    if(useNewDatasetReader) {
-        tempmask = (uint8_t*) proc_mask_dataset.checkAllocReadHyperslab(ndims, slab_start, slab_size, H5T_STD_U8LE, sizeof(uint8_t));
-    }
-    else {
-        tempmask = (uint8_t*) checkAllocReadHyperslab((char *)h5_image_mask_field.c_str(), ndims, slab_start, slab_size, H5T_STD_U8LE, sizeof(uint8_t));
-    }
-	badpixMask = (uint16_t *)calloc(nn, sizeof(uint16_t));
+	uint8_t *tempmask = b->mask + f*nn;
     // Copy across mask
     long nbad = 0;
     for (long i = 0; i < nn; i++) {
+        frameMask[i] = 0;
         if(tempmask[i] != 0) {
-            data[i] = 0;
-            badpixMask[i] = 1;
+            frameData[i] = 0;
+            frameMask[i] = 1;
             nbad++;
         }
     }
-    free(tempmask);
 
     
     // Check for screwy intensity values: Sometimes we get +/- 1e9 appearing
     // Bad form to hard code this, but for now it's just a test case
     if(false) {
         for (long i = 0; i < nn; i++) {
-            if(data[i] > 1e7 || data[i] < -1e6) {
-                data[i] = 0;
-                badpixMask[i] = 1;
+            if(frameData[i] > 1e7 || frameData[i] < -1e6) {
+                frameData[i] = 0;
+                frameMask[i] = 1;
             }
         }
     }
@@ -668,6 +823,7 @@ void cAgipdModuleReader::readFrameXFELCalib(long frameNum) {
 	pulseID = pulseIDlist[frameNum];
 	cellID = cellIDlist[frameNum];
 	statusID = statusIDlist[frameNum];
+	return true;
 };
 // cAgipdModuleReader::readFrameXFELCalib
 
@@ -676,7 +832,7 @@ void cAgipdModuleReader::readFrameXFELCalib(long frameNum) {
 // Apply calibration constants (if known)
 // A wrapper for function moved to agipd_calibrator (maybe remove later)
 // void cAgipdCalibrator::applyCalibration(int cellID, float *aduData, uint16_t *gainData){...}
-void cAgipdModuleReader::applyCalibration(long frameNum) {
+void cAgipdModuleReader::applyCalibration(long frameNum, float *frameData, uint16_t *frameGain, uint16_t *frameMask) {
     
     // Apply calibrations to raw data, skip if we have pre-calibrated data
     if(rawDetectorData == false)
@@ -684,7 +840,7 @@ void cAgipdModuleReader::applyCalibration(long frameNum) {
     
     // No calibrator = no calibration; return and zero out digital gain
     if(calibrator == NULL) {
-        memset(digitalGain, 0, nn*sizeof(uint16_t));
+        memset(frameGain, 0, nn*sizeof(uint16_t));
 		return;
     }
 
@@ -701,7 +857,7 @@ void cAgipdModuleReader::applyCalibration(long frameNum) {
 
     
 	// Apply calibrator for this cell
-	calibrator->applyCalibration(thisCell, data, digitalGain, badpixMask);
+	calibrator->applyCalibration(thisCell, frameData, frameGain, frameMask);
 
 }
 //  cAgipdModuleReader::applyCalibration
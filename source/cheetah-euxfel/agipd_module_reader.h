@@ -21,13 +21,10 @@
 #include <hdf5_hl.h>
 #include <map>
 #include <sstream>
+#include <pthread.h>
 #include "hdf5_functions.h"
 #include "agipd_calibrator.h"
 
-typedef std::pair<long, int> TrainPulsePair; // pairs of trains and pulses
-typedef std::pair<TrainPulsePair, int> TrainPulseModulePair; // pairs of train-pulses and module numbers
-typedef std::map<TrainPulseModulePair, long> TrainPulseMap; // map of train-pulse & module number to frame num.
-
 inline std::string i_to_str(int val)
 {
 	std::ostringstream ss;
@@ -61,6 +58,23 @@ inline std::string getBaseFilename(std::string filename)
 
 class cAgipdCalibrator;
 
+// Frames of one train are read from file in blocks of at most this many (default for setBlockFrames)
+// Each module holds two blocks: 16 modules take about 12.6 MB per block frame for calibrated data, 8.4 MB for raw data
+#define AGIPD_BLOCK_FRAMES	32
+
+/*
+ *	Consecutive frames of one train, read from file with one hyperslab per dataset
+ */
+typedef struct {
+	long		first;		// first frame held (-1 = nothing)
+	long		count;		// frames held
+	long		nread;		// frames read from file (count, plus any following frames holding gain data)
+	bool		loading;	// being read by prefetchNextBlock()
+	void		*image;		// uint16_t for raw data (nread x (1+gainDataOffset[1]) x nn), float for calibrated data
+	uint8_t		*gain;		// calibrated data only
+	uint8_t		*mask;		// calibrated data only
+} tAgipdFrameBlock;
+
 /*
  *	This class handles reading and writing for one AGIPD module file
  *	(each module is in a separate file)
@@ -79,10 +93,14 @@ public:
 	void readGaincal(char[]);
 	void readImageStack(void);
 	void readFrame(long);
+	bool readFrame(long, float*, uint16_t*, uint16_t*);
+	void prefetchNextBlock(void);
+	long currentBlockFirst(void) { return block[currentBlock].first; }
 
 	void setGainDataOffset(int d0, int d1) {gainDataOffset[0] = d0; gainDataOffset[1] = d1; }
 	void setCellIDcorrection(int mod) { cellIDcorrection = mod; if (cellIDcorrection <= 0) cellIDcorrection = 1; }
 	void setDoNotApplyGainSwitch(bool _val) {_doNotApplyGainSwitch = _val; }
+	void setBlockFrames(long n) { blockFrames = n; if (blockFrames < 1) blockFrames = 1; }	// Before open()
     void setDetectorString(std::string detName);
 
 	
@@ -137,6 +155,13 @@ private:
 
 	cAgipdCalibrator *calibrator;
 	float		*calibGainFactor;
+
+	// Current block of frames and the one after it (which may still be loading)
+	tAgipdFrameBlock	block[2];
+	int				currentBlock;
+	long			blockFrames;
+	pthread_mutex_t	blockMutex;
+	pthread_cond_t	blockLoaded;
     
     // Persistent chunked data sets
     cHDF5dataset    raw_image_dataset;
@@ -148,9 +173,14 @@ private:
 
 // Private functions
 private:
-	void		readFrameRaw(long frameNum);
-	void		readFrameXFELCalib(long frameNum);
-	void		applyCalibration(long frameNum);
+	void		blockRange(long frameNum, long *first, long *count);
+	bool		readBlock(tAgipdFrameBlock *b);
+	void		freeBlock(tAgipdFrameBlock *b);
+	tAgipdFrameBlock *frameBlock(long frameNum);
+	bool		readFrameRaw(long frameNum, tAgipdFrameBlock *b, float *frameData, uint16_t *frameGain, uint16_t *frameMask);
+	bool		readFrameXFELCalib(long frameNum, tAgipdFrameBlock *b, float *frameData, uint16_t *frameGain, uint16_t *frameMask);
+	bool		readHyperslab(cHDF5dataset *dataset, std::string &field, int ndims, hsize_t *slab_start, hsize_t *slab_size, hid_t h5_type_id, size_t targetsize, void *buffer);
+	void		applyCalibration(long frameNum, float *frameData, uint16_t *frameGain, uint16_t *frameMask);
 };
 
 
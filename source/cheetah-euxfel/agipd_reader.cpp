@@ -20,6 +20,16 @@
 #include "agipd_reader.h"
 #include <algorithm>
 
+/*
+ *	prefetchPool task: read ahead the next block of frames of one module
+ */
+static void *prefetchModuleTask(void *arg) {
+	cAgipdModuleReader	*thisModule = (cAgipdModuleReader *) arg;
+	thisModule->prefetchNextBlock();
+	return NULL;
+}
+
+
 cAgipdReader::cAgipdReader(void){
 	data = NULL;
 	badpixMask = NULL;
@@ -40,6 +50,11 @@ cAgipdReader::cAgipdReader(void){
     _pulseIDmodulo = 1;
     _newFileSkip = 0;
 	_doNotApplyGainSwitch = false;
+	_readerThreads = 0;
+	_blockFrames = AGIPD_BLOCK_FRAMES;
+	frameIndex = NULL;
+	indexTrains = 0;
+	indexPulses = 0;
 	
 	_gainDataOffset[0] = 0;
 	_gainDataOffset[1] = 1;
@@ -290,6 +305,7 @@ void cAgipdReader::open(char *baseFilename){
 		}
 		module[i].verbose = 0;
         module[i].setDetectorString(_detName);
+		module[i].setBlockFrames(_blockFrames);
 		module[i].open((char *) moduleFilename[i].data(), i);
 		module[i].readHeaders();
 		module[i].readDarkcal((char *)darkcalFilename[i].c_str());
@@ -483,30 +499,8 @@ void cAgipdReader::open(char *baseFilename){
     std::cout << "****** End AGIPD configuration ******\n";
 
     
-    // Create trainID/pulseID pairs
-	for(long module_num=0; module_num<nAGIPDmodules; module_num++) {
-		for (long train = minTrain; train <= maxTrain; train++) {
-			for (long pulse = minPulse; pulse <= maxPulse; pulse++) {
-				TrainPulsePair train2Pulse = std::make_pair(train, pulse);
-				TrainPulseModulePair tp2Module = std::make_pair(train2Pulse, module_num);
-				trainPulseMap[tp2Module] = -1; // start with unassigned
-			}
-		}
-	}
-
-	for(long module_num=0; module_num<nAGIPDmodules; module_num++) {
-		if (module[module_num].noData)
-			continue;
-
-		for(long frame=0; frame < module[module_num].nframes; frame++) {
-			long trainID = module[module_num].trainIDlist[frame];
-			long pulseID = module[module_num].pulseIDlist[frame];
-
-			TrainPulsePair train2Pulse = std::make_pair(trainID, pulseID);
-			TrainPulseModulePair tp2Module = std::make_pair(train2Pulse, module_num);
-			trainPulseMap[tp2Module] = frame;
-		}
-	}
+    // Index trainID/pulseID pairs
+	buildFrameIndex();
 
 	
 	// Allocate memory for data and masks
@@ -525,6 +519,18 @@ void cAgipdReader::open(char *baseFilename){
 		pmask[i] = badpixMask + i*offset;
 	}
 
+	// Threads for reading modules in parallel
+	if(_readerThreads > 0 && readerPool.nWorkers() == 0) {
+		std::cout << "\tReading modules using " << _readerThreads << " threads\n";
+		readerPool.start(_readerThreads, nAGIPDmodules);
+	}
+	if(prefetchPool.nWorkers() == 0) {
+		prefetchPool.start(1, 2*nAGIPDmodules);
+	}
+	for (long i=0; i < nAGIPDmodules; i++) {
+		prefetchFrom[i] = -1;
+	}
+
 	// Bye bye
 	std::cout << "All AGIPD files successfully opened\n";
 }
@@ -535,6 +541,9 @@ void cAgipdReader::close(void){
 
 	std::cout << "Closing AGIPD files " << std::endl;
 	
+	// Let any read-ahead finish before the files go
+	prefetchPool.drain(0);
+
 	// Close files for each module
 	for(long i=0; i<nAGIPDmodules; i++) {
 		std::cout << "\tClosing " << moduleFilename[i] << std::endl;
@@ -548,11 +557,66 @@ void cAgipdReader::close(void){
 		free(badpixMask); badpixMask = NULL;
 		free(digitalGain); digitalGain = NULL;
 	}
+	free(frameIndex); frameIndex = NULL;
 	std::cout << "\tAGIPD reader closed " << std::endl;
 }
 // cAgipdReader::close()
 
 
+/*
+ *	Fill frameIndex from the train and pulse IDs of every module
+ *	Frames outside the train and pulse range (eg: silly trainIDs) are left out
+ */
+void cAgipdReader::buildFrameIndex(void) {
+	free(frameIndex);
+	indexTrains = maxTrain - minTrain + 1;
+	indexPulses = maxPulse - minPulse + 1;
+
+	long n = indexTrains * indexPulses * nAGIPDmodules;
+	std::cout << "\tFrame index: " << indexTrains << " trains x " << indexPulses << " pulses x " << nAGIPDmodules << " modules" << std::endl;
+	frameIndex = (long *) malloc(n*sizeof(long));
+	for(long i=0; i<n; i++) {
+		frameIndex[i] = -1; // start with unassigned
+	}
+
+	for(long module_num=0; module_num<nAGIPDmodules; module_num++) {
+		if (module[module_num].noData)
+			continue;
+
+		for(long frame=0; frame < module[module_num].nframes; frame++) {
+			long trainID = module[module_num].trainIDlist[frame];
+			long pulseID = module[module_num].pulseIDlist[frame];
+			if (trainID < minTrain || trainID > maxTrain || pulseID < minPulse || pulseID > maxPulse)
+				continue;
+
+			frameIndex[((trainID-minTrain)*indexPulses + pulseID-minPulse)*nAGIPDmodules + module_num] = frame;
+		}
+	}
+}
+
+
+/*
+ *	Frame numbers of every pulse of one train: indexPulses x nAGIPDmodules entries starting at pulse minPulse,
+ *	-1 for pulses a module does not have; NULL if the train is out of range
+ */
+const long *cAgipdReader::trainFrames(long trainID) {
+	if (frameIndex == NULL || trainID < minTrain || trainID > maxTrain)
+		return NULL;
+	return frameIndex + (trainID-minTrain)*indexPulses*nAGIPDmodules;
+}
+
+
+/*
+ *	Frame number of one train, pulse and module, -1 if there is none
+ */
+long cAgipdReader::frameNumber(long trainID, long pulseID, int moduleID) {
+	const long *frames = trainFrames(trainID);
+	if (frames == NULL || pulseID < minPulse || pulseID > maxPulse || moduleID < 0 || moduleID >= nAGIPDmodules)
+		return -1;
+	return frames[(pulseID-minPulse)*nAGIPDmodules + moduleID];
+}
+
+
 // Why is there a separate private and public function for this?
 bool cAgipdReader::nextFrame() {
 	return nextFramePrivate();
@@ -666,6 +730,46 @@ void cAgipdReader::setModuleToBlank(int moduleID) {
 }
 
 
+/*
+ *	Read one module of the frame set up by readFrame() (one parallelFor() iteration)
+ *	Modules only touch their own files, part of the data slab and entries of cellID[]/statusID[]
+ */
+void cAgipdReader::readModule(void *arg, long moduleID, long /*slot*/) {
+	cAgipdReader	*reader = (cAgipdReader *) arg;
+	cAgipdModuleReader	*thisModule = &reader->module[moduleID];
+	long	frameNum = reader->moduleFrame[moduleID];
+
+	reader->moduleRead[moduleID] = false;
+
+	if (thisModule->noData==true || frameNum < 0)
+	{
+		reader->setModuleToBlank(moduleID);
+		reader->cellID[moduleID] = thisModule->cellID;
+		return;
+	}
+
+	// Read the requested frame number (and update metadata in structure)
+	bool ok = thisModule->readFrame(frameNum, reader->pdata[moduleID], reader->pgain[moduleID], reader->pmask[moduleID]);
+
+	if (!ok || thisModule->noData) {
+		reader->setModuleToBlank(moduleID);
+		return;
+	}
+
+	// Copy across
+	reader->cellID[moduleID] = thisModule->cellID;
+	reader->statusID[moduleID] = thisModule->statusID;
+
+	// Set entire panel mask to whatever the status is.
+	if(thisModule->statusID != 0) {
+		for(long p=0; p<reader->modulenn; p++) {
+			reader->pmask[moduleID][p] = thisModule->statusID;
+		}
+	}
+	reader->moduleRead[moduleID] = true;
+}
+
+
 bool cAgipdReader::readFrame(long trainID, long pulseID)
 {
 	if (trainID < minTrain || trainID > maxTrain) {
@@ -682,51 +786,38 @@ bool cAgipdReader::readFrame(long trainID, long pulseID)
 	lastModule = -1;
 
     
-	// Loop through modules
+	// Frame number of this train/pulse in each module
+	const long *frames = trainFrames(trainID);
 	for(int moduleID=0; moduleID<nAGIPDmodules; moduleID++)
 	{
-		//std::cout << "Reading module " << i << " of " << nAGIPDmodules << std::endl;
-		TrainPulsePair tp = std::make_pair(trainID, pulseID);
-		TrainPulseModulePair tp2mod = std::make_pair(tp, moduleID);
-		long frameNum = trainPulseMap[tp2mod];
-
-		if (module[moduleID].noData==true || frameNum < 0)
-		{
-            setModuleToBlank(moduleID);
-			cellID[moduleID] = module[moduleID].cellID;
-			continue;
-		}
+		moduleFrame[moduleID] = (frames != NULL) ? frames[(pulseID-minPulse)*nAGIPDmodules + moduleID] : -1;
+	}
 
-		// Read the requested frame number (and update metadata in structure)
-        //std::cout << "Reading train " << trainID << " pulse " << pulseID << " module " << i << std::endl;
-        module[moduleID].readFrame(frameNum);
-        // std::cout << "Reading frame done" << std::endl;
+	// Read, convert and calibrate each module straight into its part of the data slab
+	if(readerPool.nWorkers() > 0)
+		readerPool.parallelFor(nAGIPDmodules, readModule, this);
+	else
+		for(int moduleID=0; moduleID<nAGIPDmodules; moduleID++)
+			readModule(this, moduleID, 0);
 
-		if (module[moduleID].noData) {
-            setModuleToBlank(moduleID);
+	// Collect metadata
+	for(int moduleID=0; moduleID<nAGIPDmodules; moduleID++)
+	{
+		if (!moduleRead[moduleID]) {
 			continue;
 		}
 		moduleCount++;
-
-		// Copy across
-		cellID[moduleID] = module[moduleID].cellID;
-		statusID[moduleID] = module[moduleID].statusID;
-
-        memcpy(pdata[moduleID], module[moduleID].data, modulenn*sizeof(float));
-		memcpy(pgain[moduleID], module[moduleID].digitalGain, modulenn*sizeof(uint16_t));
-
 		lastModule = (int)moduleID;
-		
-		// Set entire panel mask to whatever the status is.
-        //std::cout << "Memset mask" << std::endl;
-		if(module[moduleID].statusID != 0) {
-			for(long p=0; p<modulenn; p++) {
-				pmask[moduleID][p] = module[moduleID].statusID;
-			}
-		}
-		else {
-			memcpy(pmask[moduleID], module[moduleID].badpixMask, modulenn*sizeof(uint16_t));
+	}
+
+	// Start reading the next block of frames of any module that has just moved on to a new one
+	for(int moduleID=0; moduleID<nAGIPDmodules; moduleID++)
+	{
+		if (!moduleRead[moduleID] || module[moduleID].currentBlockFirst() == prefetchFrom[moduleID]) {
+			continue;
 		}
+		prefetchFrom[moduleID] = module[moduleID].currentBlockFirst();
+		prefetchPool.submit(prefetchModuleTask, &module[moduleID], 0);
 	}
 
 	if (lastModule >= 0)
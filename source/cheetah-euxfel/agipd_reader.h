@@ -24,6 +24,7 @@
 #include "agipd_module_reader.h"
 #include "hdf5_functions.h"
 #include "agipd_calibrator.h"
+#include "workerPool.h"
 
 
 
@@ -48,6 +49,8 @@ public:
 	bool nextFrame();
 	void resetCurrentFrame();
 	bool goodFrame() { return (lastModule >= 0); }
+	long frameNumber(long trainID, long pulseID, int moduleID);
+	const long *trainFrames(long trainID);
 
 	void maxAllFrames();
 	float *getCellAverage(int i);
@@ -63,6 +66,8 @@ public:
 	
 	
 	void setDoNotApplyGainSwitch(bool _val) {_doNotApplyGainSwitch = _val; }
+	void setReaderThreads(int n) { _readerThreads = n; if (_readerThreads < 0) _readerThreads = 0; }
+	void setBlockFrames(int n) { _blockFrames = n; if (_blockFrames < 1) _blockFrames = 1; }
 
 	
 
@@ -122,6 +127,7 @@ private:
 	cAgipdModuleReader	module[nAGIPDmodules];
 	bool				moduleOK[nAGIPDmodules];
     void                setModuleToBlank(int);
+    static void         readModule(void *, long, long);
 
 
 	std::string			darkcalFilename[nAGIPDmodules];
@@ -138,6 +144,17 @@ private:
     int                 _referenceModule;   // The module number passed on the command line (evidently it exists)
 	int					_gainDataOffset[2];	// Gain data hyperslab offset relative to image data frame
 	bool				_doNotApplyGainSwitch;		// Bypass gain switching
+	int					_readerThreads;		// Threads reading modules in parallel (0 = read in turn)
+	int					_blockFrames;		// Frames per block read from each module file (see AGIPD_BLOCK_FRAMES)
+
+	/* Modules are read and calibrated in parallel on this pool */
+	cWorkerPool			readerPool;
+	long				moduleFrame[nAGIPDmodules];
+	bool				moduleRead[nAGIPDmodules];
+
+	/* Each module reads its next block of frames on this thread while the current one is processed */
+	cWorkerPool			prefetchPool;
+	long				prefetchFrom[nAGIPDmodules];
 
 
 	/* Housekeeping for trains and pulses */
@@ -159,7 +176,11 @@ private:
 	/* Number of non-empty images in the current train */
 	int                 goodImages4ThisTrain;
 
-	TrainPulseMap       trainPulseMap;
+	/* Frame number of each train, pulse and module: [train - minTrain][pulse - minPulse][module], -1 where there is none */
+	long                *frameIndex;
+	long                indexTrains;
+	long                indexPulses;
+	void                buildFrameIndex(void);
 
 	bool nextFramePrivate();
 };
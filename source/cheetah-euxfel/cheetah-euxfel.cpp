@@ -70,6 +70,8 @@ struct tCheetahEuXFELparams {
     int frameSkip;
 	int verbose;
 	bool nogainswitch;
+	int readThreads;
+	int blockFrames;
 } CheetahEuXFELparams;
 void parse_config(int, char *[], tCheetahEuXFELparams*);
 void waitForCheetahWorkers(cGlobal*);
@@ -159,6 +161,8 @@ int main(int argc, char* argv[]) {
     //    agipd.setStride(CheetahEuXFELparams.frameStride);
 	if(CheetahEuXFELparams.nogainswitch)
 		agipd.setDoNotApplyGainSwitch(CheetahEuXFELparams.nogainswitch);
+	agipd.setReaderThreads(CheetahEuXFELparams.readThreads);
+	agipd.setBlockFrames(CheetahEuXFELparams.blockFrames);
 
 	//  Files for calibration stuff
 	//	Will pick up darkcal and gaincal filenames from cheetah.ini: maintains the same 'feel'as before
@@ -393,6 +397,10 @@ void print_help(void){
     std::cout << "\t--skip=<n>           Skip the first <n> frame of each .h5 file\n";
 	std::cout << "\t--nogainswitch       Disable gain switching calibration (assume all high gain)\n";
 	std::cout << "\t--dataformat         Data layout {XFEL2012, XFEL2066}\n";
+	std::cout << "\t--readthreads=<n>    Read and calibrate AGIPD modules using <n> threads (0 = one module at a time)\n";
+	std::cout << "\t--blockframes=<n>    Read AGIPD frames from file <n> at a time (default " << AGIPD_BLOCK_FRAMES << ")\n";
+	std::cout << "\t                     Two blocks per module stay in memory: about <n> x 12.6 MB for calibrated data,\n";
+	std::cout << "\t                     <n> x 8.4 MB for raw data (all 16 modules; " << AGIPD_BLOCK_FRAMES << " frames = 403 MB / 268 MB)\n";
     std::cout << std::endl;
     std::cout << "End of help\n";
 }
@@ -411,6 +419,8 @@ void parse_config(int argc, char *argv[], tCheetahEuXFELparams *global) {
     global->frameStride = -1;
     global->frameSkip = -1;
 	global->nogainswitch = false;
+	global->readThreads = 4;
+	global->blockFrames = AGIPD_BLOCK_FRAMES;
 
     
 	// Add getopt-long options
@@ -424,6 +434,8 @@ void parse_config(int argc, char *argv[], tCheetahEuXFELparams *global) {
 		{ "dataformat", required_argument, NULL, 'f' },
 		{ "verbose", no_argument, NULL, 'v' },
 		{ "nogainswitch", no_argument, NULL, 'g' },
+		{ "readthreads", required_argument, NULL, 0 },
+		{ "blockframes", required_argument, NULL, 0 },
 		{ "help", no_argument, NULL, 'h' },
 		{ NULL, no_argument, NULL, 0 }
 	};
@@ -471,6 +483,14 @@ void parse_config(int argc, char *argv[], tCheetahEuXFELparams *global) {
                     global->frameSkip = atoi(optarg);
                     std::cout << "Skip set to " << global->frameSkip << std::endl;
                 }
+				if( strcmp( "readthreads", longOpts[longIndex].name ) == 0 ) {
+					global->readThreads = atoi(optarg);
+					std::cout << "Module reader threads set to " << global->readThreads << std::endl;
+				}
+				if( strcmp( "blockframes", longOpts[longIndex].name ) == 0 ) {
+					global->blockFrames = atoi(optarg);
+					std::cout << "AGIPD block size set to " << global->blockFrames << " frames" << std::endl;
+				}
 				if( strcmp( "nogainswitch", longOpts[longIndex].name ) == 0 ) {
 					global->nogainswitch = true;
 					std::cout << "No gain switching " << global->nogainswitch << std::endl;
@@ -20,6 +20,32 @@
 #include <sstream>
 
 
+/*
+ *  Lock for HDF5 calls from reader threads (only taken if the library is not threadsafe)
+ */
+static pthread_mutex_t h5_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t h5_threadsafe_once = PTHREAD_ONCE_INIT;
+static bool h5_threadsafe = false;
+
+static void checkHDF5threadsafe(void) {
+    hbool_t threadsafe = 0;
+    H5is_library_threadsafe(&threadsafe);
+    h5_threadsafe = (threadsafe > 0);
+}
+
+cHDF5Lock::cHDF5Lock() {
+    pthread_once(&h5_threadsafe_once, checkHDF5threadsafe);
+    locked = !h5_threadsafe;
+    if(locked)
+        pthread_mutex_lock(&h5_mutex);
+}
+
+cHDF5Lock::~cHDF5Lock() {
+    if(locked)
+        pthread_mutex_unlock(&h5_mutex);
+}
+
+
 
 /*
  *	Get dataset dimensions (but do not read the data)
@@ -218,6 +244,7 @@ void* cHDF5Functions::checkNeventsAllocRead(char fieldName[], long targetnframes
  */
 void* cHDF5Functions::checkAllocReadHyperslab(char fieldName[], int ndims, hsize_t *slab_start, hsize_t *slab_size, hid_t h5_type_id, size_t targetsize) {
 
+	cHDF5Lock lock;
 
 	// Open the dataset
 	hid_t dataset_id;
@@ -505,19 +532,40 @@ void cHDF5dataset::setChunkCacheSize(void){
 
 void* cHDF5dataset::checkAllocReadHyperslab(int ndims, hsize_t *slab_start, hsize_t *slab_size, hid_t h5_type_id, size_t targetsize){
     
+    // Allocate space into which data will be read
+    long nelements = 1;
+    for(int i = 0;i<ndims;i++)
+        nelements *= slab_size[i];
+    
+    void *databuffer = malloc(nelements*targetsize);;
+    
+    if(!checkReadHyperslab(ndims, slab_start, slab_size, h5_type_id, databuffer)) {
+        free(databuffer);
+        return NULL;
+    }
+    return databuffer;
+}
+
+
+/*
+ *  Read a hyperslab into memory the caller already has (false if the hyperslab is not in the dataset)
+ */
+bool cHDF5dataset::checkReadHyperslab(int ndims, hsize_t *slab_start, hsize_t *slab_size, hid_t h5_type_id, void *databuffer){
+    
+    cHDF5Lock lock;
     
     // Checks
     if(h5_ndims != ndims) {
         std::cout << "\tcheckAllocReadHyperslab error: dimensions of data sets do not match requested dimensions (oops)\n";
         std::cout << "\tndims=" << ndims << ", h5_ndims=" << h5_ndims << std::endl;
         std::cout << "\tIn field " << h5_fieldname << std::endl;
-        return NULL;
+        return false;
     }
     
     for(int i=0; i<h5_ndims; i++) {
         if(slab_start[i] < 0 || slab_start[i]+slab_size[i] > h5_dims[i]){
             std::cout << "\tcheckAllocReadHyperslab error: One array dimension runs out of bounds (oops), dim=" << i << std::endl;
-            return NULL;
+            return false;
         }
     }
     
@@ -541,14 +589,6 @@ void* cHDF5dataset::checkAllocReadHyperslab(int ndims, hsize_t *slab_start, hsiz
     H5Sselect_hyperslab(h5_dataspace_id, H5S_SELECT_SET, slab_start, NULL, count, slab_size);
     
     
-    // Allocate space into which data will be read
-    long nelements = 1;
-    for(int i = 0;i<ndims;i++)
-        nelements *= slab_size[i];
-    
-    void *databuffer = malloc(nelements*targetsize);;
-    
-    
     // Define how to map the hyperslab into memory
     // See https://support.hdfgroup.org/HDF5/doc/RM/RM_H5D.html#Dataset-Read
     hid_t        memspace_id;
@@ -571,7 +611,7 @@ void* cHDF5dataset::checkAllocReadHyperslab(int ndims, hsize_t *slab_start, hsiz
     H5Sclose(memspace_id);
     
     // Return
-    return databuffer;
+    return true;
 }
 
 
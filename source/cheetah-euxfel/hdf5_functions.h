@@ -20,9 +20,24 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string>
+#include <pthread.h>
 #include <hdf5.h>
 #include <hdf5_hl.h>
 
+/*
+ *  Held around HDF5 calls that may come from several reader threads at once
+ *  Does nothing if the HDF5 library is built threadsafe (it then does its own locking)
+ */
+class cHDF5Lock
+{
+public:
+    cHDF5Lock();
+    ~cHDF5Lock();
+
+private:
+    bool    locked;
+};
+
 class cHDF5Functions
 {
 public:
@@ -62,6 +77,7 @@ public:
     void    open(char[],char[]);
     void    setChunkCacheSize(void);
     void*   checkAllocReadHyperslab(int, hsize_t*, hsize_t*, hid_t, size_t);
+    bool    checkReadHyperslab(int, hsize_t*, hsize_t*, hid_t, void*);
     void    close(void);
     
 private:
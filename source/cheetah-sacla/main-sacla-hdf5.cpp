@@ -13,12 +13,55 @@
 #include <string.h>
 #include <stdio.h>
 #include <math.h>
+#include <pthread.h>
 
 
 #include "cheetah.h"
 #include "sacla-hdf5-reader.h"
 
 
+/*
+ *  One event tag read ahead on a separate thread, straight into the data_raw array of a new event
+ */
+typedef struct {
+    cGlobal         *global;
+    SACLA_h5_info_t *header;
+    long            runID;
+    long            eventID;
+    long            nn_one;
+    float           *buffer;        // only used if data_raw is too small to hold all panels
+    cEventData      *eventData;     // the event read
+    pthread_t       thread;
+} tSaclaReadAhead;
+
+
+static void *readTag(void *arg) {
+    tSaclaReadAhead *r = (tSaclaReadAhead *) arg;
+    long    detID = 0;
+    long    pix_nn = r->global->detector[detID].pix_nn;
+    long    nread = r->header->ndetectors * r->nn_one;
+
+    r->eventData = cheetahNewEvent(r->global);
+    float   *data_raw = r->eventData->detector[detID].data_raw;
+
+    // SACLA provides float data, which Cheetah takes as it is (no conversion to uint16_t)
+    if(nread <= pix_nn) {
+        SACLA_HDF5_ReadImageRaw(r->header, r->runID, r->eventID, data_raw, r->nn_one);
+        memset(data_raw + nread, 0, (pix_nn-nread)*sizeof(float));
+    }
+    else {
+        SACLA_HDF5_ReadImageRaw(r->header, r->runID, r->eventID, r->buffer, r->nn_one);
+        memcpy(data_raw, r->buffer, pix_nn*sizeof(float));
+    }
+    r->eventData->detector[detID].data_raw_is_float = true;
+    return NULL;
+}
+
+static void startReadAhead(tSaclaReadAhead *r, long eventID) {
+    r->eventID = eventID;
+    r->eventData = NULL;
+    pthread_create(&r->thread, NULL, readTag, r);
+}
 
 
 
@@ -74,18 +117,18 @@ int main(int argc, const char * argv[])
     
 	
     /*
-     * Create a buffer for holding the detector image data from all 8 panels
+     * Size of one detector panel
+     * Image data from all panels normally goes straight into the event; the buffer is only for when it does not fit
      */
     long    fs_one = 512;
     long    ss_one = 1024;
     long    nn_one = fs_one*ss_one;
-    long    fs = fs_one;
-    long    ss = 8*ss_one;
-    long    nn = fs*ss;
-    float   *buffer = (float*) calloc(nn, sizeof(float));
-    hsize_t dims[2];
-    dims[0] = ss;
-    dims[1] = fs;
+    float   *buffer = NULL;
+
+    tSaclaReadAhead readAhead;
+    readAhead.global = &cheetahGlobal;
+    readAhead.header = &SACLA_header;
+    readAhead.nn_one = nn_one;
     
     
     
@@ -97,7 +140,13 @@ int main(int argc, const char * argv[])
         // Gather detector fields and event tags for this run
         SACLA_HDF5_Read2dDetectorFields(&SACLA_header, runID);
         SACLA_HDF5_ReadEventTags(&SACLA_header, runID);
+        buffer = (float*) realloc(buffer, SACLA_header.ndetectors*nn_one*sizeof(float));
+        readAhead.buffer = buffer;
+        readAhead.runID = runID;
         
+        // Read the first event of the run
+        if(SACLA_header.nevents > 0)
+            startReadAhead(&readAhead, 0);
         
         // Loop through all events found in this run
         for(long eventID=0; eventID<SACLA_header.nevents; eventID++) {
@@ -122,10 +171,13 @@ int main(int argc, const char * argv[])
             
 			
 			/*
-			 *	Cheetah: Create a new eventData structure in which to place all information
+			 *	SACLA: Collect this event (a new eventData structure with the image already in it),
+			 *	then start reading the next one while this one is processed
 			 */
-			cEventData	*eventData;
-			eventData = cheetahNewEvent(&cheetahGlobal);
+			pthread_join(readAhead.thread, NULL);
+			cEventData	*eventData = readAhead.eventData;
+			if(eventID+1 < SACLA_header.nevents)
+				startReadAhead(&readAhead, eventID+1);
 			ntriggers++;
             
             
@@ -143,29 +195,6 @@ int main(int argc, const char * argv[])
             
             
 			
-			/*
-			 *	SACLA: Read next image
-			 */
-            SACLA_HDF5_ReadImageRaw(&SACLA_header, runID, eventID, buffer, nn_one);
-            
-            
-            
-            /*
-             *  Cheetah: Copy image data into
-             *  Raw data is currently hard-coded as UINT16_t, SACLA provides as float, so we have to loose precision :-(
-             */
-            long    detID = 0;
-            long    pix_nn = cheetahGlobal.detector[detID].pix_nn;
-            long    asic_nx = cheetahGlobal.detector[detID].asic_nx;
-            long    asic_ny = cheetahGlobal.detector[detID].asic_ny;
-            eventData->detector[detID].raw_data = (uint16_t*) calloc(pix_nn, sizeof(uint16_t));
-            
-            for(long ii=0; ii<pix_nn; ii++) {
-                eventData->detector[detID].raw_data[ii] = (uint16_t) lrint(buffer[ii]);
-            }
-            
-            
-            
 			/*
 			 *	Cheetah: Process this event
 			 */
@@ -178,10 +207,11 @@ int main(int argc, const char * argv[])
             /*
 			  char    outfile[1024];
 			  hid_t   outfile_id;
+			  hsize_t dims[2] = {8*ss_one, fs_one};
 			  sprintf(outfile,"/data/scratch/sacla/%s.h5", SACLA_header.event_name[eventID]);
 			  printf("Writing to temporary file: %s\n",outfile);
 			  outfile_id = H5Fcreate(outfile,  H5F_ACC_TRUNC, H5P_DEFAULT, H5P_DEFAULT);
-			  H5LTmake_dataset_float(outfile_id, "data", 2, dims, buffer );
+			  H5LTmake_dataset_float(outfile_id, "data", 2, dims, eventData->detector[0].data_raw );
 			  H5Fclose(outfile_id);
 			*/
             
@@ -194,6 +224,7 @@ int main(int argc, const char * argv[])
 	
 	
 	// Clean up stale IDs and exit
+    free(buffer);
     SACLA_HDF5_cleanup(&SACLA_header);
     
     
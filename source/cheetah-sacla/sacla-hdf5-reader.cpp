@@ -249,6 +249,7 @@ int SACLA_HDF5_ReadImageRaw(SACLA_h5_info_t *header, long runID, long eventID, f
 		herr = H5LTfind_dataset ( group, h5field );
         if(herr!=1) {
             printf("%s/%s : H5LTfind_dataset=false\n",h5group, h5field);
+            memset(buffer + offset*moduleID, 0, offset*sizeof(float));
             H5Gclose(group);
             continue;
         }
@@ -0,0 +1,56 @@
+//
+//  assembleTable.h
+//  cheetah
+//
+//  Pixel to image mapping used by assemble2DImage and assemble2DMask, worked out once from the geometry
+//
+
+#ifndef ASSEMBLETABLE_H
+#define ASSEMBLETABLE_H
+
+#include <stdint.h>
+
+class cWorkerPool;
+
+// Image rows per parallelFor() task
+#define ASSEMBLETABLE_ROWS 32
+
+
+/*
+ *	For every image pixel, the detector pixels that land on it and their interpolation weights
+ *	(compressed rows: entries start[o] to start[o+1]-1 belong to image pixel o, in detector pixel order).
+ *	Assembly is then a gather over the image, with no per frame allocation or geometry arithmetic.
+ */
+class cAssembleTable {
+
+public:
+	cAssembleTable(float *pix_x, float *pix_y, long pix_nn, long image_nx, int interpolation);
+	~cAssembleTable();
+
+	void image(float *image, float *data, cWorkerPool *pool);
+	void mask(uint16_t *image, uint16_t *data, cWorkerPool *pool);
+
+private:
+	int			interpolation;
+	long		image_nx;
+	long		image_nn;
+	long		*start;		// image_nn+1
+	int32_t		*pixel;		// detector pixel of each entry
+	int32_t		*dest;		// image pixel of each entry (nearest neighbour only)
+	float		*weight;	// weight of each entry (linear interpolation only)
+	float		*norm;		// sum of the weights of each image pixel (linear interpolation only)
+
+	typedef struct {
+		cAssembleTable	*table;
+		float			*image;
+		float			*data;
+		uint16_t		*imageMask;
+		uint16_t		*dataMask;
+	} tJob;
+
+	static void imageRows(void *arg, long block, long slot);
+	static void maskRows(void *arg, long block, long slot);
+	void run(tJob *job, void (*function)(void *, long, long), cWorkerPool *pool);
+};
+
+#endif
@@ -20,6 +20,22 @@
 //typedef tPeakList;
 
 
+/*
+ *	One image slice already converted to the file type and deflated by the worker
+ *	(handed to the CXI writer for H5Dwrite_chunk, see compressCXIChunks in saveCXI.cpp)
+ */
+typedef struct {
+	long	detIndex;
+	int		dataFormat;			// cDataVersion::DATA_FORMAT_*
+	int		version;			// Position of the data version in cDataVersion::next() order
+	bool	mask;				// Pixel mask rather than data
+	long	nElements;
+	size_t	elementSize;		// Bytes per element in the file
+	void	*data;
+	size_t	size;
+} tCXIChunk;
+
+
 /*
  *	Structure used for passing information to worker threads
  */
@@ -28,6 +44,8 @@ class cEventData {
 public:
 	// Reference to common global structure
 	cGlobal		*pGlobal;
+	// Owners still holding the event (the worker, plus the CXI writer while a frame is queued)
+	long		refcount;
 	int			busy;
 	long		threadNum;
 	long        frameNumber;
@@ -35,6 +53,10 @@ public:
 	long        frameNum;
 	long		stackSlice;
 	bool		writeFlag;
+	std::vector<tCXIChunk>	cxiChunks;
+	// Data products made on first use (assemble2DOnce, calculateRadialAverageOnce)
+	bool		assembled;
+	bool		radialAveraged;
 	
 	char		eventname[1024];
 	char		filename[1024];
@@ -13,19 +13,22 @@
 #include <map>
 #include <string>
 #include <vector>
-#include <semaphore.h>
 
 #include "myTimer.h"
 #include "detectorObject.h"
 #include "tofDetector.h"
 #include "peakDetect.h"
 #include "processRateMonitor.h"
+#include "workerPool.h"
+#include "powderShards.h"
 #define MAX_POWDER_CLASSES 16
 #define MAX_DETECTORS 5
 #define MAX_FILENAME_LENGTH 1024
 #define MAX_EPICS_PVS 100
 #define MAX_EPICS_PV_NAME_LENGTH 512
 
+class cEventData;
+
 /** @brief Global variables.
  *
  * Configuration parameters, and things that don't change often.
@@ -230,6 +233,8 @@ public:
 	float   powderthresh;
 	/** @brief Toggle intensity threshold for forming powder patterns. */
 	int		usePowderThresh;
+	/** @brief Private powder sums workers add frames to before they are reduced into the shared powders (1 = one accumulator shared by all workers). */
+	long     nPowderShards;
 
 	/** @brief Interval between saving of powder patterns, etc. */
 	int      saveInterval;
@@ -311,6 +316,14 @@ public:
 	    The default is 1.
 	 */
 	int cxiFlushPeriod;
+	/** @brief Hand frames to a dedicated CXI writer thread instead of writing them inside the worker (default 1). */
+	int cxiAsyncWriter;
+	/** @brief Frames that may wait for the CXI writer before workers block (0 = 2*nThreads). */
+	long cxiWriterQueueDepth;
+	/** @brief Consecutive stack slices buffered per dataset and written as one hyperslab by the writer thread. */
+	long cxiWriteBatch;
+	/** @brief Deflate image stacks in the workers and hand finished chunks to H5Dwrite_chunk (default 1, needs h5compress). */
+	int cxiDirectChunkWrite;
 
 	/** @brief  Only one thread during calibration */
 	int useSingleThreadCalibration;
@@ -354,11 +367,14 @@ public:
 	// Thread management
 	int      useHelperThreads;
 	long     nThreads;
+	/** @brief Extra threads that search the panels of one frame concurrently (0 = each worker searches its frame's panels itself). */
+	long     nPanelThreads;
 	long     nActiveCheetahThreads;
 	long     threadCounter;
 	//long     threadPurge;
 	int      threadTimeoutInSeconds;
 	int      threadSafetyLevel;
+	int      useFusedDetectorCorrection;
 
 	// Number of threads in cheetah_ana_mod
 	int      nEventCopyThreads;
@@ -382,7 +398,19 @@ public:
 	//pthread_mutex_t  hitVector_mutex;
 	pthread_mutex_t  gmd_mutex;
 	pthread_mutex_t  swmr_mutex;
-	sem_t availableCheetahThreads;
+
+	/** @brief Persistent pool of nThreads workers that events are queued on. */
+	cWorkerPool workerPool;
+	/** @brief Pool of nPanelThreads that peak finders spread the panels of a frame over (see peakfinder3/peakfinder8). */
+	cWorkerPool panelPool;
+	/** @brief Single thread that writes CXI frames (see writeCXI in saveCXI.cpp). */
+	cWorkerPool cxiWriter;
+	/** @brief Powder shards (see addToPowder / reducePowder in powder.cpp). */
+	cPowderShards powderShards;
+
+	/** @brief Recycled events (see cheetahNewEvent / cheetahDestroyEvent in event.cpp). */
+	std::vector<cEventData*> eventPool;
+	pthread_mutex_t  eventPool_mutex;
 
 	/*
 	 *	Common variables
@@ -14,12 +14,19 @@
  */
 void *worker(void *);
 
+// event.cpp
+void freeEventPool(cGlobal *global);
+
 // detectorCorrection.cpp
+void fusedDetectorCorrection(cEventData *eventData, cGlobal *global);
+void fusedDetectorCorrection(uint16_t*, float*, float*, uint16_t*, float*, float*, long, int, int, long, long, long);
 void initDetectorCorrection(cEventData *eventData, cGlobal *global);
 void initRaw(cEventData *eventData, cGlobal *global);
 void initPixelmask(cEventData *eventData, cGlobal *global);
 void subtractDarkcal(cEventData*, cGlobal*);
 void applyGainCorrection(cEventData*, cGlobal*);
+bool foldPhotonCorrectionFactor(cPixelDetectorCommon*);
+void applyPhotonCorrectionFactor(cEventData*, cGlobal*);
 void applyPolarizationCorrection(cEventData*, cGlobal*);
 void applySolidAngleCorrection(cEventData*, cGlobal*);
 void setBadPixelsToZero(cEventData*, cGlobal*);
@@ -57,6 +64,7 @@ void pnccdOffsetCorrection(float*);
 void pnccdFixWiringError(float*);
 
 void agipdModuleSubtract(cEventData *eventData, cGlobal *global);
+void jungfrauModuleSubtract(cEventData *eventData, cGlobal *global);
 
 
 // backgroundCorrection.cpp
@@ -70,6 +78,7 @@ void checkSaturatedPixelsPnccd(uint16_t*, uint16_t*);
 void updateBackgroundBuffer(cEventData*, cGlobal*, int);
 void subtractPersistentBackground(cEventData*, cGlobal*);
 void subtractLocalBackground(float*, long, long, long, long, long);
+void subtractLocalBackground(float*, long, long, long, long, long, cWorkerPool*);
 void subtractRadialBackground(float*, float*, char*, long, float);
 void subtractPersistentBackground(float*, float*, int, long);
 void updateNoisyPixelBuffer(cEventData*, cGlobal*,int);
@@ -85,6 +94,7 @@ void writeSpectrumInfoHDF5(const char*, const void*, const void*, int, int, cons
 
 // saveCXI.cpp
 void writeCXI(cEventData*, cGlobal*);
+void compressCXIChunks(cEventData*, cGlobal*);
 void writeCXIHitstats(cEventData*, cGlobal*);
 void writeAccumulatedCXI(cGlobal*);
 void closeCXIFiles(cGlobal*);
@@ -93,10 +103,8 @@ herr_t cheetahHDF5ErrorHandler(hid_t,void*);
 
 // assemble2DImage.cpp
 void assemble2D(cEventData*, cGlobal*);
+void assemble2DOnce(cEventData*, cGlobal*);
 void assemble2DPowder(cGlobal*);
-void assemble2DImage(float*, float*, float*, float*, long, long, long, int);
-void assemble2DImage(int16_t*, float*, float*, float*, long, long, long, int);
-void assemble2DMask(uint16_t*, uint16_t*, float*, float*, long, long, long, int);
 
 // modularDetector.cpp
 int moduleCornerIndex(int, int, int);
@@ -123,11 +131,13 @@ void sortPowderClass(cEventData*, cGlobal*);
 // peakfinders.cpp
 int peakfinder(cGlobal*, cEventData*, int);
 int peakfinder3(tPeakList*, float*, char*, long, long, long, long, float, float, long, long, long);
+int peakfinder3(tPeakList*, float*, char*, long, long, long, long, float, float, long, long, long, cWorkerPool*);
 int peakfinder6(tPeakList*, float*, char*, long, long, long, long, float, float, long, long, long, float);
 int killNearbyPeaks(tPeakList*, float );
 
 // peakfinder8.cpp
 int peakfinder8(tPeakList*, float*, char*, float*, long, long, long, long, float, float, long, long, long);
+int peakfinder8(tPeakList*, float*, char*, float*, long, long, long, long, float, float, long, long, long, cWorkerPool*);
 int peakfinder8old(tPeakList*, float*, char*, float*, long, long, long, long, float, float, long, long, long);
 
 
@@ -155,6 +165,7 @@ void saveTimeToolStacks(cGlobal*);
 void addToPowder(cEventData*, cGlobal*);
 void addToPowder(cEventData*, cGlobal*, int, long);
 void saveRunningSums(cGlobal*);
+void reducePowder(cGlobal*);
 void saveDarkcal(cGlobal*, int);
 void saveGaincal(cGlobal*, int);
 void savePowderPattern(cGlobal*, int, int);
@@ -168,6 +179,7 @@ void calculateHistogramScale(long histMin, long histNBins, float histBinSize, fl
 
 // RadialAverage.cpp
 void calculateRadialAverage(cEventData*, cGlobal*);
+void calculateRadialAverageOnce(cEventData*, cGlobal*);
 template <class T>
 void calculateRadialAverage(T *data2d, uint16_t *pixelmask2d, T *dataRadial, uint16_t *pixelmaskRadial, float * pix_r, long radial_nn, long pix_nn);
 void addToRadialAverageStack(cEventData*, cGlobal*);
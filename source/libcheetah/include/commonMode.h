@@ -0,0 +1,31 @@
+//
+//  commonMode.h
+//  cheetah
+//
+//  Common mode (electronic offset) estimates over groups of pixels: whole ASICs, ASIC rows or ASIC columns
+//
+
+#ifndef COMMONMODE_H
+#define COMMONMODE_H
+
+#include <stdint.h>
+
+// cmModule values handled here
+#define CM_ASIC_QUANTILE		1	// cmFloor quantile of each ASIC (also 2: residual, later in the worker)
+#define CM_ASIC_HISTOGRAM		3	// peak of the 1-ADU histogram of each ASIC (the LCLS/psana approach)
+#define CM_ROW_QUANTILE			4	// cmFloor quantile of each row of each ASIC
+#define CM_COLUMN_QUANTILE		5	// cmFloor quantile of each column of each ASIC
+
+// Range of the histogram for CM_ASIC_HISTOGRAM (values are binned from -span to span-1 ADU)
+#define CM_HISTOGRAM_SPAN		16384
+
+
+/*
+ *	A group is ny lines of nx pixels, stride apart in data and mask; bad pixels are left out
+ */
+float commonModeQuantile(float *data, uint16_t *mask, long nx, long ny, long stride, float fraction);
+float commonModeHistogramPeak(float *data, uint16_t *mask, long nx, long ny, long stride, long span);
+
+void commonModeSubtract(float *data, uint16_t *mask, int mode, float cmFloor, long asic_nx, long asic_ny, long nasics_x, long nasics_y);
+
+#endif
@@ -19,6 +19,8 @@
 #include <stdint.h>
 #include "dataVersion.h"
 #include "frameBuffer.h"
+#include "pixelHistogram.h"
+#include "assembleTable.h"
 
 #include "cheetah_extensions_yaroslav/streakfinder_wrapper.h"
 #include "cheetah_extensions_yaroslav/cheetahConversion.h"
@@ -199,6 +201,9 @@ public:
     long image_nx;
     long image_ny;
     long image_nn;
+    // Interpolation used for assembly (ASSEMBLE_INTERPOLATION_*) and the pixel to image table built from the geometry
+    int assembleInterpolation;
+    cAssembleTable *assembleTable;
 
     // Assembled downsampled image size
     long imageXxX_nx;
@@ -253,7 +258,7 @@ public:
     int useDarkcalSubtraction;
     // Subtract common mode from each ASIC
     char commonModeCorrection[MAX_FILENAME_LENGTH];
-    int cmModule;
+    int cmModule;        // 1,2: ASIC quantile (cmFloor), 3: ASIC histogram peak, 4,5: ASIC row/column quantile (Jungfrau, ePix, AGIPD)
     int cspadSubtractUnbondedPixels;
     int cspadSubtractBehindWires;
     float cmFloor;         // CSPAD: use lowest x% of values to estimate DC offset
@@ -270,6 +275,8 @@ public:
     // Apply solid angle correction
     int useSolidAngleCorrection;
     int solidAngleAlgorithm;
+    // Polarization and solid angle corrections combined into one multiplier per pixel (NULL if neither is used)
+    float *photonCorrectionFactor;
     // Saturated pixels
     int maskSaturatedPixels;
     long pixelSaturationADC;
@@ -289,6 +296,7 @@ public:
     int scaleBackground;
     int useBackgroundBufferMutex;
     float bgMedian;
+    int bgIncrementalMedian;
     long bgMemory;
     long bgRecalc;
     long bgCounter;
@@ -359,6 +367,8 @@ public:
     cFrameBuffer *frameBufferNoisyPix;
 
     int threadSafetyLevel;
+    // Threads used for recalculating frame buffer statistics
+    long nThreads;
 
     // Saving options
     // Data versions
@@ -421,7 +431,8 @@ public:
     pthread_mutex_t pixelmask_shared_mutex;
     pthread_mutex_t pixelmask_shared_min_mutex;
     pthread_mutex_t pixelmask_shared_max_mutex;
-    // Powder data (accumulated sums and sums of squared values)
+    // Powder data (accumulated sums; squared holds the sum of squared deviations from the mean)
+    // Only the formats and versions in powderFormat/powderVersion are allocated, the rest stay NULL
     long nPowderClasses;
     long nPowderFrames[MAX_POWDER_CLASSES];
     double *powderData_raw[MAX_POWDER_CLASSES];
@@ -477,8 +488,9 @@ public:
     long histogram_nn;
     long histogram_count;
     float histogramMaxMemoryGb;
+    int histogramSparse;
     uint64_t histogram_nnn;
-    uint16_t *histogramData;
+    cPixelHistogram *histogramData;
     float *histogramScale;
     pthread_mutex_t histogram_mutex;
     //long	histogram_depth;
@@ -495,10 +507,13 @@ public:
     void configure(cGlobal * global);
     void parseConfigFile(char *);
     void allocateMemory();
+    void allocatePowderMemory();
     void freeMemory();
     void unlockMutexes();
     void readDetectorGeometry(char *);
     void updateKspace(cGlobal*, float);
+    void updatePhotonCorrectionFactor();
+    bool canFuseDetectorCorrection();
     void readDarkcal(char *);
     void readGaincal(char *);
     void readPeakmask(cGlobal*, char *);
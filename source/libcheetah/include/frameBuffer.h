@@ -11,10 +11,16 @@
 #define FRAMEBUFFER_H
 
 #include <stdint.h>
+#include <pthread.h>
+
+typedef struct {
+	float * data;
+	long refcount;
+} tFrameBufferSnapshot;
 
 class cFrameBuffer {
  public:
-	cFrameBuffer(long pix_nn0, long depth0, int threadSafetyLevel0);
+	cFrameBuffer(long pix_nn0, long depth0, int threadSafetyLevel0, long nThreads0 = 1, bool incrementalMedian0 = false);
 	~cFrameBuffer();
 	long writeNextFrame(float * data);
 	void copyMedian(float * target);
@@ -31,42 +37,46 @@ class cFrameBuffer {
 	long depth;
 	int threadSafetyLevel;
 	long counter;
+	long nThreads;
+	bool incrementalMedian;
  private:
+	// Ring of depth frames, stored in tiles of tile_nn pixels (see frameBuffer.cpp)
 	float * frames;
-	float * median;
-	float * mean;
-	float * std;
-	float * absAboveThresh;
+	long tile_nn;
+	long n_tiles;
+	float * tileFrame(long t, long frameID);
+	long tileSize(long t);
+	// Recalculations split tiles over nThreads threads
+	static void * tileThread(void * threadarg);
+	void forEachTile(void (cFrameBuffer::*kernel)(long, void *, double *), void * arg);
+	void medianTile(long t, void * arg, double * scratch);
+	void meanTile(long t, void * arg, double * scratch);
+	void stdTile(long t, void * arg, double * scratch);
+	void absAboveThreshTile(long t, void * arg, double * scratch);
+	// Per-pixel sorted copy of the ring (pixel-major, depth values per pixel), only if incrementalMedian
+	float * sorted;
+	long stripe_nn;
+	long n_stripes;
+	pthread_mutex_t * stripe_mutexes;
+	void updateSortedWindows(long frameID, float * data);
+	// Published results (see snapshot functions in frameBuffer.cpp)
+	tFrameBufferSnapshot * median;
+	tFrameBufferSnapshot * mean;
+	tFrameBufferSnapshot * std;
+	tFrameBufferSnapshot * absAboveThresh;
+	pthread_mutex_t snapshot_mutex;
+	tFrameBufferSnapshot * newSnapshot(float * data);
+	tFrameBufferSnapshot * acquireSnapshot(tFrameBufferSnapshot ** current);
+	void releaseSnapshot(tFrameBufferSnapshot * snapshot);
+	void publishSnapshot(tFrameBufferSnapshot ** current, float * data);
+	void copySnapshot(tFrameBufferSnapshot ** current, float * target);
 	bool filled,median_updated,mean_updated,std_updated,absAboveThresh_updated;
-	pthread_mutex_t * frame_mutexes;
-	pthread_mutex_t median_mutex,mean_mutex,std_mutex,absAboveThresh_mutex;
-	long n_std_readers,n_median_readers,n_mean_readers,n_absAboveThresh_readers;
-	long * n_frame_readers;
 	// Scheduling reading and writing
-	void lockFrameWriters(long frameID);
-	void lockAllFramesWriters();
-	void unlockFrameWriters(long frameID);
-	void unlockAllFramesWriters();
-	void lockFrameReadersAndWriters(long frameID);
-	void lockAllFramesReadersAndWriters();
-	void unlockFrameReadersAndWriters(long frameID);
-	void unlockAllFramesReadersAndWriters();
-	void lockStdWriters();
-	void unlockStdWriters();
-	void lockStdReadersAndWriters();
-	void unlockStdReadersAndWriters();
-	void lockMeanWriters();
-	void unlockMeanWriters();
-	void lockMeanReadersAndWriters();
-	void unlockMeanReadersAndWriters();
-	void lockMedianWriters();
-	void unlockMedianWriters();
-	void lockMedianReadersAndWriters();
-	void unlockMedianReadersAndWriters();
-	void lockAbsAboveThreshWriters();
-	void unlockAbsAboveThreshWriters();
-	void lockAbsAboveThreshReadersAndWriters();
-	void unlockAbsAboveThreshReadersAndWriters();
+	pthread_rwlock_t * frame_rwlocks;
+	void lockAllFramesForReading();
+	void unlockAllFramesForReading();
+	void lockFrameForWriting(long frameID);
+	void unlockFrameForWriting(long frameID);
 };
 
 #endif
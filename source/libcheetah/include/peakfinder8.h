@@ -15,3 +15,4 @@
 
 
 int peakfinder8(tPeakList*, float*, char*, float*, long, long, long, long, float, float, long, long, long);
+int peakfinder8(tPeakList*, float*, char*, float*, long, long, long, long, float, float, long, long, long, cWorkerPool*);
@@ -49,6 +49,7 @@ public:
 
 void allocatePeakList(tPeakList*, long);
 void freePeakList(tPeakList);
+long compactPeakList(tPeakList*, const char*, long);
 
 
 #endif
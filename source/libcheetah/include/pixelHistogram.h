@@ -0,0 +1,68 @@
+//
+//  pixelHistogram.h
+//  cheetah
+//
+//  Per pixel histogram of detector values (see addToHistogram)
+//
+
+#ifndef PIXELHISTOGRAM_H
+#define PIXELHISTOGRAM_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+
+// Pixels per tile; each tile has its own lock
+#define PIXELHISTOGRAM_TILE_NN 4096
+
+
+/*
+ *	Counts are kept as one byte per pixel and bin.
+ *	When a byte wraps, the carry goes into a 32-bit counter for that pixel and bin only,
+ *	so the handful of bins around each pixel's peak are the only ones that cost more than a byte.
+ *	count = counts[pixel*nBins+bin] + 256*carry
+ */
+class cPixelHistogram {
+
+public:
+	cPixelHistogram(long nPixels, long nBins);
+	~cPixelHistogram();
+	static uint64_t footprint(long nPixels, long nBins);
+
+	long nTiles(void);
+	long tileFirst(long tile);
+	long tileSize(long tile);
+
+	void beginFrame(void);
+	void endFrame(void);
+	void addTile(long tile, const uint16_t *bins);
+	void copy(long first, long n, uint32_t *out);
+	void snapshot(uint32_t *out);
+	void snapshotSparse(long *pixelOffset, std::vector<uint16_t> *bins, std::vector<uint32_t> *counts);
+
+private:
+	typedef struct {
+		uint32_t	bin;
+		uint32_t	carry;
+	} tCarry;
+
+	long		nPixels;
+	long		nBins;
+	long		n_tiles;
+	uint8_t		*counts;
+	tCarry		**carry;
+	uint16_t	*nCarry;
+	pthread_mutex_t	*tileMutex;
+	// Frames being added, and whether a snapshot is waiting for them or running
+	pthread_mutex_t	frameMutex;
+	pthread_cond_t	frameCond;
+	long		nFrames;
+	bool		snapshotting;
+
+	void addCarry(long pixel, long bin);
+	void pixelCounts(long pixel, uint32_t *out);
+	void beginSnapshot(void);
+	void endSnapshot(void);
+};
+
+#endif
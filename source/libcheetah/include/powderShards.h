@@ -0,0 +1,64 @@
+//
+//  powderShards.h
+//  cheetah
+//
+//  Private powder sums that workers accumulate into without touching the shared powders.
+//  They are folded into cPixelDetectorCommon::powderData_* whenever someone is about to read those (see reducePowder).
+//
+
+#ifndef POWDERSHARDS_H
+#define POWDERSHARDS_H
+
+#include <pthread.h>
+
+#include "dataVersion.h"
+#include "detectorObject.h"
+
+
+/*
+ *  Fixed set of powder shards
+ *  A worker keeps coming back to the same shard, so with as many shards as workers nobody waits;
+ *  with fewer, a busy shard is skipped for an idle one before blocking
+ */
+class cPowderShards {
+
+public:
+    /*
+     *  Running mean and M2 (sum of squared deviations from the mean, Welford) for one detector,
+     *  powder class, data format and data version (allocated on first use)
+     *  n frames went into it, or counter[i] for masked powders
+     */
+    typedef struct {
+        long    pix_nn;
+        long    n;
+        double  *mean;
+        double  *m2;
+        long    *counter;
+        bool    dirty;
+    } tAccumulator;
+
+    typedef struct {
+        pthread_mutex_t mutex;
+        long            nFrames[MAX_DETECTORS][MAX_POWDER_CLASSES];
+        tAccumulator    acc[MAX_DETECTORS][MAX_POWDER_CLASSES][4][DATA_VERSION_N];
+    } tShard;
+
+    cPowderShards();
+    ~cPowderShards();
+
+    void start(long nShards);
+    void stop(void);
+    long nShards(void);
+
+    tShard *acquire(void);
+    void release(tShard *);
+    tShard *lock(long i);
+    tAccumulator *accumulator(tShard *, long detIndex, long powderClass, int formatIndex, int versionIndex, long pix_nn, bool counter);
+
+private:
+    tShard  *shards;
+    long    n;
+    long    nAssigned;
+};
+
+#endif
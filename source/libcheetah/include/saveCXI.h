@@ -8,6 +8,7 @@
 #include <string.h>
 #include <typeinfo>
 #include <vector>
+#include <map>
 #include <pthread.h>
 
 
@@ -17,6 +18,11 @@
 #include <cheetahmodules.h>
 #include <median.h>
 
+// H5Dwrite_chunk() appeared in HDF5 1.10.3
+#if H5_VERSION_GE(1,10,3)
+#define CXI_DIRECT_CHUNK_WRITE
+#endif
+
 
 namespace CXI{
 	const char* ATTR_NAME_NUM_EVENTS = "numEvents";
@@ -39,8 +45,47 @@ namespace CXI{
 	const int stringSize = 128;
 	// HDF5 compression level (default=3)
 	int	h5compress = 3;
+	// Number of consecutive stack slices buffered per dataset before writing (1 = write every slice straight away)
+	// Only the CXI writer thread may write sliced data when this is above 1
+	int writeBatch = 1;
+
+
+	class Node;
+
+	/*
+	 *	Groups that every frame writes into, recorded while the skeleton is built
+	 *	so writeCXIData() and writeResultsData() don't walk the tree by name for each frame
+	 *	(CXI file path first, results file path second where they differ)
+	 */
+	struct FrameNodes {
+		Node *entry;											// entry_1
+		Node *source;											// entry_1/instrument_1/source_1
+		Node *instrument;										// instrument
+		Node *instrumentDetector[MAX_DETECTORS];				// instrument/detector_N, instrument/detectorN
+		Node *detector[MAX_DETECTORS+MAX_TOF_DETECTORS];		// entry_1/instrument_1/detector_N, event_data/detectorN
+		// One group per data version, in the order cDataVersion::next() visits them
+		std::vector<Node *> nonAssembled[MAX_DETECTORS];
+		std::vector<Node *> assembled[MAX_DETECTORS];
+		std::vector<Node *> downsampled[MAX_DETECTORS];
+		std::vector<Node *> radialAverage[MAX_DETECTORS];
+		Node *result;											// entry_1/result_1, event_data/peaks0
+		Node *cheetah;											// cheetah
+		Node *eventData;										// cheetah/event_data, event_data
+		Node *eventDetector[MAX_DETECTORS];						// cheetah/event_data/detector_N
+		Node *globalDetector[MAX_DETECTORS];					// cheetah/global_data/detector_N
+
+		FrameNodes(){
+			entry = source = instrument = result = cheetah = eventData = NULL;
+			for (int i=0; i<MAX_DETECTORS; i++) {
+				instrumentDetector[i] = eventDetector[i] = globalDetector[i] = NULL;
+			}
+			for (int i=0; i<MAX_DETECTORS+MAX_TOF_DETECTORS; i++) {
+				detector[i] = NULL;
+			}
+		}
+	};
+
 
-	
 	class Node {
 		public:
 			enum Type{Dataset, Group, Link};
@@ -67,6 +112,8 @@ namespace CXI{
 				id = H5Fcreate(filename, H5F_ACC_TRUNC, H5P_DEFAULT, fapl_id);
 				if( id<0 ) {ERROR("Cannot create file.\n");}
 				stackCounter = 0;
+				initCache();
+				frame = new FrameNodes();
 			}
 			
 			Node(std::string s, hid_t oid, Node * p, Type t,  int _ignore_flags){
@@ -75,6 +122,7 @@ namespace CXI{
 				id = oid;
 				type = t;
 				ignoreConversionExceptions = _ignore_flags;
+				initCache();
 			}
 			
 			Node & operator [](std::string s){
@@ -96,6 +144,8 @@ namespace CXI{
 				for(Iter it = children.begin(); it != children.end(); it++) {
 					delete it->second;
 				}
+				releaseCache();
+				delete frame;
 			}
 			/*
 			  The base name of the class should be used.
@@ -125,18 +175,30 @@ namespace CXI{
 			}
 			template<class T>
 				void write(T * data, int stackSlice = -1, int sliceSize = 0, bool varibleSliceSize = false);
+			/*
+			   1D dataset not indexed by frame: writeArray() replaces its contents and sets its length.
+			   It is not a stack, so trimAll() leaves it alone.
+			 */
+			Node * createArray(const char * s, hid_t dataType);
+			template<class T>
+				void writeArray(T * data, hsize_t n);
 			
+			void flushAll();
 			void closeAll();
 			void openAll();
 			std::string path();
 			Node & child(std::string prefix, int n);
             Node & cxichild(std::string prefix, int n);
 			void trimAll(int stackSize = -1);
+			bool putChunk(int stackSlice, long nElements, size_t elementSize, void * data, size_t size);
 			uint getStackSlice();
             void setStackSlice(uint);
+			Node * find(const char * s);
 			uint stackCounter;
 
 			std::string name;
+			// Root only: groups written for every frame (see FrameNodes)
+			FrameNodes * frame;
 			
 			
 		private:
@@ -147,6 +209,43 @@ namespace CXI{
             std::string nextCXIKey(const char * s);
 			template <class T>
 				hid_t get_datatype(const T * foo);
+			void initCache(){
+				frame = NULL;
+				ndims = -1;
+				for (int i=0; i<4; i++) {
+					extent[i] = 0;
+					maxExtent[i] = 0;
+				}
+				fileSpace = -1;
+				sliceSpace = -1;
+				fileType = -1;
+				xferPlist = -1;
+				lastSlice = -1;
+				lastSliceDirty = false;
+				batchData = NULL;
+				batchCapacity = 0;
+				batchStart = 0;
+				batchCount = 0;
+				batchSliceElements = 0;
+				batchSliceBytes = 0;
+				batchType = -1;
+				directChunk = false;
+				array = false;
+				chunkElements = 0;
+				chunkElementSize = 0;
+			}
+			void cacheShape();
+			void releaseCache();
+			void growExtent(int dim, hsize_t needed);
+			void bufferSlice(const void * data, hid_t memType, int stackSlice, int sliceSize);
+			void flushBatch();
+			bool writeChunk(int stackSlice);
+			void noteSlice(int stackSlice){
+				if(stackSlice > lastSlice){
+					lastSlice = stackSlice;
+				}
+				lastSliceDirty = true;
+			}
 
 			typedef std::map<std::string, Node *>::iterator Iter;
 			Node * parent;
@@ -158,6 +257,39 @@ namespace CXI{
 			 *  It is atomically incremented by each thread */
 			//uint stackCounter;
 			int ignoreConversionExceptions;
+
+			/*  Dataset shape and HDF5 objects kept from the first write onwards (see cacheShape)
+			 *  so that writing a slice needs no dataspace queries */
+			int ndims;
+			hsize_t extent[4];
+			hsize_t maxExtent[4];
+			hid_t fileSpace;
+			hid_t sliceSpace;
+			hid_t fileType;
+			hid_t xferPlist;
+			// numEvents attribute is brought up to date on flushAll() rather than after every slice
+			int lastSlice;
+			bool lastSliceDirty;
+
+			/*  Slices waiting to be written as one hyperslab (see bufferSlice)
+			 *  batchCount consecutive slices starting at batchStart */
+			char * batchData;
+			long batchCapacity;
+			long batchStart;
+			long batchCount;
+			long batchSliceElements;
+			size_t batchSliceBytes;
+			hid_t batchType;
+
+			/*  Stacks stored as one deflated chunk per slice can take chunks compressed by the workers (see putChunk)
+			 *  pendingChunks maps a stack slice to its compressed chunk and size */
+			bool directChunk;
+			long chunkElements;
+			size_t chunkElementSize;
+			std::map<int, std::pair<void *, size_t> > pendingChunks;
+
+			// Created by createArray()
+			bool array;
 		
 			// Mutex
 		
@@ -0,0 +1,77 @@
+//
+//  workerPool.h
+//  cheetah
+//
+//  Fixed pool of long-lived worker threads fed from a bounded task queue.
+//  Replaces spawning one detached thread per event.
+//
+
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <pthread.h>
+#include <vector>
+
+
+/*
+ *  Thread pool with a bounded multi-producer/multi-consumer queue
+ *  Tasks use the same signature as pthread_create() so existing thread functions (eg: worker) can be queued directly
+ */
+class cWorkerPool {
+
+public:
+    cWorkerPool();
+    ~cWorkerPool();
+
+    void start(long nWorkers, long queueSize);
+    void stop(void);
+    void submit(void *(*function)(void *), void *arg, int timeoutInSeconds);
+    int  drain(float waitTime);
+    long nPending(void);
+    long nWorkers(void);
+
+    void parallelFor(long n, void (*function)(void *, long, long), void *arg);
+    long nSlots(void);
+
+private:
+    typedef struct {
+        void *(*function)(void *);
+        void *arg;
+    } tTask;
+
+    /*
+     *  One parallelFor() call, shared by the caller and the helper tasks it queued
+     *  Freed by whoever drops the last reference (helpers may start after the caller has returned)
+     */
+    typedef struct {
+        void (*function)(void *, long, long);
+        void *arg;
+        long n;
+        long next;
+        long nDone;
+        long nSlotsUsed;
+        long refs;
+        pthread_mutex_t mutex;
+        pthread_cond_t  done;
+    } tParallelFor;
+
+    static void *threadMain(void *);
+    static void *parallelForTask(void *);
+    static void parallelForWork(tParallelFor *, long slot);
+    static void parallelForRelease(tParallelFor *);
+    void run(void);
+
+    std::vector<pthread_t> threads;
+    std::vector<tTask> queue;
+    long queueHead;
+    long queueCount;
+    long nBusy;
+    bool running;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  notEmpty;
+    pthread_cond_t  notFull;
+    pthread_cond_t  idle;
+};
+
+#endif
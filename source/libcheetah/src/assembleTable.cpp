@@ -0,0 +1,230 @@
+//
+//  assembleTable.cpp
+//  cheetah
+//
+//  Pixel to image mapping used by assemble2DImage and assemble2DMask, worked out once from the geometry
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+
+#include "detectorObject.h"
+#include "workerPool.h"
+#include "assembleTable.h"
+
+
+/*
+ *	Same pixel placement as the original per frame loops:
+ *	linear interpolation spreads each pixel over the 4 image pixels around it (weights may be 0),
+ *	nearest neighbour puts it on one image pixel, the last detector pixel to get there winning.
+ */
+cAssembleTable::cAssembleTable(float *pix_x, float *pix_y, long pix_nn, long image_nx0, int interpolation0) {
+	interpolation = interpolation0;
+	image_nx = image_nx0;
+	image_nn = image_nx*image_nx;
+	start = (long *) calloc(image_nn+1, sizeof(long));
+	pixel = NULL;
+	dest = NULL;
+	weight = NULL;
+	norm = NULL;
+
+	if(interpolation == ASSEMBLE_INTERPOLATION_NEAREST) {
+		long	*last = (long *) malloc(image_nn*sizeof(long));
+		for(long o=0; o<image_nn; o++)
+			last[o] = -1;
+		for(long i=0; i<pix_nn; i++) {
+			float	x = pix_x[i] + image_nx/2.;
+			float	y = pix_y[i] + image_nx/2.;
+			long	ix = (long) (x+0.5);
+			long	iy = (long) (y+0.5);
+			if(ix>=0 && iy>=0 && ix<image_nx && iy<image_nx)
+				last[ix + image_nx*iy] = i;
+		}
+
+		long	n = 0;
+		for(long o=0; o<image_nn; o++)
+			n += (last[o] >= 0);
+		pixel = (int32_t *) malloc(n*sizeof(int32_t));
+		dest = (int32_t *) malloc(n*sizeof(int32_t));
+		n = 0;
+		for(long o=0; o<image_nn; o++) {
+			start[o] = n;
+			if(last[o] >= 0) {
+				pixel[n] = (int32_t) last[o];
+				dest[n++] = (int32_t) o;
+			}
+		}
+		start[image_nn] = n;
+		free(last);
+	}
+
+	else if(interpolation == ASSEMBLE_INTERPOLATION_LINEAR) {
+		// Image pixel and weight of each pixel corner (-1: off the image)
+		long	*dest = (long *) malloc(4*pix_nn*sizeof(long));
+		float	*w = (float *) malloc(4*pix_nn*sizeof(float));
+		for(long i=0; i<pix_nn; i++) {
+			// Pixel location with (0,0) at array element (0,0) in bottom left corner
+			float	x = pix_x[i] + image_nx/2.;
+			float	y = pix_y[i] + image_nx/2.;
+			long	ix = (long) floor(x);
+			long	iy = (long) floor(y);
+			float	fx = x - ix;
+			float	fy = y - iy;
+
+			long	cx[4] = {ix, ix+1, ix, ix+1};
+			long	cy[4] = {iy, iy, iy+1, iy+1};
+			w[4*i] = (1-fx)*(1-fy);
+			w[4*i+1] = (fx)*(1-fy);
+			w[4*i+2] = (1-fx)*(fy);
+			w[4*i+3] = (fx)*(fy);
+			for(long c=0; c<4; c++) {
+				if(cx[c]>=0 && cy[c]>=0 && cx[c]<image_nx && cy[c]<image_nx) {
+					dest[4*i+c] = cx[c] + image_nx*cy[c];
+					start[dest[4*i+c]+1]++;
+				}
+				else
+					dest[4*i+c] = -1;
+			}
+		}
+
+		// Counting sort by image pixel keeps detector pixel order within each image pixel
+		for(long o=0; o<image_nn; o++)
+			start[o+1] += start[o];
+		long	n = start[image_nn];
+		long	*fill = (long *) malloc(image_nn*sizeof(long));
+		memcpy(fill, start, image_nn*sizeof(long));
+		pixel = (int32_t *) malloc(n*sizeof(int32_t));
+		weight = (float *) malloc(n*sizeof(float));
+		for(long e=0; e<4*pix_nn; e++) {
+			if(dest[e] >= 0) {
+				long	k = fill[dest[e]]++;
+				pixel[k] = (int32_t) (e/4);
+				weight[k] = w[e];
+			}
+		}
+
+		// Weights are summed in the same order the data will be
+		norm = (float *) malloc(image_nn*sizeof(float));
+		for(long o=0; o<image_nn; o++) {
+			float	sum = 0;
+			for(long k=start[o]; k<start[o+1]; k++)
+				sum += weight[k];
+			norm[o] = sum;
+		}
+
+		free(fill);
+		free(dest);
+		free(w);
+	}
+
+	printf("\tAssembly table: %li entries for %li x %li image\n", start[image_nn], image_nx, image_nx);
+}
+
+cAssembleTable::~cAssembleTable() {
+	free(start);
+	free(pixel);
+	free(dest);
+	free(weight);
+	free(norm);
+}
+
+
+void cAssembleTable::run(tJob *job, void (*function)(void *, long, long), cWorkerPool *pool) {
+	long	nBlocks = (image_nx + ASSEMBLETABLE_ROWS - 1) / ASSEMBLETABLE_ROWS;
+
+	if(pool != NULL) {
+		pool->parallelFor(nBlocks, function, job);
+	}
+	else {
+		for(long block=0; block<nBlocks; block++)
+			function(job, block, 0);
+	}
+}
+
+
+/*
+ *	Assemble data into image
+ *	Linear: weighted mean of the pixels on each image pixel, 0 where the weights add up to less than 0.05
+ *	Nearest: image pixels no detector pixel lands on are left as they are
+ */
+void cAssembleTable::image(float *image, float *data, cWorkerPool *pool) {
+	tJob	job;
+	job.table = this;
+	job.image = image;
+	job.data = data;
+	run(&job, imageRows, pool);
+}
+
+void cAssembleTable::imageRows(void *arg, long block, long /*slot*/) {
+	tJob			*job = (tJob *) arg;
+	cAssembleTable	*t = job->table;
+	float			*image = job->image;
+	float			*data = job->data;
+	long			first = block*ASSEMBLETABLE_ROWS*t->image_nx;
+	long			last = std::min(first + ASSEMBLETABLE_ROWS*t->image_nx, t->image_nn);
+
+	if(t->interpolation == ASSEMBLE_INTERPOLATION_NEAREST) {
+		for(long k=t->start[first]; k<t->start[last]; k++)
+			image[t->dest[k]] = data[t->pixel[k]];
+	}
+	else if(t->interpolation == ASSEMBLE_INTERPOLATION_LINEAR) {
+		for(long o=first; o<last; o++) {
+			if(t->norm[o] < 0.05) {
+				image[o] = 0;
+				continue;
+			}
+			float	sum = 0;
+			for(long k=t->start[o]; k<t->start[o+1]; k++)
+				sum += t->weight[k]*data[t->pixel[k]];
+			image[o] = sum / t->norm[o];
+		}
+	}
+}
+
+
+/*
+ *	Assemble pixel mask into image
+ *	Linear: union of the options of the pixels on each image pixel
+ *	Nearest: options of the pixel that lands there
+ *	PIXEL_IS_MISSING where no detector pixel lands
+ */
+void cAssembleTable::mask(uint16_t *image, uint16_t *data, cWorkerPool *pool) {
+	tJob	job;
+	job.table = this;
+	job.imageMask = image;
+	job.dataMask = data;
+	run(&job, maskRows, pool);
+}
+
+void cAssembleTable::maskRows(void *arg, long block, long /*slot*/) {
+	tJob			*job = (tJob *) arg;
+	cAssembleTable	*t = job->table;
+	uint16_t		*image = job->imageMask;
+	uint16_t		*data = job->dataMask;
+	long			first = block*ASSEMBLETABLE_ROWS*t->image_nx;
+	long			last = std::min(first + ASSEMBLETABLE_ROWS*t->image_nx, t->image_nn);
+
+	if(t->interpolation == ASSEMBLE_INTERPOLATION_NEAREST) {
+		for(long o=first; o<last; o++)
+			image[o] = PIXEL_IS_MISSING;
+		for(long k=t->start[first]; k<t->start[last]; k++)
+			image[t->dest[k]] = data[t->pixel[k]];
+	}
+	else if(t->interpolation == ASSEMBLE_INTERPOLATION_LINEAR) {
+		for(long o=first; o<last; o++) {
+			long	k0 = t->start[o];
+			long	k1 = t->start[o+1];
+			if(k1 == k0) {
+				image[o] = PIXEL_IS_MISSING;
+				continue;
+			}
+			uint16_t	m = 0;
+			for(long k=k0; k<k1; k++)
+				m |= data[t->pixel[k]];
+			image[o] = m & ~PIXEL_IS_MISSING;
+		}
+	}
+}
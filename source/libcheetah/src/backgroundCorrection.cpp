@@ -255,6 +255,9 @@ void subtractRadialBackground(float *data, float *pix_r, char *mask, long pix_nn
  */
 void subtractLocalBackground(cEventData *eventData, cGlobal *global){
 	
+	// ASICs filtered concurrently if panel threads are enabled
+	cWorkerPool	*panelPool = (global->nPanelThreads > 0) ? &global->panelPool : NULL;
+	
 	DETECTOR_LOOP {
         if(global->detector[detIndex].useLocalBackgroundSubtraction) {
 			DEBUG3("Subtract local background. (detectorID=%ld)",global->detector[detIndex].detectorID);										
@@ -265,131 +268,283 @@ void subtractLocalBackground(cEventData *eventData, cGlobal *global){
 			long		radius = global->detector[detIndex].localBackgroundRadius;
 			float		*data = eventData->detector[detIndex].data_detPhotCorr;
 			
-			subtractLocalBackground(data, radius, asic_nx, asic_ny, nasics_x, nasics_y);
+			subtractLocalBackground(data, radius, asic_nx, asic_ny, nasics_x, nasics_y, panelPool);
 		}
 	}
 	
 }
 
 
-void subtractLocalBackground(float *data, long radius, long asic_nx, long asic_ny, long nasics_x, long nasics_y) {
-	
-	// Tank for silly radius values
-	if(radius <= 0 || radius >= asic_ny/2 )
-		return;
-	
-	// Raw data array size can be calculated from asic modules
-	long	pix_nx = asic_nx*nasics_x;
-	long	pix_ny = asic_ny*nasics_y;
-	long	pix_nn = pix_nx*pix_ny;
+/*
+ *	Scratch for the local background median filter, one per thread and kept between frames
+ */
+typedef struct {
+	long		asic_nn;
+	float		*asic_buffer;	// ASIC values
+	uint64_t	*keys;			// sort keys (value bits << 32 | pixel), then sorted
+	uint64_t	*keys_tmp;
+	uint32_t	*rank;			// rank of each pixel in the sorted ASIC
+	float		*sorted;		// value at each rank
+	uint64_t	*present;		// ranks in the window (one bit each)
+	uint64_t	*present_words;	// non-zero words of present
+} tLocalBackgroundScratch;
+
+static pthread_key_t localBackgroundKey;
+static pthread_once_t localBackgroundKeyOnce = PTHREAD_ONCE_INIT;
+
+static void freeLocalBackgroundScratch(void *p) {
+	tLocalBackgroundScratch	*scratch = (tLocalBackgroundScratch *) p;
+	free(scratch->asic_buffer);
+	free(scratch->keys);
+	free(scratch->keys_tmp);
+	free(scratch->rank);
+	free(scratch->sorted);
+	free(scratch->present);
+	free(scratch->present_words);
+	free(scratch);
+}
+
+static void createLocalBackgroundKey(void) {
+	pthread_key_create(&localBackgroundKey, freeLocalBackgroundScratch);
+}
+
+static tLocalBackgroundScratch *localBackgroundScratch(long asic_nn) {
+	pthread_once(&localBackgroundKeyOnce, createLocalBackgroundKey);
+	tLocalBackgroundScratch	*scratch = (tLocalBackgroundScratch *) pthread_getspecific(localBackgroundKey);
+	if(scratch == NULL) {
+		scratch = (tLocalBackgroundScratch *) calloc(1, sizeof(tLocalBackgroundScratch));
+		pthread_setspecific(localBackgroundKey, scratch);
+	}
+	if(scratch->asic_nn < asic_nn) {
+		long	nWords = (asic_nn+63)/64;
+		free(scratch->asic_buffer);
+		free(scratch->keys);
+		free(scratch->keys_tmp);
+		free(scratch->rank);
+		free(scratch->sorted);
+		free(scratch->present);
+		free(scratch->present_words);
+		scratch->asic_nn = asic_nn;
+		scratch->asic_buffer = (float*) malloc(asic_nn*sizeof(float));
+		scratch->keys = (uint64_t*) malloc(asic_nn*sizeof(uint64_t));
+		scratch->keys_tmp = (uint64_t*) malloc(asic_nn*sizeof(uint64_t));
+		scratch->rank = (uint32_t*) malloc(asic_nn*sizeof(uint32_t));
+		scratch->sorted = (float*) malloc(asic_nn*sizeof(float));
+		scratch->present = (uint64_t*) calloc(nWords, sizeof(uint64_t));
+		scratch->present_words = (uint64_t*) calloc((nWords+63)/64, sizeof(uint64_t));
+	}
+	return scratch;
+}
+
+
+/*
+ *	Window of ASIC ranks: a bit per rank, plus a bit per non-empty 64 bit word
+ */
+static inline void windowAdd(tLocalBackgroundScratch *s, uint32_t r) {
+	s->present[r>>6] |= 1ULL << (r&63);
+	s->present_words[r>>12] |= 1ULL << ((r>>6)&63);
+}
+
+static inline void windowRemove(tLocalBackgroundScratch *s, uint32_t r) {
+	s->present[r>>6] &= ~(1ULL << (r&63));
+	if(s->present[r>>6] == 0)
+		s->present_words[r>>12] &= ~(1ULL << ((r>>6)&63));
+}
+
+static inline bool windowHas(tLocalBackgroundScratch *s, uint32_t r) {
+	return (s->present[r>>6] >> (r&63)) & 1;
+}
+
+// Smallest rank in the window above r (there must be one)
+static inline uint32_t windowNext(tLocalBackgroundScratch *s, uint32_t r) {
+	long		w = r>>6;
+	uint64_t	bits = ((r&63) == 63) ? 0 : s->present[w] & (~0ULL << ((r&63)+1));
+	if(bits == 0) {
+		w += 1;
+		long		ww = w>>6;
+		uint64_t	words = s->present_words[ww] & (~0ULL << (w&63));
+		while(words == 0)
+			words = s->present_words[++ww];
+		w = (ww<<6) + __builtin_ctzll(words);
+		bits = s->present[w];
+	}
+	return (w<<6) + __builtin_ctzll(bits);
+}
+
+// Largest rank in the window below r (there must be one)
+static inline uint32_t windowPrev(tLocalBackgroundScratch *s, uint32_t r) {
+	long		w = r>>6;
+	uint64_t	bits = s->present[w] & ((1ULL << (r&63)) - 1);
+	if(bits == 0) {
+		long		ww = w>>6;
+		uint64_t	words = s->present_words[ww] & ((1ULL << (w&63)) - 1);
+		while(words == 0)
+			words = s->present_words[--ww];
+		w = (ww<<6) + 63 - __builtin_clzll(words);
+		bits = s->present[w];
+	}
+	return (w<<6) + 63 - __builtin_clzll(bits);
+}
+
+
+/*
+ *	Local background of one ASIC: median of the (2*radius+1)^2 window around each pixel (clipped at the ASIC edge),
+ *	the (n/2)-th smallest of the n values in the window, as kth_smallest(window, n, n/2) would give
+ *
+ *	Values are replaced by their rank within the ASIC, so the window is a set of distinct integers.
+ *	The window slides along each row (Huang et al. 1979), updating a bitset of ranks and moving the median
+ *	by as many ranks as were added or removed below it, instead of selecting from scratch at every pixel.
+ */
+typedef struct {
+	float	*data;
+	long	radius;
+	long	asic_nx;
+	long	asic_ny;
+	long	nasics_x;
+} tLocalBackgroundJob;
+
+static void subtractLocalBackgroundAsic(void *arg, long asic, long) {
+	tLocalBackgroundJob		*job = (tLocalBackgroundJob *) arg;
+	long	radius = job->radius;
+	long	asic_nx = job->asic_nx;
+	long	asic_ny = job->asic_ny;
 	long	asic_nn = asic_nx*asic_ny;
+	long	pix_nx = asic_nx*job->nasics_x;
+	long	mi = asic % job->nasics_x;
+	long	mj = asic / job->nasics_x;
+	float	*data = job->data + (mj*asic_ny)*pix_nx + mi*asic_nx;
 	
+	tLocalBackgroundScratch	*s = localBackgroundScratch(asic_nn);
+	float		*asic_buffer = s->asic_buffer;
+	uint64_t	*keys = s->keys;
+	uint64_t	*keys_tmp = s->keys_tmp;
+	uint32_t	*rank = s->rank;
 	
-	// Median window size
-	long nn = (2*radius+1);
-	nn=nn*nn;
-	
-	float	*asic_buffer = (float*) calloc(asic_nn, sizeof(float));
-	float	*median_buffer = (float*) calloc(nn, sizeof(float));
-	float	*localBg = (float*) calloc(pix_nn, sizeof(float)); 
+	// Extract buffer of ASIC values, with keys that sort like the values (ties by position)
+	for(long j=0; j<asic_ny; j++){
+		for(long i=0; i<asic_nx; i++){
+			long		e = i+j*asic_nx;
+			uint32_t	bits;
+			asic_buffer[e] = data[j*pix_nx+i];
+			memcpy(&bits, &asic_buffer[e], sizeof(bits));
+			bits = (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+			keys[e] = ((uint64_t) bits << 32) | (uint64_t) e;
+		}
+	}
 	
+	// Ranks (stable radix sort on the value bits)
+	for(int shift=32; shift<64; shift+=8) {
+		long	count[257];
+		memset(count, 0, sizeof(count));
+		for(long e=0; e<asic_nn; e++)
+			count[((keys[e] >> shift) & 0xff) + 1]++;
+		for(int b=0; b<256; b++)
+			count[b+1] += count[b];
+		for(long e=0; e<asic_nn; e++)
+			keys_tmp[count[(keys[e] >> shift) & 0xff]++] = keys[e];
+		uint64_t	*t = keys; keys = keys_tmp; keys_tmp = t;
+	}
+	for(long k=0; k<asic_nn; k++) {
+		long	e = (long) (keys[k] & 0xffffffffu);
+		rank[e] = k;
+		s->sorted[k] = asic_buffer[e];
+	}
 	
 	/*
-	 *	Determine local background
-	 *	(median over window width either side of current pixel)
+	 *	Slide the window along each row; the median is rank m, with lt ranks in the window below it
 	 */
-	long		e = 0;
-	long        ee;
-	long		counter;
+	uint32_t	m = 0;
+	long		lt = 0;
 	
-	
-	// Loop over ASIC modules 
-	for(long mj=0; mj<nasics_y; mj++){
-		for(long mi=0; mi<nasics_x; mi++){
-			
-			// Extract buffer of ASIC values (small array is cache friendly)
-			for(long j=0; j<asic_ny; j++){
-				for(long i=0; i<asic_nx; i++){
-					
-					// Element in ASIC buffer
-					e = i+j*asic_nx;
-					
-					// Element in data array
-					ee = (j+mj*asic_ny)*pix_nx;
-					ee += i+mi*asic_nx;
-					
-					asic_buffer[e] = data[ee];
-				}
+	for(long j=0; j<asic_ny; j++){
+		long	jmin = (j-radius < 0) ? 0 : j-radius;
+		long	jmax = (j+radius >= asic_ny) ? asic_ny-1 : j+radius;
+		long	imax = (radius >= asic_nx) ? asic_nx-1 : radius;
+		
+		// Window at the start of the row
+		for(long jj=jmin; jj<=jmax; jj++){
+			for(long ii=0; ii<=imax; ii++){
+				uint32_t	r = rank[ii+jj*asic_nx];
+				windowAdd(s, r);
+				if(r < m) lt++;
 			}
+		}
+		
+		for(long i=0; i<asic_nx; i++){
+			long	imin = (i-radius < 0) ? 0 : i-radius;
+			imax = (i+radius >= asic_nx) ? asic_nx-1 : i+radius;
 			
-			// Loop over pixels within a module
-			for(long j=0; j<asic_ny; j++){
-				for(long i=0; i<asic_nx; i++){
-					
-					counter = 0;
-					
-					// Loop over median window
-					for(long jj=-radius; jj<=radius; jj++){
-						for(long ii=-radius; ii<=radius; ii++){
-							
-							// Quick array bounds check
-							if((i+ii) < 0)
-								continue;
-							if((i+ii) >= asic_nx)
-								continue;
-							if((j+jj) < 0)
-								continue;
-							if((j+jj) >= asic_ny)
-								continue;
-							
-							// Element in asic buffer
-							e = (j+jj)*asic_nx;
-							e += i+ii;
-							if(e < 0 || e >= asic_nn){
-								printf("Error: Array bounds error: e = %li > %li\n",e,asic_nn);
-								continue;
-							}
-							median_buffer[counter] = asic_buffer[e];
-							
-							counter++;
-						}
+			// Move the window one pixel along
+			if(i > 0) {
+				if(i-radius-1 >= 0) {
+					for(long jj=jmin; jj<=jmax; jj++){
+						uint32_t	r = rank[(i-radius-1)+jj*asic_nx];
+						windowRemove(s, r);
+						if(r < m) lt--;
 					}
-					
-					// Element in data array
-					ee = (j+mj*asic_ny)*pix_nx;
-					ee += i+mi*asic_nx;
-
-					// No elements -> trap an error
-					if(counter == 0) {
-						printf("Error: Local background counter == 0\n");
-						localBg[e] = 0;
-						continue;
-					}
-					if(counter > nn) {
-						printf("Error: counter == %li > %li\n",counter,nn);
-						continue;
+				}
+				if(i+radius < asic_nx) {
+					for(long jj=jmin; jj<=jmax; jj++){
+						uint32_t	r = rank[(i+radius)+jj*asic_nx];
+						windowAdd(s, r);
+						if(r < m) lt++;
 					}
-					
-					// Find median value
-					localBg[ee] = kth_smallest(median_buffer, counter, counter/2);
 				}
 			}
+			
+			// Median: the rank with k window ranks below it
+			long	k = ((jmax-jmin+1)*(imax-imin+1))/2;
+			while(lt > k) {
+				m = windowPrev(s, m);
+				lt--;
+			}
+			while(lt < k || !windowHas(s, m)) {
+				if(windowHas(s, m)) lt++;
+				m = windowNext(s, m);
+			}
+			
+			// Median is taken from the original values, so the subtraction can go straight into the data
+			data[j*pix_nx+i] = asic_buffer[i+j*asic_nx] - s->sorted[m];
+		}
+		
+		// Empty the window for the next row
+		imax = asic_nx-1;
+		for(long jj=jmin; jj<=jmax; jj++){
+			for(long ii=(asic_nx-1-radius < 0) ? 0 : asic_nx-1-radius; ii<=imax; ii++){
+				uint32_t	r = rank[ii+jj*asic_nx];
+				windowRemove(s, r);
+				if(r < m) lt--;
+			}
 		}
 	}
+}
+
+
+void subtractLocalBackground(float *data, long radius, long asic_nx, long asic_ny, long nasics_x, long nasics_y, cWorkerPool *panelPool) {
 	
+	// Tank for silly radius values
+	if(radius <= 0 || radius >= asic_ny/2 )
+		return;
 	
-	/*
-	 *	Do the background subtraction
-	 */
-	for(long i=0;i<pix_nn;i++) {
-		data[i] -= localBg[i];	
-	}	
-	
+	tLocalBackgroundJob	job;
+	job.data = data;
+	job.radius = radius;
+	job.asic_nx = asic_nx;
+	job.asic_ny = asic_ny;
+	job.nasics_x = nasics_x;
 	
-	// Cleanup
-	free(localBg);
-	free(asic_buffer);
-	free(median_buffer);
+	// Loop over ASIC modules 
+	if(panelPool != NULL) {
+		panelPool->parallelFor(nasics_x*nasics_y, subtractLocalBackgroundAsic, &job);
+	}
+	else {
+		for(long asic=0; asic<nasics_x*nasics_y; asic++)
+			subtractLocalBackgroundAsic(&job, asic, 0);
+	}
+}
+
+void subtractLocalBackground(float *data, long radius, long asic_nx, long asic_ny, long nasics_x, long nasics_y) {
+	subtractLocalBackground(data, radius, asic_nx, asic_ny, nasics_x, nasics_y, NULL);
 }
 
 
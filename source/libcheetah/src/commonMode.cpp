@@ -0,0 +1,301 @@
+//
+//  commonMode.cpp
+//  cheetah
+//
+//  Common mode (electronic offset) estimates over groups of pixels: whole ASICs, ASIC rows or ASIC columns
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "detectorObject.h"
+#include "commonMode.h"
+#include "median.h"
+
+
+// Quantile histograms narrower than this are filled as 4 interleaved copies
+#define CM_INTERLEAVED_BINS		1024
+
+
+/*
+ *	Scratch, one per thread and kept between frames
+ */
+typedef struct {
+	long		n;
+	float		*values;	// good pixels of the group
+	float		*select;	// values of one histogram bin
+	int32_t		*bins;		// histogram bin of each value
+	long		nHist;
+	uint32_t	*hist;
+} tCommonModeScratch;
+
+static pthread_key_t commonModeKey;
+static pthread_once_t commonModeKeyOnce = PTHREAD_ONCE_INIT;
+
+static void freeCommonModeScratch(void *p) {
+	tCommonModeScratch	*scratch = (tCommonModeScratch *) p;
+	free(scratch->values);
+	free(scratch->select);
+	free(scratch->bins);
+	free(scratch->hist);
+	free(scratch);
+}
+
+static void createCommonModeKey(void) {
+	pthread_key_create(&commonModeKey, freeCommonModeScratch);
+}
+
+static tCommonModeScratch *commonModeScratch(long n, long nHist) {
+	pthread_once(&commonModeKeyOnce, createCommonModeKey);
+	tCommonModeScratch	*scratch = (tCommonModeScratch *) pthread_getspecific(commonModeKey);
+	if(scratch == NULL) {
+		scratch = (tCommonModeScratch *) calloc(1, sizeof(tCommonModeScratch));
+		pthread_setspecific(commonModeKey, scratch);
+	}
+	if(scratch->n < n) {
+		free(scratch->values);
+		free(scratch->select);
+		free(scratch->bins);
+		scratch->n = n;
+		scratch->values = (float *) malloc(n*sizeof(float));
+		scratch->select = (float *) malloc(n*sizeof(float));
+		scratch->bins = (int32_t *) malloc(n*sizeof(int32_t));
+	}
+	if(scratch->nHist < nHist) {
+		free(scratch->hist);
+		scratch->nHist = nHist;
+		scratch->hist = (uint32_t *) malloc(nHist*sizeof(uint32_t));
+	}
+	return scratch;
+}
+
+
+/*
+ *	bins[i] = floor(values[i]) - lo, or overflow if that is overflow or more (values known to be >= lo and finite)
+ */
+static void binFloor(const float *values, long n, long lo, int32_t overflow, int32_t *bins) {
+	long	i = 0;
+#ifdef __SSE2__
+	if(lo > -(1L<<30) && lo < (1L<<30)) {
+		__m128i	vlo = _mm_set1_epi32((int32_t) lo);
+		__m128i	vover = _mm_set1_epi32(overflow);
+		__m128	vmax = _mm_set1_ps(1073741824.0f);
+		for(; i+4<=n; i+=4) {
+			__m128	v = _mm_min_ps(_mm_loadu_ps(values+i), vmax);
+			__m128i	t = _mm_cvttps_epi32(v);
+			// Truncation rounds negative values up: take one off where that happened
+			t = _mm_add_epi32(t, _mm_castps_si128(_mm_cmplt_ps(v, _mm_cvtepi32_ps(t))));
+			t = _mm_sub_epi32(t, vlo);
+			__m128i	big = _mm_cmpgt_epi32(t, _mm_sub_epi32(vover, _mm_set1_epi32(1)));
+			t = _mm_or_si128(_mm_and_si128(big, vover), _mm_andnot_si128(big, t));
+			_mm_storeu_si128((__m128i *) (bins+i), t);
+		}
+	}
+#endif
+	for(; i<n; i++) {
+		long	b = (long) floorf(values[i]) - lo;
+		bins[i] = (b >= overflow) ? overflow : (int32_t) b;
+	}
+}
+
+
+/*
+ *	Value with rank lrint(n*fraction) among the n good pixels of the group, i.e. kth_smallest() of them
+ *
+ *	The values go into a 1-ADU histogram starting at the smallest value, at most n bins long (so clearing it
+ *	costs no more than filling it); the bin holding the wanted rank is then the only part that needs selecting from.
+ */
+float commonModeQuantile(float *data, uint16_t *mask, long nx, long ny, long stride, float fraction) {
+	tCommonModeScratch	*scratch = commonModeScratch(nx*ny, std::max(nx*ny+1, 4L*CM_INTERLEAVED_BINS));
+	float		*values = scratch->values;
+	long		counter = 0;
+	float		vmin = INFINITY;
+	float		vmax = -INFINITY;
+	bool		finite = true;
+
+	// Good pixels and their range
+	for(long j=0; j<ny; j++) {
+		float		*d = data + j*stride;
+		uint16_t	*m = mask + j*stride;
+		for(long i=0; i<nx; i++) {
+			if(isBitOptionUnset(m[i], PIXEL_IS_BAD)) {
+				float	v = d[i];
+				values[counter++] = v;
+				vmin = (v < vmin) ? v : vmin;
+				vmax = (v > vmax) ? v : vmax;
+				finite &= (v - v == 0);
+			}
+		}
+	}
+	if(counter == 0)
+		return 0;
+
+	long	k = lrint(counter*fraction);
+	if(k < 0)
+		k = 1;
+	if(k >= counter)
+		k = counter-1;
+
+	// Anything not finite or huge: select from everything
+	if(!finite || vmin < -1e9 || vmax > 1e9)
+		return kth_smallest(values, counter, k);
+
+	long	lo = (long) floorf(vmin);
+	long	nbins = (long) floorf(vmax) - lo + 1;
+	if(nbins > counter)
+		nbins = counter;
+
+	// Histogram, with everything from lo+nbins up in the last bin
+	// A narrow histogram is filled as 4 interleaved copies, so runs of equal values don't wait on one counter
+	int32_t		*bins = scratch->bins;
+	uint32_t	*hist = scratch->hist;
+	binFloor(values, counter, lo, (int32_t) nbins, bins);
+	if(nbins < CM_INTERLEAVED_BINS) {
+		memset(hist, 0, 4*(nbins+1)*sizeof(uint32_t));
+		long	i = 0;
+		for(; i+4<=counter; i+=4) {
+			hist[4*bins[i]]++;
+			hist[4*bins[i+1]+1]++;
+			hist[4*bins[i+2]+2]++;
+			hist[4*bins[i+3]+3]++;
+		}
+		for(; i<counter; i++)
+			hist[4*bins[i]]++;
+		for(long b=0; b<=nbins; b++)
+			hist[b] = hist[4*b] + hist[4*b+1] + hist[4*b+2] + hist[4*b+3];
+	}
+	else {
+		memset(hist, 0, (nbins+1)*sizeof(uint32_t));
+		for(long i=0; i<counter; i++)
+			hist[bins[i]]++;
+	}
+
+	// Bin with rank k, and rank within that bin
+	long	b = 0;
+	long	below = 0;
+	while(below + (long) hist[b] <= k) {
+		below += hist[b];
+		b++;
+	}
+
+	// (integer valued data often has just one value in the bin)
+	float	*select = scratch->select;
+	long	nselect = 0;
+	bool	same = true;
+	for(long i=0; i<counter; i++) {
+		if(bins[i] == b) {
+			select[nselect++] = values[i];
+			same &= (values[i] == select[0]);
+		}
+	}
+	if(same)
+		return select[0];
+	return kth_smallest(select, nselect, k-below);
+}
+
+
+/*
+ *	Most common value (rounded to the nearest ADU) of the good, non-zero pixels of the group within +-span ADU;
+ *	the lowest one if several are equally common, 0 if there are none
+ */
+float commonModeHistogramPeak(float *data, uint16_t *mask, long nx, long ny, long stride, long span) {
+	tCommonModeScratch	*scratch = commonModeScratch(nx*ny, 0);
+	float		*values = scratch->values;
+	int32_t		*bins = scratch->bins;
+	long		counter = 0;
+
+	for(long j=0; j<ny; j++) {
+		float		*d = data + j*stride;
+		uint16_t	*m = mask + j*stride;
+		for(long i=0; i<nx; i++) {
+			if(isBitOptionUnset(m[i], PIXEL_IS_BAD) && d[i] != 0)
+				values[counter++] = d[i];
+		}
+	}
+
+	// Nearest ADU (out of range values end up outside +-span and are dropped)
+	long	i = 0;
+#ifdef __SSE2__
+	for(; i+4<=counter; i+=4)
+		_mm_storeu_si128((__m128i *) (bins+i), _mm_cvtps_epi32(_mm_loadu_ps(values+i)));
+#endif
+	for(; i<counter; i++) {
+		long	r = lrint(values[i]);
+		bins[i] = (r < -span || r >= span) ? INT32_MIN : (int32_t) r;
+	}
+
+	long	lo = span;
+	long	hi = -span-1;
+	long	n = 0;
+	for(long i=0; i<counter; i++) {
+		if(bins[i] >= -span && bins[i] < span) {
+			lo = (bins[i] < lo) ? bins[i] : lo;
+			hi = (bins[i] > hi) ? bins[i] : hi;
+			bins[n++] = bins[i];
+		}
+	}
+	if(n == 0)
+		return 0;
+
+	// Histogram over the occupied range only
+	scratch = commonModeScratch(nx*ny, hi-lo+1);
+	uint32_t	*hist = scratch->hist;
+	memset(hist, 0, (hi-lo+1)*sizeof(uint32_t));
+	for(long i=0; i<n; i++)
+		hist[bins[i]-lo]++;
+
+	long	peak = 0;
+	for(long b=1; b<=hi-lo; b++) {
+		if(hist[b] > hist[peak])
+			peak = b;
+	}
+	return (float) (peak + lo);
+}
+
+
+/*
+ *	Subtract common mode from every ASIC, ASIC row or ASIC column (bad pixels included)
+ */
+void commonModeSubtract(float *data, uint16_t *mask, int mode, float cmFloor, long asic_nx, long asic_ny, long nasics_x, long nasics_y) {
+	long	pix_nx = asic_nx*nasics_x;
+
+	for(long mj=0; mj<nasics_y; mj++){
+		for(long mi=0; mi<nasics_x; mi++){
+			long		e = mj*asic_ny*pix_nx + mi*asic_nx;
+			float		*d = data + e;
+			uint16_t	*m = mask + e;
+
+			if(mode == CM_ASIC_QUANTILE || mode == 2 || mode == CM_ASIC_HISTOGRAM) {
+				float	correction;
+				if(mode == CM_ASIC_HISTOGRAM)
+					correction = commonModeHistogramPeak(d, m, asic_nx, asic_ny, pix_nx, CM_HISTOGRAM_SPAN);
+				else
+					correction = commonModeQuantile(d, m, asic_nx, asic_ny, pix_nx, cmFloor);
+				for(long j=0; j<asic_ny; j++)
+					for(long i=0; i<asic_nx; i++)
+						d[j*pix_nx+i] -= correction;
+			}
+			else if(mode == CM_ROW_QUANTILE) {
+				for(long j=0; j<asic_ny; j++) {
+					float	correction = commonModeQuantile(d + j*pix_nx, m + j*pix_nx, asic_nx, 1, pix_nx, cmFloor);
+					for(long i=0; i<asic_nx; i++)
+						d[j*pix_nx+i] -= correction;
+				}
+			}
+			else if(mode == CM_COLUMN_QUANTILE) {
+				for(long i=0; i<asic_nx; i++) {
+					float	correction = commonModeQuantile(d + i, m + i, 1, asic_ny, pix_nx, cmFloor);
+					for(long j=0; j<asic_ny; j++)
+						d[j*pix_nx+i] -= correction;
+				}
+			}
+		}
+	}
+}
@@ -23,6 +23,7 @@
 #include "cheetahGlobal.h"
 #include "cheetahEvent.h"
 #include "detectorObject.h"
+#include "cheetahmodules.h"
 
 void initRaw(cEventData *eventData, cGlobal *global){
 	// Copy raw detector data into float array
@@ -55,8 +56,18 @@ void initPhotonCorrection(cEventData *eventData, cGlobal *global){
 	// Copy detector corrected data into photon corrected array as starting point for photon corrections
 	DETECTOR_LOOP {
 		DEBUG3("Initialise photon corrected data with detector corrected data. (detectorID=%ld)",global->detector[detIndex].detectorID);										
-		for(long i=0;i<global->detector[detIndex].pix_nn;i++){
-			eventData->detector[detIndex].data_detPhotCorr[i] = eventData->detector[detIndex].data_detCorr[i];
+		float	*detCorr = eventData->detector[detIndex].data_detCorr;
+		float	*detPhotCorr = eventData->detector[detIndex].data_detPhotCorr;
+		long	pix_nn = global->detector[detIndex].pix_nn;
+		// Polarization and solid angle corrections come for free with the copy (see applyPhotonCorrectionFactor)
+		if (foldPhotonCorrectionFactor(&global->detector[detIndex])) {
+			float	*factor = global->detector[detIndex].photonCorrectionFactor;
+			for(long i=0;i<pix_nn;i++){
+				detPhotCorr[i] = detCorr[i]*factor[i];
+			}
+		}
+		else {
+			memcpy(detPhotCorr, detCorr, pix_nn*sizeof(float));
 		}
 	}
 }
@@ -82,10 +93,13 @@ cDataVersion::cDataVersion(cPixelDetectorEvent * detectorEvent0, cPixelDetectorC
 		powder_counter[powderClass]             = NULL;
 		powder_raw[powderClass]                 = NULL;
 		powder_raw_squared[powderClass]         = NULL;
+		powder_raw_counter[powderClass]         = NULL;
 		powder_detCorr[powderClass]             = NULL;
 		powder_detCorr_squared[powderClass]     = NULL;
+		powder_detCorr_counter[powderClass]     = NULL;
 		powder_detPhotCorr[powderClass]         = NULL;
 		powder_detPhotCorr_squared[powderClass] = NULL;
+		powder_detPhotCorr_counter[powderClass] = NULL;
 		powder_mutex[powderClass]               = &detectorCommon->null_mutex;
 	}
 	
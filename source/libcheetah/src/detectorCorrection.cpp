@@ -23,6 +23,80 @@
 #include "cheetahEvent.h"
 #include "cheetahmodules.h"
 #include "median.h"
+#include "commonMode.h"
+
+
+/*
+ *	Single pass detector correction
+ *	Does what initRaw, initDetectorCorrection, checkSaturatedPixels, subtractDarkcal, applyGainCorrection and
+ *	setBadPixelsToZero do one after the other, but in one sweep over the frame instead of six.
+ *	Only used when no detector needs a correction in between (see cPixelDetectorCommon::canFuseDetectorCorrection),
+ *	otherwise the worker runs the separate steps.
+ */
+void fusedDetectorCorrection(cEventData *eventData, cGlobal *global) {
+	DETECTOR_LOOP {
+		DEBUG3("Fused detector correction. (detectorID=%ld)",global->detector[detIndex].detectorID);
+		cPixelDetectorCommon	*detector = &global->detector[detIndex];
+		cPixelDetectorEvent		*detectorEvent = &eventData->detector[detIndex];
+
+		float	*darkcal = detector->useDarkcalSubtraction ? detector->darkcal : NULL;
+		float	*gaincal = detector->useGaincal ? detector->gaincal : NULL;
+
+		fusedDetectorCorrection(detectorEvent->data_raw_is_float ? NULL : detectorEvent->data_raw16, detectorEvent->data_raw, detectorEvent->data_detCorr,
+								detectorEvent->pixelmask, darkcal, gaincal, detector->pix_nn, detector->maskSaturatedPixels, detector->applyBadPixelMask,
+								detector->pixelSaturationADC, detector->pixelMinimumAllowedADC, detector->pixelMaximumAllowedADC);
+
+		if (darkcal != NULL)
+			detectorEvent->pedSubtracted = 1;
+	}
+}
+
+/*
+ *	raw16 == NULL means raw already holds the data as float
+ *	darkcal/gaincal == NULL skip that step
+ *	Written without data dependent branches so the compiler can vectorise it; where GCC supports it,
+ *	AVX-512 and AVX2 versions are built alongside the generic one and picked at load time.
+ */
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__) && defined(__linux__)
+__attribute__((target_clones("avx512f","avx2","default")))
+#endif
+void fusedDetectorCorrection(uint16_t *raw16, float *raw, float *detCorr, uint16_t *mask, float *darkcal, float *gaincal, long pix_nn,
+							 int checkSaturated, int applyBadPixelMask, long pixelSaturationADC, long pixelMinimumAllowedADC, long pixelMaximumAllowedADC) {
+	float	saturation = pixelSaturationADC;
+	float	minimumAllowed = pixelMinimumAllowedADC;
+	float	maximumAllowed = pixelMaximumAllowedADC;
+
+	for(long i=0; i<pix_nn; i++) {
+		float		v = (raw16 != NULL) ? (float) raw16[i] : raw[i];
+		uint16_t	m = mask[i];
+
+		// Same as checkSaturatedPixels, which zeroes the raw data (a saturated pixel before the range check)
+		// but runs after initDetectorCorrection, so data_detCorr starts from the value as read
+		if(checkSaturated) {
+			float	r = v;
+			bool	saturated = (r >= saturation);
+			m = saturated ? (m | PIXEL_IS_SATURATED) : (m & ~PIXEL_IS_SATURATED);
+			r = saturated ? 0 : r;
+			bool	outOfRange = (r <= minimumAllowed) | (r >= maximumAllowed);
+			m = outOfRange ? (m | PIXEL_IS_BAD) : m;
+			r = outOfRange ? 0 : r;
+			raw[i] = r;
+		}
+		else {
+			raw[i] = v;
+		}
+		mask[i] = m;
+
+		if(darkcal != NULL)
+			v -= darkcal[i];
+		if(gaincal != NULL)
+			v *= gaincal[i];
+		if(applyBadPixelMask)
+			v *= isBitOptionUnset(m,PIXEL_IS_BAD);
+		detCorr[i] = v;
+	}
+}
+
 
 
 /*
@@ -191,8 +265,7 @@ void cspadModuleSubtract(cEventData *eventData, cGlobal *global, int flag){
 					cspadModuleSubtractMedian(data, mask, threshold, asic_nx, asic_ny, nasics_x, nasics_y);
 				}
 				else if(flag==3) {
-					long span = 16384;
-					cspadModuleSubtractHistogram(data, mask, span, asic_nx, asic_ny, nasics_x, nasics_y);
+					cspadModuleSubtractHistogram(data, mask, CM_HISTOGRAM_SPAN, asic_nx, asic_ny, nasics_x, nasics_y);
 				}
             }
         }
@@ -205,7 +278,7 @@ void agipdModuleSubtract(cEventData *eventData, cGlobal *global){
     
     DETECTOR_LOOP {
         int flag = global->detector[detIndex].cmModule;
-        if(strcmp(global->detector[detIndex].detectorType, "agipd-1M") == 0) {
+        if(strcmp(global->detector[detIndex].detectorType, "agipd-1M") == 0 && flag >= 1 && flag <= 5) {
             DEBUG3("AGIPD module subtraction. (detectorID=%ld)",global->detector[detIndex].detectorID);
             // Dereference datector arrays
             float        threshold = global->detector[detIndex].cmFloor;
@@ -216,14 +289,31 @@ void agipdModuleSubtract(cEventData *eventData, cGlobal *global){
             long        nasics_x = global->detector[detIndex].nasics_x;
             long        nasics_y = global->detector[detIndex].nasics_y;
             
-            if(flag==1 || flag==2) {
-                cspadModuleSubtractMedian(data, mask, threshold, asic_nx, asic_ny, nasics_x, nasics_y);
-                printf("AGIPD module correction (median)\n");
-            }
-            else if(flag==3) {
-                long span = 16384;
-                cspadModuleSubtractHistogram(data, mask, span, asic_nx, asic_ny, nasics_x, nasics_y);
-                printf("AGIPD module correction (histogram)\n");
+            commonModeSubtract(data, mask, flag, threshold, asic_nx, asic_ny, nasics_x, nasics_y);
+        }
+    }
+}
+
+
+/*
+ *	Jungfrau and ePix: common mode per ASIC (cmModule=1 or 3) or per ASIC row or column (cmModule=4 or 5)
+ */
+void jungfrauModuleSubtract(cEventData *eventData, cGlobal *global){
+    
+    DETECTOR_LOOP {
+        int flag = global->detector[detIndex].cmModule;
+        if((strcmp(global->detector[detIndex].detectorType, "jungfrau1M") == 0) || (strcmp(global->detector[detIndex].detectorType, "epix100a") == 0)) {
+            if(flag == CM_ASIC_QUANTILE || flag == CM_ASIC_HISTOGRAM || flag == CM_ROW_QUANTILE || flag == CM_COLUMN_QUANTILE) {
+                DEBUG3("Jungfrau/ePix module subtraction. (detectorID=%ld)",global->detector[detIndex].detectorID);
+                float        threshold = global->detector[detIndex].cmFloor;
+                float        *data = eventData->detector[detIndex].data_detCorr;
+                uint16_t    *mask = eventData->detector[detIndex].pixelmask;
+                long        asic_nx = global->detector[detIndex].asic_nx;
+                long        asic_ny = global->detector[detIndex].asic_ny;
+                long        nasics_x = global->detector[detIndex].nasics_x;
+                long        nasics_y = global->detector[detIndex].nasics_y;
+                
+                commonModeSubtract(data, mask, flag, threshold, asic_nx, asic_ny, nasics_x, nasics_y);
             }
         }
     }
@@ -233,73 +323,10 @@ void agipdModuleSubtract(cEventData *eventData, cGlobal *global){
 
 /*
  *	Subtract the median value on each ASIC
+ *	(the cmFloor quantile of the good pixels, see commonModeQuantile)
  */
 void cspadModuleSubtractMedian(float *data, uint16_t *mask, float threshold, long asic_nx, long asic_ny, long nasics_x, long nasics_y) {
-	
-	long		e;
-	long		mval;
-	long		counter;
-	float		median;
-    float       mean;
-    float       correction;
-					  
-	// Create median buffer
-	float	*buffer; 
-	buffer = (float*) calloc(asic_nx*asic_ny, sizeof(float));
-	
-	
-	// Loop over modules (8x8 array)
-	for(long mi=0; mi<nasics_x; mi++){
-		for(long mj=0; mj<nasics_y; mj++){
-			
-			// Zero array
-            mean = 0;
-			for(long i=0; i<asic_nx*asic_ny; i++)
-				buffer[i] = 0;
-			
-			// Loop over pixels within a module
-            counter = 0;
-			for(long j=0; j<asic_ny; j++){
-				for(long i=0; i<asic_nx; i++){
-					e = (j + mj*asic_ny) * (asic_nx*nasics_x);
-					e += i + mi*asic_nx;
-					if( isBitOptionUnset(mask[e],PIXEL_IS_BAD) ) {
-						buffer[counter++] = data[e];
-                        mean += data[e];
-					}
-				}
-			}
-			
-            // Calculate background using median value 
-			//median = kth_smallest(buffer, global->asic_nx*global->asic_ny, mval);
-            
-			if(counter>0) {
-				mval = lrint(counter*threshold);
-                if(mval < 0) 
-                    mval = 1;
-				median = kth_smallest(buffer, counter, mval);
-                mean /= counter;
-			}
-            else {
-				median = 0;
-                mean = 0;
-            }
-            //printf("%f %f ", median, mean);
-
-            correction = median;
-            
-			// Subtract median value
-			for(long j=0; j<asic_ny; j++){
-				for(long i=0; i<asic_nx; i++){
-					e = (j + mj*asic_ny) * (asic_nx*nasics_x);
-					e += i + mi*asic_nx;
-					data[e] -= correction;
-				}
-			}
-		}
-	}
-    //printf("\n");
-	free(buffer);
+	commonModeSubtract(data, mask, CM_ASIC_QUANTILE, threshold, asic_nx, asic_ny, nasics_x, nasics_y);
 }
 
 
@@ -308,70 +335,19 @@ void cspadModuleSubtractMedian(float *data, uint16_t *mask, float threshold, lon
  *	(the LCLS/psana apporach)
  */
 void cspadModuleSubtractHistogram(float *data, uint16_t *mask, long hist_span, long asic_nx, long asic_ny, long nasics_x, long nasics_y) {
-	long		e;
-	long		counter;
-	
-	
-	// Create histogram array
-	long	hist_offset = hist_span;
-	long	hist_index;
-	long	*histogram = (long*) calloc(2*hist_span, sizeof(long));
+	long	pix_nx = asic_nx*nasics_x;
 	
-	
-	// Loop over modules (8x8 array)
-	for(long mi=0; mi<nasics_x; mi++){
-		for(long mj=0; mj<nasics_y; mj++){
-			
-			// Zero histogram array
-			for(long i=0; i<2*hist_span; i++)
-				histogram[i] = 0;
-			
-			// Loop over pixels within a module and populate the histogram
-			// Ignoring bad pixels avoids being dominated by those pixels being set to 0
-			// Remember to do an array bounds check
-			counter = 0;
-			for(long j=0; j<asic_ny; j++){
-				for(long i=0; i<asic_nx; i++){
-					e = (j + mj*asic_ny) * (asic_nx*nasics_x);
-					e += i + mi*asic_nx;
-					if( isBitOptionUnset(mask[e],PIXEL_IS_BAD) && data[e] != 0 ) {
-						hist_index = lrint(data[e]) + hist_offset;
-						if(hist_index >= 0 && hist_index < 2*hist_span)
-							histogram[hist_index] += 1;
-					}
-				}
-			}
-			
-			// Maximum of the histogram is the common mode offset
-			long	hist_max_value = -1;
-			long	hist_max_position = -1;
-			
-			for(long i=0; i<2*hist_span; i++) {
-				if(histogram[i] > hist_max_value) {
-					hist_max_value = histogram[i];
-					hist_max_position = i;
-				}
-			}
-			if(hist_max_position != -1)
-				hist_max_position -= hist_offset;
-			else
-				hist_max_position = 0;
-
-            printf("%f ", hist_max_position);
-
+	for(long mj=0; mj<nasics_y; mj++){
+		for(long mi=0; mi<nasics_x; mi++){
+			long	e = mj*asic_ny*pix_nx + mi*asic_nx;
+			float	offset = commonModeHistogramPeak(data+e, mask+e, asic_nx, asic_ny, pix_nx, hist_span);
 			
 			// Subtract offset value
-			for(long j=0; j<asic_ny; j++){
-				for(long i=0; i<asic_nx; i++){
-					e = (j + mj*asic_ny) * (asic_nx*nasics_x);
-					e += i + mi*asic_nx;
-					data[e] -= hist_max_position;
-				}
-			}
+			for(long j=0; j<asic_ny; j++)
+				for(long i=0; i<asic_nx; i++)
+					data[e + j*pix_nx + i] -= offset;
 		}
-        printf("\n");
 	}
-	free(histogram);
 }
 
 
@@ -613,6 +589,30 @@ void updateHotPixelBuffer(cEventData *eventData, cGlobal *global) {
 
 
 
+/*
+ *	Apply the precomputed polarization and solid angle corrections (see cPixelDetectorCommon::updatePhotonCorrectionFactor)
+ *	Without photon counting this has already been folded into initPhotonCorrection, so there is nothing left to do here
+ */
+bool foldPhotonCorrectionFactor(cPixelDetectorCommon *detector) {
+	return detector->photonCorrectionFactor != NULL && !detector->photonCount;
+}
+
+void applyPhotonCorrectionFactor(cEventData *eventData, cGlobal *global) {
+	DETECTOR_LOOP {
+		float	*factor = global->detector[detIndex].photonCorrectionFactor;
+		if (factor != NULL && !foldPhotonCorrectionFactor(&global->detector[detIndex])) {
+			DEBUG3("Apply polarization/solid angle correction. (detectorID=%ld)",global->detector[detIndex].detectorID);
+			float	*data = eventData->detector[detIndex].data_detPhotCorr;
+			long	pix_nn = global->detector[detIndex].pix_nn;
+			for (long i=0; i<pix_nn; i++) {
+				data[i] *= factor[i];
+			}
+		}
+	}
+}
+
+
+
 /*
  *	Apply polarization correction
  *	The polarization correction is calculated using classical electrodynamics (expression from Hura et al JCP 2000)
@@ -17,6 +17,7 @@
 #include <hdf5.h>
 #include <fenv.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <iostream>
 
 #include "data2d.h"
@@ -122,6 +123,7 @@ cPixelDetectorCommon::cPixelDetectorCommon()
     scaleBackground = 0;
     useBackgroundBufferMutex = 0;
     bgMedian = 0.5;
+    bgIncrementalMedian = 0;
     bgRecalc = bgMemory;
     bgIncludeHits = 0;
     bgNoBeamReset = 0;
@@ -180,7 +182,8 @@ cPixelDetectorCommon::cPixelDetectorCommon()
     histogram_ss_min = 0;
     histogram_ss_max = 1480;
     histogram_nss = 1480;
-    histogramMaxMemoryGb = 4;
+    histogramMaxMemoryGb = 0;   // 0: physical memory
+    histogramSparse = 0;
     histogram_count = 0;
     histogramDataVersion = 1; // 0: raw; 1: detector corrected; 2: detector and photon corrected
 
@@ -190,6 +193,10 @@ cPixelDetectorCommon::cPixelDetectorCommon()
     usePnccdLineInterpolation = 0;
     usePnccdLineMasking = 0;
 
+    // Assembly (table is built with the geometry)
+    assembleInterpolation = ASSEMBLE_INTERPOLATION_DEFAULT;
+    assembleTable = NULL;
+
     // Downsampling factor (1: no downsampling)
     downsampling = 1;
     downsamplingConservative = 1;
@@ -391,10 +398,18 @@ void cPixelDetectorCommon::configure(cGlobal * global) {
 			cmModule = 3;
 			cspadSubtractUnbondedPixels = 0;
 		}
+		else if( strcmp(commonModeCorrection, "row_median" ) == 0) {
+			cmModule = 4;
+			cspadSubtractUnbondedPixels = 0;
+		}
+		else if( strcmp(commonModeCorrection, "column_median" ) == 0) {
+			cmModule = 5;
+			cspadSubtractUnbondedPixels = 0;
+		}
 		else {
 			fprintf(stderr,"Error: Unknown common mode method: %s\n", commonModeCorrection);
 			fprintf(stderr,"Valid options are\n");
-			fprintf(stderr,"{none, asic_unbonded, asic_median, asic_histogram}\n");
+			fprintf(stderr,"{none, asic_unbonded, asic_median, asic_histogram, row_median, column_median}\n");
 			exit(1);
 		}
 	}
@@ -424,6 +439,10 @@ void cPixelDetectorCommon::configure(cGlobal * global) {
 	
 	// Thread safety
 	threadSafetyLevel = global->threadSafetyLevel;
+	nThreads = global->nThreads;
+
+	// Assembly
+	assembleInterpolation = global->assembleInterpolation;
 
 
     // Set modes in accordance to configuration
@@ -884,6 +903,9 @@ int cPixelDetectorCommon::parseConfigTag(char *tag, char *value)
     else if (!strcmp(tag, "bgmedian")) {
         bgMedian = atof(value);
     }
+    else if (!strcmp(tag, "bgincrementalmedian")) {
+        bgIncrementalMedian = atoi(value);
+    }
     else if (!strcmp(tag, "bgincludehits")) {
         bgIncludeHits = atoi(value);
     }
@@ -942,6 +964,9 @@ int cPixelDetectorCommon::parseConfigTag(char *tag, char *value)
     else if (!strcmp(tag, "histogrammaxmemorygb")) {
         histogramMaxMemoryGb = atof(value);
     }
+    else if (!strcmp(tag, "histogramsparse")) {
+        histogramSparse = atoi(value);
+    }
 
     // Unknown tags
     else {
@@ -966,6 +991,10 @@ void cPixelDetectorCommon::allocateMemory()
     gaincal = (float*) calloc(pix_nn, sizeof(float));
     darkcal = (float*) calloc(pix_nn, sizeof(float));
 
+    // Geometry corrections (rebuilt by updateKspace once the camera length is known)
+    photonCorrectionFactor = NULL;
+    updatePhotonCorrectionFactor();
+
     /*
      *  Shared dynamic data
      */
@@ -982,52 +1011,54 @@ void cPixelDetectorCommon::allocateMemory()
 
     // Hot pixel map
     pthread_mutex_init(&hotPix_update_mutex, NULL);
-    frameBufferHotPix = new cFrameBuffer(pix_nn, hotPixMemory, threadSafetyLevel);
+    frameBufferHotPix = new cFrameBuffer(pix_nn, hotPixMemory, threadSafetyLevel, nThreads);
     // Noisy pixel map
 
     pthread_mutex_init(&noisyPix_update_mutex, NULL);
-    frameBufferNoisyPix = new cFrameBuffer(pix_nn, noisyPixMemory, threadSafetyLevel);
+    frameBufferNoisyPix = new cFrameBuffer(pix_nn, noisyPixMemory, threadSafetyLevel, nThreads);
     // Persistent background
 
     pthread_mutex_init(&bg_update_mutex, NULL);
-    frameBufferBlanks = new cFrameBuffer(pix_nn, bgMemory, threadSafetyLevel);
+    // Sorted windows double the memory of the ring, so only when the median is actually going to be used
+    bool incrementalMedian = bgIncrementalMedian && useSubtractPersistentBackground && !subtractPersistentBackgroundMean;
+    frameBufferBlanks = new cFrameBuffer(pix_nn, bgMemory, threadSafetyLevel, nThreads, incrementalMedian);
 
-    // Powder data (accumulated sums and sums of squared values)  
+    // Powder data (accumulated sums; squared holds the sum of squared deviations from the mean)
     for (long powderClass = 0; powderClass < nPowderClasses; powderClass++) {
         nPowderFrames[powderClass] = 0;
-        powderData_raw[powderClass] = (double*) calloc(pix_nn, sizeof(double));
-        powderData_raw_squared[powderClass] = (double*) calloc(pix_nn, sizeof(double));
-        powderData_raw_counter[powderClass] = (long*) calloc(pix_nn, sizeof(long));
-        powderData_detCorr[powderClass] = (double*) calloc(pix_nn, sizeof(double));
-        powderData_detCorr_squared[powderClass] = (double*) calloc(pix_nn, sizeof(double));
-        powderData_detCorr_counter[powderClass] = (long*) calloc(pix_nn, sizeof(long));
-        powderData_detPhotCorr[powderClass] = (double*) calloc(pix_nn, sizeof(double));
-        powderData_detPhotCorr_squared[powderClass] = (double*) calloc(pix_nn, sizeof(double));
-        powderData_detPhotCorr_counter[powderClass] = (long*) calloc(pix_nn, sizeof(long));
+        powderData_raw[powderClass] = NULL;
+        powderData_raw_squared[powderClass] = NULL;
+        powderData_raw_counter[powderClass] = NULL;
+        powderData_detCorr[powderClass] = NULL;
+        powderData_detCorr_squared[powderClass] = NULL;
+        powderData_detCorr_counter[powderClass] = NULL;
+        powderData_detPhotCorr[powderClass] = NULL;
+        powderData_detPhotCorr_squared[powderClass] = NULL;
+        powderData_detPhotCorr_counter[powderClass] = NULL;
         pthread_mutex_init(&powderData_mutex[powderClass], NULL);
 
-        powderImage_raw[powderClass] = (double*) calloc(image_nn, sizeof(double));
-        powderImage_raw_squared[powderClass] = (double*) calloc(image_nn, sizeof(double));
-        powderImage_detCorr[powderClass] = (double*) calloc(image_nn, sizeof(double));
-        powderImage_detCorr_squared[powderClass] = (double*) calloc(image_nn, sizeof(double));
-        powderImage_detPhotCorr[powderClass] = (double*) calloc(image_nn, sizeof(double));
-        powderImage_detPhotCorr_squared[powderClass] = (double*) calloc(image_nn, sizeof(double));
+        powderImage_raw[powderClass] = NULL;
+        powderImage_raw_squared[powderClass] = NULL;
+        powderImage_detCorr[powderClass] = NULL;
+        powderImage_detCorr_squared[powderClass] = NULL;
+        powderImage_detPhotCorr[powderClass] = NULL;
+        powderImage_detPhotCorr_squared[powderClass] = NULL;
         pthread_mutex_init(&powderImage_mutex[powderClass], NULL);
 
-        powderImageXxX_raw[powderClass] = (double*) calloc(imageXxX_nn, sizeof(double));
-        powderImageXxX_raw_squared[powderClass] = (double*) calloc(imageXxX_nn, sizeof(double));
-        powderImageXxX_detCorr[powderClass] = (double*) calloc(imageXxX_nn, sizeof(double));
-        powderImageXxX_detCorr_squared[powderClass] = (double*) calloc(imageXxX_nn, sizeof(double));
-        powderImageXxX_detPhotCorr[powderClass] = (double*) calloc(imageXxX_nn, sizeof(double));
-        powderImageXxX_detPhotCorr_squared[powderClass] = (double*) calloc(imageXxX_nn, sizeof(double));
+        powderImageXxX_raw[powderClass] = NULL;
+        powderImageXxX_raw_squared[powderClass] = NULL;
+        powderImageXxX_detCorr[powderClass] = NULL;
+        powderImageXxX_detCorr_squared[powderClass] = NULL;
+        powderImageXxX_detPhotCorr[powderClass] = NULL;
+        powderImageXxX_detPhotCorr_squared[powderClass] = NULL;
         pthread_mutex_init(&powderImageXxX_mutex[powderClass], NULL);
 
-        powderRadialAverage_raw[powderClass] = (double*) calloc(radial_nn, sizeof(double));
-        powderRadialAverage_raw_squared[powderClass] = (double*) calloc(radial_nn, sizeof(double));
-        powderRadialAverage_detCorr[powderClass] = (double*) calloc(radial_nn, sizeof(double));
-        powderRadialAverage_detCorr_squared[powderClass] = (double*) calloc(radial_nn, sizeof(double));
-        powderRadialAverage_detPhotCorr[powderClass] = (double*) calloc(radial_nn, sizeof(double));
-        powderRadialAverage_detPhotCorr_squared[powderClass] = (double*) calloc(radial_nn, sizeof(double));
+        powderRadialAverage_raw[powderClass] = NULL;
+        powderRadialAverage_raw_squared[powderClass] = NULL;
+        powderRadialAverage_detCorr[powderClass] = NULL;
+        powderRadialAverage_detCorr_squared[powderClass] = NULL;
+        powderRadialAverage_detPhotCorr[powderClass] = NULL;
+        powderRadialAverage_detPhotCorr_squared[powderClass] = NULL;
         pthread_mutex_init(&powderRadialAverage_mutex[powderClass], NULL);
 
         // Powder peaks
@@ -1039,6 +1070,8 @@ void cPixelDetectorCommon::allocateMemory()
         pthread_mutex_init(&radialStack_mutex[powderClass], NULL);
     }
 
+    allocatePowderMemory();
+
     // Histogram memory
     if (histogram) {
         printf("Allocating histogram memory\n");
@@ -1048,24 +1081,96 @@ void cPixelDetectorCommon::allocateMemory()
         histogram_nnn = (uint64_t) histogramNbins * (uint64_t)(histogram_nn);
         float histogramMemory;
         float histogramMemoryGb;
-        histogramMemory = (histogram_nnn * sizeof(uint16_t));
+        float histogramLimitGb = histogramMaxMemoryGb;
+        // About one byte per pixel and bin (see cPixelHistogram)
+        histogramMemory = cPixelHistogram::footprint(histogram_nn, histogramNbins);
         histogramMemoryGb = histogramMemory / (1024LL * 1024LL * 1024LL);
-        if (histogramMemoryGb > histogramMaxMemoryGb) {
+        if (histogramLimitGb <= 0) {
+            histogramLimitGb = ((float) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGE_SIZE)) / (1024LL * 1024LL * 1024LL);
+        }
+        if (histogramMemoryGb > histogramLimitGb) {
             printf("Size of histogram buffer would exceed allowed size:\n");
             printf("Histogram depth: %li\n", histogramNbins);
             printf("Histogram buffer size (GB): %f\n", histogramMemoryGb);
-            printf("Maximum histogram buffer size (GB): %f\n", histogramMaxMemoryGb);
-            printf("Set histogramMaxMemoryGb to a larger value in cheetah.ini if you really want to use a bigger array\n");
+            printf("Maximum histogram buffer size (GB): %f\n", histogramLimitGb);
+            if (histogramMaxMemoryGb > 0)
+                printf("Set histogramMaxMemoryGb to a larger value (or 0 for the physical memory) in cheetah.ini if you really want to use a bigger array\n");
+            else
+                printf("This is more than the physical memory: reduce histogramNbins or the histogram_fs/ss region\n");
+            exit(1);
+        }
+        if (histogramNbins > 65536) {
+            printf("histogramNbins can be at most 65536\n");
             exit(1);
         }
         printf("Histogram buffer size (GB): %f\n", histogramMemoryGb);
-        histogramData = (uint16_t*) calloc(histogram_nnn, sizeof(uint16_t));
+        histogramData = new cPixelHistogram(histogram_nn, histogramNbins);
         pthread_mutex_init(&histogram_mutex, NULL);
         histogramScale = (float *) malloc(histogramNbins * sizeof(float));
         calculateHistogramScale(histogramMin, histogramNbins, histogramBinSize, histogramScale);
     }
 }
 
+/*
+ *  Allocate the powder sums for the formats and versions that are actually accumulated
+ *  Anything already allocated is kept, so this can be called again after powderFormat/powderVersion change
+ */
+static void allocatePowderArray(double **array, bool used, long nn) {
+    if (used && *array == NULL)
+        *array = (double*) calloc(nn, sizeof(double));
+}
+
+void cPixelDetectorCommon::allocatePowderMemory()
+{
+    // Assembled powders are assembled from the non-assembled sums, downsampled ones from the assembled
+    bool nonAssembled = isAnyOfBitOptionsSet(powderFormat, cDataVersion::DATA_FORMAT_NON_ASSEMBLED | cDataVersion::DATA_FORMAT_ASSEMBLED | cDataVersion::DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED | cDataVersion::DATA_FORMAT_RADIAL_AVERAGE);
+    bool assembled = isAnyOfBitOptionsSet(powderFormat, cDataVersion::DATA_FORMAT_ASSEMBLED | cDataVersion::DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED);
+    bool downsampled = isBitOptionSet(powderFormat, cDataVersion::DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED);
+    bool radial = isBitOptionSet(powderFormat, cDataVersion::DATA_FORMAT_RADIAL_AVERAGE);
+    bool raw = isBitOptionSet(powderVersion, cDataVersion::DATA_VERSION_RAW);
+    bool detCorr = isBitOptionSet(powderVersion, cDataVersion::DATA_VERSION_DETECTOR_CORRECTED);
+    bool detPhotCorr = isBitOptionSet(powderVersion, cDataVersion::DATA_VERSION_DETECTOR_AND_PHOTON_CORRECTED);
+
+    for (long powderClass = 0; powderClass < nPowderClasses; powderClass++) {
+        allocatePowderArray(&powderData_raw[powderClass], nonAssembled && raw, pix_nn);
+        allocatePowderArray(&powderData_raw_squared[powderClass], nonAssembled && raw, pix_nn);
+        allocatePowderArray(&powderData_detCorr[powderClass], nonAssembled && detCorr, pix_nn);
+        allocatePowderArray(&powderData_detCorr_squared[powderClass], nonAssembled && detCorr, pix_nn);
+        allocatePowderArray(&powderData_detPhotCorr[powderClass], nonAssembled && detPhotCorr, pix_nn);
+        allocatePowderArray(&powderData_detPhotCorr_squared[powderClass], nonAssembled && detPhotCorr, pix_nn);
+        // Per pixel counters are only needed for masked sums
+        if (nonAssembled && savePowderMasked) {
+            if (raw && powderData_raw_counter[powderClass] == NULL)
+                powderData_raw_counter[powderClass] = (long*) calloc(pix_nn, sizeof(long));
+            if (detCorr && powderData_detCorr_counter[powderClass] == NULL)
+                powderData_detCorr_counter[powderClass] = (long*) calloc(pix_nn, sizeof(long));
+            if (detPhotCorr && powderData_detPhotCorr_counter[powderClass] == NULL)
+                powderData_detPhotCorr_counter[powderClass] = (long*) calloc(pix_nn, sizeof(long));
+        }
+
+        allocatePowderArray(&powderImage_raw[powderClass], assembled && raw, image_nn);
+        allocatePowderArray(&powderImage_raw_squared[powderClass], assembled && raw, image_nn);
+        allocatePowderArray(&powderImage_detCorr[powderClass], assembled && detCorr, image_nn);
+        allocatePowderArray(&powderImage_detCorr_squared[powderClass], assembled && detCorr, image_nn);
+        allocatePowderArray(&powderImage_detPhotCorr[powderClass], assembled && detPhotCorr, image_nn);
+        allocatePowderArray(&powderImage_detPhotCorr_squared[powderClass], assembled && detPhotCorr, image_nn);
+
+        allocatePowderArray(&powderImageXxX_raw[powderClass], downsampled && raw, imageXxX_nn);
+        allocatePowderArray(&powderImageXxX_raw_squared[powderClass], downsampled && raw, imageXxX_nn);
+        allocatePowderArray(&powderImageXxX_detCorr[powderClass], downsampled && detCorr, imageXxX_nn);
+        allocatePowderArray(&powderImageXxX_detCorr_squared[powderClass], downsampled && detCorr, imageXxX_nn);
+        allocatePowderArray(&powderImageXxX_detPhotCorr[powderClass], downsampled && detPhotCorr, imageXxX_nn);
+        allocatePowderArray(&powderImageXxX_detPhotCorr_squared[powderClass], downsampled && detPhotCorr, imageXxX_nn);
+
+        allocatePowderArray(&powderRadialAverage_raw[powderClass], radial && raw, radial_nn);
+        allocatePowderArray(&powderRadialAverage_raw_squared[powderClass], radial && raw, radial_nn);
+        allocatePowderArray(&powderRadialAverage_detCorr[powderClass], radial && detCorr, radial_nn);
+        allocatePowderArray(&powderRadialAverage_detCorr_squared[powderClass], radial && detCorr, radial_nn);
+        allocatePowderArray(&powderRadialAverage_detPhotCorr[powderClass], radial && detPhotCorr, radial_nn);
+        allocatePowderArray(&powderRadialAverage_detPhotCorr_squared[powderClass], radial && detPhotCorr, radial_nn);
+    }
+}
+
 /*
  *	Free detector specific memory
  */
@@ -1076,6 +1181,7 @@ void cPixelDetectorCommon::freeMemory()
      */
     free (gaincal);
     free (darkcal);
+    free (photonCorrectionFactor);
     /*
      *  Shared dynamic data
      */
@@ -1095,7 +1201,9 @@ void cPixelDetectorCommon::freeMemory()
     // Persistent background
     delete frameBufferBlanks;
     pthread_mutex_destroy (&bg_update_mutex);
-    // Powder data (accumulated sums and sums of squared values)  
+    // Assembly table
+    delete assembleTable;
+    // Powder data (arrays that were never allocated are NULL)
     for (long powderClass = 0; powderClass < nPowderClasses; powderClass++) {
         // Powders 
         nPowderFrames[powderClass] = 0;
@@ -1135,7 +1243,7 @@ void cPixelDetectorCommon::freeMemory()
     pthread_mutex_destroy (&null_mutex);
     // Pixel histograms
     if (histogram) {
-        free (histogramData);
+        delete histogramData;
         free (histogramScale);
         pthread_mutex_destroy (&histogram_mutex);
     }
@@ -1346,6 +1454,9 @@ void cPixelDetectorCommon::readDetectorGeometry(char* filename)
     if (downsampling > 1) {
         printf("\tDownsampled image output array will be %li x %li\n", imageXxX_ny, imageXxX_nx);
     }
+
+    // Pixel to image mapping for assembly (geometry does not change after this)
+    assembleTable = new cAssembleTable(pix_x, pix_y, nn, image_nx, assembleInterpolation);
 }
 
 /*
@@ -1421,6 +1532,63 @@ void cPixelDetectorCommon::updateKspace(cGlobal *global, float wavelengthA)
     // also update constant term of solid angle when detector has moved
     solidAngleConst = pixelSize * pixelSize / (detectorZ * cameraLengthScale * detectorZ * cameraLengthScale);
 
+    // and the per-pixel polarization / solid angle factors that depend on it
+    updatePhotonCorrectionFactor();
+}
+
+/*
+ *  Precompute polarization and solid angle corrections as one multiplier per pixel
+ *  (called whenever detector has moved)
+ *  The corrections are applied to an array of ones with the existing per-pixel functions, so the result is
+ *  by construction what those functions would divide the data by; events then only need one multiplication per pixel
+ */
+void cPixelDetectorCommon::updatePhotonCorrectionFactor()
+{
+    if (!usePolarizationCorrection && !useSolidAngleCorrection)
+        return;
+
+    if (photonCorrectionFactor == NULL)
+        photonCorrectionFactor = (float *) malloc(pix_nn * sizeof(float));
+
+    for (long i = 0; i < pix_nn; i++)
+        photonCorrectionFactor[i] = 1;
+
+    if (usePolarizationCorrection)
+        applyPolarizationCorrection(photonCorrectionFactor, pix_x, pix_y, pix_z, pixelSize, detectorZ, cameraLengthScale, horizontalFractionOfPolarization, pix_nn);
+
+    if (useSolidAngleCorrection) {
+        if (solidAngleAlgorithm == 1)
+            applyAzimuthallySymmetricSolidAngleCorrection(photonCorrectionFactor, pix_x, pix_y, pix_z, pixelSize, detectorZ, cameraLengthScale, solidAngleConst, pix_nn);
+        else
+            applyRigorousSolidAngleCorrection(photonCorrectionFactor, pix_x, pix_y, pix_z, pixelSize, detectorZ, cameraLengthScale, solidAngleConst, pix_nn);
+    }
+}
+
+/*
+ *  Can initRaw ... setBadPixelsToZero be done by fusedDetectorCorrection() for this detector?
+ *  Not if any of the module/line corrections that sit in between in the worker are switched on
+ */
+bool cPixelDetectorCommon::canFuseDetectorCorrection()
+{
+    if (strcmp(detectorType, "cspad") == 0 || strcmp(detectorType, "cspad2x2") == 0) {
+        if (cmModule == 1 || cmModule == 2 || cmModule == 3 || cspadSubtractUnbondedPixels || cspadSubtractBehindWires)
+            return false;
+    }
+    if (strcmp(detectorType, "agipd-1M") == 0) {
+        if (cmModule >= 1 && cmModule <= 5)
+            return false;
+    }
+    if (strcmp(detectorType, "jungfrau1M") == 0 || strcmp(detectorType, "epix100a") == 0) {
+        if (cmModule == 1 || cmModule == 3 || cmModule == 4 || cmModule == 5)
+            return false;
+    }
+    if (strcmp(detectorType, "pnccd") == 0) {
+        if (cmModule == 1 || usePnccdOffsetCorrection || usePnccdFixWiringError || usePnccdLineInterpolation || usePnccdLineMasking)
+            return false;
+        if (maskSaturatedPixels && maskPnccdSaturatedPixels)
+            return false;
+    }
+    return true;
 }
 
 /*
@@ -2,23 +2,191 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 
 #include "cheetah.h"
 
+
+/*
+ *	Allocate the per-detector arrays of a new event
+ *	Assembled and downsampled arrays are only needed when saveFormat or powderFormat asks for assembled data
+ *	Arrays that are not needed are left as NULL (cDataVersion complains loudly if anybody tries to use them)
+ */
+static void allocateEventBuffers(cEventData *eventData, cGlobal *global) {
+
+	DETECTOR_LOOP {
+		cPixelDetectorCommon	*detector = &global->detector[detIndex];
+		long	pix_nn = detector->pix_nn;
+		long	image_nn = detector->image_nn;
+		long	imageXxX_nn = detector->imageXxX_nn;
+		long	radial_nn = detector->radial_nn;
+		int		formats = detector->saveFormat | detector->powderFormat;
+
+		eventData->detector[detIndex].data_raw16 = (uint16_t*) malloc(pix_nn*sizeof(uint16_t));
+		eventData->detector[detIndex].data_raw = (float*) malloc(pix_nn*sizeof(float));
+		eventData->detector[detIndex].data_detCorr = (float*) calloc(pix_nn,sizeof(float));
+		eventData->detector[detIndex].data_detPhotCorr = (float*) calloc(pix_nn,sizeof(float));
+		eventData->detector[detIndex].pixelmask = (uint16_t*) calloc(pix_nn,sizeof(uint16_t));
+
+		eventData->detector[detIndex].data_forPersistentBackgroundBuffer = NULL;
+		if(detector->useSubtractPersistentBackground || detector->useAutoNoisyPixel)
+			eventData->detector[detIndex].data_forPersistentBackgroundBuffer = (float*) calloc(pix_nn,sizeof(float));
+
+		eventData->detector[detIndex].image_raw = NULL;
+		eventData->detector[detIndex].image_detCorr = NULL;
+		eventData->detector[detIndex].image_detPhotCorr = NULL;
+		eventData->detector[detIndex].image_pixelmask = NULL;
+		if(isAnyOfBitOptionsSet(formats, cDataVersion::DATA_FORMAT_ASSEMBLED | cDataVersion::DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED)) {
+			eventData->detector[detIndex].image_raw = (float*) calloc(image_nn,sizeof(float));
+			eventData->detector[detIndex].image_detCorr = (float*) calloc(image_nn,sizeof(float));
+			eventData->detector[detIndex].image_detPhotCorr = (float*) calloc(image_nn,sizeof(float));
+			eventData->detector[detIndex].image_pixelmask = (uint16_t*) calloc(image_nn,sizeof(uint16_t));
+		}
+
+		eventData->detector[detIndex].imageXxX_raw = NULL;
+		eventData->detector[detIndex].imageXxX_detCorr = NULL;
+		eventData->detector[detIndex].imageXxX_detPhotCorr = NULL;
+		eventData->detector[detIndex].imageXxX_pixelmask = NULL;
+		if(isBitOptionSet(formats, cDataVersion::DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED)) {
+			eventData->detector[detIndex].imageXxX_raw = (float*) calloc(imageXxX_nn,sizeof(float));
+			eventData->detector[detIndex].imageXxX_detCorr = (float*) calloc(imageXxX_nn,sizeof(float));
+			eventData->detector[detIndex].imageXxX_detPhotCorr = (float*) calloc(imageXxX_nn,sizeof(float));
+			eventData->detector[detIndex].imageXxX_pixelmask = (uint16_t*) calloc(imageXxX_nn,sizeof(uint16_t));
+		}
+
+		eventData->detector[detIndex].radialAverage_raw = (float *) calloc(radial_nn, sizeof(float));
+		eventData->detector[detIndex].radialAverage_detCorr = (float *) calloc(radial_nn, sizeof(float));
+		eventData->detector[detIndex].radialAverage_detPhotCorr = (float *) calloc(radial_nn, sizeof(float));
+		eventData->detector[detIndex].radialAverage_pixelmask = (uint16_t*) calloc(radial_nn,sizeof(uint16_t));
+	}
+
+	/*
+	 *	Create arrays for remembering Bragg peak data
+	 */
+	long NpeaksMax = global->hitfinderNpeaksMax;
+	allocatePeakList(&(eventData->peaklist), NpeaksMax);
+
+	/*
+	 *	Create arrays for various spectrum data
+	 */
+	int spectrumLength = global->espectrumLength;
+	eventData->energySpectrum1D = (double *) calloc(spectrumLength, sizeof(double));
+}
+
+
+/*
+ *	Free what allocateEventBuffers() allocated, plus the event itself
+ */
+static void freeEventBuffers(cEventData *eventData, cGlobal *global) {
+
+	DETECTOR_LOOP {
+		free(eventData->detector[detIndex].data_raw16);
+		free(eventData->detector[detIndex].data_raw);
+		free(eventData->detector[detIndex].data_detCorr);
+		free(eventData->detector[detIndex].data_detPhotCorr);
+		free(eventData->detector[detIndex].data_forPersistentBackgroundBuffer);
+		free(eventData->detector[detIndex].pixelmask);
+
+		free(eventData->detector[detIndex].image_raw);
+		free(eventData->detector[detIndex].image_detCorr);
+		free(eventData->detector[detIndex].image_detPhotCorr);
+		free(eventData->detector[detIndex].image_pixelmask);
+
+		free(eventData->detector[detIndex].imageXxX_raw);
+		free(eventData->detector[detIndex].imageXxX_detCorr);
+		free(eventData->detector[detIndex].imageXxX_detPhotCorr);
+		free(eventData->detector[detIndex].imageXxX_pixelmask);
+
+		free(eventData->detector[detIndex].radialAverage_raw);
+		free(eventData->detector[detIndex].radialAverage_detCorr);
+		free(eventData->detector[detIndex].radialAverage_detPhotCorr);
+		free(eventData->detector[detIndex].radialAverage_pixelmask);
+	}
+
+	// Free peak lists
+	freePeakList(eventData->peaklist);
+
+	free(eventData->energySpectrum1D);
+
+	delete eventData;
+}
+
+
+/*
+ *	Bring a recycled event back to the state of a freshly created one
+ *	Scalars are reset by assigning a value-initialised cEventData (same as new cEventData()),
+ *	only the arrays that get accumulated into (rather than overwritten) are cleared.
+ */
+static void resetEvent(cEventData *eventData, cGlobal *global) {
+
+	cPixelDetectorEvent	detector[MAX_DETECTORS];
+	tPeakList	peaklist = eventData->peaklist;
+	double		*energySpectrum1D = eventData->energySpectrum1D;
+
+	DETECTOR_LOOP {
+		detector[detIndex] = eventData->detector[detIndex];
+	}
+
+	*eventData = cEventData();
+
+	DETECTOR_LOOP {
+		cPixelDetectorEvent	*det = &eventData->detector[detIndex];
+		*det = detector[detIndex];
+
+		// initPixelmask() ORs into the event mask, and front ends may already have flagged pixels
+		memset(det->pixelmask, 0, global->detector[detIndex].pix_nn*sizeof(uint16_t));
+
+		long radial_nn = global->detector[detIndex].radial_nn;
+		memset(det->radialAverage_raw, 0, radial_nn*sizeof(float));
+		memset(det->radialAverage_detCorr, 0, radial_nn*sizeof(float));
+		memset(det->radialAverage_detPhotCorr, 0, radial_nn*sizeof(float));
+		memset(det->radialAverage_pixelmask, 0, radial_nn*sizeof(uint16_t));
+	}
+
+	// Peak arrays are only ever read up to nPeaks, so the counters are all that needs resetting
+	eventData->peaklist = peaklist;
+	eventData->peaklist.nPeaks = 0;
+	eventData->peaklist.nHot = 0;
+	eventData->peaklist.peakResolution = 0;
+	eventData->peaklist.peakResolutionA = 0;
+	eventData->peaklist.peakDensity = 0;
+	eventData->peaklist.peakNpix = 0;
+	eventData->peaklist.peakTotal = 0;
+
+	eventData->energySpectrum1D = energySpectrum1D;
+	memset(eventData->energySpectrum1D, 0, global->espectrumLength*sizeof(double));
+}
+
+
 /*
  *  libCheetah function to create structure for holding new event information
- *  Currently only a malloc() but set up as a function so that we have the option of 
- *  initialising variables without needing to change any top level code
+ *  Events come from a pool owned by cGlobal: buffers are allocated the first time an event is needed,
+ *  and then recycled by cheetahDestroyEvent() rather than freed, so the steady state does no allocation at all
  */
 cEventData* cheetahNewEvent(cGlobal	*global) {
 
 	/*
-	 *	Create new event structure
+	 *	Take an event from the pool, or create a new one if the pool is empty
 	 */
-	cEventData	*eventData;
-	eventData = new cEventData();
+	cEventData	*eventData = NULL;
+
+	pthread_mutex_lock(&global->eventPool_mutex);
+	if(!global->eventPool.empty()) {
+		eventData = global->eventPool.back();
+		global->eventPool.pop_back();
+	}
+	pthread_mutex_unlock(&global->eventPool_mutex);
+
+	if(eventData != NULL) {
+		resetEvent(eventData, global);
+	}
+	else {
+		eventData = new cEventData();
+		allocateEventBuffers(eventData, global);
+	}
 	eventData->pGlobal = global;
+	eventData->refcount = 1;
 
 	strcpy(eventData->eventname,"---");
 	strcpy(eventData->filename,"---");
@@ -37,56 +205,13 @@ cEventData* cheetahNewEvent(cGlobal	*global) {
 	eventData->peakTotal=0.;
 	eventData->stackSlice=-1;
 
-	//long		pix_nn1 = global->detector[0].pix_nn;
-	//long		asic_nx = global->detector[0].asic_nx;
-	//long		asic_ny = global->detector[0].asic_ny;	
-	//printf("************>>> %li, %li, %li\n", asic_nx, asic_ny, pix_nn1);
-
-	/*
-	 *	Create arrays for intermediate detector data, etc 
-	 */
 	DETECTOR_LOOP {
-		long	pix_nn = global->detector[detIndex].pix_nn;
-		long	image_nn = global->detector[detIndex].image_nn;
-		long	imageXxX_nn = global->detector[detIndex].imageXxX_nn;
-		long	radial_nn = global->detector[detIndex].radial_nn;
-
 		eventData->detector[detIndex].data_raw_is_float = false;
-		eventData->detector[detIndex].data_raw16 = (uint16_t*) malloc(pix_nn*sizeof(uint16_t));
-		eventData->detector[detIndex].data_raw = (float*) malloc(pix_nn*sizeof(float));
-		eventData->detector[detIndex].data_detCorr = (float*) calloc(pix_nn,sizeof(float));
-		eventData->detector[detIndex].data_detPhotCorr = (float*) calloc(pix_nn,sizeof(float));
-		eventData->detector[detIndex].data_forPersistentBackgroundBuffer = (float*) calloc(pix_nn,sizeof(float));
-		eventData->detector[detIndex].pixelmask = (uint16_t*) calloc(pix_nn,sizeof(uint16_t));
-
-		eventData->detector[detIndex].image_raw = (float*) calloc(image_nn,sizeof(float));
-		eventData->detector[detIndex].image_detCorr = (float*) calloc(image_nn,sizeof(float));
-		eventData->detector[detIndex].image_detPhotCorr = (float*) calloc(image_nn,sizeof(float));
-		eventData->detector[detIndex].image_pixelmask = (uint16_t*) calloc(image_nn,sizeof(uint16_t));
-
-		eventData->detector[detIndex].imageXxX_raw = (float*) calloc(imageXxX_nn,sizeof(float));
-		eventData->detector[detIndex].imageXxX_detCorr = (float*) calloc(imageXxX_nn,sizeof(float));
-		eventData->detector[detIndex].imageXxX_detPhotCorr = (float*) calloc(imageXxX_nn,sizeof(float));
-		eventData->detector[detIndex].imageXxX_pixelmask = (uint16_t*) calloc(imageXxX_nn,sizeof(uint16_t));
-
-		eventData->detector[detIndex].radialAverage_raw = (float *) calloc(radial_nn, sizeof(float));
-		eventData->detector[detIndex].radialAverage_detCorr = (float *) calloc(radial_nn, sizeof(float));
-		eventData->detector[detIndex].radialAverage_detPhotCorr = (float *) calloc(radial_nn, sizeof(float));
-		eventData->detector[detIndex].radialAverage_pixelmask = (uint16_t*) calloc(radial_nn,sizeof(uint16_t));
-
 		eventData->detector[detIndex].pedSubtracted=0;
 		eventData->detector[detIndex].sum=0.;
 	}
 
-	
-	/*
-	 *	Create arrays for remembering Bragg peak data
-	 */
-	long NpeaksMax = global->hitfinderNpeaksMax;
-	allocatePeakList(&(eventData->peaklist), NpeaksMax);
-	
 
-	
 	/*
 	 *	Make it clear we dont know certain things until this data is read
 	 */
@@ -97,24 +222,20 @@ cEventData* cheetahNewEvent(cGlobal	*global) {
 	eventData->CXIspec_present = false;
 
 
-	
 	/*
-	 *	Create arrays for various spectrum data 
-	 *	Setting non-allocated arrays to NULL is useful for preventing double free() errors 
+	 *	Setting non-allocated arrays to NULL is useful for preventing double free() errors
 	 *	(ie: we are not completely clean with knowing when we have allocated arrays and when we haven't)
 	 */
-	int spectrumLength = global->espectrumLength;
-	eventData->energySpectrum1D = (double *) calloc(spectrumLength, sizeof(double));
 	eventData->energySpectrumExist = 0;
-	
+
 	eventData->FEEspec_hproj = NULL;
 	eventData->FEEspec_vproj = NULL;
 	eventData->TimeTool_hproj = NULL;
 	eventData->TimeTool_vproj = NULL;
 	eventData->pulnixImage = NULL;
 	eventData->CXIspec_image = NULL;
-	
-	
+
+
 	// Return
 	return eventData;
 }
@@ -123,41 +244,17 @@ cEventData* cheetahNewEvent(cGlobal	*global) {
 
 
 /*
- *  libCheetah function to clean up all memory allocated in event struture
+ *  libCheetah function to clean up an event
+ *  Arrays supplied by the front end are freed; the event itself goes back into the pool for reuse
  */
 void cheetahDestroyEvent(cEventData *eventData) {
-    
-    cGlobal	*global = eventData->pGlobal;;
-    
-    // Free primary detector memory
-	DETECTOR_LOOP {
-		free(eventData->detector[detIndex].data_raw16);
-		free(eventData->detector[detIndex].data_raw);
-		free(eventData->detector[detIndex].data_detCorr);
-		free(eventData->detector[detIndex].data_detPhotCorr);
-		free(eventData->detector[detIndex].data_forPersistentBackgroundBuffer);
-		free(eventData->detector[detIndex].pixelmask);
 
-		free(eventData->detector[detIndex].image_raw);
-		free(eventData->detector[detIndex].image_detCorr);
-		free(eventData->detector[detIndex].image_detPhotCorr);
-		free(eventData->detector[detIndex].image_pixelmask);
+    cGlobal	*global = eventData->pGlobal;;
 
-		free(eventData->detector[detIndex].imageXxX_raw);
-		free(eventData->detector[detIndex].imageXxX_detCorr);
-		free(eventData->detector[detIndex].imageXxX_detPhotCorr);
-		free(eventData->detector[detIndex].imageXxX_pixelmask);
+	// The CXI writer thread holds its own reference until the frame is on disk (see writeCXI)
+	if(__sync_sub_and_fetch(&eventData->refcount, 1) > 0)
+		return;
 
-		free(eventData->detector[detIndex].radialAverage_raw);
-		free(eventData->detector[detIndex].radialAverage_detCorr);
-		free(eventData->detector[detIndex].radialAverage_detPhotCorr);
-		free(eventData->detector[detIndex].radialAverage_pixelmask);
-	}
-
-	// Free peak lists
-	freePeakList(eventData->peaklist);
-	
-	
 	// Pulnix external camera
 	if(eventData->Pulnix_present == true && eventData->pulnixImage != NULL){
 		free(eventData->pulnixImage);
@@ -178,8 +275,45 @@ void cheetahDestroyEvent(cEventData *eventData) {
 		free(eventData->TimeTool_hproj);
 		free(eventData->TimeTool_vproj);
 	}
+	eventData->Pulnix_present = false;
+	eventData->CXIspec_present = false;
+	eventData->FEEspec_present = 0;
+	eventData->TimeTool_present = 0;
+
+	// Compressed CXI chunks nobody wrote
+	for(size_t i=0; i<eventData->cxiChunks.size(); i++) {
+		free(eventData->cxiChunks[i].data);
+	}
+	eventData->cxiChunks.clear();
 
-    free(eventData->energySpectrum1D);
-   
-	delete eventData;
+	/*
+	 *	Return to the pool
+	 *	Enough events for every worker, every queue slot (including the CXI writer's) and the front end's copy threads are kept;
+	 *	anything beyond that is freed so a burst doesn't pin memory for the rest of the run
+	 */
+	long	poolSize = 2*global->nThreads + global->nEventCopyThreads + 2;
+	if(global->cxiWriter.nWorkers() > 0)
+		poolSize += global->cxiWriterQueueDepth + 1;
+
+	pthread_mutex_lock(&global->eventPool_mutex);
+	if((long) global->eventPool.size() < poolSize) {
+		global->eventPool.push_back(eventData);
+		eventData = NULL;
+	}
+	pthread_mutex_unlock(&global->eventPool_mutex);
+
+	if(eventData != NULL)
+		freeEventBuffers(eventData, global);
+}
+
+
+/*
+ *	Free all pooled events (called from cGlobal::freeMemory once workers are done)
+ */
+void freeEventPool(cGlobal *global) {
+	pthread_mutex_lock(&global->eventPool_mutex);
+	for(size_t i=0; i<global->eventPool.size(); i++)
+		freeEventBuffers(global->eventPool[i], global);
+	global->eventPool.clear();
+	pthread_mutex_unlock(&global->eventPool_mutex);
 }
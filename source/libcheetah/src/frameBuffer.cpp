@@ -16,216 +16,229 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <iostream>
+#include <algorithm>
 #include "detectorObject.h"
 #include "frameBuffer.h"
 #include "median.h"
 
-cFrameBuffer::cFrameBuffer(long pix_nn0, long depth0, int threadSafetyLevel0) {
+/*
+ *	Frames are stored tile by tile: all depth frames of FRAMEBUFFER_TILE_NN pixels are contiguous,
+ *	so per-pixel statistics over the ring work on a block that stays in cache instead of striding by pix_nn.
+ *	frame j, pixel i  ->  frames[(i/tile_nn)*tile_nn*depth + j*tile_nn + i%tile_nn]
+ */
+#define FRAMEBUFFER_TILE_NN 256
+// Pixels per lock of the sorted windows
+#define FRAMEBUFFER_STRIPE_NN 16384
+
+cFrameBuffer::cFrameBuffer(long pix_nn0, long depth0, int threadSafetyLevel0, long nThreads0, bool incrementalMedian0) {
 	pix_nn = pix_nn0;
 	depth = depth0;
 	threadSafetyLevel = threadSafetyLevel0;
-	// initialize buffer
-	frames = (float *) calloc(pix_nn*depth, sizeof(float));
+	nThreads = nThreads0;
+	incrementalMedian = incrementalMedian0;
+	// initialize buffer (last tile padded)
+	tile_nn = FRAMEBUFFER_TILE_NN;
+	n_tiles = (pix_nn + tile_nn - 1) / tile_nn;
+	frames = (float *) calloc(n_tiles*tile_nn*depth, sizeof(float));
 	counter = 0;
-    median = (float *) calloc(pix_nn, sizeof(float));
-    mean = (float *) calloc(pix_nn, sizeof(float));
-	std = (float *) calloc(pix_nn, sizeof(float));
-	absAboveThresh = (float *) calloc(pix_nn, sizeof(float));
-	// Frames scheduling
-	n_frame_readers = (long *) calloc(depth,sizeof(long));
-	frame_mutexes = (pthread_mutex_t*) calloc(depth, sizeof(pthread_mutex_t));
+	// Sorted windows start out consistent with the (all zero) ring
+	sorted = NULL;
+	stripe_mutexes = NULL;
+	stripe_nn = FRAMEBUFFER_STRIPE_NN;
+	n_stripes = (pix_nn + stripe_nn - 1) / stripe_nn;
+	if (incrementalMedian) {
+		sorted = (float *) calloc(pix_nn*depth, sizeof(float));
+		stripe_mutexes = (pthread_mutex_t*) calloc(n_stripes, sizeof(pthread_mutex_t));
+		for (long s=0; s<n_stripes; s++) {
+			pthread_mutex_init(&stripe_mutexes[s], NULL);
+		}
+	}
+	// Frames scheduling: writeNextFrame takes a frame exclusively, recalculations share all frames
+	frame_rwlocks = (pthread_rwlock_t*) calloc(depth, sizeof(pthread_rwlock_t));
 	for (long j=0; j<depth; j++) {
-		pthread_mutex_init(&frame_mutexes[j], NULL);
+		pthread_rwlock_init(&frame_rwlocks[j], NULL);
 	}
 	filled = false;
-	// Median scheduling
-	n_median_readers = 0;
-	pthread_mutex_init(&median_mutex, NULL);
+	// Results start out as all zero snapshots
+	pthread_mutex_init(&snapshot_mutex, NULL);
+	median = newSnapshot((float *) calloc(pix_nn, sizeof(float)));
+	mean = newSnapshot((float *) calloc(pix_nn, sizeof(float)));
+	std = newSnapshot((float *) calloc(pix_nn, sizeof(float)));
+	absAboveThresh = newSnapshot((float *) calloc(pix_nn, sizeof(float)));
 	median_updated = false;
-	// Mean scheduling
-	n_mean_readers = 0;
-	pthread_mutex_init(&mean_mutex, NULL);
 	mean_updated = false;
-	// Std scheduling
-	n_std_readers = 0;
-	pthread_mutex_init(&std_mutex, NULL);
 	std_updated = false;
-	// absAbovethresh scheduling
-	n_absAboveThresh_readers = 0;
-	pthread_mutex_init(&absAboveThresh_mutex, NULL);
-	absAboveThresh_updated = false;	
+	absAboveThresh_updated = false;
 }
 
 cFrameBuffer::~cFrameBuffer() {
 	free(frames);
-	free(median);
-	free(std);
-	free(absAboveThresh);
+	free(sorted);
+	if (stripe_mutexes != NULL) {
+		for (long s=0; s<n_stripes; s++) {
+			pthread_mutex_destroy(&stripe_mutexes[s]);
+		}
+		free(stripe_mutexes);
+	}
+	releaseSnapshot(median);
+	releaseSnapshot(mean);
+	releaseSnapshot(std);
+	releaseSnapshot(absAboveThresh);
+	pthread_mutex_destroy(&snapshot_mutex);
 	for (long j=0; j<depth; j++) {
-		pthread_mutex_destroy(&frame_mutexes[j]);
+		pthread_rwlock_destroy(&frame_rwlocks[j]);
 	}
-	free(frame_mutexes);
-	free(n_frame_readers);
-	pthread_mutex_destroy(&std_mutex);
-	pthread_mutex_destroy(&median_mutex);
-	pthread_mutex_destroy(&absAboveThresh_mutex);
-}
-
-//.........................................//
-// Frame write / read scheduler functions
-void cFrameBuffer::lockFrameWriters(long frameID) {
-	pthread_mutex_lock(&frame_mutexes[frameID]);
-	__sync_fetch_and_add(&n_frame_readers[frameID],1);
-	pthread_mutex_unlock(&frame_mutexes[frameID]);
-}
-
-void cFrameBuffer::lockAllFramesWriters() {
-	for (long j = 0; j<depth; j++) lockFrameWriters(j);
-}
-
-void cFrameBuffer::unlockFrameWriters(long frameID) {
-	__sync_fetch_and_sub(&n_frame_readers[frameID],1);
-}
-
-void cFrameBuffer::unlockAllFramesWriters() {
-	for (long j = 0; j<depth; j++) unlockFrameWriters(j);
+	free(frame_rwlocks);
 }
 
-void cFrameBuffer::lockFrameReadersAndWriters(long frameID) {
-	// Prevent new reader from starting
-	pthread_mutex_lock(&frame_mutexes[frameID]);
-	// Wait for readers to finish
-	while (n_frame_readers[frameID] > 0)
-		usleep(10000);
-}
-
-void cFrameBuffer::lockAllFramesReadersAndWriters() {
-	for (long j = 0; j<depth; j++) lockFrameReadersAndWriters(j);
-}
-
-void cFrameBuffer::unlockFrameReadersAndWriters(long frameID) {
-	// Allows readers and writers to start
-	pthread_mutex_unlock(&frame_mutexes[frameID]);
-}
-
-void cFrameBuffer::unlockAllFramesReadersAndWriters() {
-	for (long j = 0; j<depth; j++) unlockFrameReadersAndWriters(j);
-}
 
 //.........................................//
-// std write / read scheduler functions
-void cFrameBuffer::lockStdWriters() {
-	pthread_mutex_lock(&std_mutex);
-	__sync_fetch_and_add(&n_std_readers,1);
-	pthread_mutex_unlock(&std_mutex);
+// Frame write / read scheduling
+void cFrameBuffer::lockAllFramesForReading() {
+	for (long j = 0; j<depth; j++) pthread_rwlock_rdlock(&frame_rwlocks[j]);
 }
 
-void cFrameBuffer::unlockStdWriters() {
-	__sync_fetch_and_sub(&n_std_readers,1);
+void cFrameBuffer::unlockAllFramesForReading() {
+	for (long j = 0; j<depth; j++) pthread_rwlock_unlock(&frame_rwlocks[j]);
 }
 
-void cFrameBuffer::lockStdReadersAndWriters() {
-	// Prevent new reader from starting
-	pthread_mutex_lock(&std_mutex);
-	// Wait for readers to finish
-	while (n_std_readers > 0)
-		usleep(10000);
+void cFrameBuffer::lockFrameForWriting(long frameID) {
+	pthread_rwlock_wrlock(&frame_rwlocks[frameID]);
 }
 
-void cFrameBuffer::unlockStdReadersAndWriters() {
-	// Allows readers and writers to start
-	pthread_mutex_unlock(&std_mutex);
+void cFrameBuffer::unlockFrameForWriting(long frameID) {
+	pthread_rwlock_unlock(&frame_rwlocks[frameID]);
 }
 
 //.........................................//
-// median write / read scheduler functions
-void cFrameBuffer::lockMedianWriters() {
-	pthread_mutex_lock(&median_mutex);
-	__sync_fetch_and_add(&n_median_readers,1);
-	pthread_mutex_unlock(&median_mutex);
-}
-
-void cFrameBuffer::unlockMedianWriters() {
-	__sync_fetch_and_sub(&n_median_readers,1);
-}
-
-void cFrameBuffer::lockMedianReadersAndWriters() {
-	// Prevent new reader from starting
-	pthread_mutex_lock(&median_mutex);
-	// Wait for readers to finish
-	while (n_median_readers > 0)
-		usleep(10000);
+/*
+ *	Median, mean, std and absAboveThresh are published as reference counted snapshots that are never modified.
+ *	Readers take a reference (snapshot_mutex is only held for the pointer copy), recalculations build a new
+ *	array on the side and swap it in; the old one is freed when its last reader lets go.
+ *	Readers therefore never wait for a recalculation, and a recalculation never waits for readers.
+ */
+tFrameBufferSnapshot * cFrameBuffer::newSnapshot(float * data) {
+	tFrameBufferSnapshot * snapshot = (tFrameBufferSnapshot *) malloc(sizeof(tFrameBufferSnapshot));
+	snapshot->data = data;
+	snapshot->refcount = 1;
+	return snapshot;
 }
 
-void cFrameBuffer::unlockMedianReadersAndWriters() {
-	// Allows readers and writers to start
-	pthread_mutex_unlock(&median_mutex);
+tFrameBufferSnapshot * cFrameBuffer::acquireSnapshot(tFrameBufferSnapshot ** current) {
+	pthread_mutex_lock(&snapshot_mutex);
+	tFrameBufferSnapshot * snapshot = *current;
+	__sync_fetch_and_add(&snapshot->refcount,1);
+	pthread_mutex_unlock(&snapshot_mutex);
+	return snapshot;
 }
 
-//.........................................//
-// mean write / read scheduler functions
-void cFrameBuffer::lockMeanWriters() {
-	pthread_mutex_lock(&mean_mutex);
-	__sync_fetch_and_add(&n_mean_readers,1);
-	pthread_mutex_unlock(&mean_mutex);
+void cFrameBuffer::releaseSnapshot(tFrameBufferSnapshot * snapshot) {
+	if (__sync_sub_and_fetch(&snapshot->refcount,1) == 0) {
+		free(snapshot->data);
+		free(snapshot);
+	}
 }
 
-void cFrameBuffer::unlockMeanWriters() {
-	__sync_fetch_and_sub(&n_mean_readers,1);
+void cFrameBuffer::publishSnapshot(tFrameBufferSnapshot ** current, float * data) {
+	tFrameBufferSnapshot * snapshot = newSnapshot(data);
+	pthread_mutex_lock(&snapshot_mutex);
+	tFrameBufferSnapshot * old = *current;
+	*current = snapshot;
+	pthread_mutex_unlock(&snapshot_mutex);
+	releaseSnapshot(old);
 }
 
-void cFrameBuffer::lockMeanReadersAndWriters() {
-	// Prevent new reader from starting
-	pthread_mutex_lock(&mean_mutex);
-	// Wait for readers to finish
-	while (n_mean_readers > 0)
-		usleep(10000);
+void cFrameBuffer::copySnapshot(tFrameBufferSnapshot ** current, float * target) {
+	tFrameBufferSnapshot * snapshot = acquireSnapshot(current);
+	memcpy(target,snapshot->data,pix_nn*sizeof(float));
+	releaseSnapshot(snapshot);
 }
 
-void cFrameBuffer::unlockMeanReadersAndWriters() {
-	// Allows readers and writers to start
-	pthread_mutex_unlock(&mean_mutex);
-}
 //.........................................//
-// absAboveThresh write / read scheduler functions
-void cFrameBuffer::lockAbsAboveThreshWriters() {
-	pthread_mutex_lock(&absAboveThresh_mutex);
-	__sync_fetch_and_add(&n_absAboveThresh_readers,1);
-	pthread_mutex_unlock(&absAboveThresh_mutex);
-}
 
-void cFrameBuffer::unlockAbsAboveThreshWriters() {
-	__sync_fetch_and_sub(&n_absAboveThresh_readers,1);
+/*
+ *	Start of frame frameID within tile t (tile_nn consecutive pixels)
+ */
+float * cFrameBuffer::tileFrame(long t, long frameID) {
+	return frames + (t*depth + frameID)*tile_nn;
 }
 
-void cFrameBuffer::lockAbsAboveThreshReadersAndWriters() {
-	// Prevent new reader from starting
-	pthread_mutex_lock(&absAboveThresh_mutex);
-	// Wait for readers to finish
-	while (n_absAboveThresh_readers > 0)
-		usleep(10000);
+long cFrameBuffer::tileSize(long t) {
+	return std::min(tile_nn, pix_nn - t*tile_nn);
 }
 
-void cFrameBuffer::unlockAbsAboveThreshReadersAndWriters() {
-	// Allows readers and writers to start
-	pthread_mutex_unlock(&absAboveThresh_mutex);
+/*
+ *	Run kernel on every tile, spread over nThreads threads
+ *	Recalculations are infrequent so threads are simply created and joined here:
+ *	the global worker pool can't be used as the caller is usually one of its workers.
+ *	Each thread gets a scratch array of max(depth, 2*tile_nn) doubles
+ */
+typedef struct {
+	cFrameBuffer * frameBuffer;
+	void (cFrameBuffer::*kernel)(long, void *, double *);
+	void * arg;
+	long threadID;
+	long nThreads;
+} tFrameBufferThreadArg;
+
+void * cFrameBuffer::tileThread(void * threadarg) {
+	tFrameBufferThreadArg * a = (tFrameBufferThreadArg *) threadarg;
+	cFrameBuffer * fb = a->frameBuffer;
+	double * scratch = (double *) malloc(std::max(fb->depth, 2*fb->tile_nn)*sizeof(double));
+	for (long t=a->threadID; t<fb->n_tiles; t+=a->nThreads) {
+		(fb->*(a->kernel))(t, a->arg, scratch);
+	}
+	free(scratch);
+	return NULL;
+}
+
+void cFrameBuffer::forEachTile(void (cFrameBuffer::*kernel)(long, void *, double *), void * arg) {
+	long n = std::max(1L, std::min(nThreads, n_tiles));
+	tFrameBufferThreadArg * args = (tFrameBufferThreadArg *) calloc(n, sizeof(tFrameBufferThreadArg));
+	pthread_t * threads = (pthread_t *) calloc(n, sizeof(pthread_t));
+	for (long i=0; i<n; i++) {
+		args[i].frameBuffer = this;
+		args[i].kernel = kernel;
+		args[i].arg = arg;
+		args[i].threadID = i;
+		args[i].nThreads = n;
+	}
+	// Thread 0 is the caller, which also picks up the share of any thread that couldn't be started
+	bool * started = (bool *) calloc(n, sizeof(bool));
+	for (long i=1; i<n; i++) {
+		started[i] = (pthread_create(&threads[i], NULL, tileThread, (void *) &args[i]) == 0);
+	}
+	for (long i=0; i<n; i++) {
+		if (!started[i])
+			tileThread((void *) &args[i]);
+	}
+	for (long i=1; i<n; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+	}
+	free(started);
+	free(threads);
+	free(args);
 }
-//.........................................//
 
 long cFrameBuffer::writeNextFrame(float * data) {
 	long counter_last = __sync_fetch_and_add(&counter,1);
 	long frameID = counter_last % depth;
-	if (threadSafetyLevel > 0) lockFrameReadersAndWriters(frameID);
-	memcpy(frames+frameID*pix_nn,data,pix_nn*sizeof(float));
-	if (threadSafetyLevel > 0) unlockFrameReadersAndWriters(frameID);
+	if (threadSafetyLevel > 0) lockFrameForWriting(frameID);
+	if (incrementalMedian)
+		updateSortedWindows(frameID, data);
+	else {
+		for (long t=0; t<n_tiles; t++) {
+			memcpy(tileFrame(t,frameID),data+t*tile_nn,tileSize(t)*sizeof(float));
+		}
+	}
+	if (threadSafetyLevel > 0) unlockFrameForWriting(frameID);
 	filled = counter >= (depth-1);
 	return counter_last;
 }
 
 void cFrameBuffer::copyMedian(float * target) {
-	if (threadSafetyLevel > 0) lockMedianWriters();
-	memcpy(target,median,pix_nn*sizeof(float));
-	if (threadSafetyLevel > 0) unlockMedianWriters();
+	copySnapshot(&median,target);
 }
 
 /*
@@ -237,14 +250,17 @@ void cFrameBuffer::subtractMedian(float * data, uint16_t * mask, int scale,float
 	float	s2 = 0;
 	float	v1, v2;
 	float	factor = 1;
-	if (threadSafetyLevel > 0) lockMedianWriters();
+	tFrameBufferSnapshot * bgSnapshot = acquireSnapshot(&median);
+	tFrameBufferSnapshot * stdSnapshot = acquireSnapshot(&std);
+	float	* bg = bgSnapshot->data;
+	float	* sd = stdSnapshot->data;
 	/*
 	 *	Find appropriate scaling factor to match background with current image
 	 *	Use with care: this assumes background vector is orthogonal to the image vector (which is often not true)
 	 */
 	if(scale) {
 		for(long i=0; i<pix_nn; i++){
-			v1 = median[i];
+			v1 = bg[i];
 			v2 = data[i];
 			
 			// Simple inner product gives cos(theta), which is always less than zero
@@ -259,7 +275,7 @@ void cFrameBuffer::subtractMedian(float * data, uint16_t * mask, int scale,float
 	bool flag = false; 
 	for(long i=0; i<pix_nn; i++) {
 		if(minAbsMedianOverStdRatio > 0.){
-			flag = (abs(median[i]/std[i]) >= minAbsMedianOverStdRatio);
+			flag = (abs(bg[i]/sd[i]) >= minAbsMedianOverStdRatio);
 			/*if (i==555555){
 				printf("median[i]=%g, std[i]=%g, flag=%d\n",median[i],std[i],flag);
 				}*/
@@ -268,124 +284,223 @@ void cFrameBuffer::subtractMedian(float * data, uint16_t * mask, int scale,float
 			flag = true;
 		}
 		if(flag) {
-			data[i] -= (factor*median[i]);
+			data[i] -= (factor*bg[i]);
 		    mask[i] |= PIXEL_IS_PHOTON_BACKGROUND_CORRECTED;		// <--- This is misleading; it does not get unset if data reverts to detector corrected only (it's really pixel_has_been_photon_corrected_at_some_time)
 		}
 	}
-	if (threadSafetyLevel > 0) unlockMedianWriters();
+	releaseSnapshot(stdSnapshot);
+	releaseSnapshot(bgSnapshot);
 }
 
-void cFrameBuffer::updateMedian(float point) {
-	float * buffer = (float *) calloc(depth, sizeof(float));
-	if (threadSafetyLevel > 0) {
-		lockAllFramesReadersAndWriters();
-		lockMedianReadersAndWriters();
+/*
+ *	Replace the values of frame frameID by data, keeping every pixel's sorted window in order
+ *	Each pixel: find the outgoing value, slide the values between it and the insertion point of the new value by one.
+ *	Cost is proportional to the rank change, not to depth, and there is nothing left to do in updateMedian
+ *	Caller holds the lock on frameID; stripe locks keep concurrent writers of other frames off the same windows
+ */
+void cFrameBuffer::updateSortedWindows(long frameID, float * data) {
+	for (long s=0; s<n_stripes; s++) {
+		long i0 = s*stripe_nn;
+		long i1 = std::min(i0+stripe_nn, pix_nn);
+		// Always locked: unlike the ring itself, a window corrupted by a race would never recover
+		pthread_mutex_lock(&stripe_mutexes[s]);
+		for (long i=i0; i<i1; i++) {
+			float * frame = tileFrame(i/tile_nn, frameID);
+			float vOld = frame[i%tile_nn];
+			float vNew = data[i];
+			frame[i%tile_nn] = vNew;
+			// NaN has no place in a sorted window
+			if (vOld != vOld) vOld = 0;
+			if (vNew != vNew) vNew = 0;
+			if (vNew == vOld)
+				continue;
+			float * w = sorted+i*depth;
+			long p = std::lower_bound(w, w+depth, vOld) - w;
+			long q;
+			if (vNew > vOld) {
+				q = std::upper_bound(w+p+1, w+depth, vNew) - w - 1;
+				memmove(w+p, w+p+1, (q-p)*sizeof(float));
+			} else {
+				q = std::upper_bound(w, w+p, vNew) - w;
+				memmove(w+q+1, w+q, (p-q)*sizeof(float));
+			}
+			w[q] = vNew;
+		}
+		pthread_mutex_unlock(&stripe_mutexes[s]);
 	}
-	// Loop over all pixels 
-	for(long i=0; i<pix_nn; i++) {
+}
+
+/*
+ *	Per-tile kernels for the recalculations below
+ *	arg points to a tFrameBufferStatArg, results go to out (indexed by pixel)
+ */
+typedef struct {
+	float * out;
+	long k;
+	float threshold;
+} tFrameBufferStatArg;
+
+void cFrameBuffer::medianTile(long t, void * arg, double * scratch) {
+	tFrameBufferStatArg * a = (tFrameBufferStatArg *) arg;
+	float * buffer = (float *) scratch;
+	float * tile = tileFrame(t, 0);
+	long n = tileSize(t);
+	for (long ii=0; ii<n; ii++) {
 		// Create a local array for sorting
-		for(long j=0; j< depth; j++) {
-			buffer[j] = frames[j*pix_nn+i];
+		for (long j=0; j<depth; j++) {
+			buffer[j] = tile[j*tile_nn+ii];
 		}
 		// Find median value of the temporary array
-		median[i] = (float) kth_smallest(buffer, depth, point);
+		a->out[t*tile_nn+ii] = (float) kth_smallest(buffer, depth, a->k);
 	}
-	if (threadSafetyLevel > 0) {
-		unlockAllFramesReadersAndWriters();
-		unlockMedianReadersAndWriters();
+}
+
+void cFrameBuffer::meanTile(long t, void * arg, double * scratch) {
+	tFrameBufferStatArg * a = (tFrameBufferStatArg *) arg;
+	double * sum = scratch;
+	float * tile = tileFrame(t, 0);
+	long n = tileSize(t);
+	memset(sum, 0, n*sizeof(double));
+	for (long j=0; j<depth; j++) {
+		for (long ii=0; ii<n; ii++) {
+			sum[ii] += tile[j*tile_nn+ii];
+		}
+	}
+	for (long ii=0; ii<n; ii++) {
+		a->out[t*tile_nn+ii] = sum[ii]/depth;
 	}
-	free (buffer);	
-	median_updated = true;
 }
 
-void cFrameBuffer::copyAbsAboveThresh(float * target) {
-	if (threadSafetyLevel > 0) lockAbsAboveThreshWriters();
-	memcpy(target,absAboveThresh,pix_nn*sizeof(float));
-	if (threadSafetyLevel > 0) unlockAbsAboveThreshWriters();
+/*
+ *	The tile is in cache anyway, so do it in two passes (mean first, then squared deviations from it):
+ *	sumsq/depth - mean^2 loses everything to cancellation for pixels with a large offset and little noise
+ */
+void cFrameBuffer::stdTile(long t, void * arg, double * scratch) {
+	tFrameBufferStatArg * a = (tFrameBufferStatArg *) arg;
+	double * mean = scratch;
+	double * sumsq = scratch + tile_nn;
+	float * tile = tileFrame(t, 0);
+	long n = tileSize(t);
+	double v;
+	memset(mean, 0, n*sizeof(double));
+	memset(sumsq, 0, n*sizeof(double));
+	for (long j=0; j<depth; j++) {
+		for (long ii=0; ii<n; ii++) {
+			mean[ii] += tile[j*tile_nn+ii];
+		}
+	}
+	for (long ii=0; ii<n; ii++) {
+		mean[ii] /= depth;
+	}
+	for (long j=0; j<depth; j++) {
+		for (long ii=0; ii<n; ii++) {
+			v = tile[j*tile_nn+ii] - mean[ii];
+			sumsq[ii] += v*v;
+		}
+	}
+	for (long ii=0; ii<n; ii++) {
+		a->out[t*tile_nn+ii] = sqrt(sumsq[ii]/depth);
+	}
 }
 
-void cFrameBuffer::updateAbsAboveThresh(float threshold) {
-	if (threadSafetyLevel > 0) lockAllFramesReadersAndWriters();
-	long * n = (long *) calloc(pix_nn,sizeof(long));
+void cFrameBuffer::absAboveThreshTile(long t, void * arg, double * scratch) {
+	tFrameBufferStatArg * a = (tFrameBufferStatArg *) arg;
+	double * n_above = scratch;
+	float * tile = tileFrame(t, 0);
+	long n = tileSize(t);
+	memset(n_above, 0, n*sizeof(double));
 	for (long j=0; j<depth; j++) {
-		for (long i=0; i<pix_nn; i++) {
-			n[i] += (fabs(frames[j*pix_nn+i])>threshold)?(1):(0);
+		for (long ii=0; ii<n; ii++) {
+			n_above[ii] += (fabs(tile[j*tile_nn+ii])>a->threshold)?(1):(0);
 		}
 	}
-	if (threadSafetyLevel > 0) unlockAllFramesReadersAndWriters();
-	if (threadSafetyLevel > 0) lockAbsAboveThreshReadersAndWriters();
-	for (long i=0; i<pix_nn; i++) {
-		absAboveThresh[i] = ((float) n[i])/((float) depth);
+	for (long ii=0; ii<n; ii++) {
+		a->out[t*tile_nn+ii] = ((float) n_above[ii])/((float) depth);
+	}
+}
+
+/*
+ *	Recalculate the median (or any other quantile: point = 0.5 is the median, 0 the minimum, 1 the maximum)
+ *	The new values are calculated on the side and published as a new snapshot
+ */
+void cFrameBuffer::updateMedian(float point) {
+	long k = lrint(point*(depth-1));
+	if (k < 0) k = 0;
+	if (k > depth-1) k = depth-1;
+
+	// Sorted windows are kept up to date by writeNextFrame: just read off the k-th element
+	if (incrementalMedian) {
+		float * out = (float *) malloc(pix_nn*sizeof(float));
+		for (long s=0; s<n_stripes; s++) {
+			long i1 = std::min((s+1)*stripe_nn, pix_nn);
+			pthread_mutex_lock(&stripe_mutexes[s]);
+			for (long i=s*stripe_nn; i<i1; i++) {
+				out[i] = sorted[i*depth+k];
+			}
+			pthread_mutex_unlock(&stripe_mutexes[s]);
+		}
+		publishSnapshot(&median,out);
+		median_updated = true;
+		return;
 	}
-	if (threadSafetyLevel > 0) unlockAbsAboveThreshReadersAndWriters();
+
+	tFrameBufferStatArg arg;
+	arg.out = (float *) malloc(pix_nn*sizeof(float));
+	arg.k = k;
+	if (threadSafetyLevel > 0) lockAllFramesForReading();
+	forEachTile(&cFrameBuffer::medianTile, &arg);
+	if (threadSafetyLevel > 0) unlockAllFramesForReading();
+
+	publishSnapshot(&median,arg.out);
+	median_updated = true;
+}
+
+void cFrameBuffer::copyAbsAboveThresh(float * target) {
+	copySnapshot(&absAboveThresh,target);
+}
+
+void cFrameBuffer::updateAbsAboveThresh(float threshold) {
+	tFrameBufferStatArg arg;
+	arg.out = (float *) malloc(pix_nn*sizeof(float));
+	arg.threshold = threshold;
+	if (threadSafetyLevel > 0) lockAllFramesForReading();
+	forEachTile(&cFrameBuffer::absAboveThreshTile, &arg);
+	if (threadSafetyLevel > 0) unlockAllFramesForReading();
+
+	publishSnapshot(&absAboveThresh,arg.out);
 	absAboveThresh_updated = true;
 }
 
 void cFrameBuffer::copyStd(float * target) {
-	lockStdWriters();
-	memcpy(target,std,pix_nn*sizeof(float));
-	unlockStdWriters();
+	copySnapshot(&std,target);
 }
 
 
 void cFrameBuffer::updateStd() {
-	double v;
-	double * sum = (double *) calloc(pix_nn,sizeof(double));
-	double * sumsq = (double *) calloc(pix_nn,sizeof(double));
-	if (threadSafetyLevel > 0) {
-		lockAllFramesReadersAndWriters();
-		lockStdReadersAndWriters();
-	}
-	// Loop over all pixels and frames and sum up
-	for(long j=0; j< depth; j++) {
-		for(long i=0; i<pix_nn; i++) {
-			v = frames[j*pix_nn+i];
-			sum[i] += v;
-			sumsq[i] += v*v;
-		}
-	}
-	// Calculate standard deviation for all pixels
-	for(long i=0; i<pix_nn; i++) {
-		std[i] = sqrt(sumsq[i]/depth - (sum[i]/depth)*(sum[i]/depth));
-	}
-	if (threadSafetyLevel > 0) {
-		unlockAllFramesReadersAndWriters();
-		unlockStdReadersAndWriters();
-	}
+	tFrameBufferStatArg arg;
+	arg.out = (float *) malloc(pix_nn*sizeof(float));
+	if (threadSafetyLevel > 0) lockAllFramesForReading();
+	forEachTile(&cFrameBuffer::stdTile, &arg);
+	if (threadSafetyLevel > 0) unlockAllFramesForReading();
+
+	publishSnapshot(&std,arg.out);
 	std_updated = true;
-	free(sum);
-	free(sumsq);
 }
 
 void cFrameBuffer::copyMean(float * target) {
-	lockMeanWriters();
-	memcpy(target,mean,pix_nn*sizeof(float));
-	unlockMeanWriters();
+	copySnapshot(&mean,target);
 }
 
 
 void cFrameBuffer::updateMean() {
-	double * sum = (double *) calloc(pix_nn,sizeof(double));
-	if (threadSafetyLevel > 0) {
-		lockAllFramesReadersAndWriters();
-		lockMeanReadersAndWriters();
-	}
-	// Loop over all pixels and frames and sum up
-	for(long j=0; j< depth; j++) {
-		for(long i=0; i<pix_nn; i++) {
-			sum[i] += frames[j*pix_nn+i];
-		}
-	}
-	// Calculate mean value for every pixel
-	for(long i=0; i<pix_nn; i++) {
-		mean[i] = sum[i]/depth;
-	}
-	if (threadSafetyLevel > 0) {
-		unlockAllFramesReadersAndWriters();
-		unlockMeanReadersAndWriters();
-	}
+	tFrameBufferStatArg arg;
+	arg.out = (float *) malloc(pix_nn*sizeof(float));
+	if (threadSafetyLevel > 0) lockAllFramesForReading();
+	forEachTile(&cFrameBuffer::meanTile, &arg);
+	if (threadSafetyLevel > 0) unlockAllFramesForReading();
+
+	publishSnapshot(&mean,arg.out);
 	mean_updated = true;
-	free(sum);
 }
 
 void cFrameBuffer::subtractMean(float * data, uint16_t * mask, int scale,float minAbsMeanOverStdRatio) {
@@ -394,14 +509,17 @@ void cFrameBuffer::subtractMean(float * data, uint16_t * mask, int scale,float m
 	float	s2 = 0;
 	float	v1, v2;
 	float	factor = 1;
-	if (threadSafetyLevel > 0) lockMeanWriters();
+	tFrameBufferSnapshot * bgSnapshot = acquireSnapshot(&mean);
+	tFrameBufferSnapshot * stdSnapshot = acquireSnapshot(&std);
+	float	* bg = bgSnapshot->data;
+	float	* sd = stdSnapshot->data;
 	/*
 	 *	Find appropriate scaling factor to match background with current image
 	 *	Use with care: this assumes background vector is orthogonal to the image vector (which is often not true)
 	 */
 	if(scale) {
 		for(long i=0; i<pix_nn; i++){
-			v1 = mean[i];
+			v1 = bg[i];
 			v2 = data[i];
 			
 			// Simple inner product gives cos(theta), which is always less than zero
@@ -416,7 +534,7 @@ void cFrameBuffer::subtractMean(float * data, uint16_t * mask, int scale,float m
 	bool flag = false; 
 	for(long i=0; i<pix_nn; i++) {
 		if(minAbsMeanOverStdRatio > 0.){
-			flag = (abs(mean[i]/std[i]) >= minAbsMeanOverStdRatio);
+			flag = (abs(bg[i]/sd[i]) >= minAbsMeanOverStdRatio);
 			/*if (i==555555){
 				printf("mean[i]=%g, std[i]=%g, flag=%d\n",median[i],std[i],flag);
 				}*/
@@ -424,9 +542,10 @@ void cFrameBuffer::subtractMean(float * data, uint16_t * mask, int scale,float m
 			flag = true;
 		}
 		if(flag) {
-			data[i] -= (factor*mean[i]);
+			data[i] -= (factor*bg[i]);
 			mask[i] |= PIXEL_IS_PHOTON_BACKGROUND_CORRECTED;		//<--- This is misleading; it does not get unset if data reverts to detector corrected only (it's really pixel_has_been_photon_corrected_at_some_time)
 		}
 	}
-	if (threadSafetyLevel > 0) unlockMeanWriters();
+	releaseSnapshot(stdSnapshot);
+	releaseSnapshot(bgSnapshot);
 }
@@ -186,6 +186,7 @@ cGlobal::cGlobal(void)
     powderthresh = 0.0;
     powderSumHits = 1;
     powderSumBlanks = 1;
+    nPowderShards = 4;
 
     // Radial average stacks
     saveRadialStacks = 0;
@@ -212,6 +213,17 @@ cGlobal::cGlobal(void)
     // Flush after every image by default
     cxiFlushPeriod = 1;
 
+    // Write CXI data from a separate thread, in batches of consecutive frames
+    // (needs a thread safe HDF5 library, see validateConfiguration())
+#ifdef H5_HAVE_THREADSAFE
+    cxiAsyncWriter = 1;
+#else
+    cxiAsyncWriter = 0;
+#endif
+    cxiWriterQueueDepth = 0;
+    cxiWriteBatch = 16;
+    cxiDirectChunkWrite = 1;
+
     // Save data in modular stack (see CXI version 1.4)
     saveModular = 0;
 
@@ -245,8 +257,12 @@ cGlobal::cGlobal(void)
     // Thread safety level
     threadSafetyLevel = 1;
 
+    // Detector corrections in one pass where the configuration allows it
+    useFusedDetectorCorrection = 1;
+
     // Default to only a few threads
     nThreads = 16;
+    nPanelThreads = 0;
     // deprecated?
     useHelperThreads = 0;
     // deprecated?
@@ -371,6 +387,16 @@ void cGlobal::setup()
             detector[detIndex].readPeakmask(self, peaksearchFile);
     }
 
+    // Single pass detector correction only works if no detector needs a correction in between the usual steps
+    if (useFusedDetectorCorrection) {
+        for (long detIndex = 0; detIndex < nDetectors; detIndex++) {
+            if (!detector[detIndex].canFuseDetectorCorrection()) {
+                printf("Detector %li: Configuration needs corrections between darkcal and gain, using separate correction passes\n", detIndex);
+                useFusedDetectorCorrection = 0;
+            }
+        }
+    }
+
     /*
      *  HITFINDING
      */
@@ -438,10 +464,28 @@ void cGlobal::setup()
 
     pthread_mutex_init(&gmd_mutex, NULL);
     pthread_mutex_init(&swmr_mutex, NULL);
+    pthread_mutex_init(&eventPool_mutex, NULL);
 
     threadID = (pthread_t*) calloc(nThreads, sizeof(pthread_t));
 
-    sem_init(&availableCheetahThreads, 0, nThreads);
+    // Long-lived worker threads, with up to nThreads further events queued before the data source blocks
+    workerPool.start(nThreads, nThreads);
+
+    // Intra-frame parallelism for the peak finders; every worker may have a helper queued for each panel thread
+    if (nPanelThreads > 0)
+        panelPool.start(nPanelThreads, nPanelThreads * nThreads);
+
+    // No point in more powder shards than workers
+    powderShards.start(std::max(1L, std::min(nPowderShards, nThreads)));
+
+    // Single CXI writer thread; workers only block on it when its queue is full
+    if (saveCXI && cxiAsyncWriter) {
+        if (cxiWriterQueueDepth <= 0)
+            cxiWriterQueueDepth = 2 * nThreads;
+        if (cxiWriteBatch < 1)
+            cxiWriteBatch = 1;
+        cxiWriter.start(1, cxiWriterQueueDepth);
+    }
 
     /*
      *  INITIAL CALIBRATION
@@ -502,6 +546,7 @@ void cGlobal::setup()
             detector[i].saveVersion = cDataVersion::DATA_VERSION_NONE;
             detector[i].powderFormat = cDataVersion::DATA_FORMAT_NON_ASSEMBLED;
             detector[i].powderVersion = cDataVersion::DATA_VERSION_RAW;
+            detector[i].allocatePowderMemory();
         }
     }
     // Detector gain calibration
@@ -534,6 +579,7 @@ void cGlobal::setup()
             detector[i].saveVersion = cDataVersion::DATA_VERSION_NONE;
             detector[i].powderFormat = cDataVersion::DATA_FORMAT_NON_ASSEMBLED;
             detector[i].powderVersion = cDataVersion::DATA_VERSION_RAW;
+            detector[i].allocatePowderMemory();
         }
     }
 
@@ -704,24 +750,11 @@ void cGlobal::waitForThreadsToFinish(void)
 
 void cGlobal::waitForThreadsToFinish(float waitTime)
 {
-    time_t tstart, tnow;
-    double dtime;
-
-    time(&tstart);
-
-    while (nActiveCheetahThreads > 0) {
-        printf("Waiting for %li worker threads to terminate\n", nActiveCheetahThreads);
-        usleep(100000);
-        time(&tnow);
-        dtime = difftime(tnow, tstart);
-        if (dtime > waitTime) {
-            printf("\t%li threads still active after waiting %f seconds\n", nActiveCheetahThreads, dtime);
-            printf("\tGiving up and exiting anyway\n");
-            unlockMutexes();
-            break;
-        }
+    if (workerPool.drain(waitTime) != 0) {
+        printf("\t%li threads still active after waiting %f seconds\n", workerPool.nPending(), waitTime);
+        printf("\tGiving up and exiting anyway\n");
+        unlockMutexes();
     }
-
 }
 
 /*
@@ -1001,9 +1034,15 @@ int cGlobal::parseConfigTag(char *tag, char *value)
     else if (!strcmp(tag, "threadsafetylevel")) {
         threadSafetyLevel = atoi(value);
     }
+    else if (!strcmp(tag, "usefuseddetectorcorrection")) {
+        useFusedDetectorCorrection = atoi(value);
+    }
     else if (!strcmp(tag, "nthreads")) {
         nThreads = atoi(value);
     }
+    else if (!strcmp(tag, "npanelthreads")) {
+        nPanelThreads = atoi(value);
+    }
     else if (!strcmp(tag, "threadtimeoutinseconds")) {
         threadTimeoutInSeconds = atof(value);
     }
@@ -1216,6 +1255,9 @@ int cGlobal::parseConfigTag(char *tag, char *value)
     else if (!strcmp(tag, "powdersumblanks")) {
         powderSumBlanks = atoi(value);
     }
+    else if (!strcmp(tag, "npowdershards")) {
+        nPowderShards = atoi(value);
+    }
     else if (!strcmp(tag, "powdersumwithbackgroundsubtraction")) {
         printf("The keyword powdersumwithbackgroundsubtraction is deprecated.\n"
                 "Please use respective keywords in the detector section (e.g. savepowderdatadetectorandphotoncorrected=1).\n"
@@ -1329,6 +1371,14 @@ int cGlobal::parseConfigTag(char *tag, char *value)
         cxiFlushPeriod = atoi(value);
     } else if (!strcmp(tag, "cxiswmr")) {
         cxiSWMR = atoi(value);
+    } else if (!strcmp(tag, "cxiasyncwriter")) {
+        cxiAsyncWriter = atoi(value);
+    } else if (!strcmp(tag, "cxiwriterqueuedepth")) {
+        cxiWriterQueueDepth = atoi(value);
+    } else if (!strcmp(tag, "cxiwritebatch")) {
+        cxiWriteBatch = atoi(value);
+    } else if (!strcmp(tag, "cxidirectchunkwrite")) {
+        cxiDirectChunkWrite = atoi(value);
     } else if (!strcmp(tag, "ignoreconversionoverflow")) {
         ignoreConversionOverflow = atoi(value);
     } else if (!strcmp(tag, "ignoreconversiontruncate")) {
@@ -1377,6 +1427,12 @@ int cGlobal::validateConfiguration(void)
                 "your HDF5 installation (./configure --enable-threadsafe --with-pthread; make install).", nThreads);
         fail = 1;
     }
+    if (saveCXI && cxiAsyncWriter) {
+        ERROR("Configuration with cxiAsyncWriter=%d is incompatible with your HDF5 installation (no thread safety). "
+                "Either write CXI files from the worker threads (cxiAsyncWriter=0) or add thread safety by reconfiguring "
+                "your HDF5 installation (./configure --enable-threadsafe --with-pthread; make install).", cxiAsyncWriter);
+        fail = 1;
+    }
 #endif
 
     /* Do we know this data format */
@@ -1443,6 +1499,7 @@ void cGlobal::writeConfigurationLog(void)
     fprintf(fp, "powderThresh=%f\n", powderthresh);
     fprintf(fp, "powderSumHits=%d\n", powderSumHits);
     fprintf(fp, "powderSumBlanks=%d\n", powderSumBlanks);
+    fprintf(fp, "nPowderShards=%ld\n", nPowderShards);
     fprintf(fp, "saveInterval=%d\n", saveInterval);
     fprintf(fp, "saveRadialStacks=%d\n", saveRadialStacks);
     fprintf(fp, "radialStackSize=%ld\n", radialStackSize);
@@ -1452,11 +1509,17 @@ void cGlobal::writeConfigurationLog(void)
     fprintf(fp, "saveModular=%d\n", saveModular);
     fprintf(fp, "assembleInterpolation=%d\n", assembleInterpolation);
     fprintf(fp, "saveCXI=%d\n", saveCXI);
+    fprintf(fp, "cxiAsyncWriter=%d\n", cxiAsyncWriter);
+    fprintf(fp, "cxiWriterQueueDepth=%ld\n", cxiWriterQueueDepth);
+    fprintf(fp, "cxiWriteBatch=%ld\n", cxiWriteBatch);
+    fprintf(fp, "cxiDirectChunkWrite=%d\n", cxiDirectChunkWrite);
     fprintf(fp, "hdf5dump=%d\n", hdf5dump);
     fprintf(fp, "pythonfile=%s\n", pythonFile);
     fprintf(fp, "debugLevel=%d\n", debugLevel);
     fprintf(fp, "threadSafetyLevel=%d\n", threadSafetyLevel);
+    fprintf(fp, "useFusedDetectorCorrection=%d\n", useFusedDetectorCorrection);
     fprintf(fp, "nThreads=%ld\n", nThreads);
+    fprintf(fp, "nPanelThreads=%ld\n", nPanelThreads);
     fprintf(fp, "threadTimeoutInSeconds=%d\n", threadTimeoutInSeconds);
     fprintf(fp, "useHelperThreads=%d\n", useHelperThreads);
     //fprintf(fp, "threadPurge=%ld\n",threadPurge);
@@ -1521,6 +1584,7 @@ void cGlobal::writeConfigurationLog(void)
         fprintf(fp, "bgMemory=%li\n", detector[i].bgMemory);
         fprintf(fp, "bgRecalc=%ld\n", detector[i].bgRecalc);
         fprintf(fp, "bgMedian=%f\n", detector[i].bgMedian);
+        fprintf(fp, "bgIncrementalMedian=%d\n", detector[i].bgIncrementalMedian);
         fprintf(fp, "bgIncludeHits=%d\n", detector[i].bgIncludeHits);
         fprintf(fp, "bgNoBeamReset=%d\n", detector[i].bgNoBeamReset);
         fprintf(fp, "bgFiducialGlitchReset=%d\n", detector[i].bgFiducialGlitchReset);
@@ -1549,6 +1613,7 @@ void cGlobal::writeConfigurationLog(void)
         fprintf(fp, "histogram_ss_min=%ld\n", detector[i].histogram_ss_min);
         fprintf(fp, "histogram_ss_max=%ld\n", detector[i].histogram_ss_max);
         fprintf(fp, "histogramMaxMemoryGb=%f\n", detector[i].histogramMaxMemoryGb);
+        fprintf(fp, "histogramSparse=%d\n", detector[i].histogramSparse);
         fprintf(fp, "downsampling=%ld\n", detector[i].downsampling);
         fprintf(fp, "saveDetectorRaw=%d\n", detector[i].saveDetectorRaw);
         fprintf(fp, "saveDetectorCorrected=%d\n", detector[i].saveDetectorCorrected);
@@ -1877,6 +1942,11 @@ template< typename T > void cGlobal::splitList(char * values, std::vector< T > &
 
 void cGlobal::freeMemory()
 {
+    workerPool.stop();
+    panelPool.stop();
+    cxiWriter.stop();
+    powderShards.stop();
+    freeEventPool(this);
     for (long i = 0; i < nDetectors; i++) {
         detector[i].freeMemory();
     }
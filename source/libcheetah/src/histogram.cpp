@@ -35,10 +35,8 @@ void addToHistogram(cEventData *eventData, cGlobal *global, int hit) {
 			long		hist_fs_min = global->detector[detIndex].histogram_fs_min;
 			long		hist_fs_max = global->detector[detIndex].histogram_fs_max;
 			long		hist_ss_min = global->detector[detIndex].histogram_ss_min;
-			long		hist_ss_max = global->detector[detIndex].histogram_ss_max;
 			long		hist_nfs = global->detector[detIndex].histogram_nfs;
-			long		hist_nn = global->detector[detIndex].histogram_nn;
-			uint16_t	*histData = global->detector[detIndex].histogramData;
+			cPixelHistogram	*histData = global->detector[detIndex].histogramData;
 			int         dataVersion = global->detector[detIndex].histogramDataVersion;
 			float       *frameData;
 			
@@ -52,49 +50,44 @@ void addToHistogram(cEventData *eventData, cGlobal *global, int hit) {
 				frameData = eventData->detector[detIndex].data_detPhotCorr;				
 			}
 
-			// Figure out which bin should be filled
-			// (done outside of mutex lock)
-			long	bin;
-			float	binf;
-			long	i_hist, i_buffer;
-			float	value;
-			
-			long	*buffer;
-			buffer = (long *) calloc(hist_nn, sizeof(long));
-	
 			//printf("histMin=%li, histBinSize=%f, histNbins=%li\n",histMin,histBinSize,histNbins);
 
-			for(long ss=hist_ss_min; ss<hist_ss_max; ss++) {
-				for(long fs=hist_fs_min; fs<hist_fs_max; fs++) {
-			
-					i_hist = fs + ss*pix_nx;
-					i_buffer = (fs-hist_fs_min) + (ss-hist_ss_min)*hist_nfs;
-			
-					value = frameData[i_hist];
-					binf = (value-histMin)/histBinSize;
-					bin = (long) lrint(binf);
-			
+			// Work through the tiles starting at a different one in each thread, so workers rarely queue for the same lock
+			long	nTiles = histData->nTiles();
+			long	startTile = (eventData->threadNum % global->nThreads) * nTiles / global->nThreads;
+			uint16_t	buffer[PIXELHISTOGRAM_TILE_NN];
+
+			histData->beginFrame();
+			for(long t=0; t<nTiles; t++) {
+				long	tile = (startTile + t) % nTiles;
+				long	first = histData->tileFirst(tile);
+				long	n = histData->tileSize(tile);
+
+				// Figure out which bin should be filled (done outside of the tile lock)
+				long	ss = hist_ss_min + first/hist_nfs;
+				long	fs = hist_fs_min + first%hist_nfs;
+				for(long i=0; i<n; i++) {
+					float	value = frameData[fs + ss*pix_nx];
+					float	binf = (value-histMin)/histBinSize;
+					long	bin = (long) lrint(binf);
+
 					if(bin < 0) bin = 0;
 					if(bin >= histNbins) bin=histNbins-1;
-			
-					buffer[i_buffer] = bin;
+					buffer[i] = bin;
+
+					if(++fs == hist_fs_max) {
+						fs = hist_fs_min;
+						ss++;
+					}
 				}
+
+				histData->addTile(tile, buffer);
 			}
-	
-	
-			// Update histogram
-			// This could be a little slow due to sparse memory access conflicting with predictive memory caching
+			histData->endFrame();
+
 			pthread_mutex_lock(&global->detector[detIndex].histogram_mutex);
-			uint64_t	cell;
-			for(long i=0; i<hist_nn; i++) {
-				cell = i*histNbins;
-				histData[cell+buffer[i]] += 1;
-			}
 			global->detector[detIndex].histogram_count += 1;
 			pthread_mutex_unlock(&global->detector[detIndex].histogram_mutex);
-			
-			// Free temporary memory
-			free(buffer);
 		}
 	}
 }
@@ -133,8 +126,7 @@ void saveHistogram(cGlobal *global, int detIndex) {
 	long		hist_nfs = global->detector[detIndex].histogram_nfs;
 	long		hist_nss = global->detector[detIndex].histogram_nss;
 	long		hist_nn = global->detector[detIndex].histogram_nn;
-	uint64_t	hist_nnn = global->detector[detIndex].histogram_nnn;
-	uint16_t	*histData = global->detector[detIndex].histogramData;
+	cPixelHistogram	*histData = global->detector[detIndex].histogramData;
 	float		*darkcal = global->detector[detIndex].darkcal;
 	
 	long		hist_count;
@@ -143,17 +135,10 @@ void saveHistogram(cGlobal *global, int detIndex) {
 
     
 	/*
-     *  Copy histogram into a buffer so that the rest of the code can keep crunching in the meantime
-     *  Keep this bit as short as possible because it locks up the rest of the code.
+     *  The histogram is copied out one detector row at a time while it is written,
+     *  so only the row being copied is locked and no full size copy is ever made
 	 */
-	
-    // Create and allocate the buffer outside of mutex lock (memset forces allocation)
-    uint16_t *histogramBuffer = (uint16_t*) calloc(hist_nnn, sizeof(uint16_t));
-    memset(histogramBuffer, 0, hist_nnn*sizeof(uint16_t));
-    
-    // Copy histogram data inside mutex lock
 	pthread_mutex_lock(&global->detector[detIndex].histogram_mutex);
-	memcpy(histogramBuffer, histData, hist_nnn*sizeof(uint16_t));
 	hist_count = global->detector[detIndex].histogram_count;
     pthread_mutex_unlock(&global->detector[detIndex].histogram_mutex);
     
@@ -217,10 +202,8 @@ void saveHistogram(cGlobal *global, int detIndex) {
 	}
 
 	
-	dh = H5Dcreate(gh, "histogram", H5T_NATIVE_UINT16, sh, H5P_DEFAULT, h5compression, H5P_DEFAULT);
+	dh = H5Dcreate(gh, "histogram", H5T_NATIVE_UINT32, sh, H5P_DEFAULT, h5compression, H5P_DEFAULT);
 	if (dh < 0) ERROR("Could not create dataset.\n");
-	H5Dwrite(dh, H5T_NATIVE_UINT16, H5S_ALL, H5S_ALL, H5P_DEFAULT, histogramBuffer);
-	H5Dclose(dh);
     
     // Create link from /data/histogram to /data/data (the default data locations)
     H5Lcreate_soft( "/data/histogram", fh, "/data/data",0,0);
@@ -245,10 +228,21 @@ void saveHistogram(cGlobal *global, int detIndex) {
 	float	*count_arr = (float*) calloc(hist_nn, sizeof(float));
 	float	*hist = (float*) calloc(histNbins, sizeof(float));
 	uint64_t	offset;
+	uint32_t	*histogramBuffer = (uint32_t*) calloc((uint64_t) hist_nfs*histNbins, sizeof(uint32_t));
+	hsize_t		rowOffset[3] = {0, 0, 0};
+	hid_t		rowSpace = H5Screate_simple(3, chunk, NULL);
 	
 	
 	for(long i=0; i<hist_nn; i++) {
-		offset = i*histNbins;
+		offset = (i%hist_nfs)*histNbins;
+
+		// Next detector row of the histogram
+		if(offset == 0) {
+			histData->copy(i, hist_nfs, histogramBuffer);
+			rowOffset[0] = i/hist_nfs;
+			H5Sselect_hyperslab(sh, H5S_SELECT_SET, rowOffset, NULL, chunk, NULL);
+			H5Dwrite(dh, H5T_NATIVE_UINT32, rowSpace, sh, H5P_DEFAULT, histogramBuffer);
+		}
 
 		// Extract a temporary copy of the histogram for this pixel
 		count = 0;
@@ -311,6 +305,9 @@ void saveHistogram(cGlobal *global, int detIndex) {
 		kld_arr[i] = kld;
 		count_arr[i] = n;
 	}
+	H5Sclose(rowSpace);
+	H5Dclose(dh);
+	H5Sclose(sh);
 	
     
     
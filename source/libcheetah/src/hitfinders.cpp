@@ -252,7 +252,10 @@ long hitfinderFastScan(cEventData *eventData, cGlobal *global)
     for (long i = 0; i < pix_nn; i++)
         mask[i] = isNoneOfBitOptionsSet(eventData->detector[detIndex].pixelmask[i], combined_pixel_options);
 
-    subtractLocalBackground(data, radius, asic_nx, asic_ny, nasics_x, 2);
+    // Panels of this frame processed concurrently (background and peakfinder3 and 8)
+    cWorkerPool *panelPool = (global->nPanelThreads > 0) ? &global->panelPool : NULL;
+
+    subtractLocalBackground(data, radius, asic_nx, asic_ny, nasics_x, 2, panelPool);
 
     /*
      *	Call the appropriate peak finding algorithm
@@ -262,7 +265,7 @@ long hitfinderFastScan(cEventData *eventData, cGlobal *global)
 
         case 3: 	// Count number of Bragg peaks
             nPeaks = peakfinder3(peaklist, data, mask, asic_nx, asic_ny, nasics_x, 2, hitfinderADCthresh, hitfinderMinSNR, hitfinderMinPixCount,
-                    hitfinderMaxPixCount, hitfinderLocalBGRadius);
+                    hitfinderMaxPixCount, hitfinderLocalBGRadius, panelPool);
             break;
 
         case 6: 	// Count number of Bragg peaks
@@ -272,7 +275,7 @@ long hitfinderFastScan(cEventData *eventData, cGlobal *global)
 
         case 8: 	// Count number of Bragg peaks
             nPeaks = peakfinder8(peaklist, data, mask, pix_r, asic_nx, asic_ny, nasics_x, 2, hitfinderADCthresh, hitfinderMinSNR, hitfinderMinPixCount,
-                    hitfinderMaxPixCount, hitfinderLocalBGRadius);
+                    hitfinderMaxPixCount, hitfinderLocalBGRadius, panelPool);
             break;
 
         default:
@@ -294,7 +297,7 @@ long hitfinderFastScan(cEventData *eventData, cGlobal *global)
 
         // Do the rest of the local background subtraction
         long offset = (2 * asic_ny) * pix_nx;
-        subtractLocalBackground(data + offset, radius, asic_nx, asic_ny, nasics_x, 6);
+        subtractLocalBackground(data + offset, radius, asic_nx, asic_ny, nasics_x, 6, panelPool);
     }
 
     free(mask);
@@ -153,10 +153,7 @@ int cheetahInit(cGlobal *global) {
  */
 void cheetahNewRun(cGlobal *global) {
 	// Wait for all workers to finish
-	while(global->nActiveCheetahThreads > 0) {
-		printf("Waiting for %li worker threads to terminate\n", global->nActiveCheetahThreads);
-		usleep(500000);
-	}
+	global->workerPool.drain(0);
     
 	// Reset the powder log files
     pthread_mutex_lock(&global->powderfp_mutex);
@@ -393,61 +390,25 @@ void cheetahProcessEvent(cGlobal *global, cEventData *eventData){
     }
   	
 	/*
-	 *	Spawn worker in multithreaded mode 
-	 *	Threads are created detached so we don't have to wait for anything to happen before returning
-	 *		(each thread is responsible for cleaning up its own eventData structure when done)
+	 *	Queue worker in multithreaded mode
+	 *	Events are picked up by one of the nThreads long-lived threads in global->workerPool
+	 *		(the worker is responsible for cleaning up its own eventData structure when done)
 	 */
     if(eventData->useThreads == 1) {
 		pthread_mutex_unlock(&global->process_mutex);
-        pthread_t		thread;
-        pthread_attr_t	threadAttribute;
-        int				returnStatus;
-        
-        /*
-         *  Wait until we have a spare thread in the thread pool
-         *  If nothing happens for some time, assume we have some sort of thread lockup and keep going anyway
-         */
-		struct timespec ts;
-		clock_gettime(CLOCK_REALTIME, &ts);
-		ts.tv_sec += global->threadTimeoutInSeconds;
-		int sem_ret = sem_timedwait(&global->availableCheetahThreads, &ts);
-		if(sem_ret == ETIMEDOUT){
-			printf("\tApparent thread lock - no free thread for %d seconds.\n", global->threadTimeoutInSeconds);
-			printf("\tGiving up and resetting the thread counter\n");
-			global->unlockMutexes();
-			global->nActiveCheetahThreads = 0;
-			int semValue = 0;
-			while(semValue < global->nThreads){
-				sem_post(&global->availableCheetahThreads);
-				sem_getvalue(&global->availableCheetahThreads, &semValue);
-			}
-				
-		}
 
-        
-        
-        // Set detached state
-        pthread_attr_init(&threadAttribute);
-        pthread_attr_setdetachstate(&threadAttribute, PTHREAD_CREATE_DETACHED);
-
-        // Create a new worker thread for this data frame
-		// Lock acquired before creation to avoid race condition where nActiveThreads decremented before incremented
+        // Count the frame as active before it is queued, so the worker can never decrement the counter before it is incremented
 		pthread_mutex_lock(&global->nActiveThreads_mutex);
         eventData->threadNum = global->threadCounter;
-        returnStatus = pthread_create(&thread, &threadAttribute, worker, (void *)eventData);
-
-		if (returnStatus == 0) { // creation successful
-			// Increment threadpool counter
-			global->nActiveCheetahThreads += 1;
-			global->threadCounter += 1;
-		}
-		else{
-			sem_post(&global->availableCheetahThreads);
-			printf("Error: thread creation failed (frame skipped)\n");
-        }
+        global->nActiveCheetahThreads += 1;
+        global->threadCounter += 1;
 		pthread_mutex_unlock(&global->nActiveThreads_mutex);
-        pthread_attr_destroy(&threadAttribute);
-        //        pthread_mutex_lock(&global->process_mutex);
+
+        /*
+         *  Hand the frame over to the persistent worker pool
+         *  This blocks while the queue is full, which throttles the data source to the processing rate
+         */
+        global->workerPool.submit(worker, (void *) eventData, global->threadTimeoutInSeconds);
     }
     
     timer_workerWait.stop();
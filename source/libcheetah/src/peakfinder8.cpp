@@ -18,7 +18,9 @@
 #include <cstring>
 #include <stdio.h>
 #include <float.h>
+#include <pthread.h>
 
+#include "workerPool.h"
 #include "peakfinders.h"
 #include "peakfinder8.h"
 //#include "cheetahmodules.h"
@@ -71,6 +73,52 @@ void freePeakList(tPeakList peak)
 }
 
 
+static void compactPeakArray(float *a, const long *keep, long n)
+{
+	for ( long i=0; i<n; i++ ) a[i] = a[keep[i]];
+}
+
+static void compactPeakArray(long *a, const long *keep, long n)
+{
+	for ( long i=0; i<n; i++ ) a[i] = a[keep[i]];
+}
+
+/*
+ *	Drop peaks with killpeak[p] != 0 from the first n peaks, keeping the others in order
+ *	Returns (and sets) the new number of peaks
+ */
+long compactPeakList(tPeakList *peak, const char *killpeak, long n)
+{
+	long *keep = (long *) malloc(n*sizeof(long));
+	long c = 0;
+
+	for ( long p=0; p<n; p++ ) {
+		if ( killpeak[p] == 0 ) keep[c++] = p;
+	}
+
+	// One array at a time (nothing to move if no peak was dropped)
+	if ( c < n ) {
+		compactPeakArray(peak->peak_maxintensity, keep, c);
+		compactPeakArray(peak->peak_totalintensity, keep, c);
+		compactPeakArray(peak->peak_snr, keep, c);
+		compactPeakArray(peak->peak_sigma, keep, c);
+		compactPeakArray(peak->peak_npix, keep, c);
+		compactPeakArray(peak->peak_com_x, keep, c);
+		compactPeakArray(peak->peak_com_y, keep, c);
+		compactPeakArray(peak->peak_com_index, keep, c);
+		compactPeakArray(peak->peak_com_x_assembled, keep, c);
+		compactPeakArray(peak->peak_com_y_assembled, keep, c);
+		compactPeakArray(peak->peak_com_r_assembled, keep, c);
+		compactPeakArray(peak->peak_com_q, keep, c);
+		compactPeakArray(peak->peak_com_res, keep, c);
+	}
+	free(keep);
+
+	peak->nPeaks = c;
+	return c;
+}
+
+
 struct radial_stats
 {
 	float *roffset;
@@ -88,6 +136,8 @@ struct peakfinder_intern_data
 	int *infs;
 	int *inss;
 	int *peak_pixels;
+	int data_size;
+	int used;		// infs/inss entries written since they were last cleared
 };
 
 
@@ -105,22 +155,6 @@ struct peakfinder_peak_data
 };
 
 
-static void compute_num_radial_bins(int w, int h, float *r_map, float *max_r)
-{
-	int ifs, iss;
-	int pidx;
-
-	for ( iss=0 ; iss<h ; iss++ ) {
-		for ( ifs=0 ; ifs<w ; ifs++ ) {
-			pidx = iss * w + ifs;
-			if ( r_map[pidx] > *max_r ) {
-				*max_r = r_map[pidx];
-			}
-		}
-	}
-}
-
-
 static struct radial_stats* allocate_radial_stats(int num_rad_bins)
 {
 	struct radial_stats* rstats;
@@ -187,148 +221,37 @@ static void free_radial_stats(struct radial_stats *rstats)
 }
 
 
-static void fill_radial_bins(float *data,
-                             int w,
-                             int h,
-                             float *r_map,
-                             char *mask,
-                             float *rthreshold,
-                             float *lthreshold,
-                             float *roffset,
-                             float *rsigma,
-                             int *rcount)
-{
-	int iss, ifs;
-	int pidx;
-
-	int curr_r;
-	float value;
-
-	for ( iss=0; iss<h ; iss++ ) {
-		for ( ifs=0; ifs<w ; ifs++ ) {
-			pidx = iss * w + ifs;
-			if ( mask[pidx] != 0 ) {
-				curr_r = (int)rint(r_map[pidx]);
-				value = data[pidx];
-				if ( value < rthreshold[curr_r]
-				  && value > lthreshold[curr_r] )
-				{
-					roffset[curr_r] += value;
-					rsigma[curr_r] += (value * value);
-					rcount[curr_r] += 1;
-				}
-			}
-		}
-	}
-}
-
-
 static void compute_radial_stats(float *rthreshold,
                                  float *lthreshold,
                                  float *roffset,
                                  float *rsigma,
-                                 int *rcount,
-                                 int num_rad_bins,
+                                 int rcount,
                                  float min_snr,
                                  float acd_threshold)
 {
-	int ri;
 	float this_offset, this_sigma;
 
-	for ( ri=0 ; ri<num_rad_bins ; ri++ ) {
-
-		if ( rcount[ri] == 0 ) {
-			roffset[ri] = 0;
-			rsigma[ri] = 0;
-			rthreshold[ri] = FLT_MAX;
-			lthreshold[ri] = FLT_MIN;
-		} else {
-			this_offset = roffset[ri] / rcount[ri];
-			this_sigma = rsigma[ri] / rcount[ri] - (this_offset * this_offset);
-			if ( this_sigma >= 0 ) {
-				this_sigma = sqrt(this_sigma);
-			}
-
-			roffset[ri] = this_offset;
-			rsigma[ri] = this_sigma;
-			rthreshold[ri] = roffset[ri] + min_snr*rsigma[ri];
-			lthreshold[ri] = roffset[ri] - min_snr*rsigma[ri];
-
-			if ( rthreshold[ri] < acd_threshold ) {
-				rthreshold[ri] = acd_threshold;
-			}
+	if ( rcount == 0 ) {
+		*roffset = 0;
+		*rsigma = 0;
+		*rthreshold = FLT_MAX;
+		*lthreshold = FLT_MIN;
+	} else {
+		this_offset = *roffset / rcount;
+		this_sigma = *rsigma / rcount - (this_offset * this_offset);
+		if ( this_sigma >= 0 ) {
+			this_sigma = sqrt(this_sigma);
 		}
-	}
-
-}
 
+		*roffset = this_offset;
+		*rsigma = this_sigma;
+		*rthreshold = *roffset + min_snr * *rsigma;
+		*lthreshold = *roffset - min_snr * *rsigma;
 
-static struct radial_stats *compute_radial_bins(float *data,
-                                                char *mask,
-                                                int num_pix,
-                                                float *r_map,
-                                                int iterations,
-                                                float min_snr,
-                                                float acd_threshold,
-                                                int num_pix_fs,
-                                                int num_pix_ss)
-{
-	float max_r;
-	int it_counter;
-	int i;
-	int num_rad_bins;
-	struct radial_stats *rstats;
-
-	max_r = -1e9;
-
-	compute_num_radial_bins(num_pix_fs, num_pix_ss, r_map, &max_r);
-
-	num_rad_bins = (int)ceil(max_r) + 1;
-
-	// Allocate and zero arrays
-	rstats = allocate_radial_stats(num_rad_bins);
-	if ( rstats == NULL ) {
-		return NULL;
-	}
-
-	for ( i=0; i<num_rad_bins; i++ ) {
-		rstats->rthreshold[i] = 1e9;
-		rstats->lthreshold[i] = -1e9;
-  	}
-
-	// Compute sigma and average of data values at each radius
-	// From this, compute the ADC threshold to be applied at each radius
-	// Iterate a few times to reduce the effect of positive outliers (ie: peaks)
-	for ( it_counter=0 ; it_counter<iterations ; it_counter++ ) {
-
-		for ( i=0; i<num_rad_bins; i++ ) {
-			rstats->roffset[i] = 0;
-			rstats->rsigma[i] = 0;
-			rstats->rcount[i] = 0;
+		if ( *rthreshold < acd_threshold ) {
+			*rthreshold = acd_threshold;
 		}
-
-		fill_radial_bins(data,
-                         num_pix_fs,
-                         num_pix_ss,
-		                 r_map,
-		                 mask,
-		                 rstats->rthreshold,
-		                 rstats->lthreshold,
-		                 rstats->roffset,
-		                 rstats->rsigma,
-		                 rstats->rcount);
-
-		compute_radial_stats(rstats->rthreshold,
-		                     rstats->lthreshold,
-		                     rstats->roffset,
-		                     rstats->rsigma,
-		                     rstats->rcount,
-		                     num_rad_bins,
-		                     min_snr,
-		                     acd_threshold);
-
 	}
-	return rstats;
 }
 
 
@@ -468,7 +391,7 @@ static struct peakfinder_intern_data *allocate_peakfinder_intern_data(int data_s
 	}
 
 	intern_data->peak_pixels =(int *)calloc(max_pix_count, sizeof(int));
-	if ( intern_data->peak_pixels == NULL ) {
+	if ( intern_data->peak_pixels == NULL && max_pix_count > 0 ) {
 		free(intern_data->pix_in_peak_map);
 		free(intern_data->infs);
 		free(intern_data->inss);
@@ -476,6 +399,8 @@ static struct peakfinder_intern_data *allocate_peakfinder_intern_data(int data_s
 		return NULL;
 	}
 
+	intern_data->data_size = data_size;
+	intern_data->used = 0;
 	return intern_data;
 }
 
@@ -491,9 +416,367 @@ static void free_peakfinder_intern_data(struct peakfinder_intern_data *pfid)
 
 
 
+/*
+ *	Per thread peakfinder8 state, kept from one event to the next
+ *	The radial bin of each pixel depends only on the geometry, the lists of unmasked pixels per bin
+ *	only on the mask; both are rebuilt when those change. Scratch arrays are reused as they are.
+ */
+#define PEAKFINDER8_CONTEXTS 4
+
+struct peakfinder8_context
+{
+	// Geometry
+	float *r_map;
+	int num_pix_fs;
+	int num_pix_ss;
+	int num_pix_tot;
+	int num_rad_bins;
+	int *rbin;
+
+	// Unmasked pixels of radial bin ri are pix_list[bin_start[ri]] .. pix_list[bin_start[ri+1]-1]
+	char *mask;
+	int *bin_start;
+	int *pix_list;
+	float *pix_values;
+
+	// Scratch
+	struct radial_stats *rstats;
+	struct peakfinder_intern_data *pfinter;
+	int max_pix_count;
+	struct peakfinder_peak_data *pkdata;
+	int max_num_peaks;
+
+	// Panel-parallel search: scratch and found peaks per pool slot, and where each panel's peaks went
+	int n_slots;
+	int slot_data_size;
+	struct peakfinder_intern_data **slot_pfinter;
+	struct peakfinder_peak_data **slot_pkdata;
+	int *slot_peak_count;
+	int n_panels;
+	int *panel_slot;
+	int *panel_first;
+	int *panel_count;
+
+	long last_used;
+};
+
+struct peakfinder8_thread_contexts
+{
+	struct peakfinder8_context ctx[PEAKFINDER8_CONTEXTS];
+	long n_calls;
+};
+
+static pthread_key_t peakfinder8_key;
+static pthread_once_t peakfinder8_key_once = PTHREAD_ONCE_INIT;
+
+
+static void free_peakfinder8_context(struct peakfinder8_context *ctx)
+{
+	free(ctx->rbin);
+	free(ctx->mask);
+	free(ctx->bin_start);
+	free(ctx->pix_list);
+	free(ctx->pix_values);
+	if ( ctx->rstats != NULL ) free_radial_stats(ctx->rstats);
+	if ( ctx->pfinter != NULL ) free_peakfinder_intern_data(ctx->pfinter);
+	if ( ctx->pkdata != NULL ) free_peak_data(ctx->pkdata);
+	for ( int i=0; i<ctx->n_slots; i++ ) {
+		if ( ctx->slot_pfinter[i] != NULL ) free_peakfinder_intern_data(ctx->slot_pfinter[i]);
+		if ( ctx->slot_pkdata[i] != NULL ) free_peak_data(ctx->slot_pkdata[i]);
+	}
+	free(ctx->slot_pfinter);
+	free(ctx->slot_pkdata);
+	free(ctx->slot_peak_count);
+	free(ctx->panel_slot);
+	free(ctx->panel_first);
+	free(ctx->panel_count);
+	memset(ctx, 0, sizeof(struct peakfinder8_context));
+}
+
+
+static void free_peakfinder8_thread_contexts(void *p)
+{
+	struct peakfinder8_thread_contexts *contexts = (struct peakfinder8_thread_contexts *) p;
+
+	for ( int i=0; i<PEAKFINDER8_CONTEXTS; i++ ) {
+		free_peakfinder8_context(&contexts->ctx[i]);
+	}
+	free(contexts);
+}
+
+
+static void create_peakfinder8_key(void)
+{
+	pthread_key_create(&peakfinder8_key, free_peakfinder8_thread_contexts);
+}
+
+
+/*
+ *	Radial bin of every pixel, from the geometry alone
+ */
+static int build_radial_bins(struct peakfinder8_context *ctx, float *r_map, int num_pix_fs, int num_pix_ss)
+{
+	float max_r;
+	int i;
+
+	free_peakfinder8_context(ctx);
+
+	ctx->r_map = r_map;
+	ctx->num_pix_fs = num_pix_fs;
+	ctx->num_pix_ss = num_pix_ss;
+	ctx->num_pix_tot = num_pix_fs * num_pix_ss;
+
+	max_r = -1e9;
+	for ( i=0; i<ctx->num_pix_tot; i++ ) {
+		if ( r_map[i] > max_r ) {
+			max_r = r_map[i];
+		}
+	}
+	ctx->num_rad_bins = (int)ceil(max_r) + 1;
+
+	ctx->rbin = (int *)malloc(ctx->num_pix_tot*sizeof(int));
+	ctx->mask = (char *)malloc(ctx->num_pix_tot*sizeof(char));
+	ctx->bin_start = (int *)malloc((ctx->num_rad_bins+1)*sizeof(int));
+	ctx->pix_list = (int *)malloc(ctx->num_pix_tot*sizeof(int));
+	ctx->pix_values = (float *)malloc(ctx->num_pix_tot*sizeof(float));
+	ctx->rstats = allocate_radial_stats(ctx->num_rad_bins);
+	ctx->pfinter = allocate_peakfinder_intern_data(ctx->num_pix_tot, 0);
+	if ( ctx->rbin == NULL || ctx->mask == NULL || ctx->bin_start == NULL || ctx->pix_list == NULL
+	  || ctx->pix_values == NULL || ctx->rstats == NULL || ctx->pfinter == NULL ) {
+		free_peakfinder8_context(ctx);
+		return 1;
+	}
+
+	for ( i=0; i<ctx->num_pix_tot; i++ ) {
+		ctx->rbin[i] = (int)rint(r_map[i]);
+	}
+
+	// Force the pixel lists to be built on first use
+	memset(ctx->mask, 0, ctx->num_pix_tot*sizeof(char));
+	memset(ctx->bin_start, 0, (ctx->num_rad_bins+1)*sizeof(int));
+	return 0;
+}
+
+
+/*
+ *	Unmasked pixels grouped by radial bin, each bin in pixel order
+ *	(so the radial sums add up values in the same order as a scan over the detector)
+ */
+static void build_pixel_lists(struct peakfinder8_context *ctx, char *mask)
+{
+	int *bin_start = ctx->bin_start;
+	int i, ri;
+
+	memcpy(ctx->mask, mask, ctx->num_pix_tot*sizeof(char));
+
+	memset(bin_start, 0, (ctx->num_rad_bins+1)*sizeof(int));
+	for ( i=0; i<ctx->num_pix_tot; i++ ) {
+		if ( mask[i] != 0 ) {
+			bin_start[ctx->rbin[i]+1] += 1;
+		}
+	}
+	for ( ri=0; ri<ctx->num_rad_bins; ri++ ) {
+		bin_start[ri+1] += bin_start[ri];
+	}
+	for ( i=0; i<ctx->num_pix_tot; i++ ) {
+		if ( mask[i] != 0 ) {
+			ctx->pix_list[bin_start[ctx->rbin[i]]++] = i;
+		}
+	}
+	// bin_start[ri] now holds the end of bin ri; shift back
+	for ( ri=ctx->num_rad_bins; ri>0; ri-- ) {
+		bin_start[ri] = bin_start[ri-1];
+	}
+	bin_start[0] = 0;
+}
+
+
+/*
+ *	Context of the calling thread for this geometry, with lists for this mask and room for the peaks
+ */
+static struct peakfinder8_context *get_peakfinder8_context(float *r_map, char *mask,
+                                                          int num_pix_fs, int num_pix_ss,
+                                                          int max_num_peaks, int max_pix_count)
+{
+	struct peakfinder8_thread_contexts *contexts;
+	struct peakfinder8_context *ctx;
+	int i;
+
+	pthread_once(&peakfinder8_key_once, create_peakfinder8_key);
+	contexts = (struct peakfinder8_thread_contexts *) pthread_getspecific(peakfinder8_key);
+	if ( contexts == NULL ) {
+		contexts = (struct peakfinder8_thread_contexts *) calloc(1, sizeof(struct peakfinder8_thread_contexts));
+		if ( contexts == NULL ) {
+			return NULL;
+		}
+		pthread_setspecific(peakfinder8_key, contexts);
+	}
+	contexts->n_calls += 1;
+
+	// Same geometry as before, or else the least recently used slot
+	ctx = &contexts->ctx[0];
+	for ( i=0; i<PEAKFINDER8_CONTEXTS; i++ ) {
+		struct peakfinder8_context *c = &contexts->ctx[i];
+		if ( c->r_map == r_map && c->num_pix_fs == num_pix_fs && c->num_pix_ss == num_pix_ss ) {
+			ctx = c;
+			break;
+		}
+		if ( c->last_used < ctx->last_used ) {
+			ctx = c;
+		}
+	}
+	if ( ctx->r_map != r_map || ctx->num_pix_fs != num_pix_fs || ctx->num_pix_ss != num_pix_ss ) {
+		if ( build_radial_bins(ctx, r_map, num_pix_fs, num_pix_ss) != 0 ) {
+			return NULL;
+		}
+	}
+	ctx->last_used = contexts->n_calls;
+
+	if ( memcmp(ctx->mask, mask, ctx->num_pix_tot*sizeof(char)) != 0 ) {
+		build_pixel_lists(ctx, mask);
+	}
+
+	if ( ctx->max_pix_count == 0 || max_pix_count > ctx->max_pix_count ) {
+		if ( max_pix_count < 1 ) {
+			max_pix_count = 1;
+		}
+		free(ctx->pfinter->peak_pixels);
+		ctx->pfinter->peak_pixels = (int *)calloc(max_pix_count, sizeof(int));
+		if ( ctx->pfinter->peak_pixels == NULL ) {
+			free_peakfinder8_context(ctx);
+			return NULL;
+		}
+		ctx->max_pix_count = max_pix_count;
+		ctx->slot_data_size = 0;
+	}
+
+	if ( ctx->pkdata == NULL || max_num_peaks > ctx->max_num_peaks ) {
+		if ( ctx->pkdata != NULL ) free_peak_data(ctx->pkdata);
+		ctx->pkdata = allocate_peak_data(max_num_peaks);
+		if ( ctx->pkdata == NULL ) {
+			free_peakfinder8_context(ctx);
+			return NULL;
+		}
+		ctx->max_num_peaks = max_num_peaks;
+		ctx->slot_data_size = 0;
+	}
+
+	return ctx;
+}
+
+
+/*
+ *	Per slot scratch for searching panels concurrently (the peak map stays shared, panels never touch each other's pixels)
+ *	Every slot can hold max_num_peaks: a slot takes panels in increasing order, so any peak it finds beyond that
+ *	comes after at least max_num_peaks others and would not make it into the peak list anyway
+ */
+static int prepare_panel_slots(struct peakfinder8_context *ctx, int n_slots, int n_panels, int asic_nn)
+{
+	int i;
+
+	if ( n_slots != ctx->n_slots || asic_nn+1 > ctx->slot_data_size ) {
+		for ( i=0; i<ctx->n_slots; i++ ) {
+			if ( ctx->slot_pfinter[i] != NULL ) free_peakfinder_intern_data(ctx->slot_pfinter[i]);
+			if ( ctx->slot_pkdata[i] != NULL ) free_peak_data(ctx->slot_pkdata[i]);
+		}
+		free(ctx->slot_pfinter);
+		free(ctx->slot_pkdata);
+		free(ctx->slot_peak_count);
+
+		ctx->n_slots = n_slots;
+		ctx->slot_data_size = asic_nn+1;
+		ctx->slot_pfinter = (struct peakfinder_intern_data **)calloc(n_slots, sizeof(struct peakfinder_intern_data *));
+		ctx->slot_pkdata = (struct peakfinder_peak_data **)calloc(n_slots, sizeof(struct peakfinder_peak_data *));
+		ctx->slot_peak_count = (int *)calloc(n_slots, sizeof(int));
+		if ( ctx->slot_pfinter == NULL || ctx->slot_pkdata == NULL || ctx->slot_peak_count == NULL ) {
+			return 1;
+		}
+		for ( i=0; i<n_slots; i++ ) {
+			ctx->slot_pfinter[i] = allocate_peakfinder_intern_data(ctx->slot_data_size, ctx->max_pix_count);
+			ctx->slot_pkdata[i] = allocate_peak_data(ctx->max_num_peaks);
+			if ( ctx->slot_pfinter[i] == NULL || ctx->slot_pkdata[i] == NULL ) {
+				return 1;
+			}
+		}
+	}
+
+	if ( n_panels != ctx->n_panels ) {
+		free(ctx->panel_slot);
+		free(ctx->panel_first);
+		free(ctx->panel_count);
+		ctx->n_panels = n_panels;
+		ctx->panel_slot = (int *)malloc(n_panels*sizeof(int));
+		ctx->panel_first = (int *)malloc(n_panels*sizeof(int));
+		ctx->panel_count = (int *)malloc(n_panels*sizeof(int));
+		if ( ctx->panel_slot == NULL || ctx->panel_first == NULL || ctx->panel_count == NULL ) {
+			return 1;
+		}
+	}
+
+	for ( i=0; i<n_slots; i++ ) {
+		ctx->slot_peak_count[i] = 0;
+	}
+	return 0;
+}
+
+
+/*
+ *	Compute sigma and average of data values at each radius
+ *	From this, compute the ADC threshold to be applied at each radius
+ *	Iterate a few times to reduce the effect of positive outliers (ie: peaks)
+ *	Each bin's values are gathered once and all iterations run over that contiguous block
+ */
+static void compute_radial_bins(struct peakfinder8_context *ctx,
+                                float *data,
+                                int iterations,
+                                float min_snr,
+                                float acd_threshold)
+{
+	struct radial_stats *rstats = ctx->rstats;
+	int num_unmasked = ctx->bin_start[ctx->num_rad_bins];
+	int it_counter;
+	int ri, k;
+
+	for ( k=0; k<num_unmasked; k++ ) {
+		ctx->pix_values[k] = data[ctx->pix_list[k]];
+	}
+
+	for ( ri=0; ri<ctx->num_rad_bins; ri++ ) {
+		float *values = ctx->pix_values + ctx->bin_start[ri];
+		int num_values = ctx->bin_start[ri+1] - ctx->bin_start[ri];
+		float rthreshold = 1e9;
+		float lthreshold = -1e9;
+		float roffset = 0;
+		float rsigma = 0;
+		int rcount = 0;
+
+		for ( it_counter=0 ; it_counter<iterations ; it_counter++ ) {
+			roffset = 0;
+			rsigma = 0;
+			rcount = 0;
+			for ( k=0; k<num_values; k++ ) {
+				float value = values[k];
+				if ( value < rthreshold && value > lthreshold ) {
+					roffset += value;
+					rsigma += (value * value);
+					rcount += 1;
+				}
+			}
+			compute_radial_stats(&rthreshold, &lthreshold, &roffset, &rsigma, rcount, min_snr, acd_threshold);
+		}
+
+		rstats->roffset[ri] = roffset;
+		rstats->rsigma[ri] = rsigma;
+		rstats->rthreshold[ri] = rthreshold;
+		rstats->lthreshold[ri] = lthreshold;
+		rstats->rcount[ri] = rcount;
+	}
+}
+
+
 static void peak_search(int p,
                         struct peakfinder_intern_data *pfinter,
-                        float *copy, char *mask, float *r_map,
+                        float *copy, char *mask, int *rbin,
                         float *rthreshold, float *roffset,
                         int *num_pix_in_peak, int asic_size_fs,
                         int asic_size_ss, int aifs, int aiss,
@@ -525,7 +808,7 @@ static void peak_search(int p,
 		curr_ss = pfinter->inss[p] + search_ss[k] + aiss * asic_size_ss;
 		pi = curr_fs + curr_ss * num_pix_fs;
 
-		curr_radius = (int)rint(r_map[pi]);
+		curr_radius = rbin[pi];
 		curr_threshold = rthreshold[curr_radius];
 
 		// Above threshold?
@@ -551,7 +834,7 @@ static void peak_search(int p,
 
 
 static void search_in_ring(int ring_width, int com_fs_int, int com_ss_int,
-                           float *copy, float *r_map,
+                           float *copy, int *rbin,
                            float *rthreshold, float *roffset,
                            char *pix_in_peak_map, char *mask, int asic_size_fs,
                            int asic_size_ss, int aifs, int aiss,
@@ -601,7 +884,7 @@ static void search_in_ring(int ring_width, int com_fs_int, int com_ss_int,
 			curr_ss = com_ss_int + ssj + aiss * asic_size_ss;
 			pi = curr_fs + curr_ss * num_pix_fs;
 
-			curr_radius = (int)rint(r_map[pi]);
+			curr_radius = rbin[pi];
 			curr_threshold = rthreshold[curr_radius];
 
 			// Intensity above background ??? just intensity?
@@ -632,7 +915,7 @@ static void search_in_ring(int ring_width, int com_fs_int, int com_ss_int,
 			*local_sigma = 0.01;
 		}
  	} else {
-		local_radius = (int)rint(r_map[(int)rint(com_idx)]);
+		local_radius = rbin[com_idx];
 		*local_offset = roffset[local_radius];
 		*local_sigma = 0.01;
 	}
@@ -643,7 +926,7 @@ static void process_panel(int asic_size_fs, int asic_size_ss, int num_pix_fs,
                           int aiss, int aifs, float *rthreshold,
                           float *roffset, int *peak_count,
                           float *copy, struct peakfinder_intern_data *pfinter,
-                          float *r_map, char *mask, int *npix, float *com_fs,
+                          int *rbin, char *mask, int *npix, float *com_fs,
                           float *com_ss, int *com_index, float *tot_i,
                           float *max_i, float *sigma, float *snr,
                           int min_pix_count, int max_pix_count,
@@ -652,6 +935,15 @@ static void process_panel(int asic_size_fs, int asic_size_ss, int num_pix_fs,
 	int pxss, pxfs;
 	int num_pix_in_peak;
 
+	// The peak search reads one entry past the pixels found so far, so start every panel from
+	// cleared lists: what a panel finds then does not depend on which panels were searched before it
+	if ( pfinter->used > 0 ) {
+		int n = (pfinter->used+1 < pfinter->data_size) ? pfinter->used+1 : pfinter->data_size;
+		memset(pfinter->infs, 0, n*sizeof(int));
+		memset(pfinter->inss, 0, n*sizeof(int));
+		pfinter->used = 0;
+	}
+
 	// Loop over pixels within a module
 	for ( pxss=1 ; pxss<asic_size_ss-1 ; pxss++ ) {
 		for ( pxfs=1 ; pxfs<asic_size_fs-1 ; pxfs++ ) {
@@ -663,7 +955,7 @@ static void process_panel(int asic_size_fs, int asic_size_ss, int num_pix_fs,
 			pxidx = (pxss + aiss * asic_size_ss) * num_pix_fs +
 			pxfs + aifs * asic_size_fs;
 
-			curr_rad = (int)rint(r_map[pxidx]);
+			curr_rad = rbin[pxidx];
 			curr_thresh = rthreshold[curr_rad];
 
 			if ( copy[pxidx] > curr_thresh
@@ -703,7 +995,7 @@ static void process_panel(int asic_size_fs, int asic_size_ss, int num_pix_fs,
 					for ( p=0; p<=num_pix_in_peak; p++ ) { //changed from 1 to 0 by O.Y.
 						peak_search(p,
 						            pfinter, copy, mask,
-						            r_map,
+						            rbin,
 						            rthreshold,
 						            roffset,
 						            &num_pix_in_peak,
@@ -719,6 +1011,10 @@ static void process_panel(int asic_size_fs, int asic_size_ss, int num_pix_fs,
 
 				} while ( lt_num_pix_in_pk != num_pix_in_peak );
 
+				if ( num_pix_in_peak > pfinter->used ) {
+					pfinter->used = num_pix_in_peak;
+				}
+
 				// Too many or too few pixels means ignore this 'peak'; move on now
 				if ( num_pix_in_peak < min_pix_count || num_pix_in_peak > max_pix_count ) continue;
 
@@ -744,7 +1040,7 @@ static void process_panel(int asic_size_fs, int asic_size_ss, int num_pix_fs,
 
 				search_in_ring(ring_width, peak_com_fs_int,
 				               peak_com_ss_int,
-				               copy, r_map, rthreshold,
+				               copy, rbin, rthreshold,
 				               roffset,
 				               pfinter->pix_in_peak_map,
 				               mask, asic_size_fs,
@@ -859,8 +1155,54 @@ static void process_panel(int asic_size_fs, int asic_size_ss, int num_pix_fs,
 }
 
 
-static int peakfinder8_base(float *roffset, float *rthreshold,
-                            float *data, char *mask, float *r_map,
+struct peakfinder8_panel_job
+{
+	struct peakfinder8_context *ctx;
+	float *roffset;
+	float *rthreshold;
+	float *data;
+	char *mask;
+	int asic_size_fs;
+	int num_asics_fs;
+	int asic_size_ss;
+	int max_n_peaks;
+	int min_pix_count;
+	int max_pix_count;
+	int local_bg_radius;
+	float min_snr;
+};
+
+
+static void peakfinder8_panel_task(void *arg, long panel, long slot)
+{
+	struct peakfinder8_panel_job *job = (struct peakfinder8_panel_job *) arg;
+	struct peakfinder8_context *ctx = job->ctx;
+	struct peakfinder_peak_data *pkdata = ctx->slot_pkdata[slot];
+	struct peakfinder_intern_data pfinter = *ctx->slot_pfinter[slot];
+	int *peak_count = &ctx->slot_peak_count[slot];
+	int aiss = panel / job->num_asics_fs;
+	int aifs = panel % job->num_asics_fs;
+
+	// Slot's own peak search scratch, shared peak map
+	pfinter.pix_in_peak_map = ctx->pfinter->pix_in_peak_map;
+
+	ctx->panel_slot[panel] = slot;
+	ctx->panel_first[panel] = *peak_count;
+	process_panel(job->asic_size_fs, job->asic_size_ss, ctx->num_pix_fs,
+	              aiss, aifs, job->rthreshold, job->roffset,
+	              peak_count, job->data, &pfinter, ctx->rbin, job->mask,
+	              pkdata->npix, pkdata->com_fs, pkdata->com_ss, pkdata->com_index, pkdata->tot_i,
+	              pkdata->max_i, pkdata->sigma, pkdata->snr, job->min_pix_count,
+	              job->max_pix_count, job->local_bg_radius, job->min_snr,
+	              job->max_n_peaks);
+	ctx->panel_count[panel] = *peak_count - ctx->panel_first[panel];
+	ctx->slot_pfinter[slot]->used = pfinter.used;
+}
+
+
+static int peakfinder8_base(struct peakfinder8_context *ctx,
+                            float *roffset, float *rthreshold,
+                            float *data, char *mask,
                             int asic_size_fs, int num_asics_fs,
                             int asic_size_ss, int num_asics_ss,
                             int max_n_peaks, int *num_found_peaks,
@@ -869,35 +1211,79 @@ static int peakfinder8_base(float *roffset, float *rthreshold,
                             float *max_i, float *sigma, float *snr,
                             int min_pix_count, int max_pix_count,
                             int local_bg_radius, float min_snr,
-                            char* outliersMask)
+                            char* outliersMask, cWorkerPool *panelPool)
 {
 
-	int num_pix_fs, num_pix_ss, num_pix_tot;
+	int num_pix_fs, num_pix_tot;
 	int aifs, aiss;
 	int peak_count;
 	struct peakfinder_intern_data *pfinter;
 
-	num_pix_fs = asic_size_fs * num_asics_fs;
-	num_pix_ss = asic_size_ss * num_asics_ss;
-	num_pix_tot = num_pix_fs * num_pix_ss;
+	num_pix_fs = ctx->num_pix_fs;
+	num_pix_tot = ctx->num_pix_tot;
 
-	pfinter = allocate_peakfinder_intern_data(num_pix_tot, max_pix_count);
-	if ( pfinter == NULL ) {
-		return 1;
-	}
+	// Scratch is reused, so start from the state a fresh allocation would have (process_panel clears the pixel lists)
+	pfinter = ctx->pfinter;
+	memset(pfinter->pix_in_peak_map, 0, num_pix_tot*sizeof(char));
 
 	peak_count = 0;
 
-	// Loop over modules (nxn array)
-	for ( aiss=0 ; aiss<num_asics_ss ; aiss++ ) {
-		for ( aifs=0 ; aifs<num_asics_fs ; aifs++ ) {                 // ??? to change to proper panels need
-			process_panel(asic_size_fs, asic_size_ss, num_pix_fs, // change copy, mask, r_map
-  			              aiss, aifs, rthreshold, roffset,
-			              &peak_count, data, pfinter, r_map, mask,
-			              npix, com_fs, com_ss, com_index, tot_i,
-			              max_i, sigma, snr, min_pix_count,
-			              max_pix_count, local_bg_radius, min_snr,
-			              max_n_peaks);
+	// Panels in parallel, then their peaks in panel order: the same list the serial loop below makes
+	if ( panelPool != NULL ) {
+		struct peakfinder8_panel_job job;
+		int num_panels = num_asics_fs * num_asics_ss;
+		int panel, k;
+
+		if ( prepare_panel_slots(ctx, panelPool->nSlots(), num_panels, asic_size_fs*asic_size_ss) != 0 ) {
+			free_peakfinder8_context(ctx);
+			return 1;
+		}
+
+		job.ctx = ctx;
+		job.roffset = roffset;
+		job.rthreshold = rthreshold;
+		job.data = data;
+		job.mask = mask;
+		job.asic_size_fs = asic_size_fs;
+		job.num_asics_fs = num_asics_fs;
+		job.asic_size_ss = asic_size_ss;
+		job.max_n_peaks = max_n_peaks;
+		job.min_pix_count = min_pix_count;
+		job.max_pix_count = max_pix_count;
+		job.local_bg_radius = local_bg_radius;
+		job.min_snr = min_snr;
+		panelPool->parallelFor(num_panels, peakfinder8_panel_task, &job);
+
+		for ( panel=0; panel<num_panels; panel++ ) {
+			struct peakfinder_peak_data *pkdata = ctx->slot_pkdata[ctx->panel_slot[panel]];
+			for ( k=0; k<ctx->panel_count[panel]; k++ ) {
+				int pidx = ctx->panel_first[panel] + k;
+				if ( peak_count < max_n_peaks ) {
+					npix[peak_count] = pkdata->npix[pidx];
+					com_fs[peak_count] = pkdata->com_fs[pidx];
+					com_ss[peak_count] = pkdata->com_ss[pidx];
+					com_index[peak_count] = pkdata->com_index[pidx];
+					tot_i[peak_count] = pkdata->tot_i[pidx];
+					max_i[peak_count] = pkdata->max_i[pidx];
+					sigma[peak_count] = pkdata->sigma[pidx];
+					snr[peak_count] = pkdata->snr[pidx];
+				}
+				peak_count += 1;
+			}
+		}
+	}
+	else {
+		// Loop over modules (nxn array)
+		for ( aiss=0 ; aiss<num_asics_ss ; aiss++ ) {
+			for ( aifs=0 ; aifs<num_asics_fs ; aifs++ ) {                 // ??? to change to proper panels need
+				process_panel(asic_size_fs, asic_size_ss, num_pix_fs, // change copy, mask, r_map
+				              aiss, aifs, rthreshold, roffset,
+				              &peak_count, data, pfinter, ctx->rbin, mask,
+				              npix, com_fs, com_ss, com_index, tot_i,
+				              max_i, sigma, snr, min_pix_count,
+				              max_pix_count, local_bg_radius, min_snr,
+				              max_n_peaks);
+			}
 		}
 	}
 	*num_found_peaks = peak_count;
@@ -906,8 +1292,6 @@ static int peakfinder8_base(float *roffset, float *rthreshold,
 		memcpy(outliersMask, pfinter->pix_in_peak_map, num_pix_tot*sizeof(char));
 	}
 
-	free_peakfinder_intern_data(pfinter);
-
 	return 0;
 }
 
@@ -919,13 +1303,13 @@ int peakfinder8(tPeakList *peaklist, float *data, char *mask, float *pix_r,
                 long asic_nx, long asic_ny, long nasics_x, long nasics_y,
                 float ADCthresh, float hitfinderMinSNR,
                 long hitfinderMinPixCount, long hitfinderMaxPixCount,
-                long hitfinderLocalBGRadius, char* outliersMask)
+                long hitfinderLocalBGRadius, char* outliersMask, cWorkerPool *panelPool)
 {
+	struct peakfinder8_context *ctx;
 	struct radial_stats *rstats;
 	struct peakfinder_peak_data *pkdata;
 	int iterations;
 	int num_pix_fs, num_pix_ss;
-	int num_pix_tot;
 	int max_num_peaks;
 	int num_found_peaks;
 	int ret;
@@ -937,27 +1321,25 @@ int peakfinder8(tPeakList *peaklist, float *data, char *mask, float *pix_r,
 	// Derived values
 	num_pix_fs = asic_nx * nasics_x;
 	num_pix_ss = asic_ny * nasics_y;
-	num_pix_tot = num_pix_fs * num_pix_ss;
 
-	// Compute radial statistics as 1 function (O.Y.)
-	iterations = 5;
-	rstats = compute_radial_bins(data, mask, num_pix_tot, pix_r,
-	                             iterations, hitfinderMinSNR, ADCthresh,
-	                             num_pix_fs, num_pix_ss);
-
-	pkdata = allocate_peak_data(max_num_peaks);
-	if ( pkdata == NULL ) {
-		free_radial_stats(rstats);
+	ctx = get_peakfinder8_context(pix_r, mask, num_pix_fs, num_pix_ss, max_num_peaks, hitfinderMaxPixCount);
+	if ( ctx == NULL ) {
 		return 1;
 	}
+	rstats = ctx->rstats;
+	pkdata = ctx->pkdata;
+
+	// Compute radial statistics as 1 function (O.Y.)
+	iterations = 5;
+	compute_radial_bins(ctx, data, iterations, hitfinderMinSNR, ADCthresh);
 
 	num_found_peaks = 0;
 
-	ret = peakfinder8_base(rstats->roffset,
+	ret = peakfinder8_base(ctx,
+	                       rstats->roffset,
 	                       rstats->rthreshold,
 	                       data,
 	                       mask,
-	                       pix_r,
 	                       asic_nx, nasics_x,
 	                       asic_ny, nasics_y,
 	                       max_num_peaks  ,
@@ -974,11 +1356,10 @@ int peakfinder8(tPeakList *peaklist, float *data, char *mask, float *pix_r,
 	                       hitfinderMaxPixCount,
 	                       hitfinderLocalBGRadius,
 	                       hitfinderMinSNR,
-	                       outliersMask);
+	                       outliersMask,
+	                       panelPool);
 
 	if ( ret != 0 ) {
-		free_radial_stats(rstats);
-		free_peak_data(pkdata);
 		return 1;
 	}
 
@@ -1002,13 +1383,21 @@ int peakfinder8(tPeakList *peaklist, float *data, char *mask, float *pix_r,
 
 	peaklist->nPeaks = peaks_to_add;
 
-	free_radial_stats(rstats);
-	free_peak_data(pkdata);
-
 	// Valerio returns 0, old code used to return peaklist->nPeaks.  Be warned.
 	return 0;
 }
 
+int peakfinder8(tPeakList *peaklist, float *data, char *mask, float *pix_r,
+                long asic_nx, long asic_ny, long nasics_x, long nasics_y,
+                float ADCthresh, float hitfinderMinSNR,
+                long hitfinderMinPixCount, long hitfinderMaxPixCount,
+                long hitfinderLocalBGRadius, char* outliersMask)
+{
+	return peakfinder8(peaklist, data, mask, pix_r, asic_nx, asic_ny, nasics_x, nasics_y,
+	                   ADCthresh, hitfinderMinSNR, hitfinderMinPixCount, hitfinderMaxPixCount,
+	                   hitfinderLocalBGRadius, outliersMask, NULL);
+}
+
 
 //
 //	Version without outlier mask - drop in replacement in Cheetah.
@@ -1020,7 +1409,23 @@ int peakfinder8(tPeakList *peaklist, float *data, char *mask, float *pix_r,
 				long hitfinderLocalBGRadius) {
 	
 	int result = peakfinder8(peaklist, data, mask, pix_r, asic_nx, asic_ny, nasics_x, nasics_y,
-					ADCthresh, hitfinderMinSNR, hitfinderMinPixCount, hitfinderMaxPixCount, hitfinderLocalBGRadius, NULL);
+					ADCthresh, hitfinderMinSNR, hitfinderMinPixCount, hitfinderMaxPixCount, hitfinderLocalBGRadius, NULL, NULL);
+
+	return (peaklist->nPeaks);
+}
+
+
+//
+//	Same, with the panels searched concurrently on panelPool (bit-identical peak list)
+//
+int peakfinder8(tPeakList *peaklist, float *data, char *mask, float *pix_r,
+				long asic_nx, long asic_ny, long nasics_x, long nasics_y,
+				float ADCthresh, float hitfinderMinSNR,
+				long hitfinderMinPixCount, long hitfinderMaxPixCount,
+				long hitfinderLocalBGRadius, cWorkerPool *panelPool) {
+
+	peakfinder8(peaklist, data, mask, pix_r, asic_nx, asic_ny, nasics_x, nasics_y,
+				ADCthresh, hitfinderMinSNR, hitfinderMinPixCount, hitfinderMaxPixCount, hitfinderLocalBGRadius, NULL, panelPool);
 
 	return (peaklist->nPeaks);
 }
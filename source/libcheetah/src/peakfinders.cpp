@@ -12,6 +12,8 @@
 #include <math.h>
 #include <hdf5.h>
 #include <stdlib.h>
+#include <cmath>
+#include <algorithm>
 
 #include "detectorObject.h"
 #include "cheetahGlobal.h"
@@ -83,6 +85,9 @@ int peakfinder(cGlobal *global, cEventData *eventData, int detIndex)
     for (long i = 0; i < pix_nn; i++)
         mask[i] = isNoneOfBitOptionsSet(eventData->detector[detIndex].pixelmask[i], combined_pixel_options);
 
+    // Panels of this frame searched concurrently (peakfinder3 and 8 only)
+    cWorkerPool *panelPool = (global->nPanelThreads > 0) ? &global->panelPool : NULL;
+
     /*
      *	Call the appropriate peak finding algorithm
      */
@@ -90,7 +95,7 @@ int peakfinder(cGlobal *global, cEventData *eventData, int detIndex)
 
         case 3: 	// Count number of Bragg peaks (Anton's "number of connected peaks above threshold" algorithm)
             nPeaks = peakfinder3(peaklist, data, mask, asic_nx, asic_ny, nasics_x, nasics_y, hitfinderADCthresh, hitfinderMinSNR, hitfinderMinPixCount,
-                    hitfinderMaxPixCount, hitfinderLocalBGRadius);
+                    hitfinderMaxPixCount, hitfinderLocalBGRadius, panelPool);
             break;
 
         case 6: 	// Count number of Bragg peaks (Rick's algorithm)
@@ -100,7 +105,7 @@ int peakfinder(cGlobal *global, cEventData *eventData, int detIndex)
 
         case 8: 	// Count number of Bragg peaks (Anton's noise-varying algorithm)
             nPeaks = peakfinder8(peaklist, data, mask, pix_r, asic_nx, asic_ny, nasics_x, nasics_y, hitfinderADCthresh, hitfinderMinSNR, hitfinderMinPixCount,
-                    hitfinderMaxPixCount, hitfinderLocalBGRadius);
+                    hitfinderMaxPixCount, hitfinderLocalBGRadius, panelPool);
             break;
 
         case 14: 	// Yaroslav's peakfinder
@@ -206,74 +211,127 @@ int peakfinder(cGlobal *global, cEventData *eventData, int detIndex)
 
 /*
  *	Find peaks that are too close together and remove them
+ *
+ *	Pairs closer than hitfinderMinPeakSeparation used to be visited in (p1, p2>p1) order, each pair
+ *	killing the weaker peak and reviving the stronger one. So the pair visited last decides a peak's fate:
+ *	its highest-numbered close neighbour after it if there is one, otherwise its highest-numbered close
+ *	neighbour before it. Close neighbours are looked up in a grid of cells a little over the separation.
  */
 int killNearbyPeaks(tPeakList *peaklist, float hitfinderMinPeakSeparation)
 {
 
-    int p, p1, p2;
-    int k = 0;
-    int n = peaklist->nPeaks;
-    float x1, x2;
-    float y1, y2;
-    float d2;
+    long n = peaklist->nPeaks;
+    float *x = peaklist->peak_com_x_assembled;
+    float *y = peaklist->peak_com_y_assembled;
+    float *maxI = peaklist->peak_maxintensity;
     float min_dsq = hitfinderMinPeakSeparation * hitfinderMinPeakSeparation;
 
     if (hitfinderMinPeakSeparation <= 0) {
         return n;
     }
 
-    char *killpeak = (char *) calloc(n, sizeof(char));
-    for (long i = 0; i < n; i++)
-        killpeak[i] = 0;
-
     if (n > peaklist->nPeaks_max)
         n = peaklist->nPeaks_max;
+    if (n <= 1) {
+        peaklist->nPeaks = n;
+        return n;
+    }
 
-    for (p1 = 0; p1 < n; p1++) {
-        x1 = peaklist->peak_com_x_assembled[p1];
-        y1 = peaklist->peak_com_y_assembled[p1];
-        for (p2 = p1 + 1; p2 < n; p2++) {
-            x2 = peaklist->peak_com_x_assembled[p2];
-            y2 = peaklist->peak_com_y_assembled[p2];
-
-            d2 = (x1 - x2) * (x1 - x2) + (y1 - y2) * (y1 - y2);
-
-            if (d2 <= min_dsq) {
-                if (peaklist->peak_maxintensity[p1] > peaklist->peak_maxintensity[p2]) {
-                    killpeak[p1] = 0;
-                    killpeak[p2] = 1;
-                    k++;
-                } else {
-                    killpeak[p1] = 1;
-                    killpeak[p2] = 0;
-                    k++;
-                }
-            }
+    /*
+     *	Grid extent (peaks with non-finite positions are never close to anything)
+     */
+    double xmin = 0, xmax = 0, ymin = 0, ymax = 0;
+    bool first = true;
+    for (long p = 0; p < n; p++) {
+        if (!std::isfinite(x[p]) || !std::isfinite(y[p]))
+            continue;
+        if (first || x[p] < xmin) xmin = x[p];
+        if (first || x[p] > xmax) xmax = x[p];
+        if (first || y[p] < ymin) ymin = y[p];
+        if (first || y[p] > ymax) ymax = y[p];
+        first = false;
+    }
+
+    // Slightly larger than the separation so rounding can't put a close pair two cells apart,
+    // and never more cells than about 4 per peak
+    double cell = 1.001 * hitfinderMinPeakSeparation;
+    cell = std::max(cell, sqrt((xmax - xmin) * (ymax - ymin) / (4.0 * n)));
+    cell = std::max(cell, std::max(xmax - xmin, ymax - ymin) / (4.0 * n));
+    long grid_nx = (long) ((xmax - xmin) / cell) + 1;
+    long grid_ny = (long) ((ymax - ymin) / cell) + 1;
+    long grid_nn = grid_nx * grid_ny;
+
+    /*
+     *	Peaks sorted by cell (counting sort, so each cell lists its peaks in increasing order)
+     */
+    long *peakCell = (long *) malloc(n * sizeof(long));
+    long *cellStart = (long *) calloc(grid_nn + 1, sizeof(long));
+    long *cellPeaks = (long *) malloc(n * sizeof(long));
+    for (long p = 0; p < n; p++) {
+        if (!std::isfinite(x[p]) || !std::isfinite(y[p])) {
+            peakCell[p] = -1;
+            continue;
         }
+        long cx = std::min((long) ((x[p] - xmin) / cell), grid_nx - 1);
+        long cy = std::min((long) ((y[p] - ymin) / cell), grid_ny - 1);
+        peakCell[p] = cx + cy * grid_nx;
+        cellStart[peakCell[p] + 1]++;
+    }
+    for (long c = 0; c < grid_nn; c++)
+        cellStart[c + 1] += cellStart[c];
+    long *fill = (long *) malloc(grid_nn * sizeof(long));
+    memcpy(fill, cellStart, grid_nn * sizeof(long));
+    for (long p = 0; p < n; p++) {
+        if (peakCell[p] >= 0)
+            cellPeaks[fill[peakCell[p]]++] = p;
     }
+    free(fill);
+
+    /*
+     *	Decide each peak from its last close neighbour (see above)
+     */
+    char *killpeak = (char *) calloc(n, sizeof(char));
+    for (long p = 0; p < n; p++) {
+        if (peakCell[p] < 0)
+            continue;
+
+        long cx = peakCell[p] % grid_nx;
+        long cy = peakCell[p] / grid_nx;
+        long after = -1;
+        long before = -1;
+
+        for (long j = std::max(cy - 1, 0L); j <= std::min(cy + 1, grid_ny - 1); j++) {
+            for (long i = std::max(cx - 1, 0L); i <= std::min(cx + 1, grid_nx - 1); i++) {
+                long c = i + j * grid_nx;
+                for (long k = cellStart[c]; k < cellStart[c + 1]; k++) {
+                    long q = cellPeaks[k];
+                    if (q == p)
+                        continue;
 
-    long c = 0;
-    for (p = 0; p < n; p++) {
-        if (killpeak[p] == 0) {
-            peaklist->peak_maxintensity[c] = peaklist->peak_maxintensity[p];
-            peaklist->peak_totalintensity[c] = peaklist->peak_totalintensity[p];
-            peaklist->peak_snr[c] = peaklist->peak_snr[p];
-            peaklist->peak_sigma[c] = peaklist->peak_sigma[p];
-            peaklist->peak_npix[c] = peaklist->peak_npix[p];
-            peaklist->peak_com_x[c] = peaklist->peak_com_x[p];
-            peaklist->peak_com_y[c] = peaklist->peak_com_y[p];
-            peaklist->peak_com_index[c] = peaklist->peak_com_index[p];
-            peaklist->peak_com_x_assembled[c] = peaklist->peak_com_x_assembled[p];
-            peaklist->peak_com_y_assembled[c] = peaklist->peak_com_y_assembled[p];
-            peaklist->peak_com_r_assembled[c] = peaklist->peak_com_r_assembled[p];
-            peaklist->peak_com_q[c] = peaklist->peak_com_q[p];
-            peaklist->peak_com_res[c] = peaklist->peak_com_res[p];
-            c++;
+                    float d2 = (x[p] - x[q]) * (x[p] - x[q]) + (y[p] - y[q]) * (y[p] - y[q]);
+                    if (d2 <= min_dsq) {
+                        if (q > p && q > after)
+                            after = q;
+                        if (q < p && q > before)
+                            before = q;
+                    }
+                }
+            }
         }
+
+        if (after >= 0)
+            killpeak[p] = (maxI[p] > maxI[after]) ? 0 : 1;
+        else if (before >= 0)
+            killpeak[p] = (maxI[before] > maxI[p]) ? 1 : 0;
     }
+
+    long c = compactPeakList(peaklist, killpeak, n);
+
     free(killpeak);
+    free(peakCell);
+    free(cellStart);
+    free(cellPeaks);
 
-    peaklist->nPeaks = c;
     return c;
 }
 
@@ -281,37 +339,83 @@ int killNearbyPeaks(tPeakList *peaklist, float hitfinderMinPeakSeparation)
  *	Peakfinder 3
  *	Count peaks by searching for connected pixels above threshold
  *	Anton Barty
+ *
+ *	Peaks never cross an ASIC edge, so each ASIC is searched on its own (concurrently if a pool is given)
+ *	and the peaks are collected in ASIC order afterwards, giving the same list as one pass over the frame.
  */
-int peakfinder3(tPeakList *peaklist, float *data, char *mask, long asic_nx, long asic_ny, long nasics_x, long nasics_y, float ADCthresh, float hitfinderMinSNR,
-        long hitfinderMinPixCount, long hitfinderMaxPixCount, long hitfinderLocalBGRadius)
-{
+typedef struct {
+    long e;
+    long nat;
+    float com_x;
+    float com_y;
+    float totI;
+    float maxI;
+    float sigma;
+    float snr;
+} tPeakfinder3Peak;
 
-    // Derived values
-    long pix_nx = asic_nx * nasics_x;
-    long pix_ny = asic_ny * nasics_y;
-    long pix_nn = pix_nx * pix_ny;
-    //long	asic_nn = asic_nx*asic_ny;
-    long hitfinderNpeaksMax = peaklist->nPeaks_max;
+typedef struct {
+    long *inx;
+    long *iny;
+    tPeakfinder3Peak *peaks;
+    long nPeaks;
+} tPeakfinder3Slot;
+
+typedef struct {
+    float *temp;
+    char *peakpixel;
+    long asic_nx;
+    long asic_ny;
+    long nasics_x;
+    long nasics_y;
+    float ADCthresh;
+    float hitfinderMinSNR;
+    long hitfinderMinPixCount;
+    long hitfinderMaxPixCount;
+    long hitfinderLocalBGRadius;
+    long hitfinderNpeaksMax;
+    tPeakfinder3Slot *slot;
+    long *asicSlot;
+    long *asicFirst;
+    long *asicCount;
+} tPeakfinder3Job;
 
-    peaklist->nPeaks = 0;
-    peaklist->peakNpix = 0;
-    peaklist->peakTotal = 0;
+
+/*
+ *	Search ASIC n, appending its peaks to the slot's list
+ *	A slot takes ASICs in increasing order, so a peak that misses the slot's list (nPeaks_max long)
+ *	would have missed the merged list as well
+ */
+static void peakfinder3Asic(void *arg, long n, long s) {
+    tPeakfinder3Job *job = (tPeakfinder3Job *) arg;
+    tPeakfinder3Slot *slot = &job->slot[s];
+
+    float *temp = job->temp;
+    char *peakpixel = job->peakpixel;
+    long *inx = slot->inx;
+    long *iny = slot->iny;
+    long asic_nx = job->asic_nx;
+    long asic_ny = job->asic_ny;
+    long pix_nx = asic_nx * job->nasics_x;
+    long pix_nn = pix_nx * asic_ny * job->nasics_y;
+    long mi = n % job->nasics_x;
+    long mj = n / job->nasics_x;
+    float ADCthresh = job->ADCthresh;
+    float hitfinderMinSNR = job->hitfinderMinSNR;
+    long hitfinderMinPixCount = job->hitfinderMinPixCount;
+    long hitfinderMaxPixCount = job->hitfinderMaxPixCount;
+    long hitfinderLocalBGRadius = job->hitfinderLocalBGRadius;
 
     // Variables for this hitfinder
     long nat = 0;
     long lastnat = 0;
-    long counter = 0;
-    float total;
     int search_x[] = { 0, -1, 0, 1, -1, 1, -1, 0, 1 };
     int search_y[] = { 0, -1, -1, -1, 0, 0, 1, 1, 1 };
     int search_n = 9;
     long e;
-    long *inx = (long *) calloc(pix_nn, sizeof(long));
-    long *iny = (long *) calloc(pix_nn, sizeof(long));
-    char *peakpixel = (char *) calloc(pix_nn, sizeof(long));
     float totI;
-    float maxI;
-    float snr;
+    float maxI = 0;
+    float snr = 0;
     float peak_com_x;
     float peak_com_y;
     long thisx;
@@ -319,237 +423,318 @@ int peakfinder3(tPeakList *peaklist, float *data, char *mask, long asic_nx, long
     long fs, ss;
     float com_x, com_y;
 
-    nat = 0;
-    counter = 0;
-    total = 0.0;
-    snr = 0;
-    maxI = 0;
+    job->asicSlot[n] = s;
+    job->asicFirst[n] = slot->nPeaks;
 
-    /*
-     *	Create a buffer for image data so we don't nuke the main image by mistake
-     */
-    float *temp = (float*) calloc(pix_nn, sizeof(float));
-    memcpy(temp, data, pix_nn * sizeof(float));
+    // Loop over pixels within a module
+    for (long j = 1; j < asic_ny - 1; j++) {
+        for (long i = 1; i < asic_nx - 1; i++) {
 
-    /*
-     *	Apply mask (multiply data by 0 to ignore regions - this makes data below threshold for peak finding)
-     */
-    for (long i = 0; i < pix_nn; i++) {
-        temp[i] *= mask[i];
-    }
-    for (long i = 0; i < pix_nn; i++) {
-        peakpixel[i] = 0;
-    }
-
-    // Loop over modules (8x8 array)
-    for (long mj = 0; mj < nasics_y; mj++) {
-        for (long mi = 0; mi < nasics_x; mi++) {
+            ss = (j + mj * asic_ny) * pix_nx;
+            fs = i + mi * asic_nx;
+            e = ss + fs;
 
-            // Loop over pixels within a module
-            for (long j = 1; j < asic_ny - 1; j++) {
-                for (long i = 1; i < asic_nx - 1; i++) {
+            if (e >= pix_nn) {
+                printf("Array bounds error: e=%li\n", e);
+                exit(1);
+            }
 
-                    ss = (j + mj * asic_ny) * pix_nx;
-                    fs = i + mi * asic_nx;
-                    e = ss + fs;
+            if (temp[e] > ADCthresh && peakpixel[e] == 0) {
+                // This might be the start of a new peak - start searching
+                inx[0] = i;
+                iny[0] = j;
+                nat = 1;
+                totI = 0;
+                maxI = 0;
+                peak_com_x = 0;
+                peak_com_y = 0;
+
+                // Keep looping until the pixel count within this peak does not change
+                do {
+
+                    lastnat = nat;
+                    // Loop through points known to be within this peak
+                    for (long p = 0; p < nat; p++) {
+                        // Loop through search pattern
+                        for (long k = 0; k < search_n; k++) {
+                            // Array bounds check
+                            if ((inx[p] + search_x[k]) < 0)
+                                continue;
+                            if ((inx[p] + search_x[k]) >= asic_nx)
+                                continue;
+                            if ((iny[p] + search_y[k]) < 0)
+                                continue;
+                            if ((iny[p] + search_y[k]) >= asic_ny)
+                                continue;
 
-                    if (e >= pix_nn) {
-                        printf("Array bounds error: e=%li\n", e);
-                        exit(1);
+                            // Neighbour point in big array
+                            thisx = inx[p] + search_x[k] + mi * asic_nx;
+                            thisy = iny[p] + search_y[k] + mj * asic_ny;
+                            e = thisx + thisy * pix_nx;
+
+                            //if(e < 0 || e >= pix_nn){
+                            //	printf("Array bounds error: e=%i\n",e);
+                            //	continue;
+                            //}
+
+                            // Above threshold?
+                            if (temp[e] > ADCthresh && peakpixel[e] == 0) {
+                                //if(nat < 0 || nat >= global->pix_nn) {
+                                //	printf("Array bounds error: nat=%i\n",nat);
+                                //	break
+                                //}
+                                if (temp[e] > maxI)
+                                    maxI = temp[e];
+                                totI += temp[e]; // add to integrated intensity
+                                peak_com_x += temp[e] * ((float) thisx); // for center of mass x
+                                peak_com_y += temp[e] * ((float) thisy); // for center of mass y
+                                temp[e] = 0; // zero out this intensity so that we don't count it again
+                                inx[nat] = inx[p] + search_x[k];
+                                iny[nat] = iny[p] + search_y[k];
+                                nat++;
+                                peakpixel[e] = 1;
+                            }
+                        }
                     }
+                } while (lastnat != nat);
 
-                    if (temp[e] > ADCthresh && peakpixel[e] == 0) {
-                        // This might be the start of a new peak - start searching
-                        inx[0] = i;
-                        iny[0] = j;
-                        nat = 1;
-                        totI = 0;
-                        maxI = 0;
-                        peak_com_x = 0;
-                        peak_com_y = 0;
-
-                        // Keep looping until the pixel count within this peak does not change
-                        do {
-
-                            lastnat = nat;
-                            // Loop through points known to be within this peak
-                            for (long p = 0; p < nat; p++) {
-                                // Loop through search pattern
-                                for (long k = 0; k < search_n; k++) {
-                                    // Array bounds check
-                                    if ((inx[p] + search_x[k]) < 0)
-                                        continue;
-                                    if ((inx[p] + search_x[k]) >= asic_nx)
-                                        continue;
-                                    if ((iny[p] + search_y[k]) < 0)
-                                        continue;
-                                    if ((iny[p] + search_y[k]) >= asic_ny)
-                                        continue;
-
-                                    // Neighbour point in big array
-                                    thisx = inx[p] + search_x[k] + mi * asic_nx;
-                                    thisy = iny[p] + search_y[k] + mj * asic_ny;
-                                    e = thisx + thisy * pix_nx;
-
-                                    //if(e < 0 || e >= pix_nn){
-                                    //	printf("Array bounds error: e=%i\n",e);
-                                    //	continue;
-                                    //}
-
-                                    // Above threshold?
-                                    if (temp[e] > ADCthresh && peakpixel[e] == 0) {
-                                        //if(nat < 0 || nat >= global->pix_nn) {
-                                        //	printf("Array bounds error: nat=%i\n",nat);
-                                        //	break
-                                        //}
-                                        if (temp[e] > maxI)
-                                            maxI = temp[e];
-                                        totI += temp[e]; // add to integrated intensity
-                                        peak_com_x += temp[e] * ((float) thisx); // for center of mass x
-                                        peak_com_y += temp[e] * ((float) thisy); // for center of mass y
-                                        temp[e] = 0; // zero out this intensity so that we don't count it again
-                                        inx[nat] = inx[p] + search_x[k];
-                                        iny[nat] = iny[p] + search_y[k];
-                                        nat++;
-                                        peakpixel[e] = 1;
-                                    }
-                                }
-                            }
-                        } while (lastnat != nat);
+                // Too many or too few pixels means ignore this 'peak'; move on now
+                if (nat < hitfinderMinPixCount || nat > hitfinderMaxPixCount) {
+                    continue;
+                }
 
-                        // Too many or too few pixels means ignore this 'peak'; move on now
-                        if (nat < hitfinderMinPixCount || nat > hitfinderMaxPixCount) {
+                /*
+                 *	Calculate center of mass
+                 */
+                com_x = peak_com_x / fabs(totI);
+                com_y = peak_com_y / fabs(totI);
+
+                long com_xi = lrint(com_x) - mi * asic_nx;
+                long com_yi = lrint(com_y) - mj * asic_ny;
+
+                /*
+                 *	Calculate signal-to-noise ratio in an annulus around this peak
+                 */
+                float localSigma = 0;
+                long ringWidth = 2 * hitfinderLocalBGRadius;
+                float thisr;
+
+                float sum = 0;
+                float sumsquared = 0;
+                long np_sigma = 0;
+                long np_counted = 0;
+                for (long bj = -ringWidth; bj < ringWidth; bj++) {
+                    for (long bi = -ringWidth; bi < ringWidth; bi++) {
+
+                        // Within annulus, or square?
+                        thisr = sqrt(bi * bi + bj * bj);
+                        //if(thisr < hitfinderLocalBGRadius || thisr > 2*hitfinderLocalBGRadius )
+                        //if(thisr < hitfinderLocalBGRadius)
+                        //	continue;
+
+                        // Within-ASIC check
+                        if ((com_xi + bi) < 0)
+                            continue;
+                        if ((com_xi + bi) >= asic_nx)
+                            continue;
+                        if ((com_yi + bj) < 0)
+                            continue;
+                        if ((com_yi + bj) >= asic_ny)
                             continue;
-                        }
 
-                        /*
-                         *	Calculate center of mass
-                         */
-                        com_x = peak_com_x / fabs(totI);
-                        com_y = peak_com_y / fabs(totI);
-
-                        long com_xi = lrint(com_x) - mi * asic_nx;
-                        long com_yi = lrint(com_y) - mj * asic_ny;
-
-                        /*
-                         *	Calculate signal-to-noise ratio in an annulus around this peak
-                         */
-                        float localSigma = 0;
-                        long ringWidth = 2 * hitfinderLocalBGRadius;
-                        float thisr;
-
-                        float sum = 0;
-                        float sumsquared = 0;
-                        long np_sigma = 0;
-                        long np_counted = 0;
-                        for (long bj = -ringWidth; bj < ringWidth; bj++) {
-                            for (long bi = -ringWidth; bi < ringWidth; bi++) {
-
-                                // Within annulus, or square?
-                                thisr = sqrt(bi * bi + bj * bj);
-                                //if(thisr < hitfinderLocalBGRadius || thisr > 2*hitfinderLocalBGRadius )
-                                //if(thisr < hitfinderLocalBGRadius)
-                                //	continue;
-
-                                // Within-ASIC check
-                                if ((com_xi + bi) < 0)
-                                    continue;
-                                if ((com_xi + bi) >= asic_nx)
-                                    continue;
-                                if ((com_yi + bj) < 0)
-                                    continue;
-                                if ((com_yi + bj) >= asic_ny)
-                                    continue;
-
-                                // Position of this point in data stream
-                                thisx = com_xi + bi + mi * asic_nx;
-                                thisy = com_yi + bj + mj * asic_ny;
-                                e = thisx + thisy * pix_nx;
-
-                                // If pixel is less than ADC threshold, this pixel is a part of the background and not part of a peak
-                                if (temp[e] < ADCthresh && peakpixel[e] == 0) {
-                                    np_sigma++;
-                                    sum += temp[e];
-                                    sumsquared += (temp[e] * temp[e]);
-                                }
-                                np_counted += 1;
-                            }
+                        // Position of this point in data stream
+                        thisx = com_xi + bi + mi * asic_nx;
+                        thisy = com_yi + bj + mj * asic_ny;
+                        e = thisx + thisy * pix_nx;
+
+                        // If pixel is less than ADC threshold, this pixel is a part of the background and not part of a peak
+                        if (temp[e] < ADCthresh && peakpixel[e] == 0) {
+                            np_sigma++;
+                            sum += temp[e];
+                            sumsquared += (temp[e] * temp[e]);
                         }
+                        np_counted += 1;
+                    }
+                }
 
-                        // Calculate =standard deviation
-                        if (np_sigma == 0)
-                            continue;
-                        if (np_sigma < 0.5 * np_counted)
-                            continue;
+                // Calculate =standard deviation
+                if (np_sigma == 0)
+                    continue;
+                if (np_sigma < 0.5 * np_counted)
+                    continue;
 
-                        if (np_sigma != 0)
-                            localSigma = sqrt(sumsquared / np_sigma - ((sum / np_sigma) * (sum / np_sigma)));
-                        else
-                            localSigma = 0;
+                if (np_sigma != 0)
+                    localSigma = sqrt(sumsquared / np_sigma - ((sum / np_sigma) * (sum / np_sigma)));
+                else
+                    localSigma = 0;
 
-                        // This part of the detector is too noisy if we have too few pixels < ADCthresh in background region
+                // This part of the detector is too noisy if we have too few pixels < ADCthresh in background region
 
-                        // sigma
-                        snr = (float) maxI / localSigma;
+                // sigma
+                snr = (float) maxI / localSigma;
 
-                        // Signal to noise criterion (turn off check by setting hitfinderMinSNR = 0)
-                        //printf("HitfinderMinSNR, Imax, sigma: %f, %f, %f\n", hitfinderMinSNR, maxI, localSigma);
-                        if (hitfinderMinSNR > 0) {
-                            if (maxI < (localSigma * hitfinderMinSNR)) {
-                                continue;
-                            }
-                        }
+                // Signal to noise criterion (turn off check by setting hitfinderMinSNR = 0)
+                //printf("HitfinderMinSNR, Imax, sigma: %f, %f, %f\n", hitfinderMinSNR, maxI, localSigma);
+                if (hitfinderMinSNR > 0) {
+                    if (maxI < (localSigma * hitfinderMinSNR)) {
+                        continue;
+                    }
+                }
 
-                        // This is a peak? If so, add info to peak list
-                        if (nat >= hitfinderMinPixCount && nat <= hitfinderMaxPixCount) {
+                // This is a peak? If so, add info to peak list
+                if (nat >= hitfinderMinPixCount && nat <= hitfinderMaxPixCount) {
 
-                            // This CAN happen!
-                            if (totI == 0)
-                                continue;
+                    // This CAN happen!
+                    if (totI == 0)
+                        continue;
 
-                            com_x = peak_com_x / fabs(totI);
-                            com_y = peak_com_y / fabs(totI);
+                    com_x = peak_com_x / fabs(totI);
+                    com_y = peak_com_y / fabs(totI);
 
-                            e = lrint(com_x) + lrint(com_y) * pix_nx;
-                            if (e < 0 || e >= pix_nn) {
-                                printf("Array bounds error: e=%ld\n", e);
-                                continue;
-                            }
+                    e = lrint(com_x) + lrint(com_y) * pix_nx;
+                    if (e < 0 || e >= pix_nn) {
+                        printf("Array bounds error: e=%ld\n", e);
+                        continue;
+                    }
 
-                            // Remember peak information
-                            if (counter < hitfinderNpeaksMax) {
-                                peaklist->peakNpix += nat;
-                                peaklist->peakTotal += totI;
-                                peaklist->peak_com_index[counter] = e;
-                                peaklist->peak_npix[counter] = nat;
-                                peaklist->peak_com_x[counter] = com_x;
-                                peaklist->peak_com_y[counter] = com_y;
-                                peaklist->peak_totalintensity[counter] = totI;
-                                peaklist->peak_maxintensity[counter] = maxI;
-                                peaklist->peak_sigma[counter] = localSigma;
-                                peaklist->peak_snr[counter] = snr;
-                                counter++;
-                                peaklist->nPeaks = counter;
-                            }
-                            else {
-                                counter++;
-                            }
-                        }
+                    // Remember peak information
+                    if (slot->nPeaks < job->hitfinderNpeaksMax) {
+                        tPeakfinder3Peak *peak = &slot->peaks[slot->nPeaks];
+                        peak->e = e;
+                        peak->nat = nat;
+                        peak->com_x = com_x;
+                        peak->com_y = com_y;
+                        peak->totI = totI;
+                        peak->maxI = maxI;
+                        peak->sigma = localSigma;
+                        peak->snr = snr;
                     }
+                    slot->nPeaks++;
                 }
             }
         }
     }
 
+    job->asicCount[n] = slot->nPeaks - job->asicFirst[n];
+}
+
+
+int peakfinder3(tPeakList *peaklist, float *data, char *mask, long asic_nx, long asic_ny, long nasics_x, long nasics_y, float ADCthresh, float hitfinderMinSNR,
+        long hitfinderMinPixCount, long hitfinderMaxPixCount, long hitfinderLocalBGRadius, cWorkerPool *panelPool)
+{
+
+    // Derived values
+    long pix_nx = asic_nx * nasics_x;
+    long pix_ny = asic_ny * nasics_y;
+    long pix_nn = pix_nx * pix_ny;
+    long asic_nn = asic_nx * asic_ny;
+    long nasics = nasics_x * nasics_y;
+    long hitfinderNpeaksMax = peaklist->nPeaks_max;
+    long nSlots = (panelPool != NULL) ? panelPool->nSlots() : 1;
+
+    peaklist->nPeaks = 0;
+    peaklist->peakNpix = 0;
+    peaklist->peakTotal = 0;
+
+    char *peakpixel = (char *) calloc(pix_nn, sizeof(char));
+
+    /*
+     *	Create a buffer for image data so we don't nuke the main image by mistake
+     */
+    float *temp = (float*) calloc(pix_nn, sizeof(float));
+    memcpy(temp, data, pix_nn * sizeof(float));
+
+    /*
+     *	Apply mask (multiply data by 0 to ignore regions - this makes data below threshold for peak finding)
+     */
+    for (long i = 0; i < pix_nn; i++) {
+        temp[i] *= mask[i];
+    }
+
+    /*
+     *	Search buffers for each slot, and where each ASIC's peaks went
+     */
+    tPeakfinder3Slot *slot = (tPeakfinder3Slot *) calloc(nSlots, sizeof(tPeakfinder3Slot));
+    for (long s = 0; s < nSlots; s++) {
+        slot[s].inx = (long *) calloc(asic_nn + 1, sizeof(long));
+        slot[s].iny = (long *) calloc(asic_nn + 1, sizeof(long));
+        slot[s].peaks = (tPeakfinder3Peak *) calloc(hitfinderNpeaksMax, sizeof(tPeakfinder3Peak));
+        slot[s].nPeaks = 0;
+    }
+
+    tPeakfinder3Job job;
+    job.temp = temp;
+    job.peakpixel = peakpixel;
+    job.asic_nx = asic_nx;
+    job.asic_ny = asic_ny;
+    job.nasics_x = nasics_x;
+    job.nasics_y = nasics_y;
+    job.ADCthresh = ADCthresh;
+    job.hitfinderMinSNR = hitfinderMinSNR;
+    job.hitfinderMinPixCount = hitfinderMinPixCount;
+    job.hitfinderMaxPixCount = hitfinderMaxPixCount;
+    job.hitfinderLocalBGRadius = hitfinderLocalBGRadius;
+    job.hitfinderNpeaksMax = hitfinderNpeaksMax;
+    job.slot = slot;
+    job.asicSlot = (long *) calloc(nasics, sizeof(long));
+    job.asicFirst = (long *) calloc(nasics, sizeof(long));
+    job.asicCount = (long *) calloc(nasics, sizeof(long));
+
+    // Loop over modules (8x8 array)
+    if (panelPool != NULL) {
+        panelPool->parallelFor(nasics, peakfinder3Asic, &job);
+    }
+    else {
+        for (long n = 0; n < nasics; n++)
+            peakfinder3Asic(&job, n, 0);
+    }
+
+    /*
+     *	Peaks in ASIC order
+     */
+    long counter = 0;
+    for (long n = 0; n < nasics; n++) {
+        tPeakfinder3Slot *s = &slot[job.asicSlot[n]];
+        for (long k = 0; k < job.asicCount[n] && counter < hitfinderNpeaksMax; k++) {
+            tPeakfinder3Peak *peak = &s->peaks[job.asicFirst[n] + k];
+            peaklist->peakNpix += peak->nat;
+            peaklist->peakTotal += peak->totI;
+            peaklist->peak_com_index[counter] = peak->e;
+            peaklist->peak_npix[counter] = peak->nat;
+            peaklist->peak_com_x[counter] = peak->com_x;
+            peaklist->peak_com_y[counter] = peak->com_y;
+            peaklist->peak_totalintensity[counter] = peak->totI;
+            peaklist->peak_maxintensity[counter] = peak->maxI;
+            peaklist->peak_sigma[counter] = peak->sigma;
+            peaklist->peak_snr[counter] = peak->snr;
+            counter++;
+            peaklist->nPeaks = counter;
+        }
+    }
+
+    for (long s = 0; s < nSlots; s++) {
+        free(slot[s].inx);
+        free(slot[s].iny);
+        free(slot[s].peaks);
+    }
+    free(slot);
+    free(job.asicSlot);
+    free(job.asicFirst);
+    free(job.asicCount);
     free(temp);
-    free(inx);
-    free(iny);
     free(peakpixel);
 
     return (peaklist->nPeaks);
 
 }
 
+int peakfinder3(tPeakList *peaklist, float *data, char *mask, long asic_nx, long asic_ny, long nasics_x, long nasics_y, float ADCthresh, float hitfinderMinSNR,
+        long hitfinderMinPixCount, long hitfinderMaxPixCount, long hitfinderLocalBGRadius)
+{
+    return peakfinder3(peaklist, data, mask, asic_nx, asic_ny, nasics_x, nasics_y, ADCthresh, hitfinderMinSNR,
+            hitfinderMinPixCount, hitfinderMaxPixCount, hitfinderLocalBGRadius, NULL);
+}
+
 
 /*
  *	Peak finder 6
@@ -0,0 +1,217 @@
+//
+//  pixelHistogram.cpp
+//  cheetah
+//
+//  Per pixel histogram of detector values (see addToHistogram)
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <algorithm>
+
+#include "pixelHistogram.h"
+
+
+cPixelHistogram::cPixelHistogram(long nPixels0, long nBins0) {
+	nPixels = nPixels0;
+	nBins = nBins0;
+	n_tiles = (nPixels + PIXELHISTOGRAM_TILE_NN - 1) / PIXELHISTOGRAM_TILE_NN;
+
+	counts = (uint8_t *) calloc((uint64_t) nPixels * (uint64_t) nBins, sizeof(uint8_t));
+	carry = (tCarry **) calloc(nPixels, sizeof(tCarry *));
+	nCarry = (uint16_t *) calloc(nPixels, sizeof(uint16_t));
+	tileMutex = (pthread_mutex_t *) malloc(n_tiles * sizeof(pthread_mutex_t));
+	for(long t=0; t<n_tiles; t++)
+		pthread_mutex_init(&tileMutex[t], NULL);
+	pthread_mutex_init(&frameMutex, NULL);
+	pthread_cond_init(&frameCond, NULL);
+	nFrames = 0;
+	snapshotting = false;
+}
+
+cPixelHistogram::~cPixelHistogram() {
+	for(long i=0; i<nPixels; i++)
+		free(carry[i]);
+	for(long t=0; t<n_tiles; t++)
+		pthread_mutex_destroy(&tileMutex[t]);
+	pthread_mutex_destroy(&frameMutex);
+	pthread_cond_destroy(&frameCond);
+	free(counts);
+	free(carry);
+	free(nCarry);
+	free(tileMutex);
+}
+
+
+/*
+ *	Bytes allocated for a histogram of this size, not counting carries (a few bins per pixel at most)
+ */
+uint64_t cPixelHistogram::footprint(long nPixels, long nBins) {
+	uint64_t	nTiles = (nPixels + PIXELHISTOGRAM_TILE_NN - 1) / PIXELHISTOGRAM_TILE_NN;
+	return (uint64_t) nPixels * (uint64_t) nBins * sizeof(uint8_t)
+		+ (uint64_t) nPixels * (sizeof(tCarry *) + sizeof(uint16_t))
+		+ nTiles * sizeof(pthread_mutex_t);
+}
+
+
+long cPixelHistogram::nTiles(void) {
+	return n_tiles;
+}
+
+long cPixelHistogram::tileFirst(long tile) {
+	return tile * PIXELHISTOGRAM_TILE_NN;
+}
+
+long cPixelHistogram::tileSize(long tile) {
+	long first = tileFirst(tile);
+	return (first + PIXELHISTOGRAM_TILE_NN <= nPixels) ? PIXELHISTOGRAM_TILE_NN : nPixels - first;
+}
+
+
+/*
+ *	All addTile() calls for one frame go between beginFrame() and endFrame(),
+ *	so that a snapshot never holds part of a frame
+ *	New frames wait while a snapshot is pending, so a busy histogram cannot hold it off
+ */
+void cPixelHistogram::beginFrame(void) {
+	pthread_mutex_lock(&frameMutex);
+	while(snapshotting)
+		pthread_cond_wait(&frameCond, &frameMutex);
+	nFrames++;
+	pthread_mutex_unlock(&frameMutex);
+}
+
+void cPixelHistogram::endFrame(void) {
+	pthread_mutex_lock(&frameMutex);
+	if(--nFrames == 0)
+		pthread_cond_broadcast(&frameCond);
+	pthread_mutex_unlock(&frameMutex);
+}
+
+void cPixelHistogram::beginSnapshot(void) {
+	pthread_mutex_lock(&frameMutex);
+	while(snapshotting)
+		pthread_cond_wait(&frameCond, &frameMutex);
+	snapshotting = true;
+	while(nFrames > 0)
+		pthread_cond_wait(&frameCond, &frameMutex);
+	pthread_mutex_unlock(&frameMutex);
+}
+
+void cPixelHistogram::endSnapshot(void) {
+	pthread_mutex_lock(&frameMutex);
+	snapshotting = false;
+	pthread_cond_broadcast(&frameCond);
+	pthread_mutex_unlock(&frameMutex);
+}
+
+
+/*
+ *	Count one frame for the pixels of a tile (bins[i] for pixel tileFirst(tile)+i)
+ */
+void cPixelHistogram::addTile(long tile, const uint16_t *bins) {
+	long	first = tileFirst(tile);
+	long	n = tileSize(tile);
+
+	pthread_mutex_lock(&tileMutex[tile]);
+	uint8_t	*c = counts + (uint64_t) first * nBins;
+	for(long i=0; i<n; i++, c+=nBins) {
+		if(++c[bins[i]] == 0)
+			addCarry(first+i, bins[i]);
+	}
+	pthread_mutex_unlock(&tileMutex[tile]);
+}
+
+
+/*
+ *	One more wrap of the byte counter of this pixel and bin (tile lock held)
+ */
+void cPixelHistogram::addCarry(long pixel, long bin) {
+	tCarry	*list = carry[pixel];
+	long	nList = nCarry[pixel];
+
+	for(long j=0; j<nList; j++) {
+		if(list[j].bin == (uint32_t) bin) {
+			list[j].carry += 1;
+			return;
+		}
+	}
+	list = (tCarry *) realloc(list, (nList+1)*sizeof(tCarry));
+	list[nList].bin = bin;
+	list[nList].carry = 1;
+	carry[pixel] = list;
+	nCarry[pixel] = nList+1;
+}
+
+
+/*
+ *	Full counts of n pixels starting at first, nBins per pixel
+ *	Locks one tile at a time, so workers only wait for the tile being copied
+ */
+void cPixelHistogram::copy(long first, long n, uint32_t *out) {
+	long	last = first + n;
+
+	for(long tile=first/PIXELHISTOGRAM_TILE_NN; tile<n_tiles && tileFirst(tile)<last; tile++) {
+		long	start = std::max(first, tileFirst(tile));
+		long	end = std::min(last, tileFirst(tile) + tileSize(tile));
+
+		pthread_mutex_lock(&tileMutex[tile]);
+		for(long i=start; i<end; i++)
+			pixelCounts(i, out + (uint64_t) (i-first) * nBins);
+		pthread_mutex_unlock(&tileMutex[tile]);
+	}
+}
+
+
+/*
+ *	Full counts of all pixels, between frames
+ *	Workers wait for the whole copy, so this is for the accumulated output rather than streaming
+ */
+void cPixelHistogram::snapshot(uint32_t *out) {
+	beginSnapshot();
+	for(long i=0; i<nPixels; i++)
+		pixelCounts(i, out + (uint64_t) i * nBins);
+	endSnapshot();
+}
+
+
+/*
+ *	Non-zero bins of all pixels, between frames
+ *	Those of pixel i are (*bins)[pixelOffset[i]..pixelOffset[i+1]-1], pixelOffset has nPixels+1 entries
+ */
+void cPixelHistogram::snapshotSparse(long *pixelOffset, std::vector<uint16_t> *bins, std::vector<uint32_t> *counts) {
+	uint32_t	*buffer = (uint32_t *) malloc(nBins * sizeof(uint32_t));
+
+	bins->clear();
+	counts->clear();
+	beginSnapshot();
+	for(long i=0; i<nPixels; i++) {
+		pixelOffset[i] = bins->size();
+		pixelCounts(i, buffer);
+		for(long j=0; j<nBins; j++) {
+			if(buffer[j] != 0) {
+				bins->push_back(j);
+				counts->push_back(buffer[j]);
+			}
+		}
+	}
+	endSnapshot();
+	pixelOffset[nPixels] = bins->size();
+	free(buffer);
+}
+
+
+/*
+ *	Full counts of one pixel (its tile lock held, or during a snapshot)
+ */
+void cPixelHistogram::pixelCounts(long pixel, uint32_t *out) {
+	uint8_t		*c = counts + (uint64_t) pixel * nBins;
+
+	for(long j=0; j<nBins; j++)
+		out[j] = c[j];
+	for(long j=0; j<nCarry[pixel]; j++)
+		out[carry[pixel][j].bin] += carry[pixel][j].carry << 8;
+}
+
@@ -47,78 +47,79 @@ void addToPowder(cEventData *eventData, cGlobal *global) {
 }
 
 
+/*
+ *	Welford update of a running mean and M2 with one frame
+ *	Values at or below powderthresh (if set) go in as 0.
+ *	With a counter, only pixels that are not hot, bad or in the jet are taken and counted
+ */
+static void accumulatePowder(cPowderShards::tAccumulator *acc, const float *data, const uint16_t *pixelmask, cGlobal *global) {
+	bool	useThresh = global->usePowderThresh;
+	float	thresh = global->powderthresh;
+	double	*mean = acc->mean;
+	double	*m2 = acc->m2;
+	long	pix_nn = acc->pix_nn;
+
+	if(acc->counter == NULL) {
+		double	w = 1.0/(acc->n + 1);
+		for(long i=0; i<pix_nn; i++){
+			double	x = (!useThresh || data[i] > thresh) ? data[i] : 0;
+			double	d = x - mean[i];
+			mean[i] += d*w;
+			m2[i] += d*(x - mean[i]);
+		}
+	}
+	else {
+		long		*counter = acc->counter;
+		uint16_t	combined_pixel_options = PIXEL_IS_HOT|PIXEL_IS_BAD|PIXEL_IS_IN_JET;
+		for(long i=0; i<pix_nn; i++){
+			if(isNoneOfBitOptionsSet(pixelmask[i], combined_pixel_options)) {
+				double	x = (!useThresh || data[i] > thresh) ? data[i] : 0;
+				double	d = x - mean[i];
+				counter[i] += 1;
+				mean[i] += d/counter[i];
+				m2[i] += d*(x - mean[i]);
+			}
+		}
+	}
+	acc->n += 1;
+	acc->dirty = true;
+}
+
+
 void addToPowder(cEventData *eventData, cGlobal *global, int powderClass, long detIndex){
 
-	// Increment counter of number of powder patterns
-	pthread_mutex_lock(&global->detector[detIndex].powderData_mutex[powderClass]);
-	global->detector[detIndex].nPowderFrames[powderClass] += 1;
+	cPixelDetectorCommon	*detector = &global->detector[detIndex];
+	uint16_t	*pixelmask = eventData->detector[detIndex].pixelmask;
+
 	if(detIndex == 0)
-		global->nPowderFrames[powderClass] += 1;
-	pthread_mutex_unlock(&global->detector[detIndex].powderData_mutex[powderClass]);
-	
-    double  *buffer;	
-	FOREACH_DATAFORMAT_T(i_f, cDataVersion::DATA_FORMATS) {
-		if (isBitOptionSet(global->detector[detIndex].powderFormat,*i_f)) {
-			cDataVersion dataV(&eventData->detector[detIndex], &global->detector[detIndex], global->detector[detIndex].powderVersion, *i_f);
-			while (dataV.next()) {
-				float * data = dataV.getData();
-				double * powder = dataV.getPowder(powderClass);
-				double * powder_squared = dataV.getPowderSquared(powderClass);
-				long * powder_counter = dataV.getPowderCounter(powderClass);
-				pthread_mutex_t * mutex = dataV.getPowderMutex(powderClass);
+		__sync_fetch_and_add(&global->nPowderFrames[powderClass], 1);
 
-				
-                // Powder squared
-				buffer = (double*) calloc(dataV.pix_nn, sizeof(double));
-				if(!global->usePowderThresh) {
-					for(long i=0; i<dataV.pix_nn; i++)
-                        // Use double precision throughout the multiplication to reduce rounding errors in powder_squared
-						buffer[i] = ((double) data[i])*data[i];
-				}
-				else {
-					for(long i=0; i<dataV.pix_nn; i++){
-						if(data[i] > global->powderthresh)
-                            // Use double precision throughout the multiplication to reduce rounding errors in powder_squared
-							buffer[i] = ((double) data[i])*data[i];
-						else
-							buffer[i] = 0;
-					}
-				}
-				if (global->threadSafetyLevel > 0) {
-					pthread_mutex_lock(mutex);
-				}
-				
-				if(global->detector[detIndex].savePowderMasked == 0 || powder_counter==NULL) {
-					for(long i=0; i<dataV.pix_nn; i++){
-						// Powder
-						powder[i] += data[i];
-						// Powder squared
-						powder_squared[i] += buffer[i];
-					}
-				}
-				else if(global->detector[detIndex].savePowderMasked != 0 && powder_counter!=NULL) {
-					uint16_t	*pixelmask = eventData->detector[detIndex].pixelmask;
-					uint16_t	combined_pixel_options = PIXEL_IS_HOT|PIXEL_IS_BAD|PIXEL_IS_IN_JET;
-					for(long i=0; i<dataV.pix_nn; i++){
-						if(isNoneOfBitOptionsSet(pixelmask[i], combined_pixel_options)) {
-							// Powder
-							powder[i] += data[i];
-							// Powder squared
-							powder_squared[i] += buffer[i];
-							// Counter
-							powder_counter[i] += 1;
-						}
-					}
-				}
+	// Assembled images and radial averages are only made for frames that need them
+	if (isAnyOfBitOptionsSet(detector->powderFormat, cDataVersion::DATA_FORMAT_ASSEMBLED | cDataVersion::DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED))
+		assemble2DOnce(eventData, global);
+	if (isBitOptionSet(detector->powderFormat, cDataVersion::DATA_FORMAT_RADIAL_AVERAGE))
+		calculateRadialAverageOnce(eventData, global);
 
-				
-				if (global->threadSafetyLevel > 0)
-					pthread_mutex_unlock(mutex);
-				free(buffer);
+	/*
+	 *	Sum into a shard; the shared powders only see it when they are next read (reducePowder)
+	 */
+	cPowderShards::tShard	*shard = global->powderShards.acquire();
+	shard->nFrames[detIndex][powderClass] += 1;
+
+	FOREACH_DATAFORMAT_T(i_f, cDataVersion::DATA_FORMATS) {
+		if (isBitOptionSet(detector->powderFormat,*i_f)) {
+			int formatIndex = i_f - cDataVersion::DATA_FORMATS;
+			// Only the non-assembled powders have per pixel counters
+			bool masked = (detector->savePowderMasked != 0 && *i_f == cDataVersion::DATA_FORMAT_NON_ASSEMBLED);
+			cDataVersion dataV(&eventData->detector[detIndex], detector, detector->powderVersion, *i_f);
+			for(int versionIndex=0; dataV.next(); versionIndex++) {
+				cPowderShards::tAccumulator	*acc = global->powderShards.accumulator(shard, detIndex, powderClass, formatIndex, versionIndex, dataV.pix_nn, masked);
+				accumulatePowder(acc, dataV.getData(), pixelmask, global);
 			}
 		}
 	}
-	
+	global->powderShards.release(shard);
+
 	/*
      *  Sum of peaks centroids
      */
@@ -191,11 +192,91 @@ void saveRunningSums(cGlobal *global, int detIndex) {
     }
 }
 
+/*
+ *	Fold the powder shards into the shared powders
+ *	Call before anything reads powderData_* or nPowderFrames; shards nothing was added to since the last call are skipped
+ */
+void reducePowder(cGlobal *global) {
+	cPowderShards	*shards = &global->powderShards;
+
+	for(long s=0; s<shards->nShards(); s++) {
+		cPowderShards::tShard	*shard = shards->lock(s);
+
+		DETECTOR_LOOP {
+			cPixelDetectorCommon	*detector = &global->detector[detIndex];
+			for(long powderClass=0; powderClass < global->nPowderClasses; powderClass++) {
+				FOREACH_DATAFORMAT_T(i_f, cDataVersion::DATA_FORMATS) {
+					int formatIndex = i_f - cDataVersion::DATA_FORMATS;
+					cDataVersion dataV(NULL, detector, detector->powderVersion, *i_f);
+					for(int versionIndex=0; dataV.next(); versionIndex++) {
+						cPowderShards::tAccumulator	*acc = &shard->acc[detIndex][powderClass][formatIndex][versionIndex];
+						if(!acc->dirty)
+							continue;
+
+						double	*powder = dataV.getPowder(powderClass);
+						double	*powder_m2 = dataV.getPowderSquared(powderClass);
+						pthread_mutex_t	*mutex = dataV.getPowderMutex(powderClass);
+
+						/*
+						 *	Merge (nA, sum, M2) with the shard's (nB, mean, M2) (Chan et al.)
+						 *	nA is the frame count before this shard's frames are added, or the pixel counter
+						 */
+						if (global->threadSafetyLevel > 0)
+							pthread_mutex_lock(mutex);
+						if(acc->counter == NULL) {
+							double	nA = detector->nPowderFrames[powderClass];
+							double	nB = acc->n;
+							double	wA = (nA > 0) ? 1/nA : 0;
+							double	wAB = nA*nB/(nA+nB);
+							for(long i=0; i<acc->pix_nn; i++) {
+								double	d = acc->mean[i] - powder[i]*wA;
+								powder[i] += acc->mean[i]*nB;
+								powder_m2[i] += acc->m2[i] + d*d*wAB;
+							}
+						}
+						else {
+							long	*powder_counter = dataV.getPowderCounter(powderClass);
+							for(long i=0; i<acc->pix_nn; i++) {
+								if(acc->counter[i] == 0)
+									continue;
+								double	nA = powder_counter[i];
+								double	nB = acc->counter[i];
+								double	d = (nA > 0) ? acc->mean[i] - powder[i]/nA : 0;
+								powder[i] += acc->mean[i]*nB;
+								powder_m2[i] += acc->m2[i] + d*d*nA*nB/(nA+nB);
+								powder_counter[i] += acc->counter[i];
+							}
+							memset(acc->counter, 0, acc->pix_nn*sizeof(long));
+						}
+						if (global->threadSafetyLevel > 0)
+							pthread_mutex_unlock(mutex);
+
+						memset(acc->mean, 0, acc->pix_nn*sizeof(double));
+						memset(acc->m2, 0, acc->pix_nn*sizeof(double));
+						acc->n = 0;
+						acc->dirty = false;
+					}
+				}
+
+				if(shard->nFrames[detIndex][powderClass] != 0) {
+					pthread_mutex_lock(&detector->powderData_mutex[powderClass]);
+					detector->nPowderFrames[powderClass] += shard->nFrames[detIndex][powderClass];
+					pthread_mutex_unlock(&detector->powderData_mutex[powderClass]);
+					shard->nFrames[detIndex][powderClass] = 0;
+				}
+			}
+		}
+		shards->release(shard);
+	}
+}
+
+
 /*
  *	Wrapper for saving all powder patterns for a detector
  *  Also for deciding whether to calculate gain, darkcal, etc.
  */
 void saveRunningSums(cGlobal *global) {
+    reducePowder(global);
     printf("Writing powder patterns to file:\n");
     for(int detIndex=0; detIndex<global->nDetectors; detIndex++) {
         saveRunningSums(global, detIndex);
@@ -299,7 +380,10 @@ void savePowderPattern(cGlobal *global, int detIndex, int powderClass) {
 				}
 				double *powder = dataV.getPowder(powderClass);
 				double *powder_squared = dataV.getPowderSquared(powderClass);
-				long *powder_counter = dataV.getPowderCounter(powderClass);
+				// Only the non-assembled powders have per pixel counters, and only when they are masked
+				long *powder_counter = NULL;
+				if (global->detector[detIndex].savePowderMasked != 0 && *i_f == cDataVersion::DATA_FORMAT_NON_ASSEMBLED)
+					powder_counter = dataV.getPowderCounter(powderClass);
 				pthread_mutex_t *mutex = dataV.getPowderMutex(powderClass);
 				
 				// Copy powder pattern to buffer
@@ -336,7 +420,7 @@ void savePowderPattern(cGlobal *global, int detIndex, int powderClass) {
                 H5Dclose(dh);
 
 				
-				// Fluctuations (sigma)
+				// Fluctuations (sigma), from the sum of squared deviations from the mean
 				powderSquaredBuffer = (double*) calloc(dataV.pix_nn, sizeof(double));
 				powderSigmaBuffer = (double*) calloc(dataV.pix_nn, sizeof(double));
 				if (global->threadSafetyLevel > 0)
@@ -348,12 +432,12 @@ void savePowderPattern(cGlobal *global, int detIndex, int powderClass) {
 				if(global->detector[detIndex].savePowderMasked != 0 && powder_counter != NULL) {
 					for (long i=0; i<dataV.pix_nn; i++) {
 						if(powder_counter[i] != 0)
-							powderSigmaBuffer[i] = sqrt(powderSquaredBuffer[i]/powder_counter[i] - powderBuffer[i]*powderBuffer[i]);
+							powderSigmaBuffer[i] = sqrt(powderSquaredBuffer[i]/powder_counter[i]);
 					}
 				}
-				else {
+				else if(nframes > 0) {
 					for (long i=0; i<dataV.pix_nn; i++) {
-						powderSigmaBuffer[i] = sqrt(powderSquaredBuffer[i]/nframes - (powderBuffer[i]/nframes)*(powderBuffer[i]/nframes));
+						powderSigmaBuffer[i] = sqrt(powderSquaredBuffer[i]/nframes);
 					}
 				}
 				// Write to data set
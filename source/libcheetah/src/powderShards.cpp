@@ -0,0 +1,115 @@
+//
+//  powderShards.cpp
+//  cheetah
+//
+//  Private powder sums that workers accumulate into without touching the shared powders.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "powderShards.h"
+
+
+// Shard each thread returns to (assigned round robin on first use)
+static __thread long homeShard = -1;
+
+
+cPowderShards::cPowderShards() {
+    shards = NULL;
+    n = 0;
+    nAssigned = 0;
+}
+
+cPowderShards::~cPowderShards() {
+    stop();
+}
+
+
+void cPowderShards::start(long nShards) {
+    if(shards != NULL || nShards < 1)
+        return;
+
+    n = nShards;
+    shards = (tShard *) calloc(n, sizeof(tShard));
+    for(long i=0; i<n; i++)
+        pthread_mutex_init(&shards[i].mutex, NULL);
+}
+
+
+/*
+ *  Free all shards (anything not yet reduced is lost)
+ */
+void cPowderShards::stop(void) {
+    if(shards == NULL)
+        return;
+
+    for(long i=0; i<n; i++) {
+        tAccumulator *acc = &shards[i].acc[0][0][0][0];
+        for(long j=0; j<(long) (sizeof(shards[i].acc)/sizeof(tAccumulator)); j++) {
+            free(acc[j].mean);
+            free(acc[j].m2);
+            free(acc[j].counter);
+        }
+        pthread_mutex_destroy(&shards[i].mutex);
+    }
+    free(shards);
+    shards = NULL;
+    n = 0;
+}
+
+
+long cPowderShards::nShards(void) {
+    return n;
+}
+
+
+/*
+ *  Lock a shard for the calling thread
+ *  Its own shard if that is free, otherwise the first idle one, otherwise wait for its own
+ */
+cPowderShards::tShard *cPowderShards::acquire(void) {
+    if(homeShard < 0)
+        homeShard = __sync_fetch_and_add(&nAssigned, 1);
+
+    long home = homeShard % n;
+    for(long i=0; i<n; i++) {
+        tShard *shard = &shards[(home+i) % n];
+        if(pthread_mutex_trylock(&shard->mutex) == 0)
+            return shard;
+    }
+    pthread_mutex_lock(&shards[home].mutex);
+    return &shards[home];
+}
+
+void cPowderShards::release(tShard *shard) {
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+
+/*
+ *  Lock shard i (for reduction); release() as usual
+ */
+cPowderShards::tShard *cPowderShards::lock(long i) {
+    pthread_mutex_lock(&shards[i].mutex);
+    return &shards[i];
+}
+
+
+/*
+ *  Accumulator in a locked shard, allocated and zeroed the first time it is asked for
+ */
+cPowderShards::tAccumulator *cPowderShards::accumulator(tShard *shard, long detIndex, long powderClass, int formatIndex, int versionIndex, long pix_nn, bool counter) {
+    tAccumulator *acc = &shard->acc[detIndex][powderClass][formatIndex][versionIndex];
+
+    if(acc->mean == NULL) {
+        acc->pix_nn = pix_nn;
+        acc->mean = (double *) calloc(pix_nn, sizeof(double));
+        acc->m2 = (double *) calloc(pix_nn, sizeof(double));
+    }
+    if(counter && acc->counter == NULL)
+        acc->counter = (long *) calloc(pix_nn, sizeof(long));
+    return acc;
+}
@@ -57,6 +57,16 @@ void calculateRadialAverage(cEventData *eventData, cGlobal *global) {
     // End detector loop
 }
 
+/*
+ *  Radial averages of this event, calculated the first time something asks for them
+ */
+void calculateRadialAverageOnce(cEventData *eventData, cGlobal *global) {
+	if (eventData->radialAveraged)
+		return;
+	calculateRadialAverage(eventData, global);
+	eventData->radialAveraged = true;
+}
+
 template <class T>
 void calculateRadialAverage(T *data2d, uint16_t *pixelmask2d, T *dataRadial, uint16_t *pixelmaskRadial, float * pix_r, long radial_nn, long pix_nn) {
 
@@ -158,6 +168,8 @@ void addToRadialAverageStack(cEventData *eventData, cGlobal *global){
     
     // Sorting parameter
     int powderClass = eventData->powderClass;
+
+    calculateRadialAverageOnce(eventData, global);
     
     // Loop over all detectors
     DETECTOR_LOOP {
@@ -14,8 +14,12 @@
 #include <math.h>
 #include <fstream> 
 #include <unistd.h>
+#include <algorithm>
+#include <limits>
+#include <zlib.h>
 
 #include <saveCXI.h>
+#include <cheetah.h>
 
 namespace CXI{
 	
@@ -143,7 +147,42 @@ namespace CXI{
 		if(stackSize == H5S_UNLIMITED){
 			addStackAttributes(dataset,ndims,userAxis);
 		}
-		return addNode(s, dataset, Dataset);    
+		Node *node = addNode(s, dataset, Dataset);
+
+		#ifdef CXI_DIRECT_CHUNK_WRITE
+		// Image stacks are stored as one deflated chunk per slice, which the workers can produce themselves
+		if(stackSize == H5S_UNLIMITED && chunkSize && heightChunkSize == 0 && ndims >= 3 && CXI::h5compress != 0){
+			node->directChunk = true;
+			node->chunkElements = chunkdims[1]*chunkdims[2]*chunkdims[3];
+			node->chunkElementSize = H5Tget_size(dataType);
+		}
+		#endif
+		return node;
+	}
+
+
+	/*
+	 *	Extendible 1D dataset, empty until the first writeArray()
+	 */
+	Node *Node::createArray(const char *s, hid_t dataType){
+		hsize_t dims[1] = {0};
+		hsize_t maxdims[1] = {H5S_UNLIMITED};
+		hsize_t chunkdims[1] = {CXI::chunkSize1D/H5Tget_size(dataType)};
+
+		printf("    + %s (1D array)\n", s);
+		hid_t dataspace = H5Screate_simple(1, dims, maxdims);
+		if( dataspace<0 ) {ERROR("Cannot create dataspace.\n");}
+		hid_t cparms = H5Pcreate(H5P_DATASET_CREATE);
+		H5Pset_chunk(cparms, 1, chunkdims);
+
+		hid_t dataset = H5Dcreate(hid(), s, dataType, dataspace, H5P_DEFAULT, cparms, H5P_DEFAULT);
+		if( dataset<0 ) {ERROR("Cannot create dataset.\n");}
+		H5Sclose(dataspace);
+		H5Pclose(cparms);
+
+		Node *node = addNode(s, dataset, Dataset);
+		node->array = true;
+		return node;
 	}
 
 	
@@ -189,6 +228,63 @@ namespace CXI{
 	}
 
 
+	/*
+	 *	Remember the dataset shape and create the objects every write needs
+	 *	From here on the extent is tracked here and only pushed to HDF5 when it grows (or is trimmed)
+	 */
+	void Node::cacheShape(){
+		hid_t dataspace = H5Dget_space(hid());
+		if( dataspace<0 ) {ERROR("Cannot get dataspace.\n");}
+		ndims = H5Sget_simple_extent_ndims(dataspace);
+		H5Sget_simple_extent_dims(dataspace, extent, maxExtent);
+		fileSpace = dataspace;
+
+		if(ndims > 0){
+			hsize_t block[4];
+			memcpy(block, extent, sizeof(block));
+			block[0] = 1;
+			sliceSpace = H5Screate_simple(ndims, block, NULL);
+		}
+
+		fileType = H5Dget_type(hid());
+		xferPlist = H5Pcreate(H5P_DATASET_XFER);
+		H5Pset_type_conv_cb(xferPlist, handle_conversion_exceptions, &ignoreConversionExceptions);
+	}
+
+	void Node::releaseCache(){
+		if(fileSpace >= 0) H5Sclose(fileSpace);
+		if(sliceSpace >= 0) H5Sclose(sliceSpace);
+		if(fileType >= 0) H5Tclose(fileType);
+		if(xferPlist >= 0) H5Pclose(xferPlist);
+		fileSpace = sliceSpace = fileType = xferPlist = -1;
+		free(batchData);
+		batchData = NULL;
+		for(std::map<int, std::pair<void *, size_t> >::iterator it = pendingChunks.begin(); it != pendingChunks.end(); it++) {
+			free(it->second.first);
+		}
+		pendingChunks.clear();
+	}
+
+	/*
+	 *	Make dimension dim at least needed long
+	 *	Doubling keeps the number of H5Dset_extent calls logarithmic in the stack size; trimAll() cuts stacks back on close
+	 */
+	void Node::growExtent(int dim, hsize_t needed){
+		if(extent[dim] >= needed){
+			return;
+		}
+		hsize_t n = (extent[dim] > 0) ? extent[dim] : 1;
+		while(n < needed){
+			n *= 2;
+		}
+		extent[dim] = n;
+		if(H5Dset_extent(hid(), extent) < 0){
+			ERROR("Cannot extend dataset.\n");
+		}
+		H5Sset_extent_simple(fileSpace, ndims, extent, maxExtent);
+	}
+
+
 	template <class T> 
 	void Node::write(T *data, int stackSlice, int sliceSize, bool variableSlice){
 		bool sliced = true;
@@ -197,63 +293,46 @@ namespace CXI{
 			sliced = false;
 		}
 
-		hid_t hs,w;
+		if(fileSpace < 0){
+			cacheShape();
+		}
+
+		// Slices the worker has already compressed go straight into their chunk
+		if(sliced && directChunk && writeChunk(stackSlice)){
+			return;
+		}
+
+		// Fixed size slices of numeric stacks are collected and written several at a time
+		if(sliced && !variableSlice && writeBatch > 1 && typeid(T) != typeid(char)){
+			bufferSlice(data, get_datatype(data), stackSlice, sliceSize);
+			return;
+		}
+
 		hsize_t count[4] = {1,1,1,1};
 		hsize_t offset[4] = {static_cast<hsize_t>(stackSlice),0,0,0};
 		/* stride is irrelevant in this case */
 		hsize_t stride[4] = {1,1,1,1};
 		hsize_t block[4];
-		/* dummy */
-		hsize_t mdims[4];
 		hid_t dataset = hid();
-		/* Use the existing dimensions as block size */
-		hid_t dataspace = H5Dget_space(dataset);
-		if( dataspace<0 ) {ERROR("Cannot get dataspace.\n");}
-		int ndims = H5Sget_simple_extent_ndims(dataspace);
-		H5Sget_simple_extent_dims(dataspace, block, mdims);
-		
+
 		/*
 		 * check if we need to extend the dataset 
 		 */
-		if(ndims > 0 && (int)block[0] <= stackSlice){
-			while((int)block[0] <= stackSlice){
-				if(block[0] < 1024) {
-					block[0] *= 2;
-				}
-				else {
-					block[0] += 1024;
-				}
-			}
-			H5Dset_extent (dataset, block);
-			/* get enlarged dataspace */
-			H5Sclose(dataspace);
-			dataspace = H5Dget_space (dataset);
-			if( dataspace<0 ) {ERROR("Cannot get dataspace.\n");}
-		}
-		if(sliced){
-			block[0] = 1;
+		if(ndims > 0){
+			growExtent(0, stackSlice+1);
 		}
 
 		/* 
 		 *	check if we need to extend the dataset in the second dimension 
 		 */
-		if(variableSlice && (int)block[1] <= sliceSize){
-			int tmp_block = block[0];
-			H5Sget_simple_extent_dims(dataspace, block, mdims);
-			while((int)block[1] <= sliceSize){
-				if(block[1] < 1024) {
-					block[1] *= 2;
-				}
-				else {
-					block[1] += 1024;
-				}
-			}
-			H5Dset_extent (dataset, block);
-			block[0] = tmp_block;
-			/* get enlarged dataspace */
-			H5Sclose(dataspace);
-			dataspace = H5Dget_space (dataset);
-			if( dataspace<0 ) {ERROR("Cannot get dataspace.\n");}
+		if(variableSlice){
+			growExtent(1, sliceSize+1);
+		}
+
+		/* Use the existing dimensions as block size */
+		memcpy(block, extent, sizeof(block));
+		if(sliced){
+			block[0] = 1;
 		}
 		if(variableSlice){
 			block[1] = sliceSize;
@@ -273,34 +352,183 @@ namespace CXI{
 			}
 		}
 
-		hid_t memspace = H5Screate_simple (ndims, block, NULL);
+		/* Slices reuse the cached memory space (only its second dimension changes, for variable slices) */
+		hid_t memspace;
+		if(sliced){
+			if(variableSlice){
+				H5Sset_extent_simple(sliceSpace, ndims, block, NULL);
+			}
+			memspace = sliceSpace;
+			if(H5Sselect_hyperslab (fileSpace, H5S_SELECT_SET, offset,stride, count, block) < 0) {
+				ERROR("Cannot select hyperslab.\n");
+			}
+		}
+		else {
+			memspace = H5S_ALL;
+			H5Sselect_all(fileSpace);
+		}
+
 		hid_t type = get_datatype(data);
 		if(type == H5T_NATIVE_CHAR){
-			type = H5Dget_type(dataset);
+			type = fileType;
 		}
-		if (sliced){
-			hs = H5Sselect_hyperslab (dataspace, H5S_SELECT_SET, offset,stride, count, block);
-			if( hs<0 ) {
-				ERROR("Cannot select hyperslab.\n");
+
+		if(H5Dwrite (dataset, type, memspace, fileSpace, xferPlist, data) < 0){
+ 			ERROR("Cannot write to file.\n");
+		}
+		if(sliced){
+			noteSlice(stackSlice);
+		}
+	}
+
+
+	/*
+	 *	Replace the contents of a dataset made by createArray() with n elements
+	 */
+	template <class T>
+	void Node::writeArray(T *data, hsize_t n){
+		if(fileSpace < 0){
+			cacheShape();
+		}
+
+		extent[0] = n;
+		if(H5Dset_extent(hid(), extent) < 0){
+			ERROR("Cannot resize dataset.\n");
+		}
+		H5Sset_extent_simple(fileSpace, ndims, extent, maxExtent);
+		if(n == 0){
+			return;
+		}
+
+		H5Sselect_all(fileSpace);
+		if(H5Dwrite(hid(), get_datatype(data), H5S_ALL, fileSpace, xferPlist, data) < 0){
+			ERROR("Cannot write to file.\n");
+		}
+	}
+
+
+	/*
+	 *	Append one slice to the batch of this dataset
+	 *	The batch goes out as a single hyperslab when it is full or when the next slice does not follow on from it
+	 */
+	void Node::bufferSlice(const void *data, hid_t memType, int stackSlice, int sliceSize){
+		if(batchCount > 0 && (stackSlice != batchStart + batchCount || memType != batchType)){
+			flushBatch();
+		}
+
+		if(batchCount == 0){
+			if(batchData == NULL || memType != batchType){
+				// Slice size is the extent of everything but the stack dimension
+				batchSliceElements = 1;
+				for (int i=1; i<ndims; i++) {
+					batchSliceElements *= extent[i];
+				}
+				batchSliceBytes = batchSliceElements*H5Tget_size(memType);
+
+				// Keep a batch within the size of a 2D chunk
+				batchCapacity = std::min((long) writeBatch, std::max(1L, (long) (chunkSize2D/batchSliceBytes)));
+				free(batchData);
+				batchData = (char *) malloc(batchCapacity*batchSliceBytes);
 			}
+			batchStart = stackSlice;
+			batchType = memType;
 		}
 
-		hid_t xfer_plist_id = H5Pcreate(H5P_DATASET_XFER);
-		H5Pset_type_conv_cb(xfer_plist_id, handle_conversion_exceptions, &ignoreConversionExceptions);
+		if(sliceSize != 0 && sliceSize != batchSliceElements) {
+			ERROR("Trying to write slice of %i elements to a dataset that was allocated for slices of a size of %li elements.",sliceSize,batchSliceElements);
+		}
 
+		memcpy(batchData + batchCount*batchSliceBytes, data, batchSliceBytes);
+		batchCount++;
+		if(batchCount == batchCapacity){
+			flushBatch();
+		}
+	}
 
-		w = H5Dwrite (dataset, type, memspace, dataspace, xfer_plist_id, data);
-		if( w<0 ){
- 			ERROR("Cannot write to file.\n");
+
+	void Node::flushBatch(){
+		if(batchCount == 0){
+			return;
 		}
-		if(sliced){
-			writeNumEvents(dataset,stackSlice);
+
+		hsize_t block[4];
+		hsize_t offset[4] = {static_cast<hsize_t>(batchStart),0,0,0};
+
+		growExtent(0, batchStart + batchCount);
+		memcpy(block, extent, sizeof(block));
+		block[0] = batchCount;
+
+		if(H5Sselect_hyperslab(fileSpace, H5S_SELECT_SET, offset, NULL, block, NULL) < 0){
+			ERROR("Cannot select hyperslab.\n");
+		}
+		hid_t memspace = H5Screate_simple (ndims, block, NULL);
+
+		if(H5Dwrite(hid(), batchType, memspace, fileSpace, xferPlist, batchData) < 0){
+			ERROR("Cannot write to file.\n");
 		}
 		H5Sclose(memspace);
-		H5Sclose(dataspace);
-		H5Pclose(xfer_plist_id);
+		noteSlice(batchStart + batchCount - 1);
+		batchCount = 0;
+	}
+
+
+	/*
+	 *	Hand over a compressed slice for the next write() of that slice (the node takes ownership of data)
+	 *	Returns false, leaving data with the caller, if the slice does not match this dataset's chunks
+	 */
+	bool Node::putChunk(int stackSlice, long nElements, size_t elementSize, void *data, size_t size){
+		if(!directChunk || nElements != chunkElements || elementSize != chunkElementSize){
+			return false;
+		}
+		std::pair<void *, size_t> &pending = pendingChunks[stackSlice];
+		free(pending.first);
+		pending = std::make_pair(data, size);
+		return true;
 	}
 
+
+	/*
+	 *	Write a slice handed over by putChunk() as it is, bypassing type conversion and the filter pipeline
+	 */
+	bool Node::writeChunk(int stackSlice){
+		std::map<int, std::pair<void *, size_t> >::iterator it = pendingChunks.find(stackSlice);
+		if(it == pendingChunks.end()){
+			return false;
+		}
+		void *data = it->second.first;
+		size_t size = it->second.second;
+		pendingChunks.erase(it);
+
+		#ifdef CXI_DIRECT_CHUNK_WRITE
+		hsize_t offset[4] = {static_cast<hsize_t>(stackSlice),0,0,0};
+		growExtent(0, stackSlice+1);
+		if(H5Dwrite_chunk(hid(), H5P_DEFAULT, 0, offset, size, data) < 0){
+			ERROR("Cannot write chunk to file.\n");
+		}
+		noteSlice(stackSlice);
+		#endif
+		free(data);
+		return true;
+	}
+
+
+	/*
+	 *	Write out pending batches and numEvents attributes of this node and everything below it
+	 */
+	void Node::flushAll(){
+		if(type == Dataset){
+			flushBatch();
+			if(lastSliceDirty){
+				writeNumEvents(hid(), lastSlice);
+				lastSliceDirty = false;
+			}
+		}
+		for(Iter it = children.begin(); it != children.end(); it++) {
+			it->second->flushAll();
+		}
+	}
+
+
 	Node * Node::addClass(const char * s){
 		std::string key = nextKey(s);
 		return createGroup(key.c_str());
@@ -427,6 +655,15 @@ namespace CXI{
 		}
 	}
 
+	// Like operator[] but returns NULL for a missing child
+	Node * Node::find(const char * s){
+		Iter it = children.find(s);
+		if(it == children.end()){
+			return NULL;
+		}
+		return it->second;
+	}
+
 	Node & Node::child(std::string prefix, int n){
 		char buffer[1024];
 		sprintf(buffer,"%s%d",prefix.c_str(),n);
@@ -448,18 +685,15 @@ namespace CXI{
 
 
 		if(hid() >= 0 && type == Dataset){
-			hsize_t block[4];
-			hsize_t mdims[4];
-			int ndims;
-			hid_t dataspace = H5Dget_space(hid());
-			if( dataspace<0 ) {ERROR("Cannot get dataspace.\n");}
-			
-			H5Sget_simple_extent_dims(dataspace, block, mdims);
-			ndims = H5Sget_simple_extent_ndims(dataspace);
-			if(ndims > 0 && mdims[0] == H5S_UNLIMITED){
+			if(fileSpace < 0){
+				cacheShape();
+			}
+			if(ndims > 0 && maxExtent[0] == H5S_UNLIMITED && !array){
 				writeNumEvents(hid(), stackSize);
-				block[0] = stackSize;
-				H5Dset_extent(hid(), block);
+				lastSliceDirty = false;
+				extent[0] = stackSize;
+				H5Dset_extent(hid(), extent);
+				H5Sset_extent_simple(fileSpace, ndims, extent, maxExtent);
 			}
 		}
 
@@ -667,6 +901,7 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
 
     using CXI::Node;
 	CXI::h5compress = global->h5compress;
+	CXI::writeBatch = (global->cxiWriter.nWorkers() > 0) ? global->cxiWriteBatch : 1;
 
     // Conversion flags
 	int ignoreConversionFlags = 0;
@@ -704,6 +939,8 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
 	Node *entry = root->addCXIClass("entry");
 	Node *instrument = entry->addCXIClass("instrument");
 	Node *source = instrument->addCXIClass("source");
+	root->frame->entry = entry;
+	root->frame->source = source;
 
     source->createStack("energy",H5T_NATIVE_DOUBLE);
     source->createLink("experiment_identifier", "/entry_1/experiment_identifier");
@@ -715,6 +952,7 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
      *  Write instrument information
      */
     Node *facility = root->createGroup("instrument");
+    root->frame->instrument = facility;
 
     // LCLS
     if(!strcmp(global->facility, "LCLS") ) {
@@ -730,6 +968,7 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
         lcls->createStack("fiducial",H5T_NATIVE_INT32);
         DETECTOR_LOOP{
             Node* detector = lcls->createCXIGroup("detector",detIndex+1);
+            root->frame->instrumentDetector[detIndex] = detector;
             detector->createStack("position",H5T_NATIVE_DOUBLE);
             detector->createStack("EncoderValue",H5T_NATIVE_DOUBLE);
         }
@@ -790,6 +1029,7 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
 		
 		DETECTOR_LOOP{
 			Node* detector = euxfel->createCXIGroup("detector",detIndex+1);
+			root->frame->instrumentDetector[detIndex] = detector;
 			detector->createStack("position",H5T_NATIVE_DOUBLE);
 			detector->createStack("EncoderValue",H5T_NATIVE_DOUBLE);
 		}
@@ -841,8 +1081,6 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
             long pix_nn = global->detector[detIndex].pix_nn;
             long pix_nx = global->detector[detIndex].pix_nx;
             long pix_ny = global->detector[detIndex].pix_ny;
-            float* pix_x = global->detector[detIndex].pix_x;
-            float* pix_y = global->detector[detIndex].pix_y;
             float* pix_r = global->detector[detIndex].pix_r;
             long image_nn = global->detector[detIndex].image_nn;
             long image_nx = global->detector[detIndex].image_nx;
@@ -858,6 +1096,7 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
 
             // /entry_1/instrument_1/detector_[i]/
             Node * detector = instrument->createCXIGroup("detector",detIndex+1);
+            root->frame->detector[detIndex] = detector;
             // Create symbolic link /entry_1/data_[i]/ which points to /entry_1/instrument_1/detector_[i]/
             entry->addCXIClassLink("data",detector->path().c_str());
 
@@ -883,6 +1122,7 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
                         // Create group /entry_1/instrument_1/detector_[i]/modular_[datver]/
                         sprintf(sBuffer,"modular_%s",dataV.name);
                         Node * data_node = detector->createGroup(sBuffer);
+                        root->frame->nonAssembled[detIndex].push_back(data_node);
                         data_node->createLink("experiment_identifier", "/entry_1/experiment_identifier");
                         data_node->createStack("data", h5type, asic_nx, asic_ny, nasics);
                         data_node->createStack("corner_positions",H5T_NATIVE_FLOAT, 3, nasics, H5S_UNLIMITED, 0, 0, 0, "experiment_identifier:module_identifier:coordinate");
@@ -920,6 +1160,7 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
                     else {
                         // Create group /entry_1/instrument_1/detector_[i]/[datver]/
                         Node * data_node = detector->createGroup(dataV.name_version);
+                        root->frame->nonAssembled[detIndex].push_back(data_node);
                         data_node->createLink("experiment_identifier", "/entry_1/experiment_identifier");
                         data_node->createStack("data", h5type,pix_nx, pix_ny);
                         if(global->detector[detIndex].savePixelmask){
@@ -963,13 +1204,13 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
                 while (dataV.next()) {
                     // Create group /entry_1/image_i/data_[datver]/
                     Node * data_node = image_node->createGroup(dataV.name_version);		
+                    root->frame->assembled[detIndex].push_back(data_node);
                     data_node->createStack("data", h5type, image_nx, image_ny);
                     if(global->detector[detIndex].savePixelmask){
                         data_node->createStack("mask",H5T_NATIVE_UINT16, image_nx, image_ny);
                     }
                     uint16_t *image_pixelmask_shared = (uint16_t*) calloc(image_nn,sizeof(uint16_t));
-                    assemble2DMask(image_pixelmask_shared, pixelmask_shared, 
-                                   pix_x, pix_y, pix_nn, image_nx, image_nn, global->assembleInterpolation);
+                    global->detector[detIndex].assembleTable->mask(image_pixelmask_shared, pixelmask_shared, NULL);
                     data_node->createDataset("mask_shared",H5T_NATIVE_UINT16,image_nx, image_ny)->write(image_pixelmask_shared, -1, image_nn);
                     free(image_pixelmask_shared);      
                     data_node->createStack("data_type",H5T_NATIVE_CHAR,CXI::stringSize);
@@ -1009,13 +1250,13 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
                 while (dataV.next()) {
                     // Create group /entry_1/image_i/[datver]/
                     Node * data_node = image_node->createGroup(dataV.name_version);			
+                    root->frame->downsampled[detIndex].push_back(data_node);
                     data_node->createStack("data", h5type, imageXxX_nx, imageXxX_ny);
                     if(global->detector[detIndex].savePixelmask){
                         data_node->createStack("mask",H5T_NATIVE_UINT16, imageXxX_nx, imageXxX_ny);
                     }
                     uint16_t *image_pixelmask_shared = (uint16_t*) calloc( image_nn,sizeof(uint16_t));
-                    assemble2DMask(image_pixelmask_shared, pixelmask_shared,
-                                   pix_x, pix_y, pix_nn, image_nx, image_nn, global->assembleInterpolation);
+                    global->detector[detIndex].assembleTable->mask(image_pixelmask_shared, pixelmask_shared, NULL);
                     uint16_t *imageXxX_pixelmask_shared = (uint16_t*) calloc(imageXxX_nn, sizeof(uint16_t));
                     if(global->detector[detIndex].downsamplingConservative==1){
                         downsampleMaskConservative(image_pixelmask_shared,imageXxX_pixelmask_shared, image_nn, image_nx, imageXxX_nn, imageXxX_nx, downsampling, debugLevel);
@@ -1063,6 +1304,7 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
                     while (dataV.next()) {
                         // Create group /entry_1/image_i/[datver]/
                         Node *data_node = image_node->createGroup(dataV.name_version);
+                        root->frame->radialAverage[detIndex].push_back(data_node);
                         data_node->createStack("data", H5T_NATIVE_FLOAT, radial_nn);
                         if(global->detector[detIndex].savePixelmask){
                             data_node->createStack("mask",H5T_NATIVE_UINT16, radial_nn);
@@ -1103,6 +1345,7 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
     int resultIndex = 1;
     if(global->savePeakInfo && global->hitfinder){
         Node * result = entry->createCXIGroup("result",resultIndex);
+        root->frame->result = result;
         
         result->createStack("powderClass", H5T_NATIVE_INT);
         
@@ -1141,6 +1384,7 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
             for(int i = 0;i<global->nTOFDetectors;i++){
                 char buffer[1024];
                 Node * detector = instrument->createCXIGroup("detector",1+i+global->nDetectors);
+                root->frame->detector[i+global->nDetectors] = detector;
                 detector->createStack("data",H5T_NATIVE_DOUBLE,global->tofDetector[i].numSamples);
                 detector->createStack("tofTime",H5T_NATIVE_DOUBLE,global->tofDetector[i].numSamples);
                 int buffLen = sprintf(buffer,"TOF detector\nSource identifier: %s\nChannel number: %d\nDescription: %s\n",global->tofDetector[i].sourceIdentifier,
@@ -1161,6 +1405,8 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
         Node * cheetah = root->createGroup("cheetah");
         Node * event_data = cheetah->createGroup("event_data");
         Node *global_data = cheetah->createGroup("global_data");
+        root->frame->cheetah = cheetah;
+        root->frame->eventData = event_data;
 
         cheetah->createDataset("cxi_version",H5T_NATIVE_INT,1)->write(&CXI::version);
         cheetah->createDataset("cheetah_version_commit",H5T_NATIVE_CHAR,strlen(GIT_SHA1))->write(GIT_SHA1);
@@ -1183,6 +1429,7 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
         event_data->createStack("hit",H5T_NATIVE_INT);
         DETECTOR_LOOP{
             Node * detector = event_data->createCXIGroup("detector",detIndex+1);
+            root->frame->eventDetector[detIndex] = detector;
             detector->createStack("sum",H5T_NATIVE_FLOAT);
         }
 
@@ -1211,6 +1458,7 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
         //
         DETECTOR_LOOP{
             Node * det_node = global_data->createCXIGroup("detector",detIndex+1);
+            root->frame->globalDetector[detIndex] = det_node;
             det_node->createStack("lastBgUpdate",H5T_NATIVE_LONG);
             det_node->createStack("nHot",H5T_NATIVE_LONG);
             det_node->createStack("lastHotPixUpdate",H5T_NATIVE_LONG);
@@ -1252,8 +1500,16 @@ static CXI::Node *createCXISkeleton(const char *filename, cGlobal *global){
             if (global->detector[detIndex].histogram) {
                 sprintf(sBuffer,"pixel_histogram");
                 Node * hist_node = det_node->createGroup(sBuffer);
-                sprintf(sBuffer,"histogram");
-                hist_node->createDataset(sBuffer, H5T_NATIVE_UINT16, global->detector[detIndex].histogramNbins, global->detector[detIndex].histogram_nfs, global->detector[detIndex].histogram_nss);
+                if (global->detector[detIndex].histogramSparse) {
+                    // Non-zero bins only: those of pixel i are bin/count[pixel_offset[i]..pixel_offset[i+1]-1]
+                    hist_node->createDataset("pixel_offset", H5T_NATIVE_LONG, global->detector[detIndex].histogram_nn+1);
+                    hist_node->createArray("bin", H5T_NATIVE_UINT16);
+                    hist_node->createArray("count", H5T_NATIVE_UINT32);
+                }
+                else {
+                    sprintf(sBuffer,"histogram");
+                    hist_node->createDataset(sBuffer, H5T_NATIVE_UINT32, global->detector[detIndex].histogramNbins, global->detector[detIndex].histogram_nfs, global->detector[detIndex].histogram_nss);
+                }
                 sprintf(sBuffer,"histogram_scale");
                 hist_node->createDataset(sBuffer, H5T_NATIVE_FLOAT, global->detector[detIndex].histogramNbins)->write(global->detector[detIndex].histogramScale);
             }
@@ -1340,6 +1596,7 @@ static CXI::Node *createResultsSkeleton(const char *filename, cGlobal *global){
     
     // Information about the instrument/beamline (such as encoder values)
     Node *facility = root->createGroup("instrument");
+    root->frame->instrument = facility;
     
     // LCLS
     if(!strcmp(global->facility, "LCLS") ) {
@@ -1401,6 +1658,7 @@ static CXI::Node *createResultsSkeleton(const char *filename, cGlobal *global){
 		
         DETECTOR_LOOP{
             Node* detector = lcls->createGroup("detector",detIndex);
+            root->frame->instrumentDetector[detIndex] = detector;
             detector->createStack("position",H5T_NATIVE_DOUBLE);
             detector->createStack("EncoderValue",H5T_NATIVE_DOUBLE);
         }
@@ -1422,6 +1680,7 @@ static CXI::Node *createResultsSkeleton(const char *filename, cGlobal *global){
 		
 		DETECTOR_LOOP{
 			Node* detector = euxfel->createGroup("detector",detIndex);
+			root->frame->instrumentDetector[detIndex] = detector;
 			detector->createStack("EncoderValue",H5T_NATIVE_DOUBLE);
 		}
 	}
@@ -1453,6 +1712,7 @@ static CXI::Node *createResultsSkeleton(const char *filename, cGlobal *global){
 	
 	// Create top level entries
     Node *event_data = root->createGroup("event_data");
+    root->frame->eventData = event_data;
     Node *run_data = root->createGroup("run_data");
     //Node *entry = root->addClass("entry");
     
@@ -1496,6 +1756,7 @@ static CXI::Node *createResultsSkeleton(const char *filename, cGlobal *global){
         int sBufferLen = sprintf(sBuffer,"%s [%s]",global->detector[detIndex].detectorType,global->detector[detIndex].detectorName);
         
         Node * detector = event_data->createGroup("detector",detIndex);
+        root->frame->detector[detIndex] = detector;
         //Node * detector = instrument->createGroup("detector",detIndex+1);
         
         detector->createStack("distance",H5T_NATIVE_DOUBLE);
@@ -1524,6 +1785,7 @@ static CXI::Node *createResultsSkeleton(const char *filename, cGlobal *global){
             while (dataV.next()) {
                 // Create group /entry_1/image_i/[datver]/
                 Node *data_node = image_node->createGroup(dataV.name_version);
+                root->frame->radialAverage[detIndex].push_back(data_node);
                 data_node->createStack("data", H5T_NATIVE_FLOAT, radial_nn);
                 if(global->detector[detIndex].savePixelmask){
                     data_node->createStack("mask",H5T_NATIVE_UINT16, radial_nn);
@@ -1552,6 +1814,7 @@ static CXI::Node *createResultsSkeleton(const char *filename, cGlobal *global){
         for(int i = 0;i<global->nTOFDetectors;i++){
             char buffer[1024];
             Node * detector = event_data->createGroup("detector",i+global->nDetectors);
+            root->frame->detector[i+global->nDetectors] = detector;
             detector->createStack("data",H5T_NATIVE_DOUBLE,global->tofDetector[i].numSamples);
             detector->createStack("tofTime",H5T_NATIVE_DOUBLE,global->tofDetector[i].numSamples);
             int buffLen = sprintf(buffer,"TOF detector\nSource identifier: %s\nChannel number: %d\nDescription: %s\n",global->tofDetector[i].sourceIdentifier,
@@ -1581,6 +1844,7 @@ static CXI::Node *createResultsSkeleton(const char *filename, cGlobal *global){
     int resultIndex = 0;
     if(global->savePeakInfo && global->hitfinder){
         Node *result = event_data->createGroup("peaks",resultIndex);
+        root->frame->result = result;
         
         result->createStack("powderClass", H5T_NATIVE_INT);
         result->createStack("nPeaks", H5T_NATIVE_INT);
@@ -1652,8 +1916,16 @@ static CXI::Node *createResultsSkeleton(const char *filename, cGlobal *global){
         if (global->detector[detIndex].histogram) {
             sprintf(sBuffer,"pixel_histogram");
             Node * hist_node = det_node->createGroup(sBuffer);
-            sprintf(sBuffer,"histogram");
-            hist_node->createDataset(sBuffer, H5T_NATIVE_UINT16, global->detector[detIndex].histogramNbins, global->detector[detIndex].histogram_nfs, global->detector[detIndex].histogram_nss);
+            if (global->detector[detIndex].histogramSparse) {
+                // Non-zero bins only: those of pixel i are bin/count[pixel_offset[i]..pixel_offset[i+1]-1]
+                hist_node->createDataset("pixel_offset", H5T_NATIVE_LONG, global->detector[detIndex].histogram_nn+1);
+                hist_node->createArray("bin", H5T_NATIVE_UINT16);
+                hist_node->createArray("count", H5T_NATIVE_UINT32);
+            }
+            else {
+                sprintf(sBuffer,"histogram");
+                hist_node->createDataset(sBuffer, H5T_NATIVE_UINT32, global->detector[detIndex].histogramNbins, global->detector[detIndex].histogram_nfs, global->detector[detIndex].histogram_nss);
+            }
             sprintf(sBuffer,"histogram_scale");
             hist_node->createDataset(sBuffer, H5T_NATIVE_FLOAT, global->detector[detIndex].histogramNbins)->write(global->detector[detIndex].histogramScale);
         }
@@ -1667,6 +1939,7 @@ static CXI::Node *createResultsSkeleton(const char *filename, cGlobal *global){
      *  (processing and configuration information that is not really a result)
      */
     Node *cheetah = root->createGroup("cheetah");
+    root->frame->cheetah = cheetah;
     Node *configuration = cheetah->createGroup("configuration");
 
     // Write configuration file to file
@@ -1829,6 +2102,9 @@ static CXI::Node *getResultsFileByName(cGlobal *global, cEventData *eventData, i
 void writeAccumulatedCXI(cGlobal * global){
 	using CXI::Node;
 
+	// Bring the shared powders up to date with what the workers have summed privately
+	reducePowder(global);
+
 	#ifdef H5F_ACC_SWMR_WRITE
 	if(global->cxiSWMR){
 		pthread_mutex_lock(&global->swmr_mutex);
@@ -1856,14 +2132,14 @@ void writeAccumulatedCXI(cGlobal * global){
 						// mean and sigma
 						long pix_nn =  dataV.pix_nn;
 						double * powder = dataV.getPowder(powderClass);
-						double * powder_squared = dataV.getPowderSquared(powderClass);     
+						// Powder squared holds the sum of squared deviations from the mean (see accumulatePowder in powder.cpp)
+						double * powder_m2 = dataV.getPowderSquared(powderClass);
 						double * mean = (double*) calloc(pix_nn, sizeof(double));
 						double * sigma = (double *) calloc(pix_nn,sizeof(double));
+						double nframes = global->detector[detIndex].nPowderFrames[powderClass];
 						for(long i = 0; i<pix_nn; i++){
-							mean[i] = powder[i]/(1.*global->detector[detIndex].nPowderFrames[powderClass]);
-                            // removed the absolute square since the rounding errors should now be negligible so that the variance is always positive
-							sigma[i] =	sqrt((powder_squared[i] - powder[i]*powder[i]/(1.*global->detector[detIndex].nPowderFrames[powderClass]))/(1.*global->detector[detIndex].nPowderFrames[powderClass]));
-                            //sigma[i] =	sqrt( fabs(powder_squared[i] - powder[i]*powder[i]/(1.*global->detector[detIndex].nPowderFrames[powderClass])) / (1.*global->detector[detIndex].nPowderFrames[powderClass]) );
+							mean[i] = powder[i]/nframes;
+							sigma[i] = sqrt(powder_m2[i]/nframes);
 						}
 						sprintf(sBuffer,"mean_%s",dataV.name); 
 						cl[sBuffer].write(mean, -1, pix_nn);
@@ -1889,11 +2165,27 @@ void writeAccumulatedCXI(cGlobal * global){
 			}
 			// Pixel value histogram
 			if (global->detector[detIndex].histogram) {
-				long     N = global->detector[detIndex].histogram_nfs *
-					         global->detector[detIndex].histogram_nss *
-					         global->detector[detIndex].histogramNbins;
-				uint16_t *histData = global->detector[detIndex].histogramData;
-				det_node["pixel_histogram"]["histogram"].write(histData, -1, N);
+				cPixelHistogram *histData = global->detector[detIndex].histogramData;
+				long     hist_nn = global->detector[detIndex].histogram_nn;
+				long     histNbins = global->detector[detIndex].histogramNbins;
+				Node & hist_node = det_node["pixel_histogram"];
+				if (global->detector[detIndex].histogramSparse) {
+					// Non-zero bins only (the dense histogram never exists in memory)
+					long     *pixelOffset = (long *) malloc((hist_nn+1) * sizeof(long));
+					std::vector<uint16_t> bins;
+					std::vector<uint32_t> counts;
+					histData->snapshotSparse(pixelOffset, &bins, &counts);
+					hist_node["pixel_offset"].write(pixelOffset);
+					hist_node["bin"].writeArray(bins.empty() ? NULL : &bins[0], bins.size());
+					hist_node["count"].writeArray(counts.empty() ? NULL : &counts[0], counts.size());
+					free(pixelOffset);
+				}
+				else {
+					uint32_t *buffer = (uint32_t *) malloc((uint64_t) hist_nn * histNbins * sizeof(uint32_t));
+					histData->snapshot(buffer);
+					hist_node["histogram"].write(buffer, -1, hist_nn*histNbins);
+					free(buffer);
+				}
 			}
 			pthread_mutex_unlock(&global->saveCXI_mutex);
 		}
@@ -1914,13 +2206,15 @@ void writeAccumulatedCXI(cGlobal * global){
 static void  flushCXI(CXI::Node *cxi){
 	//if( cxi->stackCounter == 0)
 	//	return;
+	cxi->flushAll();
 	H5Fflush(cxi->hid(), H5F_SCOPE_GLOBAL);
 }
 
 
-/* Flush each open file */
-void flushCXIFiles(cGlobal * global){
-	
+/* Flush each open file (runs on the CXI writer thread, which owns the slice batches) */
+static void *flushCXIFilesTask(void *arg){
+	cGlobal *global = (cGlobal *) arg;
+
     pthread_mutex_lock(&global->saveCXI_mutex);
 
     // CXI files
@@ -1937,7 +2231,11 @@ void flushCXIFiles(cGlobal * global){
         //usleep(100);
     }
     pthread_mutex_unlock(&global->saveCXI_mutex);
+	return NULL;
+}
 
+void flushCXIFiles(cGlobal * global){
+	global->cxiWriter.submit(flushCXIFilesTask, (void *) global, global->threadTimeoutInSeconds);
 }
 
 
@@ -1950,6 +2248,7 @@ static void  closeCXI(CXI::Node *cxi){
 	//if( cxi->stackCounter == 0)
 	//	return;
 
+	cxi->flushAll();
 	cxi->trimAll();
 	H5Fflush(cxi->hid(), H5F_SCOPE_GLOBAL);
 	H5Fclose(cxi->hid());
@@ -1968,6 +2267,9 @@ void closeCXIFiles(cGlobal * global){
 	#endif
 	
 
+	/* Let the writer thread finish whatever frames it still has queued */
+	global->cxiWriter.drain(0);
+
 	/* CXI: Go through each file and resize them to their right size */
 	pthread_mutex_lock(&global->saveCXI_mutex);
 	for(uint i=0; i<openCXIFilenames.size(); i++){
@@ -1996,6 +2298,41 @@ void closeCXIFiles(cGlobal * global){
 
 
 
+/*
+ *	Groups recorded in CXI::FrameNodes when the file was created
+ *	(NULL means the skeleton has no such group, which used to be caught by Node::operator[])
+ */
+static CXI::Node & frameNode(CXI::Node *node){
+	if(node == NULL){
+		ERROR("Group missing from CXI skeleton.\n");
+	}
+	return *node;
+}
+
+static CXI::Node & frameNode(std::vector<CXI::Node *> &nodes, size_t i){
+	if(i >= nodes.size()){
+		ERROR("Data version group missing from CXI skeleton.\n");
+	}
+	return *nodes[i];
+}
+
+
+/*
+ *	Hit statistics for one frame into the results file
+ */
+static void writeHitstatsData(CXI::Node *results, cEventData *eventData, cGlobal *global ){
+	CXI::Node &event_data = frameNode(results->frame->eventData);
+
+	pthread_mutex_lock(&global->saveCXI_mutex);
+	event_data["hit"].write(&eventData->hit,global->nCXIEvents);
+	event_data["nPeaks"].write(&eventData->nPeaks,global->nCXIEvents);
+    event_data["hitScore"].write(&eventData->hitScore,global->nCXIEvents);
+
+	global->nCXIEvents += 1;
+	pthread_mutex_unlock(&global->saveCXI_mutex);
+}
+
+
 void writeCXIHitstats(cEventData *eventData, cGlobal *global ){
 	DEBUG2("Writing Hitstats.");
 
@@ -2007,33 +2344,242 @@ void writeCXIHitstats(cEventData *eventData, cGlobal *global ){
 	/* Get the existing CXI file or open a new one */
 	CXI::Node *results = getResultsFileByName(global, eventData, eventData->powderClass);
 
-	pthread_mutex_lock(&global->saveCXI_mutex);
-	(*results)["event_data"]["hit"].write(&eventData->hit,global->nCXIEvents);
-	(*results)["event_data"]["nPeaks"].write(&eventData->nPeaks,global->nCXIEvents);
-    (*results)["event_data"]["hitScore"].write(&eventData->hitScore,global->nCXIEvents);
+	writeHitstatsData(results, eventData, global);
 
-	global->nCXIEvents += 1;
 	#ifdef H5F_ACC_SWMR_WRITE
 	if(global->cxiSWMR){
 		pthread_mutex_unlock(&global->swmr_mutex);
 	}
 	#endif
-	pthread_mutex_unlock(&global->saveCXI_mutex);
+}
+
+
+/*
+ *	Convert detector data to an integer save type the way HDF5 does
+ *	(truncation towards zero, out of range values clipped) and report exceptions once per image
+ *	NaN gets what HDF5's plain C cast leaves on x86: the 32 bit integer indefinite value, cut down to the type
+ */
+template <class T>
+static void convertToSaveType(T *dst, const float *src, long n, int ignoreFlags){
+	const float lo = (float) std::numeric_limits<T>::min();
+	const float hi = (float) std::numeric_limits<T>::max();
+	bool overflow = false, truncate = false, nan = false;
+
+	for (long i=0; i<n; i++) {
+		float v = src[i];
+		if(v >= hi) {
+			overflow |= (v > hi);
+			dst[i] = std::numeric_limits<T>::max();
+		}
+		else if(v <= lo) {
+			overflow |= (v < lo);
+			dst[i] = std::numeric_limits<T>::min();
+		}
+		else if(v == v) {
+			dst[i] = (T) v;
+			truncate |= ((float) dst[i] != v);
+		}
+		else {
+			nan = true;
+			dst[i] = (T) std::numeric_limits<int32_t>::min();
+		}
+	}
+
+	if(overflow) CXI::handle_conversion_exceptions(H5T_CONV_EXCEPT_RANGE_HI, -1, -1, NULL, NULL, &ignoreFlags);
+	if(truncate) CXI::handle_conversion_exceptions(H5T_CONV_EXCEPT_TRUNCATE, -1, -1, NULL, NULL, &ignoreFlags);
+	if(nan) CXI::handle_conversion_exceptions(H5T_CONV_EXCEPT_NAN, -1, -1, NULL, NULL, &ignoreFlags);
+}
+
+
+/*
+ *	Deflate one image into a chunk for the event (same zlib stream as the HDF5 deflate filter)
+ */
+static void addCXIChunk(cEventData *eventData, cGlobal *global, tCXIChunk chunk, const void *data){
+	uLongf	size = compressBound(chunk.nElements*chunk.elementSize);
+	chunk.data = malloc(size);
+	if(compress2((Bytef *) chunk.data, &size, (const Bytef *) data, chunk.nElements*chunk.elementSize, global->h5compress) != Z_OK){
+		ERROR("Cannot compress chunk.\n");
+	}
+	chunk.size = size;
+	eventData->cxiChunks.push_back(chunk);
+}
+
+
+/*
+ *	Compress the image stacks of a frame that is about to be written to CXI
+ *	Called by the worker before it queues for saveSynchronisation_mutex, so frames are converted and deflated in parallel
+ *	and the writer thread only has to put finished chunks into the file (see Node::putChunk)
+ */
+void compressCXIChunks(cEventData *eventData, cGlobal *global){
+	#if defined(CXI_DIRECT_CHUNK_WRITE) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if(!global->cxiDirectChunkWrite || !global->h5compress || !global->cxiSaveFrames){
+		return;
+	}
+
+	// Same save type as createCXISkeleton()
+	size_t	dataElementSize = sizeof(float);
+	if(!strcasecmp(global->dataSaveFormat,"INT16")){
+		dataElementSize = sizeof(int16_t);
+	}
+	else if(!strcasecmp(global->dataSaveFormat,"INT32")){
+		dataElementSize = sizeof(int32_t);
+	}
+
+	int ignoreFlags = 0;
+	if(global->ignoreConversionOverflow){
+		ignoreFlags |= CXI::IgnoreOverflow;
+	}
+	if(global->ignoreConversionTruncate){
+		ignoreFlags |= CXI::IgnoreTruncate;
+	}
+	if(global->ignoreConversionNAN){
+		ignoreFlags |= CXI::IgnoreNAN;
+	}
+
+	const int	formats[3] = {cDataVersion::DATA_FORMAT_NON_ASSEMBLED, cDataVersion::DATA_FORMAT_ASSEMBLED, cDataVersion::DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED};
+	void		*buffer = NULL;
+	long		bufferSize = 0;
+
+	assemble2DOnce(eventData, global);
+
+	DETECTOR_LOOP {
+		cPixelDetectorCommon *detector = &global->detector[detIndex];
+		long nn[3] = {detector->pix_nn, detector->image_nn, detector->imageXxX_nn};
+
+		for (int f=0; f<3; f++) {
+			if(!isBitOptionSet(detector->saveFormat, formats[f])) {
+				continue;
+			}
+			// Modular stacks are rearranged by writeCXIData()
+			if(formats[f] == cDataVersion::DATA_FORMAT_NON_ASSEMBLED && global->saveModular) {
+				continue;
+			}
+
+			cDataVersion dataV(&eventData->detector[detIndex], detector, detector->saveVersion, (cDataVersion::dataFormat_t) formats[f]);
+			for (int iVersion=0; dataV.next(); iVersion++) {
+				tCXIChunk chunk = {detIndex, formats[f], iVersion, false, nn[f], dataElementSize, NULL, 0};
+				float *data = dataV.getData();
+
+				if(dataElementSize == sizeof(float)) {
+					addCXIChunk(eventData, global, chunk, data);
+				}
+				else {
+					if(bufferSize < (long) (nn[f]*dataElementSize)) {
+						bufferSize = nn[f]*dataElementSize;
+						buffer = realloc(buffer, bufferSize);
+					}
+					if(dataElementSize == sizeof(int16_t))
+						convertToSaveType((int16_t *) buffer, data, nn[f], ignoreFlags);
+					else
+						convertToSaveType((int32_t *) buffer, data, nn[f], ignoreFlags);
+					addCXIChunk(eventData, global, chunk, buffer);
+				}
+
+				if(detector->savePixelmask) {
+					chunk.mask = true;
+					chunk.elementSize = sizeof(uint16_t);
+					addCXIChunk(eventData, global, chunk, dataV.getPixelmask());
+				}
+			}
+		}
+	}
+	free(buffer);
+	#endif
+}
+
+
+/*
+ *	Pass the chunks compressed by the worker to their datasets
+ *	Chunks without a matching dataset are dropped and written the usual way by writeCXIData()
+ */
+static void attachCXIChunks(CXI::Node *cxi, cEventData *eventData, uint stackSlice){
+	CXI::FrameNodes	*frame = cxi->frame;
+
+	for(size_t i=0; i<eventData->cxiChunks.size(); i++) {
+		tCXIChunk	*chunk = &eventData->cxiChunks[i];
+		std::vector<CXI::Node *> *groups = frame->nonAssembled;
+		if(chunk->dataFormat == cDataVersion::DATA_FORMAT_ASSEMBLED) {
+			groups = frame->assembled;
+		}
+		else if(chunk->dataFormat == cDataVersion::DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED) {
+			groups = frame->downsampled;
+		}
+
+		CXI::Node	*node = NULL;
+		if(chunk->version < (int) groups[chunk->detIndex].size()) {
+			node = groups[chunk->detIndex][chunk->version]->find(chunk->mask ? "mask" : "data");
+		}
+		if(node == NULL || !node->putChunk(stackSlice, chunk->nElements, chunk->elementSize, chunk->data, chunk->size)) {
+			free(chunk->data);
+		}
+	}
+	eventData->cxiChunks.clear();
+}
+
+
+/*
+ *	One frame on its way to the CXI writer thread
+ *	File and stack slice are fixed before the frame is queued, so logs and stacks stay in step
+ */
+typedef struct {
+	cEventData	*eventData;
+	cGlobal		*global;
+	CXI::Node	*cxi;
+	CXI::Node	*results;
+	uint		stackSlice;
+} tCXIWriteTask;
+
+
+/*
+ *	Write the data, results and hit statistics of one frame
+ *	Runs on global->cxiWriter, or in the calling worker when there is no writer thread
+ */
+static void *writeCXITask(void *arg){
+	tCXIWriteTask	*task = (tCXIWriteTask *) arg;
+	cGlobal			*global = task->global;
+	cMyTimer		timer_cxiWrite;
+
+	#ifdef H5F_ACC_SWMR_WRITE
+	if(global->cxiSWMR){
+		pthread_mutex_lock(&global->swmr_mutex);
+	}
+	#endif
+
+	timer_cxiWrite.start();
+	attachCXIChunks(task->cxi, task->eventData, task->stackSlice);
+	writeCXIData(task->cxi, task->eventData, global, task->stackSlice);
+	writeResultsData(task->results, task->eventData, global, task->stackSlice);
+	writeHitstatsData(task->results, task->eventData, global);
+	timer_cxiWrite.stop();
+	global->timeProfile.addToTimer(timer_cxiWrite.duration, global->timeProfile.TIMER_H5WRITE);
+
+	#ifdef H5F_ACC_SWMR_WRITE
+	if(global->cxiSWMR){
+		// Readers only see slices that have left the batches
+		if(global->cxiFlushPeriod && (task->stackSlice % global->cxiFlushPeriod) == 0){
+			task->cxi->flushAll();
+			H5Fflush(task->cxi->hid(),H5F_SCOPE_LOCAL);
+		}
+		pthread_mutex_unlock(&global->swmr_mutex);
+	}
+	#endif
+
+	// Drop the reference taken in writeCXI()
+	cheetahDestroyEvent(task->eventData);
+	free(task);
+	return NULL;
 }
 
 
 /*
  *  Write event data to CXI file
+ *  The frame is given its place in the file here and then handed to the writer thread,
+ *  which only holds up the worker when its queue is full
  */
 void writeCXI(cEventData *eventData, cGlobal *global ){
 	DEBUG2("Write a data of one frame to CXI file.");
 
-    using CXI::Node;
-    char sBuffer[1024];
-	
     cMyTimer timer_cxiWait;
-    cMyTimer timer_cxiWrite;
-
     timer_cxiWait.start();
     
     
@@ -2071,44 +2617,34 @@ void writeCXI(cEventData *eventData, cGlobal *global ){
 	results->stackCounter = cxi->stackCounter;
 
 
-    /*
-     *	Lock writing to one thread at a time to ensure stack synchronisation
-     */
     pthread_mutex_lock(&global->saveCXI_mutex);
 	global->nFramesSavedPerClass[eventData->powderClass] += 1;
     global->nCXIHits += 1;
-    pthread_mutex_unlock(&global->saveCXI_mutex);       // Moved up here on 23 May, should work.... revert if problems
+    pthread_mutex_unlock(&global->saveCXI_mutex);
     timer_cxiWait.stop();
-
-    
-    /*
-     *  Write CXI and results data
-     */
-    timer_cxiWrite.start();
-    writeCXIData(cxi, eventData, global, stackSlice);
-    writeResultsData(results, eventData, global, stackSlice);
-    timer_cxiWrite.stop();
     global->timeProfile.addToTimer(timer_cxiWait.duration, global->timeProfile.TIMER_H5WAIT);
-    global->timeProfile.addToTimer(timer_cxiWrite.duration, global->timeProfile.TIMER_H5WRITE);
-
 
-    
-    
     #ifdef H5F_ACC_SWMR_WRITE
-        if(global->cxiSWMR){
-            if(global->cxiFlushPeriod && (stackSlice % global->cxiFlushPeriod) == 0){
-                H5Fflush(cxi->hid(),H5F_SCOPE_LOCAL);
-            }
-            
-            if (didDecreaseActive) {
-                pthread_mutex_lock(&global->nActiveThreads_mutex);
-                global->nActiveCheetahThreads++;
-                pthread_mutex_unlock(&global->nActiveThreads_mutex);
-            }
-            pthread_mutex_unlock(&global->swmr_mutex);
-        }
+    if(global->cxiSWMR){
+        pthread_mutex_unlock(&global->swmr_mutex);
+    }
     #endif
 
+
+    /*
+     *  Write CXI and results data
+     *  The writer keeps its own reference to the event so it is not recycled before it is on disk.
+     *  Frames are queued in stack order (callers hold saveSynchronisation_mutex), which lets the writer batch consecutive slices.
+     */
+    tCXIWriteTask *task = (tCXIWriteTask *) malloc(sizeof(tCXIWriteTask));
+    task->eventData = eventData;
+    task->global = global;
+    task->cxi = cxi;
+    task->results = results;
+    task->stackSlice = stackSlice;
+    __sync_fetch_and_add(&eventData->refcount, 1);
+    global->cxiWriter.submit(writeCXITask, (void *) task, global->threadTimeoutInSeconds);
+
 	
 	/*
 	 *	Update text file log
@@ -2122,18 +2658,11 @@ void writeCXI(cEventData *eventData, cGlobal *global ){
     
     // Stuff only needed for SWMR mode
     #ifdef H5F_ACC_SWMR_WRITE
-        if(global->cxiSWMR){
-            if(global->cxiFlushPeriod && (stackSlice % global->cxiFlushPeriod) == 0){
-                H5Fflush(cxi->hid(),H5F_SCOPE_LOCAL);
-            }
-            
-            if (didDecreaseActive) {
-                pthread_mutex_lock(&global->nActiveThreads_mutex);
-                global->nActiveCheetahThreads++;
-                pthread_mutex_unlock(&global->nActiveThreads_mutex);
-            }
-            pthread_mutex_unlock(&global->swmr_mutex);
-        }
+    if (didDecreaseActive) {
+        pthread_mutex_lock(&global->nActiveThreads_mutex);
+        global->nActiveCheetahThreads++;
+        pthread_mutex_unlock(&global->nActiveThreads_mutex);
+    }
     #endif
 
 }
@@ -2147,17 +2676,18 @@ void writeCXI(cEventData *eventData, cGlobal *global ){
 void writeCXIData(CXI::Node *cxi, cEventData *eventData, cGlobal *global, uint stackSlice ){
     
     using CXI::Node;
-    Node &root = *cxi;
-
-    char sBuffer[1024];
+    CXI::FrameNodes *frame = cxi->frame;
     
+    // Normally already done by the worker before the frame was queued
+    assemble2DOnce(eventData, global);
+    calculateRadialAverageOnce(eventData, global);
     
     //printf("WriteCXI: powderClass=%i, stackSlice=%u\n",eventData->powderClass, stackSlice);
     
     
     double en = eventData->photonEnergyeV * 1.60217646e-19;
-    root["entry_1"]["instrument_1"]["source_1"]["energy"].write(&en,stackSlice);
-    root["entry_1"]["experiment_identifier"].write(eventData->eventname,stackSlice);
+    frameNode(frame->source)["energy"].write(&en,stackSlice);
+    frameNode(frame->entry)["experiment_identifier"].write(eventData->eventname,stackSlice);
 
     
     /*
@@ -2166,7 +2696,7 @@ void writeCXIData(CXI::Node *cxi, cEventData *eventData, cGlobal *global, uint s
     // LCLS
     if(!strcmp(global->facility, "LCLS")) {
         //Node &lcls = root["LCLS"];
-        Node &lcls = root["instrument"];
+        Node &lcls = frameNode(frame->instrument);
 
         lcls["photon_energy_eV"].write(&eventData->photonEnergyeV,stackSlice);
         lcls["photon_wavelength_A"].write(&eventData->wavelengthA,stackSlice);
@@ -2174,8 +2704,8 @@ void writeCXIData(CXI::Node *cxi, cEventData *eventData, cGlobal *global, uint s
 		lcls["machineTimeNanoSeconds"].write(&eventData->nanoSeconds, stackSlice);
         lcls["fiducial"].write(&eventData->fiducial,stackSlice);
         DETECTOR_LOOP{
-            lcls.cxichild("detector",detIndex+1)["position"].write(&global->detector[detIndex].detectorZ,stackSlice);
-            lcls.cxichild("detector",detIndex+1)["EncoderValue"].write(&global->detector[detIndex].detectorEncoderValue,stackSlice);
+            frameNode(frame->instrumentDetector[detIndex])["position"].write(&global->detector[detIndex].detectorZ,stackSlice);
+            frameNode(frame->instrumentDetector[detIndex])["EncoderValue"].write(&global->detector[detIndex].detectorEncoderValue,stackSlice);
         }
         
         if(global->cxiLegacyFileFormat == 2015) {
@@ -2230,7 +2760,7 @@ void writeCXIData(CXI::Node *cxi, cEventData *eventData, cGlobal *global, uint s
 	// European XFEL
 	if(!strcmp(global->facility, "EuXFEL") ) {
 		//Node *lcls = root->createGroup("LCLS");
-		Node &euxfel = root["instrument"];
+		Node &euxfel = frameNode(frame->instrument);
 
 		euxfel["photon_energy_eV"].write(&eventData->photonEnergyeV,stackSlice);
 		euxfel["photon_wavelength_A"].write(&eventData->wavelengthA,stackSlice);
@@ -2241,8 +2771,8 @@ void writeCXIData(CXI::Node *cxi, cEventData *eventData, cGlobal *global, uint s
 		euxfel["cellID"].write(&eventData->cellID,stackSlice);
 		
 		DETECTOR_LOOP{
-			euxfel.cxichild("detector",detIndex+1)["position"].write(&global->detector[detIndex].detectorZ,stackSlice);
-			euxfel.cxichild("detector",detIndex+1)["EncoderValue"].write(&global->detector[detIndex].detectorEncoderValue,stackSlice);
+			frameNode(frame->instrumentDetector[detIndex])["position"].write(&global->detector[detIndex].detectorZ,stackSlice);
+			frameNode(frame->instrumentDetector[detIndex])["EncoderValue"].write(&global->detector[detIndex].detectorEncoderValue,stackSlice);
 		}
 	}
 	
@@ -2250,7 +2780,7 @@ void writeCXIData(CXI::Node *cxi, cEventData *eventData, cGlobal *global, uint s
     // APS
     if(!strcmp(global->facility, "APS")) {
         //Node &aps = root["APS"];
-        Node &aps = root["instrument"];
+        Node &aps = frameNode(frame->instrument);
 
         aps["timestamp"].write(eventData->timeString,stackSlice);
         aps["photon_energy_eV"].write(&eventData->photonEnergyeV,stackSlice);
@@ -2280,7 +2810,7 @@ void writeCXIData(CXI::Node *cxi, cEventData *eventData, cGlobal *global, uint s
     if(global->cxiSaveFrames) {
         DETECTOR_LOOP {
             /* Save assembled image under image groups */
-            Node & detector = root["entry_1"]["instrument_1"].cxichild("detector",detIndex+1);
+            Node & detector = frameNode(frame->detector[detIndex]);
             double tmp = global->detector[detIndex].detectorZ/1000.0;
             
             // For convenience dereference some detector specific variables
@@ -2312,14 +2842,14 @@ void writeCXIData(CXI::Node *cxi, cEventData *eventData, cGlobal *global, uint s
             // DATA_FORMAT_NON_ASSEMBLED
             if (isBitOptionSet(global->detector[detIndex].saveFormat, cDataVersion::DATA_FORMAT_NON_ASSEMBLED)) {
                 cDataVersion dataV(&eventData->detector[detIndex], &global->detector[detIndex], global->detector[detIndex].saveVersion, cDataVersion::DATA_FORMAT_NON_ASSEMBLED);
+                size_t iVersion = 0;
                 while (dataV.next()) {
                     float * data = dataV.getData();
                     uint16_t * pixelmask = dataV.getPixelmask();
 
                     // Non-assembled images, modular (4D: N_frames x N_modules x Ny_module x Nx_module)
                     if (global->saveModular){
-                        sprintf(sBuffer,"modular_%s",dataV.name);
-                        Node & data_node = detector[sBuffer];
+                        Node & data_node = frameNode(frame->nonAssembled[detIndex], iVersion);
                         
                         long nn = asic_nn*nasics;
                         float * dataModular = (float *) calloc(nn, sizeof(float));
@@ -2356,7 +2886,7 @@ void writeCXIData(CXI::Node *cxi, cEventData *eventData, cGlobal *global, uint s
 
                     // Non-assembled images (3D: N_frames x Ny_frame x Nx_frame)
                     else {
-                        Node &data_node = detector[dataV.name_version];
+                        Node &data_node = frameNode(frame->nonAssembled[detIndex], iVersion);
                         data_node["data"].write(data, stackSlice, pix_nn);
                         if(global->detector[detIndex].savePixelmask) {
                             data_node["mask"].write(pixelmask, stackSlice, pix_nn);
@@ -2368,20 +2898,19 @@ void writeCXIData(CXI::Node *cxi, cEventData *eventData, cGlobal *global, uint s
                             delete [] thumbnail;
                         }
                     }
+                    iVersion++;
                 }
             }
             
             // DATA_FORMAT_ASSEMBLED
-            int image_counter = 0;
             if (isBitOptionSet(global->detector[detIndex].saveFormat, cDataVersion::DATA_FORMAT_ASSEMBLED)) {
-                int i_image = detIndex+1;
-                image_counter += 1;
                 cDataVersion dataV(&eventData->detector[detIndex], &global->detector[detIndex], global->detector[detIndex].saveVersion, cDataVersion::DATA_FORMAT_ASSEMBLED);
+                size_t iVersion = 0;
                 while (dataV.next()) {
                     // Assembled images (3D: N_frames x Ny_image x Nx_image)
                     float * data = dataV.getData();
                     uint16_t * pixelmask = dataV.getPixelmask();
-                    Node & data_node = root["entry_1"].cxichild("image",i_image)[dataV.name_version];
+                    Node & data_node = frameNode(frame->assembled[detIndex], iVersion++);
                     data_node["data"].write(data, stackSlice, image_nn);
                     if(global->detector[detIndex].savePixelmask){
                         data_node["mask"].write(pixelmask, stackSlice, image_nn);
@@ -2399,14 +2928,13 @@ void writeCXIData(CXI::Node *cxi, cEventData *eventData, cGlobal *global, uint s
             
             // DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED
             if (isBitOptionSet(global->detector[detIndex].saveFormat, cDataVersion::DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED)) {
-                int i_image = global->nDetectors*image_counter+detIndex+1;
-                image_counter += 1;
                 cDataVersion dataV(&eventData->detector[detIndex], &global->detector[detIndex], global->detector[detIndex].saveVersion, cDataVersion::DATA_FORMAT_ASSEMBLED_AND_DOWNSAMPLED);
+                size_t iVersion = 0;
                 while (dataV.next()) {
                     // Assembled images (3D: N_frames x Ny_imageXxX x Nx_imageXxX)
                     float * data = dataV.getData();
                     uint16_t * pixelmask = dataV.getPixelmask();
-                    Node & data_node = root["entry_1"].cxichild("image",i_image)[dataV.name_version];
+                    Node & data_node = frameNode(frame->downsampled[detIndex], iVersion++);
                     data_node["data"].write(data, stackSlice, imageXxX_nn);
                     if(global->detector[detIndex].savePixelmask){
                         data_node["mask"].write(pixelmask, stackSlice, imageXxX_nn);
@@ -2425,14 +2953,13 @@ void writeCXIData(CXI::Node *cxi, cEventData *eventData, cGlobal *global, uint s
             // DATA_FORMAT_RADIAL_AVERAGE
             if(global->cxiLegacyFileFormat == 2015) {
                 if (isBitOptionSet(global->detector[detIndex].saveFormat, cDataVersion::DATA_FORMAT_RADIAL_AVERAGE)) {
-                    int i_image = global->nDetectors*image_counter+detIndex+1;
-                    image_counter += 1;
                     cDataVersion dataV(&eventData->detector[detIndex], &global->detector[detIndex], global->detector[detIndex].saveVersion, cDataVersion::DATA_FORMAT_RADIAL_AVERAGE);
+                    size_t iVersion = 0;
                     while (dataV.next()) {
                         // Radial average (2D: N_frames x N_radial)
                         float * data = dataV.getData();
                         uint16_t * pixelmask = dataV.getPixelmask();
-                        Node & data_node = root["entry_1"].cxichild("image",i_image)[dataV.name_version];
+                        Node & data_node = frameNode(frame->radialAverage[detIndex], iVersion++);
                         data_node["data"].write(data, stackSlice, radial_nn);
                         if(global->detector[detIndex].savePixelmask){
                             data_node["mask"].write(pixelmask, stackSlice, radial_nn);
@@ -2449,12 +2976,11 @@ void writeCXIData(CXI::Node *cxi, cEventData *eventData, cGlobal *global, uint s
     /*
      *  Peak information 
      */
-    int resultIndex = 1;
     if(global->savePeakInfo && global->hitfinder) {
         long nPeaks = eventData->peaklist.nPeaks;
         long powderClass = eventData->powderClass;
         
-        Node & result = root["entry_1"].cxichild("result",resultIndex);
+        Node & result = frameNode(frame->result);
         
         result["powderClass"].write(&powderClass, stackSlice);
         result["nPeaks"].write(&nPeaks, stackSlice);
@@ -2479,7 +3005,7 @@ void writeCXIData(CXI::Node *cxi, cEventData *eventData, cGlobal *global, uint s
         if(eventData->TOFPresent){
             for(int i = 0; i<global->nTOFDetectors;i++){
                 int tofDetIndex = i+global->nDetectors;
-                Node & detector = root["entry_1"]["instrument_1"].cxichild("detector",tofDetIndex+1);
+                Node & detector = frameNode(frame->detector[tofDetIndex]);
                 detector["data"].write(&(eventData->tofDetector[i].voltage[0]),stackSlice);
                 detector["tofTime"].write(&(eventData->tofDetector[i].time[0]),stackSlice);
             }
@@ -2491,7 +3017,7 @@ void writeCXIData(CXI::Node *cxi, cEventData *eventData, cGlobal *global, uint s
      *  Cheetah info
      */
     if(global->cxiLegacyFileFormat == 2015) {
-        Node & event_data = root["cheetah"]["event_data"];
+        Node & event_data = frameNode(frame->eventData);
         event_data["eventName"].write(eventData->eventname,stackSlice);
         event_data["frameNumber"].write(&eventData->frameNumber,stackSlice);
         event_data["frameNumberIncludingSkipped"].write(&eventData->frameNumberIncludingSkipped,stackSlice);
@@ -2508,13 +3034,13 @@ void writeCXIData(CXI::Node *cxi, cEventData *eventData, cGlobal *global, uint s
         event_data["hit"].write(&eventData->hit,stackSlice);
         
         DETECTOR_LOOP{
-            Node & detector = root["cheetah"]["global_data"].cxichild("detector",detIndex+1);
+            Node & detector = frameNode(frame->globalDetector[detIndex]);
             detector["lastBgUpdate"].write(&global->detector[detIndex].bgLastUpdate,stackSlice);
             detector["nHot"].write(&global->detector[detIndex].nHot,stackSlice);
             detector["lastHotPixUpdate"].write(&global->detector[detIndex].hotPixLastUpdate,stackSlice);
             detector["nNoisy"].write(&global->detector[detIndex].nNoisy,stackSlice);
             detector["lastNoisyPixUpdate"].write(&global->detector[detIndex].noisyPixLastUpdate,stackSlice);
-            Node & detector2 = root["cheetah"]["event_data"].cxichild("detector",detIndex+1);
+            Node & detector2 = frameNode(frame->eventDetector[detIndex]);
             detector2["sum"].write(&eventData->detector[detIndex].sum,stackSlice);		
         }
     }
@@ -2538,11 +3064,11 @@ void writeCXIData(CXI::Node *cxi, cEventData *eventData, cGlobal *global, uint s
 void writeResultsData(CXI::Node *results, cEventData *eventData, cGlobal *global, uint stackSlice ){
  
     using CXI::Node;
-    Node &root = *results;
+    CXI::FrameNodes *frame = results->frame;
     
     
     // Event identifier
-    root["event_data"]["event_identifier"].write(eventData->eventname,stackSlice);
+    frameNode(frame->eventData)["event_identifier"].write(eventData->eventname,stackSlice);
 
     
     /*
@@ -2550,10 +3076,10 @@ void writeResultsData(CXI::Node *results, cEventData *eventData, cGlobal *global
      */
     // LCLS
     if(!strcmp(global->facility, "LCLS")) {
-        Node &lcls = root["instrument"];
+        Node &lcls = frameNode(frame->instrument);
         DETECTOR_LOOP{
-            lcls.child("detector",detIndex)["position"].write(&global->detector[detIndex].detectorZ,stackSlice);
-            lcls.child("detector",detIndex)["EncoderValue"].write(&global->detector[detIndex].detectorEncoderValue,stackSlice);
+            frameNode(frame->instrumentDetector[detIndex])["position"].write(&global->detector[detIndex].detectorZ,stackSlice);
+            frameNode(frame->instrumentDetector[detIndex])["EncoderValue"].write(&global->detector[detIndex].detectorEncoderValue,stackSlice);
             //lcls.child("detector",detIndex)["SolidAngleConst"].write(&global->detector[detIndex].solidAngleConst,stackSlice);
         }
         lcls["machineTime"].write(&eventData->seconds,stackSlice);
@@ -2618,7 +3144,7 @@ void writeResultsData(CXI::Node *results, cEventData *eventData, cGlobal *global
 	// European XFEL
 	if(!strcmp(global->facility, "EuXFEL") ) {
 		//Node *lcls = root->createGroup("LCLS");
-		Node &euxfel = root["instrument"];
+		Node &euxfel = frameNode(frame->instrument);
 		
 		euxfel["photon_energy_eV"].write(&eventData->photonEnergyeV,stackSlice);
 		euxfel["photon_wavelength_A"].write(&eventData->wavelengthA,stackSlice);
@@ -2640,7 +3166,7 @@ void writeResultsData(CXI::Node *results, cEventData *eventData, cGlobal *global
     
     // APS
     if(!strcmp(global->facility, "APS")) {
-        Node &aps = root["instrument"];
+        Node &aps = frameNode(frame->instrument);
         aps["exposureTime"].write(&eventData->exposureTime,stackSlice);
         aps["exposurePeriod"].write(&eventData->exposurePeriod, stackSlice);
         aps["tau"].write(&eventData->tau,stackSlice);
@@ -2663,7 +3189,7 @@ void writeResultsData(CXI::Node *results, cEventData *eventData, cGlobal *global
     /*
      *  Cheetah information 
      */
-    Node & cheetah = root["cheetah"];
+    Node & cheetah = frameNode(frame->cheetah);
     cheetah["eventName"].write(eventData->eventname,stackSlice);
     cheetah["frameNumber"].write(&eventData->frameNumber,stackSlice);
     cheetah["frameNumberIncludingSkipped"].write(&eventData->frameNumberIncludingSkipped,stackSlice);
@@ -2672,7 +3198,7 @@ void writeResultsData(CXI::Node *results, cEventData *eventData, cGlobal *global
     //cheetah["peakNpix"].write(&eventData->peakNpix,stackSlice);
     
     DETECTOR_LOOP{
-        Node & detector = root["event_data"].child("detector",detIndex);
+        Node & detector = frameNode(frame->detector[detIndex]);
         detector["lastBgUpdate"].write(&global->detector[detIndex].bgLastUpdate,stackSlice);
         detector["nHot"].write(&global->detector[detIndex].nHot,stackSlice);
         //detector["lastHotPixUpdate"].write(&global->detector[detIndex].hotPixLastUpdate,stackSlice);
@@ -2695,12 +3221,11 @@ void writeResultsData(CXI::Node *results, cEventData *eventData, cGlobal *global
     /*
      *  Peaks
      */
-    int resultIndex = 0;
     if(global->savePeakInfo && global->hitfinder) {
         long nPeaks = eventData->peaklist.nPeaks;
         long powderClass = eventData->powderClass;
         
-        Node &peaks = root["event_data"].child("peaks",resultIndex);
+        Node &peaks = frameNode(frame->result);
         
         peaks["nPeaks"].write(&nPeaks, stackSlice);
         peaks["powderClass"].write(&powderClass, stackSlice);
@@ -2740,7 +3265,7 @@ void writeResultsData(CXI::Node *results, cEventData *eventData, cGlobal *global
      */
     DETECTOR_LOOP {
         /* Save assembled image under image groups */
-        Node & detector = root["event_data"].child("detector",detIndex);
+        Node & detector = frameNode(frame->detector[detIndex]);
         
         // For convenience dereference some detector specific variables
         //int asic_nx = global->detector[detIndex].asic_nx;
@@ -2777,12 +3302,12 @@ void writeResultsData(CXI::Node *results, cEventData *eventData, cGlobal *global
             //int i_image = global->nDetectors*image_counter+detIndex;
             image_counter += 1;
             cDataVersion dataV(&eventData->detector[detIndex], &global->detector[detIndex], global->detector[detIndex].saveVersion, cDataVersion::DATA_FORMAT_RADIAL_AVERAGE);
+            size_t iVersion = 0;
             while (dataV.next()) {
                 // Radial average (2D: N_frames x N_radial)
                 float * data = dataV.getData();
                 uint16_t * pixelmask = dataV.getPixelmask();
-                Node & det_node = root["event_data"].child("detector",detIndex);
-                Node & data_node = det_node["radialaverage"][dataV.name_version];
+                Node & data_node = frameNode(frame->radialAverage[detIndex], iVersion++);
                 data_node["data"].write(data, stackSlice, radial_nn);
                 if(global->detector[detIndex].savePixelmask){
                     data_node["mask"].write(pixelmask, stackSlice, radial_nn);
@@ -2799,7 +3324,7 @@ void writeResultsData(CXI::Node *results, cEventData *eventData, cGlobal *global
     if(eventData->TOFPresent){
         for(int i = 0; i<global->nTOFDetectors;i++){
             int tofDetIndex = i+global->nDetectors;
-            Node &detector = root["event_data"].child("detector",tofDetIndex);
+            Node &detector = frameNode(frame->detector[tofDetIndex]);
             detector["data"].write(&(eventData->tofDetector[i].voltage[0]),stackSlice);
             detector["tofTime"].write(&(eventData->tofDetector[i].time[0]),stackSlice);
         }
@@ -96,6 +96,9 @@ void writeHDF5(cEventData *eventData, cGlobal *global){
 	strcpy(eventData->filename, outfile);
 	eventData->stackSlice = 0;
 
+	assemble2DOnce(eventData, global);
+	calculateRadialAverageOnce(eventData, global);
+
 	
 	/*
 	 *	Update text file log
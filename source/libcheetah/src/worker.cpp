@@ -98,57 +98,67 @@ void *worker(void *threadarg)
     // Initialise pixelmask with pixelmask_shared
     initPixelmask(eventData, global);
 
-    // Initialise raw data array (float) THIS MIGHT SLOW THINGS DOWN, WE MIGHT WANT TO CHANGE THIS
-    initRaw(eventData, global);
-
     //-------------------------//
     //---DETECTOR-CORRECTION---//
     //-------------------------//
     DEBUG2("Detector correction");
 
-    // Initialise data_detCorr with data_raw16
-    initDetectorCorrection(eventData, global);
-
-    // Check for saturated pixels before applying any other corrections
-    checkSaturatedPixels(eventData, global);
-
-    // Subtract darkcal image (static electronic offsets)
-    subtractDarkcal(eventData, global);
-
-    // If no darkcal file: Subtract persistent background here (background = photon background + static electronic offsets)
-    // Commenting this out because it was was causing crashes with memory access violations (and the problem went away when this was commented out) <-- Anton 14 Dec 2014
-    //subtractPersistentBackground(eventData, global);
-
-    // Fix CSPAD artefacts:
-    // Subtract common mode offsets (electronic offsets)
-    // cmModule = 1
-    // (these corrections will be automatically skipped for any non-CSPAD detector)
-    cspadModuleSubtractMedian(eventData, global);
-    cspadModuleSubtractHistogram(eventData, global);
-    cspadSubtractUnbondedPixels(eventData, global);
-    cspadSubtractBehindWires(eventData, global);
-
-    // Fix pnCCD artefacts:
-    // pnCCD offset correction (read out artifacts prominent in lines with high signal)
-    // pnCCD wiring error (shift in one set of rows relative to another - and yes, it's a wiring error).
-    // pnCCD signal drop in every second line (fast changing dimension) can be fixed by interpolation and/or masking of the affected lines
-    //  (these corrections will be automatically skipped for any non-pnCCD detector)
-    pnccdModuleSubtract(eventData, global);
-    pnccdOffsetCorrection(eventData, global);
-    pnccdFixWiringError(eventData, global);
-    pnccdLineInterpolation(eventData, global);
-    pnccdLineMasking(eventData, global);
-
-    // AGIPD corrections
-    // (Largely re-uses selected cspad corrections)
-    agipdModuleSubtract(eventData, global);
-    
-    
-    // Apply gain correction
-    applyGainCorrection(eventData, global);
-
-    // Zero out bad pixels
-    setBadPixelsToZero(eventData, global);
+    if (global->useFusedDetectorCorrection) {
+        // initRaw, initDetectorCorrection, checkSaturatedPixels, subtractDarkcal, applyGainCorrection
+        // and setBadPixelsToZero in one pass (only if nothing else needs to happen in between)
+        fusedDetectorCorrection(eventData, global);
+    }
+    else {
+        // Initialise raw data array (float) THIS MIGHT SLOW THINGS DOWN, WE MIGHT WANT TO CHANGE THIS
+        initRaw(eventData, global);
+
+        // Initialise data_detCorr with data_raw16
+        initDetectorCorrection(eventData, global);
+
+        // Check for saturated pixels before applying any other corrections
+        checkSaturatedPixels(eventData, global);
+
+        // Subtract darkcal image (static electronic offsets)
+        subtractDarkcal(eventData, global);
+
+        // If no darkcal file: Subtract persistent background here (background = photon background + static electronic offsets)
+        // Commenting this out because it was was causing crashes with memory access violations (and the problem went away when this was commented out) <-- Anton 14 Dec 2014
+        //subtractPersistentBackground(eventData, global);
+
+        // Fix CSPAD artefacts:
+        // Subtract common mode offsets (electronic offsets)
+        // cmModule = 1
+        // (these corrections will be automatically skipped for any non-CSPAD detector)
+        cspadModuleSubtractMedian(eventData, global);
+        cspadModuleSubtractHistogram(eventData, global);
+        cspadSubtractUnbondedPixels(eventData, global);
+        cspadSubtractBehindWires(eventData, global);
+
+        // Fix pnCCD artefacts:
+        // pnCCD offset correction (read out artifacts prominent in lines with high signal)
+        // pnCCD wiring error (shift in one set of rows relative to another - and yes, it's a wiring error).
+        // pnCCD signal drop in every second line (fast changing dimension) can be fixed by interpolation and/or masking of the affected lines
+        //  (these corrections will be automatically skipped for any non-pnCCD detector)
+        pnccdModuleSubtract(eventData, global);
+        pnccdOffsetCorrection(eventData, global);
+        pnccdFixWiringError(eventData, global);
+        pnccdLineInterpolation(eventData, global);
+        pnccdLineMasking(eventData, global);
+
+        // AGIPD corrections
+        // (Largely re-uses selected cspad corrections)
+        agipdModuleSubtract(eventData, global);
+
+        // Jungfrau and ePix common mode (per ASIC, ASIC row or ASIC column)
+        jungfrauModuleSubtract(eventData, global);
+
+
+        // Apply gain correction
+        applyGainCorrection(eventData, global);
+
+        // Zero out bad pixels
+        setBadPixelsToZero(eventData, global);
+    }
 
     // Histogram of detector values
     addToHistogram(eventData, global, 0);
@@ -163,8 +173,9 @@ void *worker(void *threadarg)
     // Subtract residual common mode offsets (cmModule=2)
     cspadModuleSubtract2(eventData, global);
 
-    // Set bad pixels to zero
-    setBadPixelsToZero(eventData, global);
+    // Set bad pixels to zero (again: only needed if the separate correction passes ran)
+    if (!global->useFusedDetectorCorrection)
+        setBadPixelsToZero(eventData, global);
 
     // Identify hot pixels and set them to zero
     updateHotPixelBuffer(eventData, global);
@@ -190,11 +201,8 @@ void *worker(void *threadarg)
     // Convert to photons
     photonCount(eventData, global);
 
-    // Apply polarization correction
-    applyPolarizationCorrection(eventData, global);
-
-    // Apply solid angle correction
-    applySolidAngleCorrection(eventData, global);
+    // Apply polarization and solid angle correction (precomputed per pixel, usually already folded into initPhotonCorrection)
+    applyPhotonCorrectionFactor(eventData, global);
 
     // If a darkcal file is available: Subtract persistent background is for photon subtraction (persistent background = photon background)
     subtractPersistentBackground(eventData, global);
@@ -303,16 +311,14 @@ void *worker(void *threadarg)
         goto cleanup;
     }
 
-    // Assemble, downsample and radially average current frame
-    assemble2D(eventData, global);
-    //downsample(eventData, global);
+    // Assembled images and radial averages are made on first use (assemble2DOnce, calculateRadialAverageOnce):
+    // by the powder sums and radial stacks if they need them, otherwise only if the frame is saved
 
     // Powder
     // Maintain a running sum of data (powder patterns)
     addToPowder(eventData, global);
 
-    // Calculate radial averages
-    calculateRadialAverage(eventData, global);
+    // Radial average stacks
     addToRadialAverageStack(eventData, global);
 
     // Calculate the one dimesional beam spectrum
@@ -366,6 +372,17 @@ void *worker(void *threadarg)
                     (!hit && global->saveBlanks) ||
                     ((global->hdf5dump > 0) && ((eventData->frameNumber % global->hdf5dump) == 0));
 
+    // Assemble frames that are going to be saved now, while other workers may be saving, rather than under the lock
+    if (eventData->writeFlag && !(global->generateDarkcal || global->generateGaincal)) {
+        assemble2DOnce(eventData, global);
+        calculateRadialAverageOnce(eventData, global);
+    }
+
+    // Image stacks are compressed here, while other workers may be saving, rather than by the CXI writer
+    if (eventData->writeFlag && global->saveCXI && !(global->generateDarkcal || global->generateGaincal)) {
+        compressCXIChunks(eventData, global);
+    }
+
     // Synchronisation of all writing so that stacks, CXI file, etc stay in step with each other
     pthread_mutex_lock(&global->saveSynchronisation_mutex);
 
@@ -380,8 +397,8 @@ void *worker(void *threadarg)
             if (global->saveCXI) {
                 printf("r%04u:%li (%2.1lf Hz, %3.3f %% hits): Writing %s (hit=%i,npeaks=%i)\n", global->runNumber, eventData->threadNum, processRate, hitRatio,
                         eventData->eventStamp, hit, eventData->nPeaks);
+                // Also queues the hit statistics; the data itself is written by the CXI writer thread
                 writeCXI(eventData, global);
-                writeCXIHitstats(eventData, global);
                 addTimeToolToStack(eventData, global, powderClass);
                 addFEEspectrumToStack(eventData, global, powderClass);
             }
@@ -443,6 +460,7 @@ void *worker(void *threadarg)
         DEBUG3("Save data.");
 
         // Assemble, downsample and radially average powder
+        reducePowder(global);
         assemble2DPowder(global);
         downsamplePowder(global);
         calculateRadialAveragePowder(global);
@@ -472,22 +490,21 @@ void *worker(void *threadarg)
     pthread_mutex_unlock(&global->saveinterval_mutex);
 
 
-    // Decrement thread pool counter by one
-    pthread_mutex_lock(&global->nActiveThreads_mutex);
-    global->nActiveCheetahThreads -= 1;
-    pthread_mutex_unlock(&global->nActiveThreads_mutex);
-    sem_post(&global->availableCheetahThreads);
+    // Decrement active frame counter by one (only queued frames were counted)
+    if (eventData->useThreads == 1) {
+        pthread_mutex_lock(&global->nActiveThreads_mutex);
+        global->nActiveCheetahThreads -= 1;
+        pthread_mutex_unlock(&global->nActiveThreads_mutex);
+    }
 
     global->processRateMonitor.frameFinished();
 
     // Free memory only if running multi-threaded
+    // Return rather than pthread_exit(): we are running on a pool thread that goes on to the next event
     if (eventData->useThreads == 1) {
         cheetahDestroyEvent(eventData);
-        pthread_exit (NULL);
-    }
-    else {
-        return (NULL);
     }
+    return (NULL);
 }
 
 /*
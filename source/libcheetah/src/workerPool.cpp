@@ -0,0 +1,289 @@
+//
+//  workerPool.cpp
+//  cheetah
+//
+//  Fixed pool of long-lived worker threads fed from a bounded task queue.
+//
+
+#include <stdio.h>
+#include <time.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <algorithm>
+
+#include "workerPool.h"
+
+
+static void deadlineInSeconds(struct timespec *ts, float seconds) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += (time_t) seconds;
+    ts->tv_nsec += (long) ((seconds - (time_t) seconds) * 1e9);
+    if(ts->tv_nsec >= 1000000000) {
+        ts->tv_sec += 1;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+
+cWorkerPool::cWorkerPool() {
+    queueHead = 0;
+    queueCount = 0;
+    nBusy = 0;
+    running = false;
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&notEmpty, NULL);
+    pthread_cond_init(&notFull, NULL);
+    pthread_cond_init(&idle, NULL);
+}
+
+cWorkerPool::~cWorkerPool() {
+    stop();
+    pthread_cond_destroy(&idle);
+    pthread_cond_destroy(&notFull);
+    pthread_cond_destroy(&notEmpty);
+    pthread_mutex_destroy(&mutex);
+}
+
+
+/*
+ *  Create the worker threads
+ *  queueSize is the number of tasks that may wait for a free worker before submit() blocks
+ */
+void cWorkerPool::start(long n, long queueSize) {
+    if(running)
+        return;
+    if(n < 1)
+        n = 1;
+    if(queueSize < 1)
+        queueSize = 1;
+
+    pthread_mutex_lock(&mutex);
+    queue.resize(queueSize);
+    queueHead = 0;
+    queueCount = 0;
+    nBusy = 0;
+    running = true;
+    pthread_mutex_unlock(&mutex);
+
+    threads.clear();
+    for(long i=0; i<n; i++) {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, threadMain, (void *) this) == 0)
+            threads.push_back(thread);
+        else
+            printf("Error: worker pool thread creation failed\n");
+    }
+    printf("Started pool of %li worker threads (queue depth %li)\n", (long) threads.size(), queueSize);
+}
+
+
+/*
+ *  Finish everything already queued, then let the workers exit and join them
+ */
+void cWorkerPool::stop(void) {
+    pthread_mutex_lock(&mutex);
+    if(!running) {
+        pthread_mutex_unlock(&mutex);
+        return;
+    }
+    running = false;
+    bool stuck = (queueCount > 0 || nBusy > 0);
+    pthread_cond_broadcast(&notEmpty);
+    pthread_mutex_unlock(&mutex);
+
+    // Someone already gave up waiting for these threads (see cGlobal::waitForThreadsToFinish), so don't hang here either
+    for(size_t i=0; i<threads.size(); i++) {
+        if(stuck)
+            pthread_detach(threads[i]);
+        else
+            pthread_join(threads[i], NULL);
+    }
+    threads.clear();
+}
+
+
+/*
+ *  Queue a task, blocking while the queue is full
+ *  This is where back-pressure on the data source comes from.
+ *  Every timeoutInSeconds a warning is printed but we keep waiting (no more resetting of thread counters)
+ */
+void cWorkerPool::submit(void *(*function)(void *), void *arg, int timeoutInSeconds) {
+
+    pthread_mutex_lock(&mutex);
+
+    // No workers: run in the calling thread
+    if(!running) {
+        pthread_mutex_unlock(&mutex);
+        function(arg);
+        return;
+    }
+
+    while(queueCount == (long) queue.size()) {
+        if(timeoutInSeconds > 0) {
+            struct timespec ts;
+            deadlineInSeconds(&ts, timeoutInSeconds);
+            if(pthread_cond_timedwait(&notFull, &mutex, &ts) == ETIMEDOUT) {
+                printf("\tNo free worker thread for %d seconds (%li busy, %li queued), still waiting\n", timeoutInSeconds, nBusy, queueCount);
+            }
+        }
+        else {
+            pthread_cond_wait(&notFull, &mutex);
+        }
+    }
+
+    long tail = (queueHead + queueCount) % queue.size();
+    queue[tail].function = function;
+    queue[tail].arg = arg;
+    queueCount += 1;
+
+    pthread_cond_signal(&notEmpty);
+    pthread_mutex_unlock(&mutex);
+}
+
+
+/*
+ *  Wait until the queue is empty and no worker is busy
+ *  Returns 0 when everything finished, 1 if we gave up after waitTime seconds (waitTime <= 0 waits forever)
+ */
+int cWorkerPool::drain(float waitTime) {
+    time_t tstart, tnow;
+    time(&tstart);
+
+    pthread_mutex_lock(&mutex);
+    while(queueCount > 0 || nBusy > 0) {
+        printf("Waiting for %li worker threads to terminate\n", queueCount + nBusy);
+
+        struct timespec ts;
+        deadlineInSeconds(&ts, 1.0);
+        pthread_cond_timedwait(&idle, &mutex, &ts);
+
+        time(&tnow);
+        if(waitTime > 0 && difftime(tnow, tstart) > waitTime && (queueCount > 0 || nBusy > 0)) {
+            pthread_mutex_unlock(&mutex);
+            return 1;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+    return 0;
+}
+
+
+/*
+ *  Number of tasks queued or currently running
+ */
+long cWorkerPool::nPending(void) {
+    pthread_mutex_lock(&mutex);
+    long n = queueCount + nBusy;
+    pthread_mutex_unlock(&mutex);
+    return n;
+}
+
+long cWorkerPool::nWorkers(void) {
+    return threads.size();
+}
+
+
+/*
+ *  Call function(arg, i, slot) for i = 0 .. n-1, with the calling thread helping out, and return when all are done
+ *  Indices are handed out in increasing order; slot (0 .. nSlots()-1) identifies the thread running the call,
+ *  so per-slot scratch can be used without locking. Never call this from one of this pool's own workers.
+ */
+void cWorkerPool::parallelFor(long n, void (*function)(void *, long, long), void *arg) {
+    if(n <= 0)
+        return;
+
+    long nHelpers = std::min((long) threads.size(), n-1);
+    if(!running || nHelpers == 0) {
+        for(long i=0; i<n; i++)
+            function(arg, i, 0);
+        return;
+    }
+
+    tParallelFor *job = (tParallelFor *) malloc(sizeof(tParallelFor));
+    job->function = function;
+    job->arg = arg;
+    job->n = n;
+    job->next = 0;
+    job->nDone = 0;
+    job->nSlotsUsed = 1;
+    job->refs = nHelpers + 1;
+    pthread_mutex_init(&job->mutex, NULL);
+    pthread_cond_init(&job->done, NULL);
+
+    for(long i=0; i<nHelpers; i++)
+        submit(parallelForTask, (void *) job, 0);
+
+    parallelForWork(job, 0);
+
+    pthread_mutex_lock(&job->mutex);
+    while(job->nDone < n)
+        pthread_cond_wait(&job->done, &job->mutex);
+    pthread_mutex_unlock(&job->mutex);
+
+    parallelForRelease(job);
+}
+
+long cWorkerPool::nSlots(void) {
+    return threads.size() + 1;
+}
+
+void *cWorkerPool::parallelForTask(void *p) {
+    tParallelFor *job = (tParallelFor *) p;
+    parallelForWork(job, __sync_fetch_and_add(&job->nSlotsUsed, 1));
+    parallelForRelease(job);
+    return NULL;
+}
+
+void cWorkerPool::parallelForWork(tParallelFor *job, long slot) {
+    long i;
+    while((i = __sync_fetch_and_add(&job->next, 1)) < job->n) {
+        job->function(job->arg, i, slot);
+
+        pthread_mutex_lock(&job->mutex);
+        job->nDone += 1;
+        if(job->nDone == job->n)
+            pthread_cond_signal(&job->done);
+        pthread_mutex_unlock(&job->mutex);
+    }
+}
+
+void cWorkerPool::parallelForRelease(tParallelFor *job) {
+    if(__sync_sub_and_fetch(&job->refs, 1) == 0) {
+        pthread_cond_destroy(&job->done);
+        pthread_mutex_destroy(&job->mutex);
+        free(job);
+    }
+}
+
+
+void *cWorkerPool::threadMain(void *pool) {
+    ((cWorkerPool *) pool)->run();
+    return NULL;
+}
+
+void cWorkerPool::run(void) {
+    pthread_mutex_lock(&mutex);
+    while(true) {
+        while(queueCount == 0 && running)
+            pthread_cond_wait(&notEmpty, &mutex);
+
+        if(queueCount == 0 && !running)
+            break;
+
+        tTask task = queue[queueHead];
+        queueHead = (queueHead + 1) % queue.size();
+        queueCount -= 1;
+        nBusy += 1;
+        pthread_cond_signal(&notFull);
+        pthread_mutex_unlock(&mutex);
+
+        task.function(task.arg);
+
+        pthread_mutex_lock(&mutex);
+        nBusy -= 1;
+        if(queueCount == 0 && nBusy == 0)
+            pthread_cond_broadcast(&idle);
+    }
+    pthread_mutex_unlock(&mutex);
+}